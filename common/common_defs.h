@@ -126,6 +126,22 @@ typedef size_t machine_word_t;
 #  define COMPILER_SUPPORTS_BMI2_TARGET 0
 #endif
 
+/* Does the compiler support __attribute__((target("avx2")))? */
+#ifndef COMPILER_SUPPORTS_AVX2_TARGET
+#  define COMPILER_SUPPORTS_AVX2_TARGET 0
+#endif
+
+/* Does the compiler support __attribute__((target("sse4.2")))? */
+#ifndef COMPILER_SUPPORTS_SSE42_TARGET
+#  define COMPILER_SUPPORTS_SSE42_TARGET 0
+#endif
+
+/* Does the compiler support __attribute__((target(CRC32_TARGET))) on AArch64,
+ * with crc32c_u8_builtin() and crc32c_u64_builtin()? */
+#ifndef COMPILER_SUPPORTS_CRC32_TARGET
+#  define COMPILER_SUPPORTS_CRC32_TARGET 0
+#endif
+
 /* ========================================================================== */
 /*                          Miscellaneous macros                              */
 /* ========================================================================== */
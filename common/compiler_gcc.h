@@ -39,6 +39,38 @@
 	(COMPILER_SUPPORTS_TARGET_FUNCTION_ATTRIBUTE &&		\
 	 (GCC_PREREQ(4, 7) || __has_builtin(__builtin_ia32_pdep_di)))
 
+/*
+ * Before gcc 4.9, the AVX2 intrinsics in <immintrin.h> could only be used if
+ * AVX2 was enabled for the whole translation unit, not just for one function.
+ */
+#define COMPILER_SUPPORTS_AVX2_TARGET				\
+	(COMPILER_SUPPORTS_TARGET_FUNCTION_ATTRIBUTE &&		\
+	 (GCC_PREREQ(4, 9) || __has_builtin(__builtin_ia32_pshufb256)))
+
+/* The same goes for the SSE4.2 intrinsics in <nmmintrin.h>. */
+#define COMPILER_SUPPORTS_SSE42_TARGET				\
+	(COMPILER_SUPPORTS_TARGET_FUNCTION_ATTRIBUTE &&		\
+	 (GCC_PREREQ(4, 9) || __has_builtin(__builtin_ia32_crc32di)))
+
+/*
+ * The CRC-32C intrinsics in <arm_acle.h> are only defined if the CRC extension
+ * is enabled for the whole translation unit, so a function which enables it
+ * with CRC32_TARGET uses the builtins behind them instead.  gcc supports the
+ * 'target' attribute on AArch64 since 6.
+ */
+#if defined(__aarch64__) && GCC_PREREQ(6, 1)
+#  define COMPILER_SUPPORTS_CRC32_TARGET	1
+#  define CRC32_TARGET			"+crc"
+#  define crc32c_u8_builtin		__builtin_aarch64_crc32cb
+#  define crc32c_u64_builtin		__builtin_aarch64_crc32cx
+#elif defined(__aarch64__) && COMPILER_SUPPORTS_TARGET_FUNCTION_ATTRIBUTE && \
+	__has_builtin(__builtin_arm_crc32cd)
+#  define COMPILER_SUPPORTS_CRC32_TARGET	1
+#  define CRC32_TARGET			"crc"
+#  define crc32c_u8_builtin		__builtin_arm_crc32cb
+#  define crc32c_u64_builtin		__builtin_arm_crc32cd
+#endif
+
 /* Newer gcc supports __BYTE_ORDER__.  Older gcc doesn't. */
 #ifdef __BYTE_ORDER__
 #  define CPU_IS_LITTLE_ENDIAN() (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
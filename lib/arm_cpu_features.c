@@ -0,0 +1,82 @@
+/*
+ * arm_cpu_features.c - feature detection for ARM processors
+ */
+
+#include "arm_cpu_features.h"
+
+#if ARM_CPU_FEATURES_ENABLED
+
+#include <sys/auxv.h>
+
+#define DEBUG 0
+
+#if DEBUG
+#  include <stdio.h>
+#endif
+
+u32 _arm_cpu_features = 0;
+
+/*
+ * The kernel reports the processor's features in the AT_HWCAP and AT_HWCAP2
+ * entries of the auxiliary vector.  The bits are defined here rather than taken
+ * from <asm/hwcap.h>, which old toolchains don't have, and they differ between
+ * 32-bit and 64-bit ARM.
+ */
+#ifndef AT_HWCAP2
+#  define AT_HWCAP2		26
+#endif
+
+#ifdef __aarch64__
+#  define HWCAP_ASIMD		((unsigned long)1 << 1)
+#  define HWCAP_PMULL		((unsigned long)1 << 4)
+#  define HWCAP_CRC32		((unsigned long)1 << 7)
+#else
+#  define HWCAP_NEON		((unsigned long)1 << 12)
+#  define HWCAP2_PMULL		((unsigned long)1 << 1)
+#  define HWCAP2_CRC32		((unsigned long)1 << 4)
+#endif
+
+/* Initialize _arm_cpu_features with bits for interesting processor features. */
+void
+arm_setup_cpu_features(void)
+{
+	u32 features = 0;
+	const unsigned long hwcap = getauxval(AT_HWCAP);
+
+#ifdef __aarch64__
+	if (hwcap & HWCAP_ASIMD)
+		features |= ARM_CPU_FEATURE_NEON;
+
+	if (hwcap & HWCAP_PMULL)
+		features |= ARM_CPU_FEATURE_PMULL;
+
+	if (hwcap & HWCAP_CRC32)
+		features |= ARM_CPU_FEATURE_CRC32;
+#else
+	const unsigned long hwcap2 = getauxval(AT_HWCAP2);
+
+	if (hwcap & HWCAP_NEON)
+		features |= ARM_CPU_FEATURE_NEON;
+
+	if (hwcap2 & HWCAP2_PMULL)
+		features |= ARM_CPU_FEATURE_PMULL;
+
+	if (hwcap2 & HWCAP2_CRC32)
+		features |= ARM_CPU_FEATURE_CRC32;
+#endif
+
+#if DEBUG
+	printf("Detected ARM CPU features: ");
+	if (features & ARM_CPU_FEATURE_NEON)
+		printf("NEON ");
+	if (features & ARM_CPU_FEATURE_PMULL)
+		printf("PMULL ");
+	if (features & ARM_CPU_FEATURE_CRC32)
+		printf("CRC32 ");
+	printf("\n");
+#endif /* DEBUG */
+
+	_arm_cpu_features = features | ARM_CPU_FEATURES_KNOWN;
+}
+
+#endif /* ARM_CPU_FEATURES_ENABLED */
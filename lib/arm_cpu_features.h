@@ -0,0 +1,41 @@
+/*
+ * arm_cpu_features.h - feature detection for ARM processors
+ */
+
+#ifndef LIB_ARM_CPU_FEATURES_H
+#define LIB_ARM_CPU_FEATURES_H
+
+#include "common_defs.h"
+
+#if (defined(__arm__) || defined(__aarch64__)) && defined(__linux__) && \
+	COMPILER_SUPPORTS_TARGET_FUNCTION_ATTRIBUTE
+#  define ARM_CPU_FEATURES_ENABLED 1
+#else
+#  define ARM_CPU_FEATURES_ENABLED 0
+#endif
+
+#if ARM_CPU_FEATURES_ENABLED
+
+#define ARM_CPU_FEATURE_NEON		0x00000001
+#define ARM_CPU_FEATURE_PMULL		0x00000002
+#define ARM_CPU_FEATURE_CRC32		0x00000004
+
+#define ARM_CPU_FEATURES_KNOWN		0x80000000
+
+extern u32 _arm_cpu_features;
+
+extern void
+arm_setup_cpu_features(void);
+
+/* Does the processor have the specified feature?  */
+static forceinline bool
+arm_have_cpu_feature(u32 feature)
+{
+	if (_arm_cpu_features == 0)
+		arm_setup_cpu_features();
+	return _arm_cpu_features & feature;
+}
+
+#endif /* ARM_CPU_FEATURES_ENABLED */
+
+#endif /* LIB_ARM_CPU_FEATURES_H */
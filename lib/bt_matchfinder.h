@@ -0,0 +1,498 @@
+/*
+ * bt_matchfinder.h - Lempel-Ziv matchfinding with a hash table of binary trees
+ *
+ * ---------------------------------------------------------------------------
+ *
+ *				   Algorithm
+ *
+ * This is a Binary Trees (bt) based matchfinder.
+ *
+ * The main data structure is a hash table where each hash bucket contains a
+ * binary tree of sequences whose first 4 bytes share the same hash code.  Each
+ * sequence is identified by its starting position in the input buffer.  Each
+ * binary tree is always sorted such that each left child represents a sequence
+ * lexicographically lesser than its parent and each right child represents a
+ * sequence lexicographically greater than its parent.
+ *
+ * The algorithm processes the input buffer sequentially.  At each byte
+ * position, the hash code of the first 4 bytes of the sequence beginning at
+ * that position (the sequence being matched against) is computed.  This
+ * identifies the hash bucket to use for that position.  Then, a new binary tree
+ * node is created to represent the current sequence.  Then, in a single tree
+ * traversal, the hash bucket's binary tree is searched for matches and is
+ * re-rooted at the new node.
+ *
+ * Compared to the simpler algorithm that uses linked lists instead of binary
+ * trees (see hc_matchfinder.h), the binary tree version gains more information
+ * at each node visitation.  Ideally, the binary tree version will examine only
+ * 'log(n)' nodes to find the same matches that the linked list version will
+ * find by examining 'n' nodes.  In addition, the binary tree version can
+ * examine fewer bytes at each node by taking advantage of the common prefixes
+ * that result from the sort order, whereas the linked list version may have to
+ * examine up to the full length of the match at each node.
+ *
+ * However, it is not always best to use the binary tree version.  It requires
+ * nearly twice as much memory as the linked list version, and it takes time to
+ * keep the binary trees sorted, even at positions where the compressor does not
+ * need matches.  Generally, when doing fast compression on small buffers,
+ * binary trees are the wrong approach.  They are best suited for thorough
+ * compression and/or large buffers, where they find the best matches at a
+ * stable speed even on highly redundant data.
+ *
+ * ---------------------------------------------------------------------------
+ *
+ *				Notes on usage
+ *
+ * The number of bytes that must be allocated for a given 'struct
+ * bt_matchfinder' must be gotten by calling bt_matchfinder_size(), and then the
+ * matchfinder must be set up once with bt_matchfinder_setup().  As in
+ * hc_matchfinder.h, the hash tables are sized from the maximum buffer size, and
+ * only the part needed for the next buffer is used and cleared.
+ *
+ * Positions are handled the same way as in hc_matchfinder.h: position 0 means
+ * "no node", matches are limited to positions greater than the 'cutoff', and
+ * bt_matchfinder_slide_window() supports a sliding window.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ *				 Optimizations
+ *
+ * Length 3 matches are handled by a separate hash table with no trees.  This
+ * works well for typical "greedy" or "lazy"-style compressors, where length 3
+ * matches are often only helpful if they have small offsets.  Instead of
+ * searching a full tree for length 3+ matches, the algorithm just checks for
+ * one close length 3 match, then focuses on finding length 4+ matches.
+ *
+ * The get_matches() and skip_position() functions are inlined into the
+ * compressors that use them, for the same reasons as in hc_matchfinder.h.
+ *
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef LIB_BT_MATCHFINDER_H
+#define LIB_BT_MATCHFINDER_H
+
+#include <string.h>
+
+#include "lz_extend.h"
+#include "lz_hash.h"
+#include "unaligned.h"
+
+/* The maximum number of bits in the hash codes for length 4+ matches.  The hash
+ * codes for length 3 matches have one bit fewer. */
+#define BT_MATCHFINDER_HASH4_ORDER	16
+
+/* Representation of a match found by the bt_matchfinder */
+struct lz_match {
+
+	/* The number of bytes matched */
+	u32 length;
+
+	/* The offset back from the current position that was matched */
+	u32 offset;
+};
+
+struct bt_matchfinder {
+
+	/* The number of bits in the hash codes for each hash table.  These are
+	 * chosen for each buffer, up to 'max_hash4_order'. */
+	unsigned hash3_order;
+	unsigned hash4_order;
+	unsigned max_hash4_order;
+
+	/* The hash table for finding length 3 matches */
+	u32 *hash3_tab;
+
+	/* The hash table which contains the roots of the binary trees for
+	 * finding length 4+ matches */
+	u32 *hash4_tab;
+
+	/* The child node references for the binary trees.  The left and right
+	 * children of the node for the sequence with position 'pos' are
+	 * 'child_tab[pos * 2]' and 'child_tab[pos * 2 + 1]', respectively. */
+	u32 *child_tab;
+
+	/* The storage for the tables above, unless other storage was given to
+	 * bt_matchfinder_setup() */
+	u32 tabs[];
+};
+
+static forceinline unsigned
+bt_matchfinder_hash4_order(size_t max_bufsize)
+{
+	return lz_hash_order(max_bufsize, BT_MATCHFINDER_HASH4_ORDER);
+}
+
+/*
+ * Return the number of bytes needed for the tables of a matchfinder that can
+ * work with buffers up to the specified size.
+ */
+static forceinline size_t
+bt_matchfinder_tabs_size(size_t max_bufsize)
+{
+	const unsigned hash4_order = bt_matchfinder_hash4_order(max_bufsize);
+
+	return (((size_t)1 << (hash4_order - 1)) + ((size_t)1 << hash4_order) +
+		2 * max_bufsize) * sizeof(u32);
+}
+
+/*
+ * Return the number of bytes that must be allocated for a 'bt_matchfinder' that
+ * can work with buffers up to the specified size.
+ */
+static forceinline size_t
+bt_matchfinder_size(size_t max_bufsize)
+{
+	return sizeof(struct bt_matchfinder) +
+	       bt_matchfinder_tabs_size(max_bufsize);
+}
+
+/*
+ * Set up a newly allocated matchfinder for buffers up to the specified size.
+ * This must be done before anything else.  @tabs is the storage for the tables:
+ * normally 'mf->tabs', but it may instead be a separate allocation of
+ * bt_matchfinder_tabs_size(@max_bufsize) bytes, which lets a matchfinder be
+ * set up again for larger buffers than it was allocated for.
+ */
+static forceinline void
+bt_matchfinder_setup(struct bt_matchfinder *mf, size_t max_bufsize, u32 *tabs)
+{
+	mf->max_hash4_order = bt_matchfinder_hash4_order(max_bufsize);
+	mf->hash3_tab = tabs;
+	mf->child_tab = tabs + (1UL << (mf->max_hash4_order - 1)) +
+		      (1UL << mf->max_hash4_order);
+}
+
+/*
+ * Prepare the matchfinder for a new input buffer of @bufsize bytes.  Smaller
+ * buffers get smaller hash tables, so that only the part of the tables which
+ * will actually be used has to be cleared.
+ */
+static forceinline void
+bt_matchfinder_init(struct bt_matchfinder *mf, size_t bufsize)
+{
+	mf->hash4_order = lz_hash_order_for_buffer(bufsize,
+						   mf->max_hash4_order);
+	mf->hash3_order = mf->hash4_order - 1;
+	mf->hash4_tab = mf->hash3_tab + (1UL << mf->hash3_order);
+
+	memset(mf->hash3_tab, 0,
+	       ((1UL << mf->hash3_order) + (1UL << mf->hash4_order)) *
+	       sizeof(u32));
+}
+
+/*
+ * Copy the state of @src, which has seen only the positions below
+ * @num_positions, into @dst.  Both must have been set up for the same maximum
+ * buffer size.  Like bt_matchfinder_init(), this prepares @dst for a new
+ * buffer, but one which starts with the data that @src has seen, such as a
+ * preset dictionary.
+ */
+static forceinline void
+bt_matchfinder_copy(struct bt_matchfinder *dst,
+		   const struct bt_matchfinder *src, size_t num_positions)
+{
+	dst->hash3_order = src->hash3_order;
+	dst->hash4_order = src->hash4_order;
+	dst->hash4_tab = dst->hash3_tab + (1UL << dst->hash3_order);
+
+	memcpy(dst->hash3_tab, src->hash3_tab,
+	       ((1UL << src->hash3_order) + (1UL << src->hash4_order)) *
+	       sizeof(u32));
+	memcpy(dst->child_tab, src->child_tab, 2 * num_positions * sizeof(u32));
+}
+
+/*
+ * Compute the hash codes for the sequence beginning at @in_next, in the form
+ * needed for the @next_hashes parameter of get_matches() and skip_position().
+ * At least 4 bytes must be available at @in_next.
+ */
+static forceinline void
+bt_matchfinder_init_hashes(const struct bt_matchfinder *mf, const u8 *in_next,
+			   u32 next_hashes[2])
+{
+	u32 seq4 = load_u32_unaligned(in_next);
+
+	next_hashes[0] = lz_hash(loaded_u32_to_u24(seq4), mf->hash3_order);
+	next_hashes[1] = lz_hash(seq4, mf->hash4_order);
+}
+
+static forceinline u32
+bt_matchfinder_slide_pos(u32 pos, u32 slide)
+{
+	return (pos > slide) ? pos - slide : 0;
+}
+
+/*
+ * Slide the window: position 'slide + n' becomes position 'n', and all
+ * positions <= @slide are forgotten.  @end_pos is the number of positions that
+ * are currently in use.  The caller must move the buffer contents the same way.
+ */
+static void
+bt_matchfinder_slide_window(struct bt_matchfinder *mf, u32 slide, u32 end_pos)
+{
+	u32 i;
+
+	for (i = 0; i < (1UL << mf->hash3_order); i++)
+		mf->hash3_tab[i] = bt_matchfinder_slide_pos(mf->hash3_tab[i],
+							    slide);
+
+	for (i = 0; i < (1UL << mf->hash4_order); i++)
+		mf->hash4_tab[i] = bt_matchfinder_slide_pos(mf->hash4_tab[i],
+							    slide);
+
+	for (i = 2 * slide; i < 2 * end_pos; i++)
+		mf->child_tab[i - 2 * slide] =
+			bt_matchfinder_slide_pos(mf->child_tab[i], slide);
+}
+
+static forceinline u32 *
+bt_left_child(struct bt_matchfinder *mf, u32 node)
+{
+	return &mf->child_tab[2 * node + 0];
+}
+
+static forceinline u32 *
+bt_right_child(struct bt_matchfinder *mf, u32 node)
+{
+	return &mf->child_tab[2 * node + 1];
+}
+
+/*
+ * The general form of the matchfinder: insert the sequence at @cur_pos into
+ * its binary tree and, if @record_matches is true, record the matches found on
+ * the way.  See bt_matchfinder_get_matches() for the parameters.
+ */
+static forceinline struct lz_match *
+bt_matchfinder_advance_one_byte(struct bt_matchfinder * const restrict mf,
+				const u8 * const restrict in_begin,
+				const ptrdiff_t cur_pos,
+				const u32 max_len,
+				const u32 nice_len,
+				const u32 max_search_depth,
+				const u32 cutoff,
+				u32 next_hashes[restrict 2],
+				u32 * const restrict best_len_ret,
+				struct lz_match * restrict lz_matchptr,
+				const bool record_matches)
+{
+	const u8 *in_next = in_begin + cur_pos;
+	/* When only skipping, matches needn't be extended past @nice_len.  This
+	 * keeps redundant data from taking quadratic time. */
+	const u32 extend_len = record_matches ? max_len : MIN(max_len, nice_len);
+	u32 depth_remaining = max_search_depth;
+	u32 next_seq4;
+	u32 next_seq3;
+	u32 seq3;
+	u32 hash3;
+	u32 hash4;
+	u32 cur_node;
+	const u8 *matchptr;
+	u32 *pending_lt_ptr, *pending_gt_ptr;
+	u32 best_lt_len, best_gt_len;
+	u32 len;
+	u32 best_len = 2;
+
+	if (unlikely(max_len < 5)) { /* can we read 4 bytes from 'in_next + 1'? */
+		*best_len_ret = best_len;
+		return lz_matchptr;
+	}
+
+	/* Get the precomputed hash codes */
+	hash3 = next_hashes[0];
+	hash4 = next_hashes[1];
+
+	/* Compute the next hash codes */
+	next_seq4 = load_u32_unaligned(in_next + 1);
+	next_seq3 = loaded_u32_to_u24(next_seq4);
+	next_hashes[0] = lz_hash(next_seq3, mf->hash3_order);
+	next_hashes[1] = lz_hash(next_seq4, mf->hash4_order);
+	prefetchw(&mf->hash3_tab[next_hashes[0]]);
+	prefetchw(&mf->hash4_tab[next_hashes[1]]);
+
+	/* Check for a length 3 match, and replace the singleton node in the
+	 * 'hash3' bucket with the node for the current sequence. */
+	cur_node = mf->hash3_tab[hash3];
+	mf->hash3_tab[hash3] = cur_pos;
+	if (record_matches && cur_node > cutoff) {
+		seq3 = load_u24_unaligned(in_next);
+		if (seq3 == load_u24_unaligned(&in_begin[cur_node])) {
+			lz_matchptr->length = 3;
+			lz_matchptr->offset = in_next - &in_begin[cur_node];
+			lz_matchptr++;
+			best_len = 3;
+		}
+	}
+
+	/* Search the binary tree in the 'hash4' bucket, and re-root it at the
+	 * node for the current sequence. */
+	cur_node = mf->hash4_tab[hash4];
+	mf->hash4_tab[hash4] = cur_pos;
+
+	pending_lt_ptr = bt_left_child(mf, cur_pos);
+	pending_gt_ptr = bt_right_child(mf, cur_pos);
+
+	if (cur_node <= cutoff) {
+		*pending_lt_ptr = 0;
+		*pending_gt_ptr = 0;
+		*best_len_ret = best_len;
+		return lz_matchptr;
+	}
+
+	best_lt_len = 0;
+	best_gt_len = 0;
+	len = 0;
+
+	for (;;) {
+		matchptr = &in_begin[cur_node];
+
+		if (matchptr[len] == in_next[len]) {
+			len = lz_extend(in_next, matchptr, len + 1, extend_len);
+			if (record_matches && len > best_len) {
+				best_len = len;
+				lz_matchptr->length = len;
+				lz_matchptr->offset = in_next - matchptr;
+				lz_matchptr++;
+			}
+			if (len >= nice_len) {
+				/* The new node replaces the old one, which is
+				 * identical for our purposes. */
+				*pending_lt_ptr = *bt_left_child(mf, cur_node);
+				*pending_gt_ptr = *bt_right_child(mf, cur_node);
+				*best_len_ret = best_len;
+				return lz_matchptr;
+			}
+			if (len == max_len) {
+				/* The sequences can't be ordered without
+				 * looking past @max_len, so drop the old node
+				 * and its subtrees to keep the tree sorted. */
+				*pending_lt_ptr = 0;
+				*pending_gt_ptr = 0;
+				*best_len_ret = best_len;
+				return lz_matchptr;
+			}
+		}
+
+		if (matchptr[len] < in_next[len]) {
+			*pending_lt_ptr = cur_node;
+			pending_lt_ptr = bt_right_child(mf, cur_node);
+			cur_node = *pending_lt_ptr;
+			best_lt_len = len;
+			if (best_gt_len < len)
+				len = best_gt_len;
+		} else {
+			*pending_gt_ptr = cur_node;
+			pending_gt_ptr = bt_left_child(mf, cur_node);
+			cur_node = *pending_gt_ptr;
+			best_gt_len = len;
+			if (best_lt_len < len)
+				len = best_lt_len;
+		}
+
+		if (cur_node <= cutoff || !--depth_remaining) {
+			*pending_lt_ptr = 0;
+			*pending_gt_ptr = 0;
+			*best_len_ret = best_len;
+			return lz_matchptr;
+		}
+	}
+}
+
+/*
+ * Retrieve a list of matches with the current position.
+ *
+ * @mf
+ *	The matchfinder structure.
+ * @in_begin
+ *	Pointer to the beginning of the input buffer.
+ * @cur_pos
+ *	The current position in the input buffer (the position of the sequence
+ *	being matched against).
+ * @max_len
+ *	The maximum permissible match length at this position.
+ * @nice_len
+ *	Stop searching if a match of at least this length is found.  Unlike
+ *	with hc_matchfinder, this must not be reduced near the end of the
+ *	buffer, since the trees depend on it; it may exceed @max_len.
+ * @max_search_depth
+ *	Limit on the number of potential matches to consider.  Must be >= 1.
+ * @cutoff
+ *	Only consider matches at positions greater than this.  This is 0 when
+ *	the whole buffer may be referenced, or 'cur_pos - window_size' when the
+ *	match offset must be less than 'window_size'.
+ * @next_hashes
+ *	The precomputed hash codes for the sequence beginning at @in_next.
+ *	These will be used and then updated with the precomputed hashcodes for
+ *	the sequence beginning at @in_next + 1.
+ * @best_len_ret
+ *	If a match of length >= 3 was found, then the length of the longest such
+ *	match is written here; otherwise 2 is written here.  (Note: this is
+ *	redundant with the 'struct lz_match' array, but this is easier for the
+ *	compiler to optimize when inlined and the caller immediately does a
+ *	check against 'best_len'.)
+ * @lz_matchptr
+ *	An array in which this function will record the matches.  The recorded
+ *	matches will be sorted by strictly increasing length and (non-strictly)
+ *	increasing offset.  The maximum number of matches that may be found is
+ *	'max_search_depth + 1'.
+ *
+ * The return value is a pointer to the next available slot in the @lz_matchptr
+ * array.  (If no matches were found, this will be the same as @lz_matchptr.)
+ */
+static forceinline struct lz_match *
+bt_matchfinder_get_matches(struct bt_matchfinder * const restrict mf,
+			   const u8 * const restrict in_begin,
+			   const ptrdiff_t cur_pos,
+			   const u32 max_len,
+			   const u32 nice_len,
+			   const u32 max_search_depth,
+			   const u32 cutoff,
+			   u32 next_hashes[restrict 2],
+			   u32 * const restrict best_len_ret,
+			   struct lz_match * const restrict lz_matchptr)
+{
+	return bt_matchfinder_advance_one_byte(mf,
+					       in_begin,
+					       cur_pos,
+					       max_len,
+					       nice_len,
+					       max_search_depth,
+					       cutoff,
+					       next_hashes,
+					       best_len_ret,
+					       lz_matchptr,
+					       true);
+}
+
+/*
+ * Advance the matchfinder, but don't record any matches.
+ *
+ * This is very similar to bt_matchfinder_get_matches() because both functions
+ * must do hashing and tree re-rooting.
+ */
+static forceinline void
+bt_matchfinder_skip_position(struct bt_matchfinder * const restrict mf,
+			     const u8 * const restrict in_begin,
+			     const ptrdiff_t cur_pos,
+			     const u32 max_len,
+			     const u32 nice_len,
+			     const u32 max_search_depth,
+			     const u32 cutoff,
+			     u32 next_hashes[restrict 2])
+{
+	u32 best_len;
+
+	bt_matchfinder_advance_one_byte(mf,
+					in_begin,
+					cur_pos,
+					max_len,
+					nice_len,
+					max_search_depth,
+					cutoff,
+					next_hashes,
+					&best_len,
+					NULL,
+					false);
+}
+
+#endif /* LIB_BT_MATCHFINDER_H */
@@ -0,0 +1,391 @@
+/*
+ * compress_impl.h - XPACK greedy and lazy parsers
+ *
+ * Copyright 2016 Eric Biggers
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * These are the greedy and lazy parsers, lifted out of xpack_compress.c so that
+ * they can be compiled with different target instruction sets.  Most of their
+ * time is spent in the hash chains matchfinder and lz_extend(), which are
+ * inlined into them and so are compiled for the same target.
+ *
+ * The includer defines GREEDY_FUNCNAME, LAZY_FUNCNAME, and ATTRIBUTES.
+ */
+
+static size_t ATTRIBUTES
+GREEDY_FUNCNAME(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
+{
+	u8 * const out_begin = out;
+	u8 * out_next = out_begin;
+	u8 * const out_end = out_begin + out_nbytes_avail;
+	const u8 * const in_begin = c->in_buffer;
+	const u8 *	 in_next = in_begin + c->in_start;
+	const u8 * const in_end  = in_begin + c->in_nbytes;
+	const u32 window_size = c->window_size;
+	u32 max_len = MIN(in_end - in_next, MAX_COMPRESSOR_MATCH_LEN);
+	u32 nice_len = MIN(c->nice_match_length, max_len);
+	u32 next_hashes[2] = {0, 0};
+
+	if (in_end - in_next >= 4)
+		hc_matchfinder_init_hashes(&c->hc_mf, in_next, next_hashes);
+
+	do {
+		/* Starting a new block */
+
+		const u8 * const in_block_begin = in_next;
+		const u8 * const in_max_block_end =
+			in_next + MIN(SOFT_MAX_BLOCK_LENGTH, in_end - in_next);
+		u32 length;
+		u32 offset;
+		u32 ldm_len;
+		u32 ldm_offset;
+		size_t nbytes;
+		u32 litrunlen = 0;
+
+		begin_block(c);
+
+		do {
+			if (unlikely(max_len > in_end - in_next)) {
+				max_len = in_end - in_next;
+				nice_len = MIN(max_len, nice_len);
+			}
+
+			/* Find the longest match at the current position. */
+
+			length = hc_matchfinder_longest_match(&c->hc_mf,
+							      in_begin,
+							      in_next - in_begin,
+							#if MIN_MATCH_LEN == 4
+							      3,
+							#else
+							      2,
+							#endif
+							      max_len,
+							      nice_len,
+							      c->max_search_depth,
+							      MATCH_CUTOFF(in_next - in_begin,
+									   window_size),
+							      next_hashes,
+							      &offset);
+			ldm_len = long_distance_match(c, in_next, max_len,
+						      &ldm_offset);
+			if (ldm_len > length) {
+				length = ldm_len;
+				offset = ldm_offset;
+			}
+			if (length < c->min_match_len ||
+			    (length < c->min_far_match_len &&
+			     offset >= FAR_MATCH_OFFSET)) {
+				/* Literal */
+				record_literal(c, *in_next);
+				in_next++;
+				litrunlen++;
+			} else {
+				/* Match */
+				struct match *match = &c->matches[c->num_matches++];
+
+				record_greedy_offset(c, match, offset);
+				record_litrunlen(c, match, litrunlen);
+				record_length(c, match, length);
+
+				in_next = hc_matchfinder_skip_positions(&c->hc_mf,
+									in_begin,
+									in_next + 1 - in_begin,
+									in_end - in_begin,
+									length - 1,
+									next_hashes);
+				litrunlen = 0;
+			}
+		} while (in_next < in_max_block_end &&
+			 !should_end_block(c, in_block_begin, in_next, in_end));
+
+		nbytes = write_block(c, out_next, out_end - out_next,
+				     in_block_begin, in_next - in_block_begin,
+				     litrunlen,
+				     in_next == in_end && c->is_final_data);
+		if (nbytes == 0)
+			return 0;
+
+		out_next += nbytes;
+
+	} while (in_next != in_end);
+
+	return out_next - out_begin;
+}
+
+static size_t ATTRIBUTES
+LAZY_FUNCNAME(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
+{
+	u8 * const out_begin = out;
+	u8 * out_next = out_begin;
+	u8 * const out_end = out_begin + out_nbytes_avail;
+	const u8 * const in_begin = c->in_buffer;
+	const u8 *	 in_next = in_begin + c->in_start;
+	const u8 * const in_end  = in_begin + c->in_nbytes;
+	const u32 window_size = c->window_size;
+	u32 max_len = MIN(in_end - in_next, MAX_COMPRESSOR_MATCH_LEN);
+	u32 nice_len = MIN(c->nice_match_length, max_len);
+	u32 next_hashes[2] = {0, 0};
+	u32 * const recent_offsets = c->recent_offsets;
+	const u32 min_len = c->min_match_len;
+	const u32 min_far_len = c->min_far_match_len;
+
+	if (in_end - in_next >= 4)
+		hc_matchfinder_init_hashes(&c->hc_mf, in_next, next_hashes);
+
+	do {
+		/* Starting a new block */
+
+		const u8 * const in_block_begin = in_next;
+		const u8 * const in_max_block_end =
+			in_next + MIN(SOFT_MAX_BLOCK_LENGTH, in_end - in_next);
+		u32 cur_len;
+		u32 cur_offset;
+		u32 cur_offset_data;
+		u32 cur_score;
+		u32 next_len;
+		u32 next_offset;
+		u32 next_offset_data;
+		u32 next_score;
+		u32 rep_max_len;
+		unsigned rep_max_idx;
+		u32 rep_score;
+		u32 skip_len;
+		u32 ldm_len;
+		u32 ldm_offset;
+		u32 litrunlen = 0;
+		size_t nbytes;
+		struct match *match;
+
+		begin_block(c);
+
+		do {
+			if (unlikely(max_len > in_end - in_next)) {
+				max_len = in_end - in_next;
+				nice_len = MIN(max_len, nice_len);
+			}
+
+			/* Find the longest match at the current position. */
+
+			cur_len = hc_matchfinder_longest_match(&c->hc_mf,
+							       in_begin,
+							       in_next - in_begin,
+							#if MIN_MATCH_LEN == 4
+							       3,
+							#else
+							       2,
+							#endif
+							       max_len,
+							       nice_len,
+							       c->max_search_depth,
+							       MATCH_CUTOFF(in_next - in_begin,
+									    window_size),
+							       next_hashes,
+							       &cur_offset);
+			ldm_len = long_distance_match(c, in_next, max_len,
+						      &ldm_offset);
+			if (ldm_len > cur_len) {
+				cur_len = ldm_len;
+				cur_offset = ldm_offset;
+			}
+			if (cur_len < min_len ||
+			    (cur_len < min_far_len &&
+			     cur_offset >= FAR_MATCH_OFFSET)) {
+				/*
+				 * There was no match found, or the only match
+				 * found was too short for its offset.  Output a
+				 * literal.
+				 */
+				record_literal(c, *in_next);
+				in_next++;
+				litrunlen++;
+				continue;
+			}
+
+			if (cur_offset == recent_offsets[0]) {
+				in_next++;
+				cur_offset_data = 0;
+				skip_len = cur_len - 1;
+				goto choose_cur_match;
+			}
+
+			cur_offset_data = cur_offset + (NUM_REPS - 1);
+			cur_score = explicit_offset_match_score(cur_len, cur_offset_data);
+
+			/* Consider a repeat offset match. */
+			rep_max_len = find_longest_repeat_offset_match(in_next,
+								       max_len,
+								       recent_offsets,
+								       &rep_max_idx);
+			in_next++;
+
+			if (rep_max_len >= min_len &&
+			    (rep_score = repeat_offset_match_score(rep_max_len,
+								   rep_max_idx)) >= cur_score)
+			{
+				cur_len = rep_max_len;
+				cur_offset_data = rep_max_idx;
+				skip_len = rep_max_len - 1;
+				goto choose_cur_match;
+			}
+
+		have_cur_match:
+
+			/* We have a match at the current position. */
+
+			/* If we have a very long match, choose it immediately. */
+			if (cur_len >= nice_len) {
+				skip_len = cur_len - 1;
+				goto choose_cur_match;
+			}
+
+			/* See if there's a better match at the next position. */
+
+			if (unlikely(max_len > in_end - in_next)) {
+				max_len = in_end - in_next;
+				nice_len = MIN(max_len, nice_len);
+			}
+
+			next_len = hc_matchfinder_longest_match(&c->hc_mf,
+								in_begin,
+								in_next - in_begin,
+							#if MIN_MATCH_LEN == 2
+								cur_len - 2,
+							#else
+								cur_len - 1,
+							#endif
+								max_len,
+								nice_len,
+								c->max_search_depth / 2,
+								MATCH_CUTOFF(in_next - in_begin,
+									     window_size),
+								next_hashes,
+								&next_offset);
+
+		#if MIN_MATCH_LEN == 2
+			if (next_len <= cur_len - 2) {
+		#else
+			if (next_len <= cur_len - 1) {
+		#endif
+				in_next++;
+				skip_len = cur_len - 2;
+				goto choose_cur_match;
+			}
+
+			next_offset_data = next_offset + (NUM_REPS - 1);
+			next_score = explicit_offset_match_score(next_len, next_offset_data);
+
+			rep_max_len = find_longest_repeat_offset_match(in_next,
+								       max_len,
+								       recent_offsets,
+								       &rep_max_idx);
+			in_next++;
+
+			if (rep_max_len >= min_len &&
+			    (rep_score = repeat_offset_match_score(rep_max_len,
+								   rep_max_idx)) >= next_score)
+			{
+
+				if (rep_score > cur_score) {
+					/*
+					 * The next match is better, and it's a
+					 * repeat offset match.
+					 */
+					record_literal(c, *(in_next - 2));
+					litrunlen++;
+					cur_len = rep_max_len;
+					cur_offset_data = rep_max_idx;
+					skip_len = cur_len - 1;
+					goto choose_cur_match;
+				}
+			} else {
+				if (next_score > cur_score) {
+					/*
+					 * The next match is better, and it's an
+					 * explicit offset match.
+					 */
+					record_literal(c, *(in_next - 2));
+					litrunlen++;
+					cur_len = next_len;
+					cur_offset_data = next_offset_data;
+					cur_score = next_score;
+					goto have_cur_match;
+				}
+			}
+
+			/* The original match was better. */
+			skip_len = cur_len - 2;
+
+		choose_cur_match:
+			match = &c->matches[c->num_matches++];
+			if (cur_offset_data < NUM_REPS) {
+				u32 offset;
+
+				record_repeat_offset(c, match, cur_offset_data);
+
+				offset = recent_offsets[cur_offset_data];
+				recent_offsets[cur_offset_data] = recent_offsets[0];
+				recent_offsets[0] = offset;
+			} else {
+				record_explicit_offset(c, match,
+						       cur_offset_data - (NUM_REPS - 1));
+				STATIC_ASSERT(NUM_REPS >= 1 && NUM_REPS <= 4);
+			#if NUM_REPS >= 4
+				recent_offsets[3] = recent_offsets[2];
+			#endif
+			#if NUM_REPS >= 3
+				recent_offsets[2] = recent_offsets[1];
+			#endif
+			#if NUM_REPS >= 2
+				recent_offsets[1] = recent_offsets[0];
+			#endif
+				recent_offsets[0] = cur_offset_data - (NUM_REPS - 1);
+			}
+			record_litrunlen(c, match, litrunlen);
+			record_length(c, match, cur_len);
+			litrunlen = 0;
+
+			in_next = hc_matchfinder_skip_positions(&c->hc_mf,
+								in_begin,
+								in_next - in_begin,
+								in_end - in_begin,
+								skip_len,
+								next_hashes);
+		} while (in_next < in_max_block_end &&
+			 !should_end_block(c, in_block_begin, in_next, in_end));
+
+		nbytes = write_block(c, out_next, out_end - out_next,
+				     in_block_begin, in_next - in_block_begin,
+				     litrunlen,
+				     in_next == in_end && c->is_final_data);
+		if (nbytes == 0)
+			return 0;
+
+		out_next += nbytes;
+
+	} while (in_next != in_end);
+
+	return out_next - out_begin;
+}
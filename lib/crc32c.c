@@ -0,0 +1,249 @@
+/*
+ * crc32c.c - CRC-32C (Castagnoli) checksum
+ *
+ * Copyright 2016 Eric Biggers
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * CRC-32C uses the Castagnoli polynomial, which unlike the polynomial of the
+ * zlib CRC-32 has an instruction of its own on x86 (SSE4.2) and ARMv8.  Where
+ * that instruction is available, it is used; otherwise the CRC is computed 8
+ * bytes at a time with the "slice by 8" tables.
+ *
+ * The CRCs are handled in the usual bit-reversed representation, where the
+ * coefficient of x^0 is the highest bit.  Internally they are updated without
+ * the inversions at the start and end, which xpack_crc32c() applies.
+ */
+
+#include "xpack_common.h"
+#include "arm_cpu_features.h"
+#include "x86_cpu_features.h"
+
+/* The CRC-32C generator polynomial, bit-reversed, without the x^32 term */
+#define CRC32C_POLY		0x82F63B78
+
+/* The length of each of the three lanes of the hardware implementations; see
+ * crc32c_impl.h.  crc32c_lane_shift_table is generated for this length. */
+#define CRC32C_LANE_SIZE	1024
+
+/*
+ * Choose the implementations to build.  If the compiler targets processors
+ * which all have a CRC-32C instruction, only that implementation is needed.
+ * Otherwise the SSE4.2 or ARMv8 one is chosen at runtime where it is supported.
+ */
+#if defined(__x86_64__) && defined(__SSE4_2__)
+#  define SSE42_IMPL_ENABLED	1
+#  define ARM_IMPL_ENABLED	0
+#  define GENERIC_IMPL_ENABLED	0
+#  define DISPATCH_ENABLED	0
+#elif X86_CPU_FEATURES_ENABLED && COMPILER_SUPPORTS_SSE42_TARGET
+#  define SSE42_IMPL_ENABLED	1
+#  define ARM_IMPL_ENABLED	0
+#  define GENERIC_IMPL_ENABLED	1
+#  define DISPATCH_ENABLED	1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#  define SSE42_IMPL_ENABLED	0
+#  define ARM_IMPL_ENABLED	1
+#  define GENERIC_IMPL_ENABLED	0
+#  define DISPATCH_ENABLED	0
+#elif defined(__aarch64__) && ARM_CPU_FEATURES_ENABLED && \
+	COMPILER_SUPPORTS_CRC32_TARGET
+#  define SSE42_IMPL_ENABLED	0
+#  define ARM_IMPL_ENABLED	1
+#  define GENERIC_IMPL_ENABLED	1
+#  define DISPATCH_ENABLED	1
+#else
+#  define SSE42_IMPL_ENABLED	0
+#  define ARM_IMPL_ENABLED	0
+#  define GENERIC_IMPL_ENABLED	1
+#  define DISPATCH_ENABLED	0
+#endif
+
+#define NEED_CRC32C_SLICE8_TABLE	GENERIC_IMPL_ENABLED
+#define NEED_CRC32C_LANE_SHIFT_TABLE	(SSE42_IMPL_ENABLED || ARM_IMPL_ENABLED)
+#include "crc32c_table.h"
+
+#if GENERIC_IMPL_ENABLED
+/*
+ * Update a CRC with the table for each byte of a 64-bit word.  The table for
+ * byte 'k' of the word gives the CRC of that byte followed by the 7 - k zero
+ * bytes which the rest of the word contributes to.
+ */
+static u32
+crc32c_slice8(u32 crc, const u8 *p, size_t len)
+{
+	const u32 *t = crc32c_slice8_table;
+
+	while (len != 0 && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ t[(u8)crc ^ *p++];
+		len--;
+	}
+
+	while (len >= 8) {
+		const u32 v1 = get_unaligned_le32(p) ^ crc;
+		const u32 v2 = get_unaligned_le32(p + 4);
+
+		crc = t[0x700 + (u8)v1] ^ t[0x600 + (u8)(v1 >> 8)] ^
+		      t[0x500 + (u8)(v1 >> 16)] ^ t[0x400 + (v1 >> 24)] ^
+		      t[0x300 + (u8)v2] ^ t[0x200 + (u8)(v2 >> 8)] ^
+		      t[0x100 + (u8)(v2 >> 16)] ^ t[0x000 + (v2 >> 24)];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len != 0) {
+		crc = (crc >> 8) ^ t[(u8)crc ^ *p++];
+		len--;
+	}
+	return crc;
+}
+#  define DEFAULT_IMPL crc32c_slice8
+#endif /* GENERIC_IMPL_ENABLED */
+
+#if SSE42_IMPL_ENABLED || ARM_IMPL_ENABLED
+/*
+ * Return 'crc' updated with CRC32C_LANE_SIZE zero bytes, i.e. multiplied by
+ * x^(8 * CRC32C_LANE_SIZE).  This is linear in 'crc', so the result is the sum
+ * of the results for each byte of 'crc', which the table holds.
+ */
+static forceinline u32
+crc32c_shift_lane(u32 crc)
+{
+	return crc32c_lane_shift_table[0x000 + (u8)crc] ^
+	       crc32c_lane_shift_table[0x100 + (u8)(crc >> 8)] ^
+	       crc32c_lane_shift_table[0x200 + (u8)(crc >> 16)] ^
+	       crc32c_lane_shift_table[0x300 + (crc >> 24)];
+}
+#endif
+
+#if SSE42_IMPL_ENABLED
+#  include <nmmintrin.h>
+#  define FUNCNAME crc32c_sse42
+#  if DISPATCH_ENABLED
+#    define ATTRIBUTES __attribute__((target("sse4.2")))
+#  else
+#    define ATTRIBUTES
+#    define DEFAULT_IMPL crc32c_sse42
+#  endif
+#  define CRC32C_U8(crc, b)	_mm_crc32_u8((crc), (b))
+#  define CRC32C_U64(crc, v)	((u32)_mm_crc32_u64((crc), (v)))
+#  include "crc32c_impl.h"
+#  undef FUNCNAME
+#  undef ATTRIBUTES
+#  undef CRC32C_U8
+#  undef CRC32C_U64
+#endif
+
+#if ARM_IMPL_ENABLED
+#  define FUNCNAME crc32c_arm
+#  if DISPATCH_ENABLED
+#    define ATTRIBUTES __attribute__((target(CRC32_TARGET)))
+#    define CRC32C_U8(crc, b)	crc32c_u8_builtin((crc), (b))
+#    define CRC32C_U64(crc, v)	crc32c_u64_builtin((crc), (v))
+#  else
+#    include <arm_acle.h>
+#    define ATTRIBUTES
+#    define DEFAULT_IMPL crc32c_arm
+#    define CRC32C_U8(crc, b)	__crc32cb((crc), (b))
+#    define CRC32C_U64(crc, v)	__crc32cd((crc), (v))
+#  endif
+#  include "crc32c_impl.h"
+#  undef FUNCNAME
+#  undef ATTRIBUTES
+#  undef CRC32C_U8
+#  undef CRC32C_U64
+#endif
+
+#if DISPATCH_ENABLED
+
+static u32 dispatch(u32 crc, const u8 *p, size_t len);
+
+typedef u32 (*crc32c_func_t)(u32 crc, const u8 *p, size_t len);
+
+static crc32c_func_t crc32c_impl = dispatch;
+
+static u32
+dispatch(u32 crc, const u8 *p, size_t len)
+{
+	crc32c_func_t f = DEFAULT_IMPL;
+
+#if SSE42_IMPL_ENABLED
+	if (x86_have_cpu_feature(X86_CPU_FEATURE_SSE4_2))
+		f = crc32c_sse42;
+#endif
+#if ARM_IMPL_ENABLED
+	if (arm_have_cpu_feature(ARM_CPU_FEATURE_CRC32))
+		f = crc32c_arm;
+#endif
+	crc32c_impl = f;
+	return (*f)(crc, p, len);
+}
+#endif /* DISPATCH_ENABLED */
+
+LIBEXPORT uint32_t
+xpack_crc32c(uint32_t crc, const void *buffer, size_t len)
+{
+#if DISPATCH_ENABLED
+	return ~(*crc32c_impl)(~crc, buffer, len);
+#else
+	return ~DEFAULT_IMPL(~crc, buffer, len);
+#endif
+}
+
+/* Multiply two polynomials modulo the generator polynomial. */
+static u32
+multiply_mod_poly(u32 a, u32 b)
+{
+	u32 product = 0;
+	u32 bit;
+
+	/* For each coefficient of 'a', from x^0 up, add in 'b' if it's set and
+	 * then multiply 'b' by x. */
+	for (bit = (u32)1 << 31; bit != 0; bit >>= 1) {
+		if (a & bit)
+			product ^= b;
+		b = (b >> 1) ^ ((b & 1) ? CRC32C_POLY : 0);
+	}
+	return product;
+}
+
+LIBEXPORT uint32_t
+xpack_crc32c_combine(uint32_t crc1, uint32_t crc2, unsigned long long len2)
+{
+	u32 shift = (u32)1 << 31;	/* x^0 */
+	u32 power = (u32)1 << 23;	/* x^8, for one byte */
+
+	/*
+	 * The CRC of the concatenation is the CRC of the first part updated with
+	 * 'len2' zero bytes, plus the CRC of the second part.  Updating a CRC
+	 * with n zero bytes multiplies it by x^(8n), which is found by repeated
+	 * squaring.  The inversions at the start and end cancel out.
+	 */
+	for (; len2 != 0; len2 >>= 1) {
+		if (len2 & 1)
+			shift = multiply_mod_poly(shift, power);
+		power = multiply_mod_poly(power, power);
+	}
+	return multiply_mod_poly(shift, crc1) ^ crc2;
+}
@@ -0,0 +1,55 @@
+/*
+ * crc32c_impl.h - CRC-32C using the processor's CRC instructions
+ */
+
+/*
+ * This is included by crc32c.c once for each instruction set.  The includer
+ * defines FUNCNAME, ATTRIBUTES, and CRC32C_U8(crc, b) and CRC32C_U64(crc, v),
+ * which update a CRC (without the inversions) with one byte or with a 64-bit
+ * little endian word.
+ *
+ * The instruction for a word can start every cycle but takes about three cycles
+ * to finish, so a single chain of them leaves the processor mostly waiting.
+ * Instead, each 3 * CRC32C_LANE_SIZE bytes are split into three lanes whose
+ * CRCs are computed side by side, then combined.
+ */
+static u32 ATTRIBUTES
+FUNCNAME(u32 crc, const u8 *p, size_t len)
+{
+	while (len != 0 && ((uintptr_t)p & 7)) {
+		crc = CRC32C_U8(crc, *p++);
+		len--;
+	}
+
+	while (len >= 3 * CRC32C_LANE_SIZE) {
+		const u8 * const lane_end = p + CRC32C_LANE_SIZE;
+		u32 crc1 = 0;
+		u32 crc2 = 0;
+
+		do {
+			crc = CRC32C_U64(crc, get_unaligned_le64(p));
+			crc1 = CRC32C_U64(crc1, get_unaligned_le64(
+						p + CRC32C_LANE_SIZE));
+			crc2 = CRC32C_U64(crc2, get_unaligned_le64(
+						p + 2 * CRC32C_LANE_SIZE));
+			p += 8;
+		} while (p != lane_end);
+
+		crc = crc32c_shift_lane(crc) ^ crc1;
+		crc = crc32c_shift_lane(crc) ^ crc2;
+		p += 2 * CRC32C_LANE_SIZE;
+		len -= 3 * CRC32C_LANE_SIZE;
+	}
+
+	while (len >= 8) {
+		crc = CRC32C_U64(crc, get_unaligned_le64(p));
+		p += 8;
+		len -= 8;
+	}
+
+	while (len != 0) {
+		crc = CRC32C_U8(crc, *p++);
+		len--;
+	}
+	return crc;
+}
@@ -28,20 +28,38 @@
 /*
  * This is the actual decompression routine, lifted out of xpack_decompress.c so
  * that it can be compiled with different target instruction sets.
+ *
+ * Decompress blocks from the input that begins at *in_next_p and ends at
+ * @in_end, writing the output starting at *out_next_p.  Matches may refer back
+ * as far as @out_begin, and from there into the last 'd->dict_avail' bytes of
+ * the preset dictionary.  No output is written at or beyond @out_end.  If
+ * @single_block is true, then only one block is decompressed; otherwise blocks
+ * are decompressed up to and including the final block.  The recent offsets
+ * queue is carried in 'd->recent_offsets'.
+ *
+ * On success, *in_next_p and *out_next_p are advanced past the data consumed
+ * and produced, and *is_final_ret is set to whether the last block decompressed
+ * was the final block.  If the checksum is enabled, then the output of each
+ * block is added to 'd->checksum' as soon as the block is done, while it's
+ * still in the cache.  On failure, the output and the pointers are left in an
+ * undefined state, but 'd->recent_offsets' and 'd->checksum' are not modified.
+ *
+ * Besides FUNCNAME and ATTRIBUTES, the includer defines COPY_32_BYTES(src, dst)
+ * to the 32-byte copy kernel for the target, and EXPAND_PATTERN(src, dst, end,
+ * offset) to its short-offset pattern expansion kernel if it has one.
  */
-
 static enum decompress_result ATTRIBUTES
 FUNCNAME(struct xpack_decompressor * restrict d,
-	 const void * restrict in, size_t in_nbytes,
-	 void * restrict out, size_t out_nbytes_avail,
-	 size_t *actual_out_nbytes_ret)
+	 const u8 ** restrict in_next_p, const u8 * const in_end,
+	 u8 * const out_begin, u8 ** restrict out_next_p, u8 * const out_end,
+	 bool single_block, bool *is_final_ret)
 {
-	const u8 *in_next = in;
-	const u8 * const in_end = in_next + in_nbytes;
-	u8 *out_next = out;
-	u8 * const out_end = out_next + out_nbytes_avail;
+	const u8 *in_next = *in_next_p;
+	u8 *out_next = *out_next_p;
+	u8 *out_block_begin;
 	u8 *out_block_end;
 	u32 recent_offsets[NUM_REPS];
+	u32 checksum = d->checksum;
 #ifdef ENABLE_PREPROCESSING
 	unsigned preprocessed = 0;
 #endif
@@ -65,7 +83,18 @@ FUNCNAME(struct xpack_decompressor * restrict d,
 	unsigned log2_num_length_states;
 	unsigned log2_num_offset_states;
 	unsigned log2_num_aligned_states;
-#if NUM_LITERAL_STREAMS == 2
+	bool new_literal_table;
+	bool new_litrunlen_table;
+	bool new_length_table;
+	bool new_offset_table;
+	bool new_aligned_table;
+	u16 *state_counts;
+#if NUM_LITERAL_STREAMS == 4
+	unsigned literal_state_1;
+	unsigned literal_state_2;
+	unsigned literal_state_3;
+	unsigned literal_state_4;
+#elif NUM_LITERAL_STREAMS == 2
 	unsigned literal_state_1;
 	unsigned literal_state_2;
 #else
@@ -79,10 +108,11 @@ FUNCNAME(struct xpack_decompressor * restrict d,
 	u32 sym;
 	u32 bits;
 
-	init_recent_offsets(recent_offsets);
+	memcpy(recent_offsets, d->recent_offsets, sizeof(recent_offsets));
 
 next_block:
 	/* Starting to decompress the next block */
+	out_block_begin = out_next;
 
 	ENSURE_BITS(1 + NUM_BLOCKTYPE_BITS + 1 + NUM_BLOCKSIZE_BITS);
 
@@ -91,6 +121,10 @@ next_block:
 
 	/* block type */
 	block_type = POP_BITS(NUM_BLOCKTYPE_BITS);
+#ifdef ENABLE_PREPROCESSING
+	preprocessed |= block_type & BLOCKTYPE_FLAG_PREPROCESSED;
+	block_type &= ~BLOCKTYPE_FLAG_PREPROCESSED;
+#endif
 
 	/* block uncompressed size */
 	if (POP_BITS(1))
@@ -99,43 +133,118 @@ next_block:
 		block_usize = POP_BITS(NUM_BLOCKSIZE_BITS);
 
 	SAFETY_CHECK(block_type == BLOCKTYPE_ALIGNED ||
-		     block_type == BLOCKTYPE_VERBATIM);
+		     block_type == BLOCKTYPE_VERBATIM ||
+		     block_type == BLOCKTYPE_UNCOMPRESSED);
 
 	if (unlikely(block_usize > out_end - out_next))
 		return DECOMPRESS_INSUFFICIENT_SPACE;
 
+	if (block_type == BLOCKTYPE_UNCOMPRESSED) {
+		/* The data is stored directly, starting at the next byte
+		 * boundary.  An empty block is allowed, to end a stream. */
+		SAFETY_CHECK(overrun_count <= (bitsleft >> 3));
+		ALIGN_INPUT();
+		SAFETY_CHECK(block_usize <= in_end - in_next);
+		memcpy(out_next, in_next, block_usize);
+		in_next += block_usize;
+		out_next += block_usize;
+		goto block_done;
+	}
+
 	SAFETY_CHECK(block_usize > 0);
 
 	out_block_end = out_next + block_usize;
 
-	/* Read the FSE state counts for each alphabet. */
+	/*
+	 * Read the log2 number of states for each alphabet.
+	 * REPEAT_LOG2_NUM_STATES means that the table which the last block to
+	 * send one built for the alphabet is reused, and that no state counts
+	 * are sent for it.  PREDEFINED_LOG2_NUM_STATES means the same, except
+	 * that the predefined table is installed as the one to reuse first.
+	 */
 	ENSURE_BITS(20);
 	log2_num_literal_states = POP_BITS(4);
 	log2_num_litrunlen_states = POP_BITS(4);
 	log2_num_length_states = POP_BITS(4);
 	log2_num_offset_states = POP_BITS(4);
-	if (block_type == BLOCKTYPE_ALIGNED)
+
+	if (log2_num_litrunlen_states == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(d->litrunlen_decode_table,
+		       d->predefined_litrunlen_decode_table,
+		       sizeof(d->predefined_litrunlen_decode_table));
+		d->log2_num_litrunlen_states =
+			LOG2_NUM_PREDEFINED_LITRUNLEN_STATES;
+		log2_num_litrunlen_states = REPEAT_LOG2_NUM_STATES;
+	}
+
+	if (log2_num_length_states == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(d->length_decode_table,
+		       d->predefined_length_decode_table,
+		       sizeof(d->predefined_length_decode_table));
+		d->log2_num_length_states = LOG2_NUM_PREDEFINED_LENGTH_STATES;
+		log2_num_length_states = REPEAT_LOG2_NUM_STATES;
+	}
+
+	if (log2_num_offset_states == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(d->offset_decode_table,
+		       d->predefined_offset_decode_table,
+		       sizeof(d->predefined_offset_decode_table));
+		d->log2_num_offset_states = LOG2_NUM_PREDEFINED_OFFSET_STATES;
+		log2_num_offset_states = REPEAT_LOG2_NUM_STATES;
+	}
+
+	new_aligned_table = false;
+	if (block_type == BLOCKTYPE_ALIGNED) {
 		log2_num_aligned_states = POP_BITS(4);
-	else
+		new_aligned_table = (log2_num_aligned_states !=
+				     REPEAT_LOG2_NUM_STATES);
+		if (!new_aligned_table)
+			log2_num_aligned_states = d->log2_num_aligned_states;
+	} else {
 		log2_num_aligned_states = 0;
+	}
+
+	num_state_counts = 0;
 
+	new_literal_table = (log2_num_literal_states !=
+			      REPEAT_LOG2_NUM_STATES);
+	if (new_literal_table)
+		num_state_counts += LITERAL_ALPHABET_SIZE;
+	else
+		log2_num_literal_states = d->log2_num_literal_states;
+
+	new_litrunlen_table = (log2_num_litrunlen_states !=
+			        REPEAT_LOG2_NUM_STATES);
+	if (new_litrunlen_table)
+		num_state_counts += LITRUNLEN_ALPHABET_SIZE;
+	else
+		log2_num_litrunlen_states = d->log2_num_litrunlen_states;
+
+	new_length_table = (log2_num_length_states !=
+			     REPEAT_LOG2_NUM_STATES);
+	if (new_length_table)
+		num_state_counts += LENGTH_ALPHABET_SIZE;
+	else
+		log2_num_length_states = d->log2_num_length_states;
+
+	new_offset_table = (log2_num_offset_states !=
+			     REPEAT_LOG2_NUM_STATES);
+	if (new_offset_table)
+		num_state_counts += MAX_OFFSET_ALPHABET_SIZE;
+	else
+		log2_num_offset_states = d->log2_num_offset_states;
+
+	if (new_aligned_table)
+		num_state_counts += ALIGNED_ALPHABET_SIZE;
+
+	/* This also fails if a table is to be reused but there isn't one. */
 	SAFETY_CHECK(log2_num_literal_states <= MAX_LOG2_NUM_LITERAL_STATES &&
 		     log2_num_litrunlen_states <= MAX_LOG2_NUM_LITRUNLEN_STATES &&
 		     log2_num_length_states <= MAX_LOG2_NUM_LENGTH_STATES &&
 		     log2_num_offset_states <= MAX_LOG2_NUM_OFFSET_STATES &&
 		     log2_num_aligned_states <= MAX_LOG2_NUM_ALIGNED_STATES);
 
-#ifndef _MSC_VER
-	STATIC_ASSERT(offsetof(struct xpack_decompressor,
-			aligned_state_counts[ALIGNED_ALPHABET_SIZE]) ==
-		      offsetof(struct xpack_decompressor, state_counts) +
-			sizeof(d->state_counts));
-#endif
-
-	num_state_counts = ARRAY_LEN(d->state_counts);
-	if (block_type != BLOCKTYPE_ALIGNED)
-		num_state_counts -= ALIGNED_ALPHABET_SIZE;
-
+	/* Read the FSE state counts for the alphabets with new tables. */
 	for (i = 0; i < num_state_counts; ) {
 		unsigned code;
 
@@ -165,10 +274,6 @@ next_block:
 		}
 	}
 
-#ifdef ENABLE_PREPROCESSING
-	preprocessed |= d->literal_state_counts[0xE8];
-#endif
-
 	/* Prepare the extra_bytes pointer. */
 
 	ENSURE_BITS(5);
@@ -199,12 +304,58 @@ next_block:
 	SAFETY_CHECK(num_literals <= out_block_end - out_next);
 	literals = out_block_end - num_literals;
 
-	SAFETY_CHECK(build_fse_decode_table(d->literal_decode_table,
-					    d->literal_state_counts,
-					    LITERAL_ALPHABET_SIZE,
-					    log2_num_literal_states));
+	state_counts = d->state_counts;
+	if (new_literal_table) {
+		d->log2_num_literal_states = REPEAT_LOG2_NUM_STATES;
+		SAFETY_CHECK(build_fse_decode_table(d->literal_decode_table,
+						    state_counts,
+						    LITERAL_ALPHABET_SIZE,
+						    log2_num_literal_states));
+		d->log2_num_literal_states = log2_num_literal_states;
+		state_counts += LITERAL_ALPHABET_SIZE;
+	}
 
-#if NUM_LITERAL_STREAMS == 2
+#if NUM_LITERAL_STREAMS == 4
+	/*
+	 * Literal 'i' is decoded with literal state 'i % 4'.  The four states
+	 * are independent, so the table lookups for four consecutive literals
+	 * can be in flight at once.
+	 */
+	ENSURE_BITS(2 * MAX_LOG2_NUM_LITERAL_STATES);
+	literal_state_1 = POP_BITS(log2_num_literal_states);
+	literal_state_2 = POP_BITS(log2_num_literal_states);
+	ENSURE_BITS(2 * MAX_LOG2_NUM_LITERAL_STATES);
+	literal_state_3 = POP_BITS(log2_num_literal_states);
+	literal_state_4 = POP_BITS(log2_num_literal_states);
+	lits = literals;
+	lits_end = literals + (num_literals & ~3);
+	while (lits != lits_end) {
+		if (CAN_ENSURE(4 * MAX_LOG2_NUM_LITERAL_STATES))
+			ENSURE_BITS(4 * MAX_LOG2_NUM_LITERAL_STATES);
+		else
+			ENSURE_BITS(2 * MAX_LOG2_NUM_LITERAL_STATES);
+		*lits++ = DECODE_SYMBOL(literal_state_1, d->literal_decode_table);
+		*lits++ = DECODE_SYMBOL(literal_state_2, d->literal_decode_table);
+		if (!CAN_ENSURE(4 * MAX_LOG2_NUM_LITERAL_STATES))
+			ENSURE_BITS(2 * MAX_LOG2_NUM_LITERAL_STATES);
+		*lits++ = DECODE_SYMBOL(literal_state_3, d->literal_decode_table);
+		*lits++ = DECODE_SYMBOL(literal_state_4, d->literal_decode_table);
+	}
+	if (lits != out_block_end) {
+		ENSURE_BITS(MAX_LOG2_NUM_LITERAL_STATES);
+		*lits++ = DECODE_SYMBOL(literal_state_1, d->literal_decode_table);
+	}
+	if (lits != out_block_end) {
+		ENSURE_BITS(MAX_LOG2_NUM_LITERAL_STATES);
+		*lits++ = DECODE_SYMBOL(literal_state_2, d->literal_decode_table);
+	}
+	if (lits != out_block_end) {
+		ENSURE_BITS(MAX_LOG2_NUM_LITERAL_STATES);
+		*lits++ = DECODE_SYMBOL(literal_state_3, d->literal_decode_table);
+	}
+	SAFETY_CHECK(literal_state_1 == 0 && literal_state_2 == 0 &&
+		     literal_state_3 == 0 && literal_state_4 == 0);
+#elif NUM_LITERAL_STREAMS == 2
 	ENSURE_BITS(2 * MAX_LOG2_NUM_LITERAL_STATES);
 	literal_state_1 = POP_BITS(log2_num_literal_states);
 	literal_state_2 = POP_BITS(log2_num_literal_states);
@@ -244,26 +395,44 @@ next_block:
 	if (block_type == BLOCKTYPE_ALIGNED)
 		aligned_state = POP_BITS(log2_num_aligned_states);
 
-	SAFETY_CHECK(build_fse_decode_table(d->litrunlen_decode_table,
-					    d->litrunlen_state_counts,
-					    LITRUNLEN_ALPHABET_SIZE,
-					    log2_num_litrunlen_states));
+	if (new_litrunlen_table) {
+		d->log2_num_litrunlen_states = REPEAT_LOG2_NUM_STATES;
+		SAFETY_CHECK(build_fse_decode_table(d->litrunlen_decode_table,
+						    state_counts,
+						    LITRUNLEN_ALPHABET_SIZE,
+						    log2_num_litrunlen_states));
+		d->log2_num_litrunlen_states = log2_num_litrunlen_states;
+		state_counts += LITRUNLEN_ALPHABET_SIZE;
+	}
 
-	SAFETY_CHECK(build_fse_decode_table(d->length_decode_table,
-					    d->length_state_counts,
-					    LENGTH_ALPHABET_SIZE,
-					    log2_num_length_states));
+	if (new_length_table) {
+		d->log2_num_length_states = REPEAT_LOG2_NUM_STATES;
+		SAFETY_CHECK(build_fse_decode_table(d->length_decode_table,
+						    state_counts,
+						    LENGTH_ALPHABET_SIZE,
+						    log2_num_length_states));
+		d->log2_num_length_states = log2_num_length_states;
+		state_counts += LENGTH_ALPHABET_SIZE;
+	}
 
-	SAFETY_CHECK(build_fse_decode_table(d->offset_decode_table,
-					    d->offset_state_counts,
-					    MAX_OFFSET_ALPHABET_SIZE,
-					    log2_num_offset_states));
+	if (new_offset_table) {
+		d->log2_num_offset_states = REPEAT_LOG2_NUM_STATES;
+		SAFETY_CHECK(build_fse_decode_table(d->offset_decode_table,
+						    state_counts,
+						    MAX_OFFSET_ALPHABET_SIZE,
+						    log2_num_offset_states));
+		d->log2_num_offset_states = log2_num_offset_states;
+		state_counts += MAX_OFFSET_ALPHABET_SIZE;
+	}
 
-	if (block_type == BLOCKTYPE_ALIGNED) {
+	if (new_aligned_table) {
+		d->log2_num_aligned_states = REPEAT_LOG2_NUM_STATES;
 		SAFETY_CHECK(build_fse_decode_table(d->aligned_decode_table,
-						    d->aligned_state_counts,
+						    state_counts,
 						    ALIGNED_ALPHABET_SIZE,
 						    log2_num_aligned_states));
+		d->log2_num_aligned_states = log2_num_aligned_states;
+		state_counts += ALIGNED_ALPHABET_SIZE;
 	}
 
 	/* Decode literal runs and matches */
@@ -336,8 +505,24 @@ next_block:
 			SAFETY_CHECK(num_literals >= 0);
 
 			if (UNALIGNED_ACCESS_IS_FAST &&
-			    likely(litrunlen + WORDBYTES <= literals - out_next &&
-				   num_literals >= WORDBYTES))
+			    likely(litrunlen + 32 <= literals - out_next &&
+				   num_literals >= 32))
+			{
+				const u8 *src = literals;
+				u8 *dst = out_next;
+
+				out_next += litrunlen;
+				literals += litrunlen;
+				do {
+					COPY_32_BYTES(src, dst);
+					src += 32;
+					dst += 32;
+					litrunlen -= 32;
+				} while ((s32)litrunlen > 0);
+			} else if (UNALIGNED_ACCESS_IS_FAST &&
+				   likely(litrunlen + WORDBYTES <=
+						literals - out_next &&
+					  num_literals >= WORDBYTES))
 			{
 				const u8 *src = literals;
 				u8 *dst = out_next;
@@ -417,21 +602,20 @@ next_block:
 
 		recent_offsets[0] = offset;
 
-		SAFETY_CHECK(offset <= out_next - (u8 *)out);
-
 		/* Decode the remainder of the length and copy the match. */
 
 		length += MIN_MATCH_LEN;
 
-		if (UNALIGNED_ACCESS_IS_FAST && length <= 16 &&
-		    offset >= length && literals - out_next >= 16)
+		if (UNALIGNED_ACCESS_IS_FAST && length <= 32 &&
+		    offset >= length && literals - out_next >= 32 &&
+		    likely(offset <= out_next - out_begin))
 		{
 			/*
 			 * Fast case: short length, no overlap, and we aren't
 			 * getting too close to the literals portion of the
-			 * output buffer.
+			 * output buffer.  The match is within the output.
 			 */
-			copy_16_bytes_unaligned(out_next - offset, out_next);
+			COPY_32_BYTES(out_next - offset, out_next);
 		} else {
 			/*
 			 * "Slow case" (but still very important): long length,
@@ -454,12 +638,58 @@ next_block:
 
 			SAFETY_CHECK(length <= literals - out_next);
 
-			src = out_next - offset;
 			dst = out_next;
 			end = out_next + length;
 
-			if (UNALIGNED_ACCESS_IS_FAST &&
-			    likely(literals - end >= WORDBYTES)) {
+			if (unlikely(offset > out_next - out_begin)) {
+				/*
+				 * The match begins before the output, so it
+				 * must begin in the dictionary.  It may then
+				 * continue into the output.
+				 */
+				const size_t back = offset -
+						    (out_next - out_begin);
+
+				SAFETY_CHECK(back <= d->dict_avail);
+				src = &d->dict[d->dict_size - back];
+				if (length <= back) {
+					memcpy(dst, src, length);
+				} else {
+					memcpy(dst, src, back);
+					dst += back;
+					src = out_begin;
+					do {
+						*dst++ = *src++;
+					} while (dst < end);
+				}
+				out_next = end;
+				continue;
+			}
+
+			src = out_next - offset;
+
+			if (UNALIGNED_ACCESS_IS_FAST && offset >= 16 &&
+			    likely(literals - end >= 32)) {
+				if (offset >= 32) {
+					do {
+						COPY_32_BYTES(src, dst);
+						src += 32;
+						dst += 32;
+					} while (dst < end);
+				} else {
+					do {
+						copy_16_bytes_unaligned(src, dst);
+						src += 16;
+						dst += 16;
+					} while (dst < end);
+				}
+		#ifdef EXPAND_PATTERN
+			} else if (UNALIGNED_ACCESS_IS_FAST &&
+				   likely(literals - end >= 32)) {
+				EXPAND_PATTERN(src, dst, end, offset);
+		#endif
+			} else if (UNALIGNED_ACCESS_IS_FAST &&
+				   likely(literals - end >= WORDBYTES)) {
 				if (offset >= WORDBYTES) {
 					copy_word_unaligned(src, dst);
 					src += WORDBYTES;
@@ -498,25 +728,26 @@ next_block:
 	SAFETY_CHECK(litrunlen_state == 0 && length_state == 0 &&
 		     offset_state == 0 && aligned_state == 0);
 
+	/* The block must not have extended past the end of the input. */
+	SAFETY_CHECK(overrun_count <= (bitsleft >> 3));
+
 	ALIGN_INPUT();
 
+block_done:
 	/* Finished decompressing a block. */
-	if (!is_final_block)
+	if (d->checksum_enabled)
+		checksum = xpack_crc32c(checksum, out_block_begin,
+					out_next - out_block_begin);
+	if (!is_final_block && !single_block)
 		goto next_block;
 
-	/* That was the final block. */
-
 #ifdef ENABLE_PREPROCESSING
-	/* Postprocess the data if needed. */
-	if (preprocessed)
-		postprocess(out, out_nbytes_avail);
+	d->preprocessed |= preprocessed;
 #endif
-
-	if (actual_out_nbytes_ret) {
-		*actual_out_nbytes_ret = out_next - (u8 *)out;
-	} else {
-		if (out_next != out_end)
-			return DECOMPRESS_SHORT_OUTPUT;
-	}
+	memcpy(d->recent_offsets, recent_offsets, sizeof(recent_offsets));
+	d->checksum = checksum;
+	*in_next_p = in_next;
+	*out_next_p = out_next;
+	*is_final_ret = is_final_block;
 	return DECOMPRESS_SUCCESS;
 }
@@ -44,7 +44,18 @@
  *				Notes on usage
  *
  * The number of bytes that must be allocated for a given 'struct
- * hc_matchfinder' must be gotten by calling hc_matchfinder_size().
+ * hc_matchfinder' must be gotten by calling hc_matchfinder_size(), and then the
+ * matchfinder must be set up once with hc_matchfinder_setup().  The hash tables
+ * are sized from the maximum buffer size, and hc_matchfinder_init() uses only as
+ * much of them as the next buffer needs, so that starting a small buffer is
+ * cheap even with a matchfinder allocated for large buffers.
+ *
+ * Positions are indices into a single buffer.  Position 0 is reserved to mean
+ * "no node", so the sequence at the very beginning of the buffer can never be
+ * matched against.  For streaming, the caller can keep a sliding window in the
+ * buffer: matches are limited to those whose position is greater than the
+ * 'cutoff' passed to longest_match(), and hc_matchfinder_slide_window() moves
+ * all positions down when the caller moves the data down in the buffer.
  *
  * ----------------------------------------------------------------------------
  *
@@ -94,23 +105,53 @@
 #include "lz_hash.h"
 #include "unaligned.h"
 
-#define HC_MATCHFINDER_HASH3_ORDER	15
+/* The maximum number of bits in the hash codes for length 4+ matches.  The hash
+ * codes for length 3 matches have one bit fewer. */
 #define HC_MATCHFINDER_HASH4_ORDER	16
 
 struct hc_matchfinder {
 
+	/* The number of bits in the hash codes for each hash table.  These are
+	 * chosen for each buffer, up to 'max_hash4_order'. */
+	unsigned hash3_order;
+	unsigned hash4_order;
+	unsigned max_hash4_order;
+
 	/* The hash table for finding length 3 matches */
-	u32 hash3_tab[1UL << HC_MATCHFINDER_HASH3_ORDER];
+	u32 *hash3_tab;
 
 	/* The hash table which contains the first nodes of the linked lists for
 	 * finding length 4+ matches */
-	u32 hash4_tab[1UL << HC_MATCHFINDER_HASH4_ORDER];
+	u32 *hash4_tab;
 
 	/* The "next node" references for the linked lists.  The "next node" of
 	 * the node for the sequence with position 'pos' is 'next_tab[pos]'. */
-	u32 next_tab[];
+	u32 *next_tab;
+
+	/* The storage for the tables above, unless other storage was given to
+	 * hc_matchfinder_setup() */
+	u32 tabs[];
 };
 
+static forceinline unsigned
+hc_matchfinder_hash4_order(size_t max_bufsize)
+{
+	return lz_hash_order(max_bufsize, HC_MATCHFINDER_HASH4_ORDER);
+}
+
+/*
+ * Return the number of bytes needed for the tables of a matchfinder that can
+ * work with buffers up to the specified size.
+ */
+static forceinline size_t
+hc_matchfinder_tabs_size(size_t max_bufsize)
+{
+	const unsigned hash4_order = hc_matchfinder_hash4_order(max_bufsize);
+
+	return (((size_t)1 << (hash4_order - 1)) + ((size_t)1 << hash4_order) +
+		max_bufsize) * sizeof(u32);
+}
+
 /*
  * Return the number of bytes that must be allocated for a 'hc_matchfinder' that
  * can work with buffers up to the specified size.
@@ -118,14 +159,135 @@ struct hc_matchfinder {
 static forceinline size_t
 hc_matchfinder_size(size_t max_bufsize)
 {
-	return sizeof(struct hc_matchfinder) + (max_bufsize * sizeof(u32));
+	return sizeof(struct hc_matchfinder) +
+	       hc_matchfinder_tabs_size(max_bufsize);
+}
+
+/*
+ * Set up a newly allocated matchfinder for buffers up to the specified size.
+ * This must be done before anything else.  @tabs is the storage for the tables:
+ * normally 'mf->tabs', but it may instead be a separate allocation of
+ * hc_matchfinder_tabs_size(@max_bufsize) bytes, which lets a matchfinder be
+ * set up again for larger buffers than it was allocated for.
+ */
+static forceinline void
+hc_matchfinder_setup(struct hc_matchfinder *mf, size_t max_bufsize, u32 *tabs)
+{
+	mf->max_hash4_order = hc_matchfinder_hash4_order(max_bufsize);
+	mf->hash3_tab = tabs;
+	mf->next_tab = tabs + (1UL << (mf->max_hash4_order - 1)) +
+		      (1UL << mf->max_hash4_order);
+}
+
+/*
+ * Prepare the matchfinder for a new input buffer of @bufsize bytes.  Smaller
+ * buffers get smaller hash tables, so that only the part of the tables which
+ * will actually be used has to be cleared.
+ */
+static forceinline void
+hc_matchfinder_init(struct hc_matchfinder *mf, size_t bufsize)
+{
+	mf->hash4_order = lz_hash_order_for_buffer(bufsize,
+						   mf->max_hash4_order);
+	mf->hash3_order = mf->hash4_order - 1;
+	mf->hash4_tab = mf->hash3_tab + (1UL << mf->hash3_order);
+
+	memset(mf->hash3_tab, 0,
+	       ((1UL << mf->hash3_order) + (1UL << mf->hash4_order)) *
+	       sizeof(u32));
 }
 
-/* Prepare the matchfinder for a new input buffer. */
+/*
+ * Copy the state of @src, which has seen only the positions below
+ * @num_positions, into @dst.  Both must have been set up for the same maximum
+ * buffer size.  Like hc_matchfinder_init(), this prepares @dst for a new
+ * buffer, but one which starts with the data that @src has seen, such as a
+ * preset dictionary.
+ */
 static forceinline void
-hc_matchfinder_init(struct hc_matchfinder *mf)
+hc_matchfinder_copy(struct hc_matchfinder *dst,
+		   const struct hc_matchfinder *src, size_t num_positions)
 {
-	memset(mf, 0, sizeof(*mf));
+	dst->hash3_order = src->hash3_order;
+	dst->hash4_order = src->hash4_order;
+	dst->hash4_tab = dst->hash3_tab + (1UL << dst->hash3_order);
+
+	memcpy(dst->hash3_tab, src->hash3_tab,
+	       ((1UL << src->hash3_order) + (1UL << src->hash4_order)) *
+	       sizeof(u32));
+	memcpy(dst->next_tab, src->next_tab, num_positions * sizeof(u32));
+}
+
+/*
+ * Undo the insertion of the sequences at positions @start_pos through @end_pos
+ * - 1 of @in_begin into @dst, which was copied from @src by
+ * hc_matchfinder_copy() with @num_positions <= @start_pos.  This restores the
+ * hash buckets which those sequences may have changed; their "next node"
+ * references don't need to be undone, as a position is always given a new one
+ * when it is inserted again.  The data at those positions must not have changed
+ * since they were inserted.  For a short buffer, this is much cheaper than
+ * copying all of @src again.
+ */
+static forceinline void
+hc_matchfinder_restore(struct hc_matchfinder *dst,
+		       const struct hc_matchfinder *src,
+		       const u8 *in_begin, size_t start_pos, size_t end_pos)
+{
+	size_t pos;
+
+	/* A sequence is only inserted if at least 5 bytes are available. */
+	for (pos = start_pos; pos + 4 < end_pos; pos++) {
+		u32 seq4 = load_u32_unaligned(&in_begin[pos]);
+		u32 hash3 = lz_hash(loaded_u32_to_u24(seq4), dst->hash3_order);
+		u32 hash4 = lz_hash(seq4, dst->hash4_order);
+
+		dst->hash3_tab[hash3] = src->hash3_tab[hash3];
+		dst->hash4_tab[hash4] = src->hash4_tab[hash4];
+	}
+}
+
+/*
+ * Compute the hash codes for the sequence beginning at @in_next, in the form
+ * needed for the @next_hashes parameter of longest_match() and
+ * skip_positions().  At least 4 bytes must be available at @in_next.
+ */
+static forceinline void
+hc_matchfinder_init_hashes(const struct hc_matchfinder *mf, const u8 *in_next,
+			   u32 next_hashes[2])
+{
+	u32 seq4 = load_u32_unaligned(in_next);
+
+	next_hashes[0] = lz_hash(loaded_u32_to_u24(seq4), mf->hash3_order);
+	next_hashes[1] = lz_hash(seq4, mf->hash4_order);
+}
+
+static forceinline u32
+hc_matchfinder_slide_pos(u32 pos, u32 slide)
+{
+	return (pos > slide) ? pos - slide : 0;
+}
+
+/*
+ * Slide the window: position 'slide + n' becomes position 'n', and all
+ * positions <= @slide are forgotten.  @end_pos is the number of positions that
+ * are currently in use.  The caller must move the buffer contents the same way.
+ */
+static void
+hc_matchfinder_slide_window(struct hc_matchfinder *mf, u32 slide, u32 end_pos)
+{
+	u32 i;
+
+	for (i = 0; i < (1UL << mf->hash3_order); i++)
+		mf->hash3_tab[i] = hc_matchfinder_slide_pos(mf->hash3_tab[i],
+							    slide);
+
+	for (i = 0; i < (1UL << mf->hash4_order); i++)
+		mf->hash4_tab[i] = hc_matchfinder_slide_pos(mf->hash4_tab[i],
+							    slide);
+
+	for (i = slide; i < end_pos; i++)
+		mf->next_tab[i - slide] =
+			hc_matchfinder_slide_pos(mf->next_tab[i], slide);
 }
 
 /*
@@ -147,6 +309,10 @@ hc_matchfinder_init(struct hc_matchfinder *mf)
  *	Must be <= @max_len.
  * @max_search_depth
  *	Limit on the number of potential matches to consider.  Must be >= 1.
+ * @cutoff
+ *	Only consider matches at positions greater than this.  This is 0 when
+ *	the whole buffer may be referenced, or 'cur_pos - window_size' when the
+ *	match offset must be less than 'window_size'.
  * @next_hashes
  *	The precomputed hash codes for the sequence beginning at @in_next.
  *	These will be used and then updated with the precomputed hashcodes for
@@ -165,6 +331,7 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 			     const u32 max_len,
 			     const u32 nice_len,
 			     const u32 max_search_depth,
+			     const u32 cutoff,
 			     u32 next_hashes[restrict 2],
 			     u32 * const restrict offset_ret)
 {
@@ -201,8 +368,8 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 	/* Compute the next hash codes */
 	next_seq4 = load_u32_unaligned(in_next + 1);
 	next_seq3 = loaded_u32_to_u24(next_seq4);
-	next_hashes[0] = lz_hash(next_seq3, HC_MATCHFINDER_HASH3_ORDER);
-	next_hashes[1] = lz_hash(next_seq4, HC_MATCHFINDER_HASH4_ORDER);
+	next_hashes[0] = lz_hash(next_seq3, mf->hash3_order);
+	next_hashes[1] = lz_hash(next_seq4, mf->hash4_order);
 	prefetchw(&mf->hash3_tab[next_hashes[0]]);
 	prefetchw(&mf->hash4_tab[next_hashes[1]]);
 
@@ -210,7 +377,7 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 
 		/* Check for a length 3 match if needed */
 
-		if (!cur_node3)
+		if (cur_node3 <= cutoff)
 			goto out;
 
 		seq4 = load_u32_unaligned(in_next);
@@ -225,7 +392,7 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 
 		/* Check for a length 4 match */
 
-		if (!cur_node4)
+		if (cur_node4 <= cutoff)
 			goto out;
 
 		for (;;) {
@@ -237,7 +404,7 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 
 			/* The first 4 bytes did not match.  Keep trying. */
 			cur_node4 = mf->next_tab[cur_node4];
-			if (!cur_node4 || !--depth_remaining)
+			if (cur_node4 <= cutoff || !--depth_remaining)
 				goto out;
 		}
 
@@ -247,10 +414,10 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 		if (best_len >= nice_len)
 			goto out;
 		cur_node4 = mf->next_tab[cur_node4];
-		if (!cur_node4 || !--depth_remaining)
+		if (cur_node4 <= cutoff || !--depth_remaining)
 			goto out;
 	} else {
-		if (!cur_node4 || best_len >= nice_len)
+		if (cur_node4 <= cutoff || best_len >= nice_len)
 			goto out;
 	}
 
@@ -277,7 +444,7 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 
 			/* Continue to the next node in the list */
 			cur_node4 = mf->next_tab[cur_node4];
-			if (!cur_node4 || !--depth_remaining)
+			if (cur_node4 <= cutoff || !--depth_remaining)
 				goto out;
 		}
 
@@ -297,7 +464,7 @@ hc_matchfinder_longest_match(struct hc_matchfinder * const restrict mf,
 
 		/* Continue to the next node in the list */
 		cur_node4 = mf->next_tab[cur_node4];
-		if (!cur_node4 || !--depth_remaining)
+		if (cur_node4 <= cutoff || !--depth_remaining)
 			goto out;
 	}
 out:
@@ -350,8 +517,8 @@ hc_matchfinder_skip_positions(struct hc_matchfinder * const restrict mf,
 
 			next_seq4 = load_u32_unaligned(++in_next);
 			next_seq3 = loaded_u32_to_u24(next_seq4);
-			hash3 = lz_hash(next_seq3, HC_MATCHFINDER_HASH3_ORDER);
-			hash4 = lz_hash(next_seq4, HC_MATCHFINDER_HASH4_ORDER);
+			hash3 = lz_hash(next_seq3, mf->hash3_order);
+			hash4 = lz_hash(next_seq4, mf->hash4_order);
 
 		} while (in_next != stop_ptr);
 
@@ -0,0 +1,280 @@
+/*
+ * ht_matchfinder.h - Lempel-Ziv matchfinding with a hash table
+ *
+ * ---------------------------------------------------------------------------
+ *
+ *				   Algorithm
+ *
+ * This is a Hash Table (ht) based matchfinder, for the fastest compression
+ * level.
+ *
+ * The only data structure is a hash table where each hash bucket holds the
+ * position of the most recent sequence whose first 4 bytes have that hash code.
+ * At each position, the one sequence in the bucket is checked for a match, and
+ * then it is replaced by the current sequence.  There are no chains, so finding
+ * a match takes constant time, and the memory usage is small no matter how
+ * large the buffer is.  However, only one candidate is ever checked, so the
+ * matches are often not the longest ones available.
+ *
+ * ---------------------------------------------------------------------------
+ *
+ *				Notes on usage
+ *
+ * The number of bytes that must be allocated for a 'struct ht_matchfinder' is
+ * given by ht_matchfinder_size(), and then the matchfinder must be set up once
+ * with ht_matchfinder_setup().  As in hc_matchfinder.h, the hash table is sized
+ * from the maximum buffer size, and only the part needed for the next buffer is
+ * used and cleared.
+ *
+ * Positions are handled the same way as in hc_matchfinder.h: position 0 means
+ * "no sequence", matches are limited to positions greater than the 'cutoff',
+ * and ht_matchfinder_slide_window() supports a sliding window.
+ *
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef LIB_HT_MATCHFINDER_H
+#define LIB_HT_MATCHFINDER_H
+
+#include <string.h>
+
+#include "lz_extend.h"
+#include "lz_hash.h"
+#include "unaligned.h"
+
+/* The maximum number of bits in the hash codes */
+#define HT_MATCHFINDER_HASH_ORDER	15
+
+/* The minimum length of the matches that are found */
+#define HT_MATCHFINDER_MIN_MATCH_LEN	4
+
+struct ht_matchfinder {
+
+	/* The number of bits in the hash codes.  This is chosen for each
+	 * buffer, up to 'max_hash_order'. */
+	unsigned hash_order;
+	unsigned max_hash_order;
+
+	/* The hash table, which contains the position of the most recent
+	 * sequence for each hash code */
+	u32 *hash_tab;
+
+	/* The storage for the hash table, unless other storage was given to
+	 * ht_matchfinder_setup() */
+	u32 tabs[];
+};
+
+/*
+ * Return the number of bytes needed for the hash table of a matchfinder that can
+ * work with buffers up to the specified size.  Unlike with the other
+ * matchfinders, this is bounded no matter how large the buffers are.
+ */
+static forceinline size_t
+ht_matchfinder_tabs_size(size_t max_bufsize)
+{
+	return ((size_t)1 << lz_hash_order(max_bufsize,
+					   HT_MATCHFINDER_HASH_ORDER)) *
+	       sizeof(u32);
+}
+
+/*
+ * Return the number of bytes that must be allocated for a 'ht_matchfinder' that
+ * can work with buffers up to the specified size.
+ */
+static forceinline size_t
+ht_matchfinder_size(size_t max_bufsize)
+{
+	return sizeof(struct ht_matchfinder) +
+	       ht_matchfinder_tabs_size(max_bufsize);
+}
+
+/*
+ * Set up a newly allocated matchfinder for buffers up to the specified size.
+ * This must be done before anything else.  @tabs is the storage for the hash
+ * table, as described for hc_matchfinder_setup().
+ */
+static forceinline void
+ht_matchfinder_setup(struct ht_matchfinder *mf, size_t max_bufsize, u32 *tabs)
+{
+	mf->max_hash_order = lz_hash_order(max_bufsize,
+					   HT_MATCHFINDER_HASH_ORDER);
+	mf->hash_tab = tabs;
+}
+
+/*
+ * Prepare the matchfinder for a new input buffer of @bufsize bytes.  As in
+ * hc_matchfinder.h, only the part of the hash table needed for a buffer of that
+ * size is used and cleared.
+ */
+static forceinline void
+ht_matchfinder_init(struct ht_matchfinder *mf, size_t bufsize)
+{
+	mf->hash_order = lz_hash_order_for_buffer(bufsize, mf->max_hash_order);
+	memset(mf->hash_tab, 0, (1UL << mf->hash_order) * sizeof(u32));
+}
+
+/*
+ * Copy the state of @src into @dst, as for hc_matchfinder_copy().  There is no
+ * per-position state, so the number of positions @src has seen doesn't matter.
+ */
+static forceinline void
+ht_matchfinder_copy(struct ht_matchfinder *dst,
+		    const struct ht_matchfinder *src)
+{
+	dst->hash_order = src->hash_order;
+	memcpy(dst->hash_tab, src->hash_tab,
+	       (1UL << src->hash_order) * sizeof(u32));
+}
+
+/*
+ * Undo the insertion of the sequences at positions @start_pos through @end_pos
+ * - 1 of @in_begin into @dst, which was copied from @src, as for
+ * hc_matchfinder_restore().
+ */
+static forceinline void
+ht_matchfinder_restore(struct ht_matchfinder *dst,
+		       const struct ht_matchfinder *src,
+		       const u8 *in_begin, size_t start_pos, size_t end_pos)
+{
+	size_t pos;
+
+	for (pos = start_pos; pos + 4 < end_pos; pos++) {
+		u32 hash = lz_hash(load_u32_unaligned(&in_begin[pos]),
+				   dst->hash_order);
+
+		dst->hash_tab[hash] = src->hash_tab[hash];
+	}
+}
+
+/*
+ * Compute the hash code for the sequence beginning at @in_next, in the form
+ * needed for the @next_hash parameter of longest_match() and skip_positions().
+ * At least 4 bytes must be available at @in_next.
+ */
+static forceinline u32
+ht_matchfinder_hash(const struct ht_matchfinder *mf, const u8 *in_next)
+{
+	return lz_hash(load_u32_unaligned(in_next), mf->hash_order);
+}
+
+/*
+ * Slide the window: position 'slide + n' becomes position 'n', and all
+ * positions <= @slide are forgotten.  The caller must move the buffer contents
+ * the same way.
+ */
+static void
+ht_matchfinder_slide_window(struct ht_matchfinder *mf, u32 slide)
+{
+	u32 i;
+
+	for (i = 0; i < (1UL << mf->hash_order); i++)
+		mf->hash_tab[i] = (mf->hash_tab[i] > slide) ?
+				  mf->hash_tab[i] - slide : 0;
+}
+
+/*
+ * Find a match at the current position, if there is one.
+ *
+ * @mf
+ *	The matchfinder structure.
+ * @in_begin
+ *	Pointer to the beginning of the input buffer.
+ * @cur_pos
+ *	The current position in the input buffer (the position of the sequence
+ *	being matched against).
+ * @max_len
+ *	The maximum permissible match length at this position.
+ * @cutoff
+ *	Only consider matches at positions greater than this.  This is 0 when
+ *	the whole buffer may be referenced, or 'cur_pos - window_size' when the
+ *	match offset must be less than 'window_size'.
+ * @next_hash
+ *	The precomputed hash code for the sequence beginning at @in_next.  This
+ *	will be used and then updated with the precomputed hash code for the
+ *	sequence beginning at @in_next + 1.
+ * @offset_ret
+ *	If a match is found, its offset is returned in this location.
+ *
+ * Return the length of the match found, or 0 if no match of at least
+ * HT_MATCHFINDER_MIN_MATCH_LEN bytes was found.
+ */
+static forceinline u32
+ht_matchfinder_longest_match(struct ht_matchfinder * const restrict mf,
+			     const u8 * const restrict in_begin,
+			     const ptrdiff_t cur_pos,
+			     const u32 max_len,
+			     const u32 cutoff,
+			     u32 * const restrict next_hash,
+			     u32 * const restrict offset_ret)
+{
+	const u8 *in_next = in_begin + cur_pos;
+	const u32 hash = *next_hash;
+	const u32 cur_node = mf->hash_tab[hash];
+	const u8 *matchptr;
+
+	if (unlikely(max_len < 5)) /* can we read 4 bytes from 'in_next + 1'? */
+		return 0;
+
+	mf->hash_tab[hash] = cur_pos;
+	*next_hash = ht_matchfinder_hash(mf, in_next + 1);
+	prefetchw(&mf->hash_tab[*next_hash]);
+
+	if (cur_node <= cutoff)
+		return 0;
+
+	matchptr = &in_begin[cur_node];
+	if (load_u32_unaligned(matchptr) != load_u32_unaligned(in_next))
+		return 0;
+
+	*offset_ret = in_next - matchptr;
+	return lz_extend(in_next, matchptr, 4, max_len);
+}
+
+/*
+ * Advance the matchfinder, but don't search for matches.
+ *
+ * @mf
+ *	The matchfinder structure.
+ * @in_begin
+ *	Pointer to the beginning of the input buffer.
+ * @cur_pos
+ *	The current position in the input buffer (the position of the sequence
+ *	being matched against).
+ * @end_pos
+ *	The length of the input buffer.
+ * @count
+ *	The number of bytes to advance.  Must be > 0.
+ * @next_hash
+ *	The precomputed hash code for the sequence beginning at @in_next.  This
+ *	will be used and then updated with the precomputed hash code for the
+ *	sequence beginning at @in_next + @count.
+ *
+ * Returns @in_next + @count.
+ */
+static forceinline const u8 *
+ht_matchfinder_skip_positions(struct ht_matchfinder * const restrict mf,
+			      const u8 * const restrict in_begin,
+			      const ptrdiff_t cur_pos,
+			      const ptrdiff_t end_pos,
+			      const u32 count,
+			      u32 * const restrict next_hash)
+{
+	const u8 *in_next = in_begin + cur_pos;
+	const u8 * const stop_ptr = in_next + count;
+
+	if (likely(count + 5 <= end_pos - cur_pos)) {
+		u32 hash = *next_hash;
+
+		do {
+			mf->hash_tab[hash] = in_next - in_begin;
+			hash = ht_matchfinder_hash(mf, ++in_next);
+		} while (in_next != stop_ptr);
+
+		prefetchw(&mf->hash_tab[hash]);
+		*next_hash = hash;
+	}
+
+	return stop_ptr;
+}
+
+#endif /* LIB_HT_MATCHFINDER_H */
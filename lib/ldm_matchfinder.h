@@ -0,0 +1,289 @@
+/*
+ * ldm_matchfinder.h - long distance matchfinding with a sparse hash table
+ *
+ * ---------------------------------------------------------------------------
+ *
+ *				   Algorithm
+ *
+ * This is a Long Distance Matching (ldm) matchfinder, which finds long matches
+ * at distances far beyond what the other matchfinders can afford to cover.
+ * The other matchfinders keep at least 4 bytes of state per position of the
+ * window, which is too much for windows of hundreds of megabytes.
+ *
+ * Instead, a rolling hash of the last 64 bytes is updated at every position,
+ * and only the positions where the hash has its top LDM_SAMPLE_LOG bits clear
+ * are remembered, which is about one position out of every 2^LDM_SAMPLE_LOG.
+ * These "split points" depend only on the nearby data, so data which repeats
+ * has its split points in the same places each time.  At each split point, the
+ * remembered split points with the same hash are checked for a match, which is
+ * extended forwards and backwards from there.  A match found this way is at
+ * least LDM_MIN_MATCH_LEN bytes long and can have any offset up to the window
+ * size.
+ *
+ * The hash table is divided into buckets of 2^LDM_BUCKET_LOG entries, each of
+ * which holds a position and some more bits of its hash, so that positions
+ * whose hash only collides in the bucket index are rejected without touching
+ * the data.  Each bucket is overwritten in round-robin order.  The table has
+ * about one entry for each split point in the window, so it takes about
+ * window_size / 16 bytes.
+ *
+ * ---------------------------------------------------------------------------
+ *
+ *				Notes on usage
+ *
+ * The number of bytes that must be allocated for a 'struct ldm_matchfinder' is
+ * given by ldm_matchfinder_size(), and then the matchfinder must be set up once
+ * with ldm_matchfinder_setup() and reset with ldm_matchfinder_init() for each
+ * stream.  Unlike the other matchfinders, ldm_matchfinder_find_matches()
+ * processes a whole range of the buffer at a time and returns the matches it
+ * found, which the parser then considers alongside its own.
+ *
+ * Positions are handled as in hc_matchfinder.h: position 0 means "no
+ * sequence", and ldm_matchfinder_slide_window() supports a sliding window.
+ *
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef LIB_LDM_MATCHFINDER_H
+#define LIB_LDM_MATCHFINDER_H
+
+#include <string.h>
+
+#include "lz_extend.h"
+
+/* The minimum length of the matches that are found */
+#define LDM_MIN_MATCH_LEN	64
+
+/* log2 of the average distance between split points */
+#define LDM_SAMPLE_LOG		7
+
+/* log2 of the number of entries in each hash bucket */
+#define LDM_BUCKET_LOG		3
+
+struct ldm_entry {
+	u32 pos;
+	u32 check;
+};
+
+/* A match found by the long distance matchfinder */
+struct ldm_match {
+	u32 pos;
+	u32 length;
+	u32 offset;
+};
+
+struct ldm_matchfinder {
+
+	/* The random values which the rolling hash adds for each byte */
+	u64 gear[256];
+
+	/* The rolling hash of the bytes before 'next_pos' */
+	u64 hash;
+
+	/* The next position to be hashed */
+	u32 next_pos;
+
+	/* The number of bits in the bucket indices */
+	unsigned bucket_order;
+
+	/* The hash table, with 2^LDM_BUCKET_LOG entries per bucket */
+	struct ldm_entry *entries;
+
+	/* The next entry of each bucket to be overwritten */
+	u8 *next_slot;
+
+	/* The storage for the hash table and 'next_slot' */
+	struct ldm_entry tabs[];
+};
+
+/* Return the number of bits in the bucket indices for a window size */
+static forceinline unsigned
+ldm_matchfinder_bucket_order(size_t window_size)
+{
+	unsigned order = 1;
+
+	while (((size_t)1 << (order + LDM_BUCKET_LOG + LDM_SAMPLE_LOG)) <
+	       window_size)
+		order++;
+	return order;
+}
+
+/*
+ * Return the number of bytes that must be allocated for a 'ldm_matchfinder'
+ * that can find matches up to @window_size bytes away.
+ */
+static forceinline size_t
+ldm_matchfinder_size(size_t window_size)
+{
+	const size_t num_buckets =
+		(size_t)1 << ldm_matchfinder_bucket_order(window_size);
+
+	return sizeof(struct ldm_matchfinder) +
+	       (num_buckets << LDM_BUCKET_LOG) * sizeof(struct ldm_entry) +
+	       num_buckets;
+}
+
+/*
+ * Set up a newly allocated matchfinder for the specified window size.  This
+ * must be done before anything else.  The values of the rolling hash come from
+ * a fixed generator (splitmix64), so the output doesn't vary between runs.
+ */
+static forceinline void
+ldm_matchfinder_setup(struct ldm_matchfinder *mf, size_t window_size)
+{
+	u64 state = 0;
+	unsigned i;
+
+	for (i = 0; i < 256; i++) {
+		u64 v;
+
+		state += 0x9E3779B97F4A7C15;
+		v = state;
+		v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9;
+		v = (v ^ (v >> 27)) * 0x94D049BB133111EB;
+		mf->gear[i] = v ^ (v >> 31);
+	}
+	mf->bucket_order = ldm_matchfinder_bucket_order(window_size);
+	mf->entries = mf->tabs;
+	mf->next_slot = (u8 *)&mf->tabs[(size_t)1 << (mf->bucket_order +
+						      LDM_BUCKET_LOG)];
+}
+
+/* Prepare the matchfinder for a new stream. */
+static forceinline void
+ldm_matchfinder_init(struct ldm_matchfinder *mf)
+{
+	const size_t num_buckets = (size_t)1 << mf->bucket_order;
+
+	mf->hash = 0;
+	mf->next_pos = 0;
+	memset(mf->entries, 0,
+	       (num_buckets << LDM_BUCKET_LOG) * sizeof(struct ldm_entry));
+	memset(mf->next_slot, 0, num_buckets);
+}
+
+/*
+ * Slide the window: position 'slide + n' becomes position 'n', and all
+ * positions <= @slide are forgotten.  The caller must move the buffer contents
+ * the same way.
+ */
+static void
+ldm_matchfinder_slide_window(struct ldm_matchfinder *mf, u32 slide)
+{
+	const size_t num_entries = (size_t)1 << (mf->bucket_order +
+						 LDM_BUCKET_LOG);
+	size_t i;
+
+	for (i = 0; i < num_entries; i++) {
+		u32 pos = mf->entries[i].pos;
+
+		mf->entries[i].pos = (pos > slide) ? pos - slide : 0;
+	}
+	mf->next_pos -= slide;
+}
+
+/*
+ * Hash the data at positions 'mf->next_pos' through @end_pos - 1 of @in_begin,
+ * remember its split points, and return the matches found at them.
+ *
+ * @mf
+ *	The matchfinder structure.
+ * @in_begin
+ *	Pointer to the beginning of the input buffer.
+ * @start_pos
+ *	Matches don't extend backwards before this position.  Usually this is
+ *	'mf->next_pos', i.e. the data is hashed as it is compressed.
+ * @end_pos
+ *	The end of the data to hash.  Matches don't extend forwards beyond it.
+ * @window_size
+ *	The maximum offset of the matches.  The data that far back must still
+ *	be in the buffer.
+ * @matches
+ *	The array to receive the matches, in increasing order of position and
+ *	not overlapping.  It must have room for '(@end_pos - @start_pos) /
+ *	LDM_MIN_MATCH_LEN + 1' matches.
+ *
+ * Return the number of matches found.
+ */
+static size_t
+ldm_matchfinder_find_matches(struct ldm_matchfinder * const restrict mf,
+			     const u8 * const restrict in_begin,
+			     const u32 start_pos, const u32 end_pos,
+			     const u32 window_size,
+			     struct ldm_match * const restrict matches)
+{
+	const u64 * const gear = mf->gear;
+	const unsigned bucket_shift = 64 - mf->bucket_order;
+	u64 hash = mf->hash;
+	u32 anchor = start_pos;	/* the end of the last match found */
+	u32 pos;
+	size_t num_matches = 0;
+
+	for (pos = mf->next_pos; pos < end_pos; pos++) {
+		const u32 split = pos + 1;
+		u64 mixed;
+		u32 check;
+		struct ldm_entry *bucket;
+		u8 *slot;
+		u32 best_len = LDM_MIN_MATCH_LEN - 1;
+		u32 best_back = 0;
+		u32 best_offset = 0;
+		unsigned i;
+
+		hash = (hash << 1) + gear[in_begin[pos]];
+		if (likely(hash >> (64 - LDM_SAMPLE_LOG)))
+			continue;
+		/* The hash doesn't cover 64 bytes yet. */
+		if (split < 64)
+			continue;
+
+		mixed = hash * 0x9E3779B97F4A7C15;
+		check = (u32)mixed;
+		bucket = &mf->entries[(size_t)(mixed >> bucket_shift) <<
+				      LDM_BUCKET_LOG];
+		slot = &mf->next_slot[mixed >> bucket_shift];
+
+		/* Only look for a match if the last one has ended. */
+		for (i = 0; split >= anchor && i < (1 << LDM_BUCKET_LOG); i++) {
+			const u32 cand = bucket[i].pos;
+			u32 fwd, back, max_back, len;
+
+			if (bucket[i].check != check || cand == 0 ||
+			    split - cand > window_size)
+				continue;
+
+			fwd = lz_extend(&in_begin[split], &in_begin[cand], 0,
+					end_pos - split);
+			max_back = MIN(split - anchor, cand);
+			back = 0;
+			while (back < max_back &&
+			       in_begin[split - back - 1] ==
+			       in_begin[cand - back - 1])
+				back++;
+			len = fwd + back;
+			if (len > best_len) {
+				best_len = len;
+				best_back = back;
+				best_offset = split - cand;
+			}
+		}
+
+		if (best_offset != 0) {
+			matches[num_matches].pos = split - best_back;
+			matches[num_matches].length = best_len;
+			matches[num_matches].offset = best_offset;
+			num_matches++;
+			anchor = split - best_back + best_len;
+		}
+
+		bucket[*slot].pos = split;
+		bucket[*slot].check = check;
+		*slot = (*slot + 1) & ((1 << LDM_BUCKET_LOG) - 1);
+	}
+
+	mf->hash = hash;
+	mf->next_pos = end_pos;
+	return num_matches;
+}
+
+#endif /* LIB_LDM_MATCHFINDER_H */
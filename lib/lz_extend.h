@@ -5,6 +5,14 @@
 #ifndef LIB_LZ_EXTEND_H
 #define LIB_LZ_EXTEND_H
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#  include <arm_neon.h>
+#  define LZ_EXTEND_NEON 1
+#endif
+
 #include "unaligned.h"
 
 /*
@@ -36,6 +44,42 @@ lz_extend(const u8 * const strptr, const u8 * const matchptr,
 		#undef COMPARE_WORD_STEP
 		}
 
+		/*
+		 * Long matches: compare 16-byte vectors, 32 bytes per iteration
+		 * with SSE2, then find the first mismatching byte from the
+		 * bitmask of the byte compare results.
+		 */
+	#ifdef __SSE2__
+		while (len + 32 <= max_len) {
+			const __m128i eq0 = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)&matchptr[len]),
+				_mm_loadu_si128((const __m128i *)&strptr[len]));
+			const __m128i eq1 = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)&matchptr[len + 16]),
+				_mm_loadu_si128((const __m128i *)&strptr[len + 16]));
+			u32 diff = (u32)_mm_movemask_epi8(_mm_and_si128(eq0, eq1)) ^ 0xFFFF;
+
+			if (diff != 0) {
+				diff = ((u32)_mm_movemask_epi8(eq0) |
+					((u32)_mm_movemask_epi8(eq1) << 16)) ^ 0xFFFFFFFF;
+				return len + bsf32(diff);
+			}
+			len += 32;
+		}
+	#elif defined(LZ_EXTEND_NEON)
+		while (len + 16 <= max_len) {
+			/* Narrow each byte compare result to 4 bits of a u64. */
+			const uint8x16_t eq = vceqq_u8(vld1q_u8(&matchptr[len]),
+						       vld1q_u8(&strptr[len]));
+			const u64 diff = ~vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+			if (diff != 0)
+				return len + (bsf64(diff) >> 2);
+			len += 16;
+		}
+	#endif
+
 		while (len + WORDBYTES <= max_len) {
 			v_word = load_word_unaligned(&matchptr[len]) ^
 				 load_word_unaligned(&strptr[len]);
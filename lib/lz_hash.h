@@ -20,4 +20,33 @@ lz_hash(u32 seq, unsigned num_bits)
 	return (u32)(seq * 0x1E35A7BD) >> (32 - num_bits);
 }
 
+/*
+ * Return the number of bits to use for the hash codes of a matchfinder's hash
+ * table, given the maximum buffer size and the maximum number of bits.  There
+ * is little use for more hash buckets than there are positions in the buffer,
+ * so small buffers get small hash tables.
+ */
+static forceinline unsigned
+lz_hash_order(size_t max_bufsize, unsigned max_order)
+{
+	unsigned order = 8;
+
+	while (order < max_order && ((size_t)1 << order) < max_bufsize)
+		order++;
+	return order;
+}
+
+/*
+ * Return the number of bits to use for the hash codes while matchfinding in one
+ * buffer of @bufsize bytes, with tables allocated for @max_order bits.  Fewer
+ * buckets mean less memory to clear for each buffer, but a table just as large
+ * as the buffer has enough collisions to cost a little compression ratio, so
+ * this allows about 4 buckets per position instead.
+ */
+static forceinline unsigned
+lz_hash_order_for_buffer(size_t bufsize, unsigned max_order)
+{
+	return MIN(lz_hash_order(bufsize, max_order) + 2, max_order);
+}
+
 #endif /* LIB_LZ_HASH_H */
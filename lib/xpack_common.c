@@ -25,6 +25,88 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include "xpack_common.h"
+
+/*
+ * The predefined state counts.  These approximate the statistics of inputs of a
+ * few kilobytes, for which sending state counts would be relatively expensive.
+ * Every symbol is given at least one state, so that any block can use them.
+ */
+
+const u16 predefined_litrunlen_state_counts[LITRUNLEN_ALPHABET_SIZE] = {
+	50, 22, 11, 8, 7, 7, 6, 4, 2, 1, 1, 1, 1, 1, 1, 5,
+};
+
+const u16 predefined_length_state_counts[LENGTH_ALPHABET_SIZE] = {
+	1, 73, 96, 53, 32, 26, 22, 15, 14, 17, 17, 12, 8, 8, 9, 8,
+	7, 3, 6, 4, 2, 4, 6, 4, 4, 3, 3, 7, 3, 3, 2, 3,
+	2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 4,
+};
+
+const u16 predefined_offset_state_counts[MAX_OFFSET_ALPHABET_SIZE] = {
+	23, 10, 3, 1, 1, 1, 5, 14, 23, 41, 36, 32, 29, 16, 4, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+static void *
+default_alloc_func(size_t size, void *private_data)
+{
+	return malloc(size);
+}
+
+static void
+default_free_func(void *ptr, void *private_data)
+{
+	free(ptr);
+}
+
+void
+xpack_mem_init(struct xpack_mem *mem, const struct xpack_allocator *allocator,
+	       void *arena, size_t arena_size)
+{
+	if (allocator) {
+		mem->allocator = *allocator;
+	} else {
+		mem->allocator.alloc_func = default_alloc_func;
+		mem->allocator.free_func = default_free_func;
+		mem->allocator.private_data = NULL;
+	}
+	mem->arena_start = arena;
+	mem->arena_next = arena;
+	mem->arena_end = arena;
+	if (arena) {
+		mem->arena_end += arena_size;
+		mem->arena_next += -(uintptr_t)arena & (ARENA_ALIGNMENT - 1);
+		if (mem->arena_next > mem->arena_end)
+			mem->arena_next = mem->arena_end;
+	}
+}
+
+void *
+xpack_mem_alloc(struct xpack_mem *mem, size_t size)
+{
+	const size_t avail = mem->arena_end - mem->arena_next;
+
+	if (size <= avail) {
+		void *p = mem->arena_next;
+
+		mem->arena_next += MIN(ARENA_SIZE(size), avail);
+		return p;
+	}
+	return (*mem->allocator.alloc_func)(size, mem->allocator.private_data);
+}
+
+void
+xpack_mem_free(struct xpack_mem *mem, void *ptr)
+{
+	if (!ptr)
+		return;
+	if ((u8 *)ptr >= mem->arena_start && (u8 *)ptr < mem->arena_end)
+		return;
+	(*mem->allocator.free_func)(ptr, mem->allocator.private_data);
+}
+
 #ifdef ENABLE_PREPROCESSING
 
 #include <string.h>
@@ -37,7 +119,6 @@
 #  include <immintrin.h>
 #endif
 
-#include "xpack_common.h"
 #include "unaligned.h"
 
 static void
@@ -79,164 +160,147 @@ undo_translate_target(void *target, s32 input_pos)
 	}
 }
 
-static void
-e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
+/*
+ * Run the E8 filter over the positions [pos, end) of 'data', and return the
+ * position from which to continue.  That's normally 'end', but it's past 'end'
+ * if the target of a translation at the end of the range extends past it, since
+ * the bytes of a translation target are never themselves considered for
+ * translation.  The caller must make sure that any translation target within
+ * the range is entirely available, i.e. that data[end + 3] can be accessed.
+ *
+ * The E8 bytes are found by looking at the bytes which aren't part of any
+ * translation target.  Translation never changes those bytes, so the same
+ * positions are found both before and after the translation.
+ */
+static forceinline u32
+e8_filter_range(u8 *data, u32 pos, u32 end,
+		void (*process_target)(void *, s32))
 {
-
-#if !defined(__SSE2__) && !defined(__AVX2__)
-	/*
-	 * A worthwhile optimization is to push the end-of-buffer check into the
-	 * relatively rare E8 case.  This is possible if we replace the last six
-	 * bytes of data with E8 bytes; then we are guaranteed to hit an E8 byte
-	 * before reaching end-of-buffer.  In addition, this scheme guarantees
-	 * that no translation can begin following an E8 byte in the last 10
-	 * bytes because a 4-byte offset containing E8 as its high byte is a
-	 * large negative number that is not valid for translation.  That is
-	 * exactly what we need.
-	 */
-	u8 *tail;
-	u8 saved_bytes[6];
-	u8 *p;
-
-	if (size <= 10)
-		return;
-
-	tail = &data[size - 6];
-	memcpy(saved_bytes, tail, 6);
-	memset(tail, 0xE8, 6);
-	p = data;
-	for (;;) {
-		while (*p != 0xE8)
-			p++;
-		if (p >= tail)
-			break;
-		(*process_target)(p + 1, p - data);
-		p += 5;
-	}
-	memcpy(tail, saved_bytes, 6);
-#else
+#if defined(__SSE2__) || defined(__AVX2__)
 	/* SSE2 or AVX-2 optimized version for x86_64 */
-
-	u8 *p = data;
-	u64 valid_mask = ~0;
-
-	if (size <= 10)
-		return;
 #ifdef __AVX2__
 #  define ALIGNMENT_REQUIRED 32
 #else
 #  define ALIGNMENT_REQUIRED 16
 #endif
+	/* No E8 byte is considered before this position, since the bytes
+	 * before it are part of the target of the last translation. */
+	u32 resume = pos;
 
 	/* Process one byte at a time until the pointer is properly aligned. */
-	while ((uintptr_t)p % ALIGNMENT_REQUIRED != 0) {
-		if (p >= data + size - 10)
-			return;
-		if (*p == 0xE8 && (valid_mask & 1)) {
-			(*process_target)(p + 1, p - data);
-			valid_mask &= ~0x1F;
+	while ((uintptr_t)&data[pos] % ALIGNMENT_REQUIRED != 0) {
+		if (pos >= end)
+			return pos;
+		if (data[pos] == 0xE8) {
+			(*process_target)(&data[pos + 1], pos);
+			pos += 5;
+		} else {
+			pos++;
 		}
-		p++;
-		valid_mask >>= 1;
-		valid_mask |= (u64)1 << 63;
 	}
+	resume = pos;
 
-	if (data + size - p >= 64) {
-
-		/* Vectorized processing */
-
-		/* Note: we use a "trap" E8 byte to eliminate the need to check
-		 * for end-of-buffer in the inner loop.  This byte is carefully
-		 * positioned so that it will never be changed by a previous
-		 * translation before it is detected. */
-
-		u8 *trap = p + ((data + size - p) & ~31) - 32 + 4;
-		u8 saved_byte = *trap;
-		*trap = 0xE8;
-
-		for (;;) {
-			u32 e8_mask;
-			u8 *orig_p = p;
-		#ifdef __AVX2__
-			const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
-			for (;;) {
-				__m256i bytes = *(const __m256i *)p;
-				__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
-				e8_mask = _mm256_movemask_epi8(cmpresult);
-				if (e8_mask)
-					break;
-				p += 32;
-			}
-		#else
-			const __m128i e8_bytes = _mm_set1_epi8(0xE8);
-			for (;;) {
-				/* Read the next 32 bytes of data and test them
-				 * for E8 bytes. */
-				__m128i bytes1 = *(const __m128i *)p;
-				__m128i bytes2 = *(const __m128i *)(p + 16);
-				__m128i cmpresult1 = _mm_cmpeq_epi8(bytes1, e8_bytes);
-				__m128i cmpresult2 = _mm_cmpeq_epi8(bytes2, e8_bytes);
-				u32 mask1 = _mm_movemask_epi8(cmpresult1);
-				u32 mask2 = _mm_movemask_epi8(cmpresult2);
-				/* The masks have a bit set for each E8 byte.
-				 * We stay in this fast inner loop as long as
-				 * there are no E8 bytes. */
-				if (mask1 | mask2) {
-					e8_mask = mask1 | (mask2 << 16);
-					break;
-				}
-				p += 32;
-			}
-		#endif
-
-			/* Did we pass over data with no E8 bytes? */
-			if (p != orig_p)
-				valid_mask = ~0;
-
-			/* Are we nearing end-of-buffer? */
-			if (p == trap - 4)
-				break;
+	/* Vectorized processing, 32 bytes at a time */
+	for (; pos + 32 <= end; pos += 32) {
+		u32 e8_mask;
+	#ifdef __AVX2__
+		const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
+		__m256i bytes = *(const __m256i *)&data[pos];
 
-			/* Process the E8 bytes.  However, the AND with
-			 * 'valid_mask' ensures we never process an E8 byte that
-			 * was itself part of a translation target. */
-			while ((e8_mask &= valid_mask)) {
-				unsigned bit = bsf32(e8_mask);
-				(*process_target)(p + bit + 1, p + bit - data);
-				valid_mask &= ~((u64)0x1F << bit);
-			}
-
-			valid_mask >>= 32;
-			valid_mask |= 0xFFFFFFFF00000000;
-			p += 32;
-		}
+		e8_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes,
+								 e8_bytes));
+	#else
+		const __m128i e8_bytes = _mm_set1_epi8(0xE8);
+		__m128i bytes1 = *(const __m128i *)&data[pos];
+		__m128i bytes2 = *(const __m128i *)&data[pos + 16];
+		u32 mask1 = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes1, e8_bytes));
+		u32 mask2 = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes2, e8_bytes));
 
-		*trap = saved_byte;
-	}
+		e8_mask = mask1 | (mask2 << 16);
+	#endif
+		if (likely(e8_mask == 0))
+			continue;
 
-	/* Approaching the end of the buffer; process one byte a time. */
-	while (p < data + size - 10) {
-		if (*p == 0xE8 && (valid_mask & 1)) {
-			(*process_target)(p + 1, p - data);
-			valid_mask &= ~0x1F;
+		/* Process the E8 bytes, skipping any which are part of the
+		 * target of a translation. */
+		if (resume > pos)
+			e8_mask &= ~(u32)0 << (resume - pos);
+		while (e8_mask) {
+			unsigned bit = bsf32(e8_mask);
+
+			(*process_target)(&data[pos + bit + 1], pos + bit);
+			resume = pos + bit + 5;
+			if (bit >= 32 - 5)
+				break;
+			e8_mask &= ~(u32)0 << (bit + 5);
 		}
-		p++;
-		valid_mask >>= 1;
-		valid_mask |= (u64)1 << 63;
 	}
+	pos = MAX(pos, resume);
+#undef ALIGNMENT_REQUIRED
 #endif /* __SSE2__ || __AVX2__ */
+
+	/* Process the rest, or all the data if not vectorized.  memchr() is
+	 * usually well optimized, and E8 bytes are relatively rare. */
+	while (pos < end) {
+		const u8 *p = memchr(&data[pos], 0xE8, end - pos);
+
+		if (p == NULL)
+			return end;
+		pos = p - data;
+		(*process_target)(&data[pos + 1], pos);
+		pos += 5;
+	}
+	return pos;
 }
 
+/*
+ * No translation starts within the last 10 bytes of the data.  This avoids any
+ * end-of-buffer checks when reading or writing a translation target.
+ */
+#define E8_DATA_END(size)	((size) > 10 ? (size) - 10 : 0)
+
 void
 preprocess(void *data, u32 size)
 {
-	e8_filter(data, size, do_translate_target);
+	e8_filter_range(data, 0, E8_DATA_END(size), do_translate_target);
 }
 
 void
 postprocess(void *data, u32 size)
 {
-	e8_filter(data, size, undo_translate_target);
+	e8_filter_range(data, 0, E8_DATA_END(size), undo_translate_target);
+}
+
+/* The amount of data which preprocess_copy() copies at a time */
+#define PREPROCESS_WINDOW_SIZE	16384
+
+/*
+ * Copy the data from 'src' to 'dst' and preprocess it.  This works through the
+ * data one window at a time, preprocessing each window right after copying it
+ * while it's still in the cache, so the data only has to travel through memory
+ * once.  The result is the same as memcpy() followed by preprocess().
+ */
+void
+preprocess_copy(void *dst, const void *src, u32 size)
+{
+	const u32 data_end = E8_DATA_END(size);
+	u32 copied = 0;
+	u32 pos = 0;
+
+	while (copied < size) {
+		u32 n = MIN(size - copied, PREPROCESS_WINDOW_SIZE);
+		u32 end;
+
+		memcpy((u8 *)dst + copied, (const u8 *)src + copied, n);
+		copied += n;
+
+		/* A translation at position i changes bytes i + 1 through
+		 * i + 4, so only positions before copied - 4 are ready. */
+		end = (copied == size) ? data_end : MIN(data_end, copied - 4);
+		if (pos < end)
+			pos = e8_filter_range(dst, pos, end,
+					      do_translate_target);
+	}
 }
 
 #endif /* ENABLE_PREPROCESSING */
@@ -11,9 +11,47 @@
 
 #include "libxpack.h"
 
+/*
+ * The state counts of the predefined tables, which a block can select for the
+ * literal run length, length, and offset alphabets instead of sending its own
+ */
+extern const u16 predefined_litrunlen_state_counts[LITRUNLEN_ALPHABET_SIZE];
+extern const u16 predefined_length_state_counts[LENGTH_ALPHABET_SIZE];
+extern const u16 predefined_offset_state_counts[MAX_OFFSET_ALPHABET_SIZE];
+
+/*
+ * Where a compressor or decompressor gets its memory from: the caller's
+ * allocator, and first the unused part of the caller's memory if it was set up
+ * in place (see xpack_init_compressor()).  The arena is carved up from 'next'
+ * onwards and never given back; frees of pointers within it are ignored.
+ */
+struct xpack_mem {
+	struct xpack_allocator allocator;
+	u8 *arena_start;
+	u8 *arena_next;
+	u8 *arena_end;
+};
+
+/* The alignment of each allocation from an arena */
+#define ARENA_ALIGNMENT		64
+
+/*
+ * The arena space needed for an allocation of 'size' bytes.  Add
+ * ARENA_ALIGNMENT - 1 to the total for the alignment of the arena itself.
+ */
+#define ARENA_SIZE(size)	\
+	(DIV_ROUND_UP((size), ARENA_ALIGNMENT) * ARENA_ALIGNMENT)
+
+extern void xpack_mem_init(struct xpack_mem *mem,
+			   const struct xpack_allocator *allocator,
+			   void *arena, size_t arena_size);
+extern void *xpack_mem_alloc(struct xpack_mem *mem, size_t size);
+extern void xpack_mem_free(struct xpack_mem *mem, void *ptr);
+
 #ifdef ENABLE_PREPROCESSING
 extern void preprocess(void *data, u32 size);
 extern void postprocess(void *data, u32 size);
+extern void preprocess_copy(void *dst, const void *src, u32 size);
 #endif
 
 /*
@@ -34,9 +34,13 @@
 #  include <smmintrin.h>
 #endif
 
+#include "bt_matchfinder.h"
 #include "hc_matchfinder.h"
+#include "ht_matchfinder.h"
+#include "ldm_matchfinder.h"
 #include "lz_extend.h"
 #include "xpack_common.h"
+#include "x86_cpu_features.h"
 
 /*
  * The compressor always chooses a block of at least MIN_BLOCK_LENGTH bytes,
@@ -58,10 +62,42 @@
  *    literal sequence is approximately limited by the "nice match length"
  *    parameter.  The actual limit is related to match scores and may be
  *    slightly different.  We overestimate the limit as EXTRA_LITERAL_SPACE.
+ *
+ *  - The near-optimal parser never exceeds SOFT_MAX_BLOCK_LENGTH, since it
+ *    chooses the block boundary before parsing the block.
  */
 #define SOFT_MAX_BLOCK_LENGTH	300000
 #define EXTRA_LITERAL_SPACE	512
 
+/*
+ * The maximum match length the compressor will choose.  Together with the
+ * limits above, this keeps the size of every block within MAX_BLOCK_SIZE.
+ */
+#define MAX_COMPRESSOR_MATCH_LEN	524288
+
+/*
+ * Explicit offset matches with at least this offset must be longer to be
+ * chosen by the greedy and lazy parsers; see struct decode_speed_params.
+ */
+#define FAR_MATCH_OFFSET	4096
+
+/*
+ * The maximum number of bytes needed to store 'n' bytes as a sequence of
+ * uncompressed blocks: each block has a header of at most 25 bits, and the
+ * header stream needs one byte of slack.
+ */
+#define UNCOMPRESSED_BLOCKS_BOUND(n)	\
+	((n) + 4 * DIV_ROUND_UP((n), MAX_BLOCK_SIZE) + 5)
+
+/*
+ * The maximum window size for streaming compression.  The stream window holds
+ * twice this many bytes, and all positions in it must fit in 32 bits.
+ */
+#define MAX_STREAM_WINDOW_SIZE		(1 << 28)
+
+/* The maximum size of a preset dictionary */
+#define MAX_DICTIONARY_SIZE		(1 << 28)
+
 /* Holds the symbols and extra offset bits needed to represent a match */
 struct match {
 	u8 litrunlen_sym;
@@ -105,6 +141,17 @@ struct codes {
 	unsigned log2_num_offset_states;
 	unsigned log2_num_aligned_states;
 
+	/*
+	 * Whether the decompressor has each alphabet's table, as sent by an
+	 * earlier block of the same buffer or stream, so that later blocks can
+	 * reuse it instead of sending new state counts
+	 */
+	bool literal_reusable;
+	bool litrunlen_reusable;
+	bool length_reusable;
+	bool offset_reusable;
+	bool aligned_reusable;
+
 	union {
 		u16 state_counts[LITERAL_ALPHABET_SIZE +
 				 LITRUNLEN_ALPHABET_SIZE +
@@ -121,15 +168,90 @@ struct codes {
 	};
 };
 
+/*
+ * The near-optimal parser's costs, in units of 1/BIT_COST bits.  The costs of
+ * explicit offset symbols include their extra offset bits.
+ */
+#define BIT_COST	16
+
+struct costs {
+	u32 literal[LITERAL_ALPHABET_SIZE];
+	u32 litrunlen[LITRUNLEN_ALPHABET_SIZE];
+	u32 length[LENGTH_ALPHABET_SIZE];
+	u32 offset[MAX_OFFSET_ALPHABET_SIZE];
+};
+
+/*
+ * A node in the graph of possible parses of a block.  Node 'i' represents the
+ * position 'i' bytes into the block, and it holds the cheapest known way to
+ * reach that position.
+ */
+struct optimum_node {
+
+	/* The cost of the cheapest path to this node, including the literal run
+	 * length of the literals at the end of that path */
+	u32 cost;
+
+	/* The last item on the path: a literal if 'length' is 1, otherwise a
+	 * match with the given offset data (see compress_lazy()).  After the
+	 * path is chosen, these are reversed to describe the item beginning at
+	 * this node instead. */
+	u32 length;
+	u32 offset_data;
+
+	/* The literal run length and recent offsets queue at this node, filled
+	 * in once the cheapest path to the node is known */
+	u32 litrunlen;
+	u32 recent_offsets[NUM_REPS];
+};
+
+/*
+ * The near-optimal parser caches the matches for a whole block so that it can
+ * parse the block several times.  For each position there is an entry holding
+ * the number of matches in its 'length' field, followed by the matches.  The
+ * block is ended early if the cache fills up, which it can't do before holding
+ * this many entries per position of the longest possible block.
+ */
+#define MATCH_CACHE_ENTRIES_PER_POS	5
+
+/* State for the near-optimal parser, which is only allocated if needed */
+struct near_optimal_state {
+	struct costs costs;
+
+	/* One node for each position of the longest possible block, plus one */
+	struct optimum_node *optimum_nodes;
+
+	/* The block is ended once the match cache is filled up to here */
+	struct lz_match *match_cache_end;
+
+	/* The match cache, plus room for the entries of the last position
+	 * searched and for the positions skipped over.  The optimum nodes
+	 * follow it. */
+	struct lz_match match_cache[];
+};
+
 /* Block split statistics.  See "Block splitting algorithm" below. */
+#define SPLIT_CHECK_INTERVAL 512
 #define NUM_LITERAL_OBSERVATION_TYPES 8
 #define NUM_MATCH_OBSERVATION_TYPES 2
 #define NUM_OBSERVATION_TYPES (NUM_LITERAL_OBSERVATION_TYPES + NUM_MATCH_OBSERVATION_TYPES)
 struct block_split_stats {
-	u32 new_observations[NUM_OBSERVATION_TYPES];
+	/* The number of items in the block at the last check, or 0 */
+	u32 num_checked_items;
+
+	/* For the lightweight check: the observations up to the last check */
 	u32 observations[NUM_OBSERVATION_TYPES];
-	u32 num_new_observations;
 	u32 num_observations;
+
+	/* For the cost-based check: the frequencies at the last check */
+	struct freqs checked_freqs;
+};
+
+/* The matchfinders, one of which is used depending on the compression level */
+enum matchfinder_type {
+	MATCHFINDER_HT,
+	MATCHFINDER_HC,
+	MATCHFINDER_BT,
 };
 
 /* The main compressor structure */
@@ -137,15 +259,130 @@ struct xpack_compressor {
 
 	unsigned nice_match_length;
 	unsigned max_search_depth;
-	u8 *in_buffer;
-	size_t in_nbytes;
+	unsigned num_optim_passes;
+	int compression_level;
+	bool cost_based_split;
+
+	/* The settings for the decode speed; see struct decode_speed_params */
+	u32 min_match_len;
+	u32 min_far_match_len;
+	u32 literal_time_cost;
+	u32 match_time_cost;
+
 	size_t max_buffer_size;
 	size_t (*impl)(struct xpack_compressor *, void *, size_t);
+	enum matchfinder_type mf_type;
+
+	/*
+	 * The data being compressed is in_buffer[in_start...in_nbytes - 1].
+	 * Any data before 'in_start' has already been compressed and may be
+	 * referenced by matches, up to a distance of 'window_size' bytes.
+	 */
+	u8 *in_buffer;
+	size_t in_start;
+	size_t in_nbytes;
+	u32 window_size;
+
+	/* Does the data being compressed end the stream? */
+	bool is_final_data;
+
+	/* The recent offsets queue, carried across calls when streaming */
+	u32 recent_offsets[NUM_REPS];
+
+#ifdef ENABLE_PREPROCESSING
+	u8 *preprocess_buffer;
+
+	/* Was the buffer being compressed preprocessed?  See
+	 * looks_like_x86_code(). */
+	bool preprocessed;
+#endif
+
+	/*
+	 * The preset dictionary, if any; see xpack_compressor_use_dictionary().
+	 * 'dict_buffer' holds a copy of the dictionary followed by room for the
+	 * buffer being compressed, so that matches can run from one into the
+	 * other.  The matchfinder then has its tables in 'dict_mf_tabs', since
+	 * they must cover the dictionary too, and starts each buffer from a
+	 * copy of the dictionary's matchfinder state.  'dict_owned' is set if
+	 * the dictionary was digested by xpack_compressor_set_dictionary().
+	 *
+	 * If 'dict_mf_dirty_end' isn't 0, then the matchfinder still has the
+	 * dictionary's state apart from the sequences that the last buffer
+	 * inserted, which ended there; see reset_dictionary_matchfinder().
+	 */
+	const struct xpack_dictionary *dict;
+	bool dict_owned;
+	u8 *dict_buffer;
+	size_t dict_size;
+	u32 *dict_mf_tabs;
+	size_t dict_mf_dirty_end;
+
+	/*
+	 * Streaming state; see xpack_compress_stream_init().  While streaming,
+	 * 'in_buffer' points 'stream_base' bytes into 'stream_window', and holds
+	 * at most 2 * 'window_size' bytes, so that the regular matchfinder only
+	 * has to cover that much.  The 'stream_history' bytes before 'in_start'
+	 * are kept in 'stream_window' for the long distance matchfinder, if it's
+	 * in use; otherwise that is just 'window_size' and 'stream_base' is 0.
+	 */
+	u8 *stream_window;
+	size_t stream_window_alloc;
+	size_t stream_base;
+	u32 stream_history;
+	u8 *stream_out;
+	size_t stream_out_nbytes;
+	size_t stream_out_pos;
+	u32 stream_segment_size;
+	bool stream_active;
+
+	/*
+	 * Long distance matching; see xpack_compressor_set_long_window().  The
+	 * matches found in the data being compressed are 'ldm_next' through
+	 * 'ldm_end' - 1, at positions in 'in_buffer', and 'ldm_next_pos' is the
+	 * next position the parser needs to look at them, or UINT32_MAX if
+	 * never.  'ldm_retry_offset' is tried up to 'ldm_retry_end'; see
+	 * next_long_distance_match().
+	 */
+	size_t long_window_size;
+	struct ldm_matchfinder *ldm;
+	size_t ldm_size;
+	struct ldm_match *ldm_matches;
+	const struct ldm_match *ldm_next;
+	const struct ldm_match *ldm_end;
+	u32 ldm_next_pos;
+	u32 ldm_retry_offset;
+	u32 ldm_retry_end;
+
+	/*
+	 * Block statistics; see xpack_compressor_set_block_stats_callback().
+	 * 'block_start_time' is when the parser started on the current block.
+	 */
+	xpack_block_stats_callback_t stats_callback;
+	unsigned long long (*stats_clock)(void);
+	void *stats_private_data;
+	unsigned long long block_start_time;
+
+	/* The CRC-32C of the data compressed so far, if enabled; see
+	 * xpack_compressor_set_checksum() */
+	bool checksum_enabled;
+	u32 checksum;
 
 	struct freqs freqs;
 	struct block_split_stats split_stats;
 	struct codes codes;
 
+	/* The encoding tables for the predefined state counts, built when the
+	 * compressor is allocated.  Only the alphabets which have predefined
+	 * state counts are used. */
+	struct codes predefined_codes;
+
+	/* Scratch space for the state counts being chosen for a block */
+	u16 new_state_counts[LITERAL_ALPHABET_SIZE +
+			     LITRUNLEN_ALPHABET_SIZE +
+			     LENGTH_ALPHABET_SIZE +
+			     MAX_OFFSET_ALPHABET_SIZE +
+			     ALIGNED_ALPHABET_SIZE];
+
 	unsigned cumul_state_counts[MAX_ALPHABET_SIZE];
 	u8 state_to_symbol[MAX_NUM_STATES];
 
@@ -153,20 +390,61 @@ struct xpack_compressor {
 	u32 num_matches;
 	u32 num_extra_bytes;
 
-	u8 literals[SOFT_MAX_BLOCK_LENGTH + EXTRA_LITERAL_SPACE];
-	struct match matches[DIV_ROUND_UP(SOFT_MAX_BLOCK_LENGTH, MIN_MATCH_LEN) + 1];
-	u8 extra_bytes[6 + /* extra for actual block length > soft max */
-		MAX4(1 * DIV_ROUND_UP(SOFT_MAX_BLOCK_LENGTH,
-				      MIN_MATCH_LEN + LENGTH_ALPHABET_SIZE - 1),
-		     3 * DIV_ROUND_UP(SOFT_MAX_BLOCK_LENGTH,
-				      MIN_MATCH_LEN + LENGTH_ALPHABET_SIZE - 1 + 0xFF),
-		     1 * DIV_ROUND_UP(SOFT_MAX_BLOCK_LENGTH,
-				      LITRUNLEN_ALPHABET_SIZE - 1),
-		     3 * DIV_ROUND_UP(SOFT_MAX_BLOCK_LENGTH,
-				      LITRUNLEN_ALPHABET_SIZE - 1 + 0xFF))];
+	struct near_optimal_state *near_optimal;
+
+	/* The items of the current block; see get_compressor_sizes() */
+	u8 *literals;
+	struct match *matches;
+	u8 *extra_bytes;
+
+	/* Where all the allocations, including this one, come from */
+	struct xpack_mem mem;
+
+	/* The matchfinder (MUST BE LAST!!!) */
+	union {
+		/* Hash table matchfinder, for the fastest parser */
+		struct ht_matchfinder ht_mf;
+
+		/* Hash chains matchfinder, for the greedy and lazy parsers */
+		struct hc_matchfinder hc_mf;
+
+		/* Binary trees matchfinder, for the near-optimal parser */
+		struct bt_matchfinder bt_mf;
+	};
+};
+
+/*
+ * A preset dictionary which has been inserted into a matchfinder, so that
+ * compressors can start each buffer from a copy of the matchfinder state rather
+ * than inserting the dictionary again.  It isn't modified after it has been
+ * created, so it may be shared by compressors on different threads.
+ */
+struct xpack_dictionary {
+
+	/* The compressor parameters which the matchfinder state depends on */
+	size_t max_buffer_size;
+	int compression_level;
+	enum matchfinder_type mf_type;
+	unsigned nice_match_length;
+	unsigned max_search_depth;
+
+	/* The dictionary itself */
+	u8 *data;
+	size_t size;
+
+	/* For the near-optimal parser, the symbol frequencies expected in data
+	 * which follows the dictionary; see estimate_dictionary_freqs() */
+	bool has_freqs;
+	struct freqs freqs;
 
-	/* Hash chains matchfinder (MUST BE LAST!!!) */
-	struct hc_matchfinder hc_mf;
+	/* The matchfinder which the dictionary was inserted into, set up for
+	 * buffers of the dictionary plus 'max_buffer_size' bytes (MUST BE
+	 * LAST!!!) */
+	union {
+		struct ht_matchfinder ht_mf;
+		struct hc_matchfinder hc_mf;
+		struct bt_matchfinder bt_mf;
+	};
 };
 
 /* Return the log base 2 of 'n', rounded up to the nearest integer. */
@@ -178,6 +456,26 @@ ilog2_ceil(u32 n)
 	return 1 + bsr32(n - 1);
 }
 
+/* Return about BIT_COST * log2(n), for n >= 1 */
+static forceinline u32
+log2_cost(u32 n)
+{
+	static const u8 frac_costs[16] = {
+		0, 1, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 15,
+	};
+	unsigned order = bsr32(n);
+	u32 frac_bits;
+
+	STATIC_ASSERT(BIT_COST == 16);
+
+	if (order >= 4)
+		frac_bits = n >> (order - 4);
+	else
+		frac_bits = n << (4 - order);
+
+	return (order * BIT_COST) + frac_costs[frac_bits & 15];
+}
+
 /* Select the log2(num_states) to use for an alphabet. */
 static unsigned
 select_log2_num_states(u32 total_freq, unsigned num_used_syms,
@@ -740,12 +1038,8 @@ encode_items(const struct xpack_compressor *c, void *out, size_t out_nbytes_avai
 	unsigned length_statex;
 	unsigned offset_statex;
 	unsigned aligned_statex;
-#if NUM_LITERAL_STREAMS == 2
-	unsigned literal_statex_1;
-	unsigned literal_statex_2;
-#else
-	unsigned literal_statex;
-#endif
+	unsigned literal_statex[NUM_LITERAL_STREAMS];
+	unsigned k;
 	s32 i;
 
 	symbol_ostream_init(&os, out, out_nbytes_avail);
@@ -821,65 +1115,32 @@ encode_items(const struct xpack_compressor *c, void *out, size_t out_nbytes_avai
 	encode_initial_state(&os, length_statex, c->codes.log2_num_length_states);
 	encode_initial_state(&os, litrunlen_statex, c->codes.log2_num_litrunlen_states);
 
-	/* Encode the literals */
-
-#if NUM_LITERAL_STREAMS == 2
-	literal_statex_1 = 1 << c->codes.log2_num_literal_states;
-	literal_statex_2 = 1 << c->codes.log2_num_literal_states;
-
-	for (i = c->num_literals - 1; i >= 1; i -= 2) {
-
-		literal_statex_1 = encode_symbol(c->literals[i],
-						 literal_statex_1,
-						 &os,
-						 c->codes.literal_sym_encinfo,
-						 c->codes.literal_next_statesx);
-
-		literal_statex_2 = encode_symbol(c->literals[i - 1],
-						 literal_statex_2,
-						 &os,
-						 c->codes.literal_sym_encinfo,
-						 c->codes.literal_next_statesx);
-		symbol_ostream_flush_bits(&os);
-	}
-
-	if (c->num_literals & 1) {
-		literal_statex_1 = encode_symbol(c->literals[0],
-						 literal_statex_1,
-						 &os,
-						 c->codes.literal_sym_encinfo,
-						 c->codes.literal_next_statesx);
-		symbol_ostream_flush_bits(&os);
-
-		/* last state the encoder used is state_1
-		 * => first state the encoder will see is state_1
-		 * => numbering will be the same
-		 * => encoder must output state_2, then state_1 */
-		encode_initial_state(&os, literal_statex_2, c->codes.log2_num_literal_states);
-		encode_initial_state(&os, literal_statex_1, c->codes.log2_num_literal_states);
-	} else {
-		/* Reversed numbering */
-		encode_initial_state(&os, literal_statex_1, c->codes.log2_num_literal_states);
-		encode_initial_state(&os, literal_statex_2, c->codes.log2_num_literal_states);
-	}
-
-#else /* NUM_LITERAL_STREAMS == 2 */
+	/*
+	 * Encode the literals.  Literal 'i' uses literal state
+	 * 'i % NUM_LITERAL_STREAMS', so that the decompressor can decode
+	 * consecutive literals with independent states.  Since the encoder goes
+	 * backwards, the initial states are output last state first.
+	 */
 
-	literal_statex = 1 << c->codes.log2_num_literal_states;
+	for (k = 0; k < NUM_LITERAL_STREAMS; k++)
+		literal_statex[k] = 1 << c->codes.log2_num_literal_states;
 
 	for (i = c->num_literals - 1; i >= 0; i--) {
 
-		literal_statex = encode_symbol(c->literals[i],
-					       literal_statex,
-					       &os,
-					       c->codes.literal_sym_encinfo,
-					       c->codes.literal_next_statesx);
+		k = i % NUM_LITERAL_STREAMS;
 
-		symbol_ostream_flush_bits(&os);
+		literal_statex[k] = encode_symbol(c->literals[i],
+						  literal_statex[k],
+						  &os,
+						  c->codes.literal_sym_encinfo,
+						  c->codes.literal_next_statesx);
+		if (i % 2 == 0)
+			symbol_ostream_flush_bits(&os);
 	}
 
-	encode_initial_state(&os, literal_statex, c->codes.log2_num_literal_states);
-#endif /* NUM_LITERAL_STREAMS != 2 */
+	for (k = NUM_LITERAL_STREAMS; k-- > 0; )
+		encode_initial_state(&os, literal_statex[k],
+				     c->codes.log2_num_literal_states);
 
 	/* Literal count */
 	order = bsr32(c->num_literals + 1);
@@ -917,6 +1178,167 @@ write_block_size(struct header_ostream *os, u32 block_size)
 	header_ostream_write_bits(os, bits, num_bits);
 }
 
+/*
+ * Return about BIT_COST times the number of bits needed to encode symbols with
+ * the frequencies @freqs using the given state counts, or UINT32_MAX if a
+ * symbol which occurs has no states.
+ */
+static u32
+symbols_cost(const u32 freqs[], const u16 state_counts[],
+	     unsigned alphabet_size, unsigned log2_num_states)
+{
+	u32 cost = 0;
+	unsigned sym;
+
+	for (sym = 0; sym < alphabet_size; sym++) {
+		if (freqs[sym] == 0)
+			continue;
+		if (state_counts[sym] == 0)
+			return UINT32_MAX;
+		cost += freqs[sym] * ((log2_num_states * BIT_COST) -
+				      log2_cost(state_counts[sym]));
+	}
+	return cost;
+}
+
+/* Return BIT_COST times the number of bits write_state_counts() would use. */
+static u32
+state_counts_cost(const u16 state_counts[], unsigned num_state_counts)
+{
+	unsigned sym = 0;
+	u32 num_bits = 0;
+
+	while (sym < num_state_counts) {
+		unsigned count = state_counts[sym++];
+
+		if (count == 0) {
+			unsigned start = sym - 1;
+			unsigned num_zeroes;
+
+			while (sym < num_state_counts && state_counts[sym] == 0)
+				sym++;
+			num_zeroes = sym - start;
+
+			while (num_zeroes >= ZEROCODE2_MIN) {
+				num_zeroes -= MIN(num_zeroes, ZEROCODE2_MAX);
+				num_bits += ZEROCODE2_NBITS + CODEBITS;
+			}
+			if (num_zeroes >= ZEROCODE1_MIN)
+				num_bits += ZEROCODE1_NBITS + CODEBITS;
+		} else {
+			num_bits += bsr32(count) + CODEBITS;
+		}
+	}
+	return num_bits * BIT_COST;
+}
+
+/*
+ * Choose the FSE state counts for an alphabet of the block being written, and
+ * return the log2_num_states field to output for it.
+ *
+ * New state counts are built at *@new_state_counts_p.  But if the alphabet has
+ * predefined state counts (@predefined_state_counts is not NULL) which code the
+ * block's symbols no less cheaply than the new ones do including the cost of
+ * sending them, then the predefined ones are selected with
+ * PREDEFINED_LOG2_NUM_STATES.  And if the decompressor still has a table for
+ * the alphabet from an earlier block which is cheaper yet, then it is reused
+ * with REPEAT_LOG2_NUM_STATES.
+ *
+ * Unless a table is reused, the chosen state counts replace the current ones,
+ * @state_counts and *@log2_num_states_p.  New state counts also advance
+ * *@new_state_counts_p past them, so that the state counts which must be sent
+ * end up packed together.
+ */
+static unsigned
+choose_block_state_counts(const u32 freqs[], unsigned alphabet_size,
+			  unsigned max_log2_num_states,
+			  const u16 predefined_state_counts[],
+			  unsigned predefined_log2_num_states,
+			  u16 **new_state_counts_p, u16 state_counts[],
+			  unsigned *log2_num_states_p, bool *reusable_p)
+{
+	u16 *new_state_counts = *new_state_counts_p;
+	unsigned new_log2_num_states;
+	unsigned field;
+	u32 best_cost;
+	u32 cost;
+
+	new_log2_num_states = choose_state_counts(freqs, alphabet_size,
+						  max_log2_num_states,
+						  new_state_counts);
+	field = new_log2_num_states;
+	best_cost = symbols_cost(freqs, new_state_counts, alphabet_size,
+				 new_log2_num_states) +
+		    state_counts_cost(new_state_counts, alphabet_size);
+
+	if (predefined_state_counts) {
+		cost = symbols_cost(freqs, predefined_state_counts,
+				    alphabet_size, predefined_log2_num_states);
+		if (cost <= best_cost) {
+			field = PREDEFINED_LOG2_NUM_STATES;
+			best_cost = cost;
+		}
+	}
+
+	if (*reusable_p &&
+	    symbols_cost(freqs, state_counts, alphabet_size,
+			 *log2_num_states_p) <= best_cost)
+		return REPEAT_LOG2_NUM_STATES;
+
+	if (field == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(state_counts, predefined_state_counts,
+		       alphabet_size * sizeof(state_counts[0]));
+		*log2_num_states_p = predefined_log2_num_states;
+	} else {
+		memcpy(state_counts, new_state_counts,
+		       alphabet_size * sizeof(state_counts[0]));
+		*log2_num_states_p = new_log2_num_states;
+		*new_state_counts_p += alphabet_size;
+	}
+	*reusable_p = true;
+	return field;
+}
+
+/* Build the encoding tables for the predefined state counts. */
+static void
+build_predefined_codes(struct xpack_compressor *c)
+{
+	struct codes *codes = &c->predefined_codes;
+
+	build_fse_encoding_tables(c, codes->litrunlen_sym_encinfo,
+				  codes->litrunlen_next_statesx,
+				  predefined_litrunlen_state_counts,
+				  LITRUNLEN_ALPHABET_SIZE,
+				  LOG2_NUM_PREDEFINED_LITRUNLEN_STATES);
+
+	build_fse_encoding_tables(c, codes->length_sym_encinfo,
+				  codes->length_next_statesx,
+				  predefined_length_state_counts,
+				  LENGTH_ALPHABET_SIZE,
+				  LOG2_NUM_PREDEFINED_LENGTH_STATES);
+
+	build_fse_encoding_tables(c, codes->offset_sym_encinfo,
+				  codes->offset_next_statesx,
+				  predefined_offset_state_counts,
+				  MAX_OFFSET_ALPHABET_SIZE,
+				  LOG2_NUM_PREDEFINED_OFFSET_STATES);
+}
+
+/*
+ * Forget the tables which the decompressor has, so that the next block sends
+ * new state counts for every alphabet.  This is needed at the start of each
+ * buffer or stream, and whenever compressed blocks are discarded.
+ */
+static void
+reset_codes(struct codes *codes)
+{
+	codes->literal_reusable = false;
+	codes->litrunlen_reusable = false;
+	codes->length_reusable = false;
+	codes->offset_reusable = false;
+	codes->aligned_reusable = false;
+}
+
 /* Heuristic for using ALIGNED blocks */
 static int
 choose_block_type(struct xpack_compressor *c)
@@ -943,13 +1365,26 @@ choose_block_type(struct xpack_compressor *c)
  * start a new block with new entropy codes.  There is a theoretically optimal
  * solution: recursively consider every possible block split, considering the
  * exact cost of each block, and choose the minimum cost approach.  But this is
- * far too slow.  Instead, as an approximation, we can count symbols and after
- * every N symbols, compare the expected distribution of symbols based on the
- * previous data with the actual distribution.  If they differ "by enough", then
- * start a new block.
+ * far too slow.  Instead, as an approximation, after every
+ * SPLIT_CHECK_INTERVAL items (literals and matches), we compare the symbols of
+ * the items since the last check with those of the rest of the block.  If they
+ * differ "by enough", then start a new block.
  *
- * As an optimization and heuristic, we don't distinguish between every symbol
- * but rather we combine many symbols into a single "observation type".  For
+ * Both ways of comparing them, described below, work from the symbol
+ * frequencies which the parser keeps for the block anyway ('struct freqs'),
+ * plus a snapshot of them taken at the last check.  So, apart from the checks
+ * themselves, block splitting costs nothing per item.  Finally, for an
+ * approximation, it is not strictly necessary that the exact symbols being
+ * used are considered.  With "near-optimal parsing", for example, the actual
+ * symbols that will be used are unknown until after the block boundary is
+ * chosen and the block has been optimized.  Since the final choices cannot be
+ * used, that parser counts preliminary "greedy" choices instead.
+ */
+
+/*
+ * The lightweight check, for the fastest compression levels.  As an
+ * optimization and heuristic, we don't distinguish between every symbol but
+ * rather we combine many symbols into a single "observation type".  For
  * literals we only look at the high bits and low bits, and for matches we only
  * look at whether the match is long or not.  The assumption is that for typical
  * "real" data, places that are good block boundaries will tend to be noticable
@@ -966,51 +1401,45 @@ choose_block_type(struct xpack_compressor *c)
  * large blocks than small blocks.  This reflects the general expectation that
  * it will become increasingly beneficial to start a new block as the current
  * blocks grows larger.
- *
- * Finally, for an approximation, it is not strictly necessary that the exact
- * symbols being used are considered.  With "near-optimal parsing", for example,
- * the actual symbols that will be used are unknown until after the block
- * boundary is chosen and the block has been optimized.  Since the final choices
- * cannot be used, we can use preliminary "greedy" choices instead.
  */
 
-/* Initialize the block split statistics when starting a new block. */
+/* Get the number of occurrences of each observation type in @freqs. */
 static void
-init_block_split_stats(struct block_split_stats *stats)
+get_observations(const struct freqs *freqs,
+		 u32 observations[NUM_OBSERVATION_TYPES])
 {
+	unsigned sym;
 	int i;
 
-	for (i = 0; i < NUM_OBSERVATION_TYPES; i++) {
-		stats->new_observations[i] = 0;
-		stats->observations[i] = 0;
-	}
-	stats->num_new_observations = 0;
-	stats->num_observations = 0;
-}
+	for (i = 0; i < NUM_OBSERVATION_TYPES; i++)
+		observations[i] = 0;
 
-/* Literal observation.  Heuristic: use the top 2 bits and low 1 bits of the
- * literal, for 8 possible literal observation types.  */
-static forceinline void
-observe_literal(struct block_split_stats *stats, u8 lit)
-{
-	stats->new_observations[((lit >> 5) & 0x6) | (lit & 1)]++;
-	stats->num_new_observations++;
-}
+	/* Literals: use the top 2 bits and low 1 bits of the literal */
+	for (sym = 0; sym < LITERAL_ALPHABET_SIZE; sym++)
+		observations[((sym >> 5) & 0x6) | (sym & 1)] +=
+			freqs->literal[sym];
 
-/* Match observation.  Heuristic: use one observation type for "short match" and
- * one observation type for "long match".  */
-static forceinline void
-observe_match(struct block_split_stats *stats, unsigned length)
-{
-	stats->new_observations[NUM_LITERAL_OBSERVATION_TYPES + (length >= 9)]++;
-	stats->num_new_observations++;
+	/* Matches: "short" if shorter than 9 bytes, otherwise "long" */
+	for (sym = 0; sym < LENGTH_ALPHABET_SIZE; sym++)
+		observations[NUM_LITERAL_OBSERVATION_TYPES +
+			     (sym + MIN_MATCH_LEN >= 9)] += freqs->length[sym];
 }
 
 static bool
-do_end_block_check(struct block_split_stats *stats, u32 block_size)
+lightweight_end_block_check(struct block_split_stats *stats,
+			    const struct freqs *freqs, u32 block_size)
 {
+	u32 observations[NUM_OBSERVATION_TYPES];
+	u32 new_observations[NUM_OBSERVATION_TYPES];
+	u32 num_new_observations = 0;
 	int i;
 
+	get_observations(freqs, observations);
+	for (i = 0; i < NUM_OBSERVATION_TYPES; i++) {
+		new_observations[i] = observations[i] - stats->observations[i];
+		num_new_observations += new_observations[i];
+	}
+
 	if (stats->num_observations > 0) {
 
 		/* Note: to avoid slow divisions, we do not divide by
@@ -1018,8 +1447,8 @@ do_end_block_check(struct block_split_stats *stats, u32 block_size)
 		 * multiplied by 'num_observations'.  */
 		u32 total_delta = 0;
 		for (i = 0; i < NUM_OBSERVATION_TYPES; i++) {
-			u32 expected = stats->observations[i] * stats->num_new_observations;
-			u32 actual = stats->new_observations[i] * stats->num_observations;
+			u32 expected = stats->observations[i] * num_new_observations;
+			u32 actual = new_observations[i] * stats->num_observations;
 			u32 delta = (actual > expected) ? actual - expected :
 							  expected - actual;
 			total_delta += delta;
@@ -1031,45 +1460,174 @@ do_end_block_check(struct block_split_stats *stats, u32 block_size)
 			return true;
 	}
 
-	for (i = 0; i < NUM_OBSERVATION_TYPES; i++) {
-		stats->num_observations += stats->new_observations[i];
-		stats->observations[i] += stats->new_observations[i];
-		stats->new_observations[i] = 0;
-	}
-	stats->num_new_observations = 0;
+	for (i = 0; i < NUM_OBSERVATION_TYPES; i++)
+		stats->observations[i] = observations[i];
+	stats->num_observations += num_new_observations;
 	return false;
 }
 
-static forceinline bool
-should_end_block(struct block_split_stats *stats,
-		 const u8 *in_block_begin, const u8 *in_next, const u8 *in_end)
+/*
+ * The cost-based check, for the higher compression levels.  This estimates the
+ * number of bits that coding the new items with a code of their own would save
+ * over coding them with a code built for the whole block so far: with 'b' and
+ * 'a + b' being the frequencies of a symbol in the new items and in the whole
+ * block, and 'B' and 'A + B' the totals, that is the sum of
+ * b * log2((b / B) / ((a + b) / (A + B))) over the symbols of each alphabet.
+ * If the new items are like the rest of the block, then the saving is about
+ * half a bit per symbol that they use, just from chance.  A new block must
+ * save more than that, plus the cost of its header, which is estimated as
+ * SPLIT_COST_PER_SYMBOL bits for each symbol used too, plus SPLIT_COST_BASE.
+ */
+#define SPLIT_COST_PER_SYMBOL	2
+#define SPLIT_COST_BASE		64
+
+/* Fractional bits of log2_fixed() */
+#define LOG2_FIXED_FRAC_BITS	8
+
+/* Return about log2(n) * (1 << LOG2_FIXED_FRAC_BITS), for n >= 1 */
+static u32
+log2_fixed(u32 n)
 {
-	/* Ready to check block split statistics? */
-	if (stats->num_new_observations < 512 ||
-	    in_next - in_block_begin < MIN_BLOCK_LENGTH ||
-	    in_end - in_next < 16384)
-		return false;
+	const unsigned order = bsr32(n);
+	u32 result = order << LOG2_FIXED_FRAC_BITS;
+	u32 x; /* n / 2**order, in 1.15 fixed point */
+	u32 bit;
 
-	return do_end_block_check(stats, in_next - in_block_begin);
+	if (order >= 15)
+		x = n >> (order - 15);
+	else
+		x = n << (15 - order);
+
+	/* Get each fractional bit by squaring: if x**2 >= 2, then that bit of
+	 * log2(x) is set and x**2 / 2 is left for the next one. */
+	for (bit = 1 << (LOG2_FIXED_FRAC_BITS - 1); bit != 0; bit >>= 1) {
+		x = (x * x) >> 15;
+		if (x >= (1 << 16)) {
+			x >>= 1;
+			result |= bit;
+		}
+	}
+	return result;
 }
 
-/******************************************************************************/
-
+/*
+ * Add to *@gain the estimated saving, in units of 1 << LOG2_FIXED_FRAC_BITS
+ * bits, of coding the new occurrences, @freqs minus @old_freqs, of the symbols
+ * of an alphabet separately.  Add the number of symbols they use to
+ * *@num_syms.
+ */
 static void
-begin_block(struct xpack_compressor *c)
+add_split_gain(const u32 freqs[], const u32 old_freqs[],
+	       unsigned alphabet_size, s64 *gain, u32 *num_syms)
 {
-	memset(&c->freqs, 0, sizeof(c->freqs));
-	c->num_literals = 0;
-	c->num_matches = 0;
-	c->num_extra_bytes = 0;
-	init_block_split_stats(&c->split_stats);
+	u32 total = 0;
+	u32 new_total = 0;
+	s64 g = 0;
+	unsigned sym;
+
+	for (sym = 0; sym < alphabet_size; sym++) {
+		const u32 f = freqs[sym];
+		const u32 new_f = f - old_freqs[sym];
+
+		total += f;
+		if (new_f == 0)
+			continue;
+		new_total += new_f;
+		g += (s64)new_f * ((s32)log2_fixed(new_f) - (s32)log2_fixed(f));
+		(*num_syms)++;
+	}
+	if (new_total == 0)
+		return;
+	g += (s64)new_total * ((s32)log2_fixed(total) -
+			       (s32)log2_fixed(new_total));
+	*gain += g;
 }
 
-static void
-record_literal(struct xpack_compressor *c, u8 literal)
+static bool
+cost_based_end_block_check(struct block_split_stats *stats,
+			   const struct freqs *freqs)
 {
-	c->literals[c->num_literals++] = literal;
-	c->freqs.literal[literal]++;
+	if (stats->num_checked_items > 0) {
+		const struct freqs *old = &stats->checked_freqs;
+		s64 gain = 0;
+		u32 num_syms = 0;
+
+		add_split_gain(freqs->literal, old->literal,
+			       LITERAL_ALPHABET_SIZE, &gain, &num_syms);
+		add_split_gain(freqs->litrunlen, old->litrunlen,
+			       LITRUNLEN_ALPHABET_SIZE, &gain, &num_syms);
+		add_split_gain(freqs->length, old->length,
+			       LENGTH_ALPHABET_SIZE, &gain, &num_syms);
+		add_split_gain(freqs->offset, old->offset,
+			       MAX_OFFSET_ALPHABET_SIZE, &gain, &num_syms);
+
+		/* Ready to end the block? */
+		if (gain > (s64)((num_syms / 2 + num_syms * SPLIT_COST_PER_SYMBOL +
+				  SPLIT_COST_BASE) << LOG2_FIXED_FRAC_BITS))
+			return true;
+	}
+	stats->checked_freqs = *freqs;
+	return false;
+}
+
+/* Initialize the block split statistics when starting a new block. */
+static void
+init_block_split_stats(struct block_split_stats *stats)
+{
+	int i;
+
+	stats->num_checked_items = 0;
+	for (i = 0; i < NUM_OBSERVATION_TYPES; i++)
+		stats->observations[i] = 0;
+	stats->num_observations = 0;
+}
+
+static bool
+do_end_block_check(struct xpack_compressor *c, u32 block_size)
+{
+	bool end_block;
+
+	if (c->cost_based_split)
+		end_block = cost_based_end_block_check(&c->split_stats,
+						       &c->freqs);
+	else
+		end_block = lightweight_end_block_check(&c->split_stats,
+							&c->freqs, block_size);
+	c->split_stats.num_checked_items = c->num_literals + c->num_matches;
+	return end_block;
+}
+
+static forceinline bool
+should_end_block(struct xpack_compressor *c,
+		 const u8 *in_block_begin, const u8 *in_next, const u8 *in_end)
+{
+	/* Ready to check block split statistics? */
+	if (c->num_literals + c->num_matches <
+	    c->split_stats.num_checked_items + SPLIT_CHECK_INTERVAL ||
+	    in_next - in_block_begin < MIN_BLOCK_LENGTH ||
+	    in_end - in_next < 16384)
+		return false;
+
+	return do_end_block_check(c, in_next - in_block_begin);
+}
+
+/******************************************************************************/
+
+static void
+begin_block(struct xpack_compressor *c)
+{
+	memset(&c->freqs, 0, sizeof(c->freqs));
+	c->num_literals = 0;
+	c->num_matches = 0;
+	c->num_extra_bytes = 0;
+	init_block_split_stats(&c->split_stats);
+}
+
+static void
+record_literal(struct xpack_compressor *c, u8 literal)
+{
+	c->literals[c->num_literals++] = literal;
+	c->freqs.literal[literal]++;
 }
 
 static void
@@ -1146,17 +1704,88 @@ record_repeat_offset(struct xpack_compressor *c, struct match *match,
 	c->freqs.offset[rep_idx]++;
 }
 
+static forceinline unsigned long long
+read_stats_clock(const struct xpack_compressor *c)
+{
+	return c->stats_clock ? (*c->stats_clock)() : 0;
+}
+
+/*
+ * Add the data of a block to the checksum, if it is enabled.  The parser has
+ * just gone over the data, so it is still in the cache.  Preprocessed data is
+ * checksummed before it is preprocessed instead; see xpack_compress().
+ */
+static forceinline void
+checksum_block(struct xpack_compressor *c, const u8 *in_block_begin,
+	       u32 block_size)
+{
+#ifdef ENABLE_PREPROCESSING
+	if (c->preprocessed)
+		return;
+#endif
+	if (c->checksum_enabled)
+		c->checksum = xpack_crc32c(c->checksum, in_block_begin,
+					   block_size);
+}
+
+/*
+ * Report the statistics of a block that was just written, given when its
+ * writing started.  The items of a compressed block are still in the
+ * compressor; an uncompressed block has none.
+ */
+static void
+report_block(struct xpack_compressor *c, int block_type, u32 block_size,
+	     size_t compressed_size, size_t header_size,
+	     unsigned long long encode_start_time)
+{
+	struct xpack_block_stats stats;
+	const unsigned long long now = read_stats_clock(c);
+	unsigned i;
+
+	stats.block_type = block_type;
+	stats.uncompressed_size = block_size;
+	stats.compressed_size = compressed_size;
+	stats.header_size = header_size;
+	stats.extra_bytes_size = 0;
+	stats.num_literals = 0;
+	stats.num_matches = 0;
+	stats.num_repeat_offset_matches = 0;
+	if (block_type != BLOCKTYPE_UNCOMPRESSED) {
+		stats.extra_bytes_size = c->num_extra_bytes;
+		stats.num_literals = c->num_literals;
+		/* Don't count the final literal run, which has no match. */
+		stats.num_matches = c->num_matches - 1;
+		for (i = 0; i < NUM_REPS; i++)
+			stats.num_repeat_offset_matches += c->freqs.offset[i];
+	}
+	stats.parse_time = encode_start_time - c->block_start_time;
+	stats.encode_time = now - encode_start_time;
+	c->block_start_time = now;
+
+	(*c->stats_callback)(&stats, c->stats_private_data);
+}
+
 static size_t
 write_block(struct xpack_compressor *c, void *out, size_t out_nbytes_avail,
-	    u32 block_size, u32 last_litrunlen, bool is_final_block)
+	    const u8 *in_block_begin, u32 block_size, u32 last_litrunlen,
+	    bool is_final_block)
 {
+	const unsigned long long encode_start_time = c->stats_callback ?
+						     read_stats_clock(c) : 0;
 	struct header_ostream os;
 	size_t header_size;
 	size_t items_size;
 	int block_type;
-	unsigned num_state_counts;
+	u16 *new_state_counts;
+	unsigned literal_field;
+	unsigned litrunlen_field;
+	unsigned length_field;
+	unsigned offset_field;
+	unsigned aligned_field;
 	unsigned order;
 
+	checksum_block(c, in_block_begin, block_size);
+
 	/* Final litrunlen */
 	record_litrunlen(c, &c->matches[c->num_matches], last_litrunlen);
 	c->matches[c->num_matches].offset_sym = MAX_OFFSET_ALPHABET_SIZE;
@@ -1171,63 +1800,91 @@ write_block(struct xpack_compressor *c, void *out, size_t out_nbytes_avail,
 	header_ostream_write_bits(&os, is_final_block, 1);
 
 	/* Output the block type */
-	header_ostream_write_bits(&os, block_type, NUM_BLOCKTYPE_BITS);
+#ifdef ENABLE_PREPROCESSING
+	if (c->preprocessed)
+		header_ostream_write_bits(&os,
+					  block_type |
+					  BLOCKTYPE_FLAG_PREPROCESSED,
+					  NUM_BLOCKTYPE_BITS);
+	else
+#endif
+		header_ostream_write_bits(&os, block_type, NUM_BLOCKTYPE_BITS);
 
 	/* Output the block size */
 	write_block_size(&os, block_size);
 
-	/* Compute FSE state counts for each alphabet */
-
-	c->codes.log2_num_literal_states =
-		choose_state_counts(c->freqs.literal,
-				    LITERAL_ALPHABET_SIZE,
-				    MAX_LOG2_NUM_LITERAL_STATES,
-				    c->codes.literal_state_counts);
-
-	c->codes.log2_num_litrunlen_states =
-		choose_state_counts(c->freqs.litrunlen,
-				    LITRUNLEN_ALPHABET_SIZE,
-				    MAX_LOG2_NUM_LITRUNLEN_STATES,
-				    c->codes.litrunlen_state_counts);
-
-	c->codes.log2_num_length_states =
-		choose_state_counts(c->freqs.length,
-				    LENGTH_ALPHABET_SIZE,
-				    MAX_LOG2_NUM_LENGTH_STATES,
-				    c->codes.length_state_counts);
-
-	c->codes.log2_num_offset_states =
-		choose_state_counts(c->freqs.offset,
-				    MAX_OFFSET_ALPHABET_SIZE,
-				    MAX_LOG2_NUM_OFFSET_STATES,
-				    c->codes.offset_state_counts);
-
+	/*
+	 * Choose the FSE state counts for each alphabet, or a table to reuse,
+	 * and output the log2_num_states field for each alphabet followed by
+	 * the state counts which must be sent.
+	 */
+	new_state_counts = c->new_state_counts;
+
+	literal_field =
+		choose_block_state_counts(c->freqs.literal,
+					  LITERAL_ALPHABET_SIZE,
+					  MAX_LOG2_NUM_LITERAL_STATES,
+					  NULL, 0,
+					  &new_state_counts,
+					  c->codes.literal_state_counts,
+					  &c->codes.log2_num_literal_states,
+					  &c->codes.literal_reusable);
+
+	litrunlen_field =
+		choose_block_state_counts(c->freqs.litrunlen,
+					  LITRUNLEN_ALPHABET_SIZE,
+					  MAX_LOG2_NUM_LITRUNLEN_STATES,
+					  predefined_litrunlen_state_counts,
+					  LOG2_NUM_PREDEFINED_LITRUNLEN_STATES,
+					  &new_state_counts,
+					  c->codes.litrunlen_state_counts,
+					  &c->codes.log2_num_litrunlen_states,
+					  &c->codes.litrunlen_reusable);
+
+	length_field =
+		choose_block_state_counts(c->freqs.length,
+					  LENGTH_ALPHABET_SIZE,
+					  MAX_LOG2_NUM_LENGTH_STATES,
+					  predefined_length_state_counts,
+					  LOG2_NUM_PREDEFINED_LENGTH_STATES,
+					  &new_state_counts,
+					  c->codes.length_state_counts,
+					  &c->codes.log2_num_length_states,
+					  &c->codes.length_reusable);
+
+	offset_field =
+		choose_block_state_counts(c->freqs.offset,
+					  MAX_OFFSET_ALPHABET_SIZE,
+					  MAX_LOG2_NUM_OFFSET_STATES,
+					  predefined_offset_state_counts,
+					  LOG2_NUM_PREDEFINED_OFFSET_STATES,
+					  &new_state_counts,
+					  c->codes.offset_state_counts,
+					  &c->codes.log2_num_offset_states,
+					  &c->codes.offset_reusable);
+
+	aligned_field = REPEAT_LOG2_NUM_STATES;
 	if (block_type == BLOCKTYPE_ALIGNED) {
-		c->codes.log2_num_aligned_states =
-			choose_state_counts(c->freqs.aligned,
-					    ALIGNED_ALPHABET_SIZE,
-					    MAX_LOG2_NUM_ALIGNED_STATES,
-					    c->codes.aligned_state_counts);
-	}
-
-	/* Output the FSE state counts for each alphabet */
-	header_ostream_write_bits(&os, c->codes.log2_num_literal_states, 4);
-	header_ostream_write_bits(&os, c->codes.log2_num_litrunlen_states, 4);
-	header_ostream_write_bits(&os, c->codes.log2_num_length_states, 4);
-	header_ostream_write_bits(&os, c->codes.log2_num_offset_states, 4);
-	if (block_type == BLOCKTYPE_ALIGNED)
-		header_ostream_write_bits(&os, c->codes.log2_num_aligned_states, 4);
+		aligned_field =
+			choose_block_state_counts(c->freqs.aligned,
+						  ALIGNED_ALPHABET_SIZE,
+						  MAX_LOG2_NUM_ALIGNED_STATES,
+						  NULL, 0,
+						  &new_state_counts,
+						  c->codes.aligned_state_counts,
+						  &c->codes.log2_num_aligned_states,
+						  &c->codes.aligned_reusable);
+	}
 
-#ifndef _MSC_VER
-	STATIC_ASSERT(offsetof(struct codes,
-			       aligned_state_counts[ALIGNED_ALPHABET_SIZE]) ==
-		      offsetof(struct codes, state_counts) + sizeof(c->codes.state_counts));
-#endif
-	num_state_counts = ARRAY_LEN(c->codes.state_counts);
-	if (block_type != BLOCKTYPE_ALIGNED)
-		num_state_counts -= ALIGNED_ALPHABET_SIZE;
+	header_ostream_write_bits(&os, literal_field, 4);
+	header_ostream_write_bits(&os, litrunlen_field, 4);
+	header_ostream_write_bits(&os, length_field, 4);
+	header_ostream_write_bits(&os, offset_field, 4);
+	if (block_type == BLOCKTYPE_ALIGNED)
+		header_ostream_write_bits(&os, aligned_field, 4);
 
-	write_state_counts(&os, c->codes.state_counts, num_state_counts);
+	write_state_counts(&os, c->new_state_counts,
+			   new_state_counts - c->new_state_counts);
 
 	/* Output the number of extra bytes */
 	order = bsr32(c->num_extra_bytes + 1);
@@ -1247,33 +1904,68 @@ write_block(struct xpack_compressor *c, void *out, size_t out_nbytes_avail,
 	memcpy((u8 *)out + header_size, c->extra_bytes, c->num_extra_bytes);
 	header_size += c->num_extra_bytes;
 
-	/* Build the FSE encoding tables for each alphabet */
+	/*
+	 * Build the FSE encoding tables for each alphabet which has new state
+	 * counts, or copy the prebuilt ones for predefined state counts.
+	 */
 
-	build_fse_encoding_tables(c, c->codes.literal_sym_encinfo,
-				  c->codes.literal_next_statesx,
-				  c->codes.literal_state_counts,
-				  LITERAL_ALPHABET_SIZE,
-				  c->codes.log2_num_literal_states);
+	if (literal_field <= MAX_LOG2_NUM_LITERAL_STATES) {
+		build_fse_encoding_tables(c, c->codes.literal_sym_encinfo,
+					  c->codes.literal_next_statesx,
+					  c->codes.literal_state_counts,
+					  LITERAL_ALPHABET_SIZE,
+					  c->codes.log2_num_literal_states);
+	}
 
-	build_fse_encoding_tables(c, c->codes.litrunlen_sym_encinfo,
-				  c->codes.litrunlen_next_statesx,
-				  c->codes.litrunlen_state_counts,
-				  LITRUNLEN_ALPHABET_SIZE,
-				  c->codes.log2_num_litrunlen_states);
+	if (litrunlen_field == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(c->codes.litrunlen_sym_encinfo,
+		       c->predefined_codes.litrunlen_sym_encinfo,
+		       sizeof(c->codes.litrunlen_sym_encinfo));
+		memcpy(c->codes.litrunlen_next_statesx,
+		       c->predefined_codes.litrunlen_next_statesx,
+		       sizeof(c->codes.litrunlen_next_statesx[0]) <<
+			LOG2_NUM_PREDEFINED_LITRUNLEN_STATES);
+	} else if (litrunlen_field <= MAX_LOG2_NUM_LITRUNLEN_STATES) {
+		build_fse_encoding_tables(c, c->codes.litrunlen_sym_encinfo,
+					  c->codes.litrunlen_next_statesx,
+					  c->codes.litrunlen_state_counts,
+					  LITRUNLEN_ALPHABET_SIZE,
+					  c->codes.log2_num_litrunlen_states);
+	}
 
-	build_fse_encoding_tables(c, c->codes.length_sym_encinfo,
-				  c->codes.length_next_statesx,
-				  c->codes.length_state_counts,
-				  LENGTH_ALPHABET_SIZE,
-				  c->codes.log2_num_length_states);
+	if (length_field == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(c->codes.length_sym_encinfo,
+		       c->predefined_codes.length_sym_encinfo,
+		       sizeof(c->codes.length_sym_encinfo));
+		memcpy(c->codes.length_next_statesx,
+		       c->predefined_codes.length_next_statesx,
+		       sizeof(c->codes.length_next_statesx[0]) <<
+			LOG2_NUM_PREDEFINED_LENGTH_STATES);
+	} else if (length_field <= MAX_LOG2_NUM_LENGTH_STATES) {
+		build_fse_encoding_tables(c, c->codes.length_sym_encinfo,
+					  c->codes.length_next_statesx,
+					  c->codes.length_state_counts,
+					  LENGTH_ALPHABET_SIZE,
+					  c->codes.log2_num_length_states);
+	}
 
-	build_fse_encoding_tables(c, c->codes.offset_sym_encinfo,
-				  c->codes.offset_next_statesx,
-				  c->codes.offset_state_counts,
-				  MAX_OFFSET_ALPHABET_SIZE,
-				  c->codes.log2_num_offset_states);
+	if (offset_field == PREDEFINED_LOG2_NUM_STATES) {
+		memcpy(c->codes.offset_sym_encinfo,
+		       c->predefined_codes.offset_sym_encinfo,
+		       sizeof(c->codes.offset_sym_encinfo));
+		memcpy(c->codes.offset_next_statesx,
+		       c->predefined_codes.offset_next_statesx,
+		       sizeof(c->codes.offset_next_statesx[0]) <<
+			LOG2_NUM_PREDEFINED_OFFSET_STATES);
+	} else if (offset_field <= MAX_LOG2_NUM_OFFSET_STATES) {
+		build_fse_encoding_tables(c, c->codes.offset_sym_encinfo,
+					  c->codes.offset_next_statesx,
+					  c->codes.offset_state_counts,
+					  MAX_OFFSET_ALPHABET_SIZE,
+					  c->codes.log2_num_offset_states);
+	}
 
-	if (block_type == BLOCKTYPE_ALIGNED) {
+	if (aligned_field <= MAX_LOG2_NUM_ALIGNED_STATES) {
 		build_fse_encoding_tables(c, c->codes.aligned_sym_encinfo,
 					  c->codes.aligned_next_statesx,
 					  c->codes.aligned_state_counts,
@@ -1289,25 +1981,214 @@ write_block(struct xpack_compressor *c, void *out, size_t out_nbytes_avail,
 	if (items_size == 0)
 		return 0;
 
+	if (c->stats_callback)
+		report_block(c, block_type, block_size,
+			     header_size + items_size,
+			     header_size - c->num_extra_bytes,
+			     encode_start_time);
+
 	return header_size + items_size;
 }
 
+/*
+ * Output the data as a sequence of uncompressed blocks.  If @in_nbytes is 0,
+ * then a single empty block is output; this is only useful as a final block.
+ * Return the number of bytes written, or 0 if there was not enough space.
+ */
+static size_t
+write_uncompressed_blocks(struct xpack_compressor *c,
+			  const u8 *in, size_t in_nbytes,
+			  u8 *out, size_t out_nbytes_avail, bool is_final_data)
+{
+	u8 * const out_begin = out;
+	u8 * out_next = out_begin;
+	u8 * const out_end = out_begin + out_nbytes_avail;
+
+	do {
+		u32 block_size = MIN(in_nbytes, MAX_BLOCK_SIZE);
+		struct header_ostream os;
+		size_t header_size;
+		unsigned long long encode_start_time = 0;
+
+		if (c->stats_callback) {
+			encode_start_time = read_stats_clock(c);
+			c->block_start_time = encode_start_time;
+		}
+
+		header_ostream_init(&os, out_next, out_end - out_next);
+		header_ostream_write_bits(&os,
+					  is_final_data && block_size == in_nbytes,
+					  1);
+		header_ostream_write_bits(&os, BLOCKTYPE_UNCOMPRESSED,
+					  NUM_BLOCKTYPE_BITS);
+		write_block_size(&os, block_size);
+		header_size = header_ostream_flush(&os);
+		if (header_size == 0 ||
+		    block_size > out_end - out_next - header_size)
+			return 0;
+		out_next += header_size;
+
+		memcpy(out_next, in, block_size);
+		checksum_block(c, in, block_size);
+		out_next += block_size;
+		in += block_size;
+		in_nbytes -= block_size;
+
+		if (c->stats_callback)
+			report_block(c, BLOCKTYPE_UNCOMPRESSED, block_size,
+				     header_size + block_size, header_size,
+				     encode_start_time);
+	} while (in_nbytes != 0);
+
+	return out_next - out_begin;
+}
+
+/*
+ * Return the 'cutoff' to pass to hc_matchfinder_longest_match() so that no
+ * match has an offset of 'window_size' or greater.
+ */
+#define MATCH_CUTOFF(cur_pos, window_size)	\
+	((u32)(cur_pos) > (window_size) ? (u32)(cur_pos) - (window_size) : 0)
+
+/*
+ * Record the offset of a match chosen by a greedy parser: as a repeat offset if
+ * it is in the recent offsets queue, otherwise as an explicit offset.  Then
+ * update the queue.
+ */
+static forceinline void
+record_greedy_offset(struct xpack_compressor *c, struct match *match,
+		     u32 offset)
+{
+	u32 * const recent_offsets = c->recent_offsets;
+
+	STATIC_ASSERT(NUM_REPS >= 1 && NUM_REPS <= 4);
+
+	if (offset == recent_offsets[0]) {
+		record_repeat_offset(c, match, 0);
+	}
+#if NUM_REPS >= 2
+	else if (offset == recent_offsets[1]) {
+		recent_offsets[1] = recent_offsets[0];
+		record_repeat_offset(c, match, 1);
+	}
+#endif
+#if NUM_REPS >= 3
+	else if (offset == recent_offsets[2]) {
+		recent_offsets[2] = recent_offsets[0];
+		record_repeat_offset(c, match, 2);
+	}
+#endif
+#if NUM_REPS >= 4
+	else if (offset == recent_offsets[3]) {
+		recent_offsets[3] = recent_offsets[0];
+		record_repeat_offset(c, match, 3);
+	}
+#endif
+	else {
+		record_explicit_offset(c, match, offset);
+	#if NUM_REPS >= 4
+		recent_offsets[3] = recent_offsets[2];
+	#endif
+	#if NUM_REPS >= 3
+		recent_offsets[2] = recent_offsets[1];
+	#endif
+	#if NUM_REPS >= 2
+		recent_offsets[1] = recent_offsets[0];
+	#endif
+	}
+	recent_offsets[0] = offset;
+}
+
+/*
+ * After a long distance match, its offset is tried at each position for this
+ * many more bytes, so that it can continue past a few changed bytes.  Only the
+ * near-optimal parser tries repeat offsets at every position by itself.
+ */
+#define LDM_RETRY_LEN		64
+
+/*
+ * Move on to the first long distance match which doesn't end before @pos, and
+ * return the rest of it if it covers @pos.  Otherwise, return the match with
+ * the offset of the last one, if it is still worth trying.
+ */
+static u32
+next_long_distance_match(struct xpack_compressor *c, u32 pos, u32 max_len,
+			 u32 *offset_ret)
+{
+	const struct ldm_match *m = c->ldm_next;
+	u32 len = 0;
+
+	while (m != c->ldm_end && m->pos + m->length <= pos) {
+		c->ldm_retry_offset = m->offset;
+		c->ldm_retry_end = m->pos + m->length + LDM_RETRY_LEN;
+		m++;
+	}
+	c->ldm_next = m;
+
+	if (m != c->ldm_end && pos >= m->pos) {
+		len = MIN(m->pos + m->length - pos, max_len);
+		*offset_ret = m->offset;
+	} else if (pos < c->ldm_retry_end) {
+		const u8 *in_next = &c->in_buffer[pos];
+
+		len = lz_extend(in_next, in_next - c->ldm_retry_offset, 0,
+				max_len);
+		if (len != 0)
+			c->ldm_retry_end = pos + len + LDM_RETRY_LEN;
+		*offset_ret = c->ldm_retry_offset;
+	}
+
+	if (pos < c->ldm_retry_end)
+		c->ldm_next_pos = pos + 1;
+	else
+		c->ldm_next_pos = (m != c->ldm_end) ? m->pos : UINT32_MAX;
+	return len >= 4 ? len : 0;
+}
+
+/*
+ * Return the length of the long distance match at the current position, i.e.
+ * the rest of a match found by the long distance matchfinder or its
+ * continuation, limited to @max_len, and its offset in *offset_ret.  Return 0
+ * if there is none of at least 4 bytes.  The positions asked about must not
+ * decrease.  The parsers use such a match instead of their own if it's longer.
+ */
+static forceinline u32
+long_distance_match(struct xpack_compressor *c, const u8 *in_next, u32 max_len,
+		    u32 *offset_ret)
+{
+	const u32 pos = in_next - c->in_buffer;
+
+	if (likely(pos < c->ldm_next_pos))
+		return 0;
+	return next_long_distance_match(c, pos, max_len, offset_ret);
+}
+
+/*
+ * The number of literals after which compress_fastest() starts skipping
+ * positions: after each additional FASTEST_SKIP_TRIGGER literals in a row, it
+ * searches one position fewer out of each run of bytes.
+ */
+#define FASTEST_SKIP_TRIGGER	64
+
+/*
+ * The fastest parser, which is greedy and uses the hash table matchfinder.  On
+ * incompressible data, it searches fewer and fewer positions the longer the
+ * current literal run gets, so that it gets faster rather than slower.
+ */
 static size_t
-compress_greedy(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
+compress_fastest(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
 {
 	u8 * const out_begin = out;
 	u8 * out_next = out_begin;
 	u8 * const out_end = out_begin + out_nbytes_avail;
 	const u8 * const in_begin = c->in_buffer;
-	const u8 *	 in_next = in_begin;
+	const u8 *	 in_next = in_begin + c->in_start;
 	const u8 * const in_end  = in_begin + c->in_nbytes;
-	u32 max_len = MIN(c->in_nbytes, UINT32_MAX);
-	u32 nice_len = MIN(c->nice_match_length, max_len);
-	u32 next_hashes[2] = {0, 0};
-	u32 recent_offsets[NUM_REPS];
+	const u32 window_size = c->window_size;
+	u32 next_hash = 0;
 
-	init_recent_offsets(recent_offsets);
-	hc_matchfinder_init(&c->hc_mf);
+	if (in_end - in_next >= 4)
+		next_hash = ht_matchfinder_hash(&c->ht_mf, in_next);
 
 	do {
 		/* Starting a new block */
@@ -1323,95 +2204,68 @@ compress_greedy(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
 		begin_block(c);
 
 		do {
-			if (unlikely(max_len > in_end - in_next)) {
-				max_len = in_end - in_next;
-				nice_len = MIN(max_len, nice_len);
-			}
+			struct match *match;
+			u32 ldm_len;
+			u32 ldm_offset;
 
-			/* Find the longest match at the current position. */
-
-			length = hc_matchfinder_longest_match(&c->hc_mf,
+			length = ht_matchfinder_longest_match(&c->ht_mf,
 							      in_begin,
 							      in_next - in_begin,
-							#if MIN_MATCH_LEN == 4
-							      3,
-							#else
-							      2,
-							#endif
-							      max_len,
-							      nice_len,
-							      c->max_search_depth,
-							      next_hashes,
+							      MIN(in_end - in_next,
+								  MAX_COMPRESSOR_MATCH_LEN),
+							      MATCH_CUTOFF(in_next - in_begin,
+									   window_size),
+							      &next_hash,
 							      &offset);
-		#if MIN_MATCH_LEN == 4
-			if (length < 4) {
-		#else
-			if (length < 3 || (length == 3 && offset >= 4096)) {
-		#endif
-				/* Literal */
-				observe_literal(&c->split_stats, *in_next);
-				record_literal(c, *in_next);
-				in_next++;
-				litrunlen++;
-			} else {
-				/* Match */
-				struct match *match = &c->matches[c->num_matches++];
-
-				STATIC_ASSERT(NUM_REPS >= 1 && NUM_REPS <= 4);
-
-				observe_match(&c->split_stats, length);
-
-				if (offset == recent_offsets[0]) {
-					record_repeat_offset(c, match, 0);
-				}
-			#if NUM_REPS >= 2
-				else if (offset == recent_offsets[1]) {
-					recent_offsets[1] = recent_offsets[0];
-					record_repeat_offset(c, match, 1);
-				}
-			#endif
-			#if NUM_REPS >= 3
-				else if (offset == recent_offsets[2]) {
-					recent_offsets[2] = recent_offsets[0];
-					record_repeat_offset(c, match, 2);
-				}
-			#endif
-			#if NUM_REPS >= 4
-				else if (offset == recent_offsets[3]) {
-					recent_offsets[3] = recent_offsets[0];
-					record_repeat_offset(c, match, 3);
-				}
-			#endif
-				else {
-					record_explicit_offset(c, match, offset);
-				#if NUM_REPS >= 4
-					recent_offsets[3] = recent_offsets[2];
-				#endif
-				#if NUM_REPS >= 3
-					recent_offsets[2] = recent_offsets[1];
-				#endif
-				#if NUM_REPS >= 2
-					recent_offsets[1] = recent_offsets[0];
-				#endif
+			ldm_len = long_distance_match(c, in_next,
+						      MIN(in_end - in_next,
+							  MAX_COMPRESSOR_MATCH_LEN),
+						      &ldm_offset);
+			if (ldm_len > length) {
+				length = ldm_len;
+				offset = ldm_offset;
+			}
+			if (length == 0) {
+				/* Literal, possibly followed by more literals
+				 * at positions that won't be searched */
+				u32 step = 1 + litrunlen / FASTEST_SKIP_TRIGGER;
+
+				if (step > 1) {
+					step = MIN(step, in_max_block_end - in_next);
+					litrunlen += step;
+					do {
+						record_literal(c, *in_next++);
+					} while (--step);
+					if (in_end - in_next >= 4)
+						next_hash = ht_matchfinder_hash(&c->ht_mf,
+										in_next);
+				} else {
+					record_literal(c, *in_next++);
+					litrunlen++;
 				}
-				recent_offsets[0] = offset;
-				record_litrunlen(c, match, litrunlen);
-				record_length(c, match, length);
-
-				in_next = hc_matchfinder_skip_positions(&c->hc_mf,
-									in_begin,
-									in_next + 1 - in_begin,
-									in_end - in_begin,
-									length - 1,
-									next_hashes);
-				litrunlen = 0;
+				continue;
 			}
+
+			/* Match */
+			match = &c->matches[c->num_matches++];
+			record_greedy_offset(c, match, offset);
+			record_litrunlen(c, match, litrunlen);
+			record_length(c, match, length);
+			litrunlen = 0;
+
+			in_next = ht_matchfinder_skip_positions(&c->ht_mf,
+								in_begin,
+								in_next + 1 - in_begin,
+								in_end - in_begin,
+								length - 1,
+								&next_hash);
 		} while (in_next < in_max_block_end &&
-			 !should_end_block(&c->split_stats, in_block_begin, in_next, in_end));
+			 !should_end_block(c, in_block_begin, in_next, in_end));
 
 		nbytes = write_block(c, out_next, out_end - out_next,
-				     in_next - in_block_begin, litrunlen,
-				     in_next == in_end);
+				     in_block_begin, in_next - in_block_begin,
+				     litrunlen,
+				     in_next == in_end && c->is_final_data);
 		if (nbytes == 0)
 			return 0;
 
@@ -1431,7 +2285,7 @@ compress_greedy(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
  * If a match of at least MIN_MATCH_LEN bytes is found, then return its length
  * and set *rep_max_idx_ret to the index of its offset in @queue.
  */
-static u32
+static forceinline u32
 find_longest_repeat_offset_match(const u8 * const in_next,
 				 const u32 max_len,
 				 const u32 recent_offsets[],
@@ -1519,240 +2373,565 @@ repeat_offset_match_score(u32 rep_len, unsigned rep_idx)
 	return rep_len + 3;
 }
 
-static size_t
-compress_lazy(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
-{
-	u8 * const out_begin = out;
-	u8 * out_next = out_begin;
-	u8 * const out_end = out_begin + out_nbytes_avail;
-	const u8 * const in_begin = c->in_buffer;
-	const u8 *	 in_next = in_begin;
-	const u8 * const in_end  = in_begin + c->in_nbytes;
-	u32 max_len = MIN(c->in_nbytes, UINT32_MAX);
-	u32 nice_len = MIN(c->nice_match_length, max_len);
-	u32 next_hashes[2] = {0, 0};
-	u32 recent_offsets[NUM_REPS];
+#define GREEDY_FUNCNAME compress_greedy
+#define LAZY_FUNCNAME compress_lazy
+#define ATTRIBUTES
+#include "compress_impl.h"
+#undef GREEDY_FUNCNAME
+#undef LAZY_FUNCNAME
+#undef ATTRIBUTES
+
+#if X86_CPU_FEATURES_ENABLED && \
+	COMPILER_SUPPORTS_BMI2_TARGET && !defined(__BMI2__)
+#  define GREEDY_FUNCNAME compress_greedy_bmi2
+#  define LAZY_FUNCNAME compress_lazy_bmi2
+#  define ATTRIBUTES __attribute__((target("bmi2")))
+#  include "compress_impl.h"
+#  undef GREEDY_FUNCNAME
+#  undef LAZY_FUNCNAME
+#  undef ATTRIBUTES
+#  define DISPATCH_ENABLED 1
+#else
+#  define DISPATCH_ENABLED 0
+#endif
 
-	init_recent_offsets(recent_offsets);
-	hc_matchfinder_init(&c->hc_mf);
+/******************************************************************************/
 
-	do {
-		/* Starting a new block */
+/*
+ * Near-optimal parsing.
+ *
+ * The near-optimal parser first finds all the matches for a block with the
+ * binary trees matchfinder and caches them.  Then, it computes the cheapest
+ * path through the graph of possible parses of the block, where each position
+ * is a node and each literal and match is an edge.  Since the entropy codes
+ * depend on the parse, the costs of the symbols are only estimates: the first
+ * pass uses default costs, and each later pass uses costs derived from the FSE
+ * state counts that would be chosen for the previous pass's parse.
+ *
+ * The path is computed in a single forward pass over the nodes.  This isn't
+ * truly optimal because the recent offsets queue and the literal run length at
+ * each node are those of the cheapest path to that node, which a more
+ * expensive path could have continued more cheaply.  But it works well.
+ */
 
-		const u8 * const in_block_begin = in_next;
-		const u8 * const in_max_block_end =
-			in_next + MIN(SOFT_MAX_BLOCK_LENGTH, in_end - in_next);
-		u32 cur_len;
-		u32 cur_offset;
-		u32 cur_offset_data;
-		u32 cur_score;
-		u32 next_len;
-		u32 next_offset;
-		u32 next_offset_data;
-		u32 next_score;
-		u32 rep_max_len;
-		unsigned rep_max_idx;
-		u32 rep_score;
-		u32 skip_len;
-		u32 litrunlen = 0;
-		size_t nbytes;
-		struct match *match;
+/*
+ * Set the costs of the symbols in an alphabet from the state counts that would
+ * be chosen for the given symbol frequencies.  A symbol that has 'count' of the
+ * 'num_states' states costs log2(num_states / count) bits.  A symbol with no
+ * states is given the cost it would have with half a state.
+ */
+static void
+set_alphabet_costs(const u32 freqs[], unsigned alphabet_size,
+		   unsigned max_log2_num_states, u16 state_counts[],
+		   u32 costs[])
+{
+	unsigned log2_num_states;
+	unsigned sym;
 
-		begin_block(c);
+	log2_num_states = choose_state_counts(freqs, alphabet_size,
+					      max_log2_num_states,
+					      state_counts);
 
-		do {
-			if (unlikely(max_len > in_end - in_next)) {
-				max_len = in_end - in_next;
-				nice_len = MIN(max_len, nice_len);
-			}
+	for (sym = 0; sym < alphabet_size; sym++) {
+		if (state_counts[sym] != 0)
+			costs[sym] = (log2_num_states * BIT_COST) -
+				     log2_cost(state_counts[sym]);
+		else
+			costs[sym] = (log2_num_states + 1) * BIT_COST;
+	}
+}
 
-			/* Find the longest match at the current position. */
+/* Add the cost of the extra offset bits to each explicit offset symbol. */
+static void
+add_extra_offset_bit_costs(struct costs *costs)
+{
+	unsigned offset_log2;
 
-			cur_len = hc_matchfinder_longest_match(&c->hc_mf,
-							       in_begin,
-							       in_next - in_begin,
-							#if MIN_MATCH_LEN == 4
-							       3,
-							#else
-							       2,
-							#endif
-							       max_len,
-							       nice_len,
-							       c->max_search_depth,
-							       next_hashes,
-							       &cur_offset);
-		#if MIN_MATCH_LEN == 4
-			if (cur_len < 4) {
-		#else
-			if (cur_len < 3 || (cur_len == 3 && cur_offset >= 4096)) {
-		#endif
-				/*
-				 * There was no match found, or the only match
-				 * found was a distant length 3 match.  Output a
-				 * literal.
-				 */
-				observe_literal(&c->split_stats, *in_next);
-				record_literal(c, *in_next);
-				in_next++;
-				litrunlen++;
-				continue;
-			}
+	for (offset_log2 = 0;
+	     offset_log2 < MAX_OFFSET_ALPHABET_SIZE - NUM_REPS; offset_log2++)
+		costs->offset[NUM_REPS + offset_log2] += offset_log2 * BIT_COST;
+}
 
-			observe_match(&c->split_stats, cur_len);
+/*
+ * Add the decode speed's estimate of the time to decompress each literal and
+ * match to the costs.  Each match's is added to its offset symbol, since every
+ * match has exactly one.
+ */
+static void
+add_decode_time_costs(const struct xpack_compressor *c, struct costs *costs)
+{
+	unsigned sym;
 
-			if (cur_offset == recent_offsets[0]) {
-				in_next++;
-				cur_offset_data = 0;
-				skip_len = cur_len - 1;
-				goto choose_cur_match;
-			}
+	for (sym = 0; sym < LITERAL_ALPHABET_SIZE; sym++)
+		costs->literal[sym] += c->literal_time_cost;
+	for (sym = 0; sym < MAX_OFFSET_ALPHABET_SIZE; sym++)
+		costs->offset[sym] += c->match_time_cost;
+}
 
-			cur_offset_data = cur_offset + (NUM_REPS - 1);
-			cur_score = explicit_offset_match_score(cur_len, cur_offset_data);
+/* Set the costs for the next pass from the symbol frequencies of this pass. */
+static void
+set_costs_from_freqs(struct xpack_compressor *c)
+{
+	struct costs *costs = &c->near_optimal->costs;
 
-			/* Consider a repeat offset match. */
-			rep_max_len = find_longest_repeat_offset_match(in_next,
-								       in_end - in_next,
-								       recent_offsets,
-								       &rep_max_idx);
-			in_next++;
+	set_alphabet_costs(c->freqs.literal, LITERAL_ALPHABET_SIZE,
+			   MAX_LOG2_NUM_LITERAL_STATES,
+			   c->new_state_counts, costs->literal);
 
-			if (rep_max_len >= 3 &&
-			    (rep_score = repeat_offset_match_score(rep_max_len,
-								   rep_max_idx)) >= cur_score)
-			{
-				cur_len = rep_max_len;
-				cur_offset_data = rep_max_idx;
-				skip_len = rep_max_len - 1;
-				goto choose_cur_match;
-			}
+	set_alphabet_costs(c->freqs.litrunlen, LITRUNLEN_ALPHABET_SIZE,
+			   MAX_LOG2_NUM_LITRUNLEN_STATES,
+			   c->new_state_counts, costs->litrunlen);
 
-		have_cur_match:
+	set_alphabet_costs(c->freqs.length, LENGTH_ALPHABET_SIZE,
+			   MAX_LOG2_NUM_LENGTH_STATES,
+			   c->new_state_counts, costs->length);
 
-			/* We have a match at the current position. */
+	set_alphabet_costs(c->freqs.offset, MAX_OFFSET_ALPHABET_SIZE,
+			   MAX_LOG2_NUM_OFFSET_STATES,
+			   c->new_state_counts, costs->offset);
+	add_extra_offset_bit_costs(costs);
+	add_decode_time_costs(c, costs);
+}
 
-			/* If we have a very long match, choose it immediately. */
-			if (cur_len >= nice_len) {
-				skip_len = cur_len - 1;
-				goto choose_cur_match;
-			}
+/*
+ * Set the costs for the first pass over a block.  The literal costs come from
+ * the frequencies of all the bytes in the block; the other costs are defaults
+ * where smaller values are cheaper.  With a preset dictionary, the frequencies
+ * estimated for data following it are used as well, since a short buffer says
+ * little about its own statistics.
+ */
+static void
+set_initial_costs(struct xpack_compressor *c, const u8 *in_block_begin,
+		  u32 block_length)
+{
+	struct costs *costs = &c->near_optimal->costs;
+	unsigned sym;
+	u32 i;
+
+	if (c->dict && c->dict->has_freqs) {
+		c->freqs = c->dict->freqs;
+		for (i = 0; i < block_length; i++)
+			c->freqs.literal[in_block_begin[i]]++;
+		set_costs_from_freqs(c);
+		return;
+	}
 
-			/* See if there's a better match at the next position. */
+	memset(c->freqs.literal, 0, sizeof(c->freqs.literal));
+	for (i = 0; i < block_length; i++)
+		c->freqs.literal[in_block_begin[i]]++;
+	set_alphabet_costs(c->freqs.literal, LITERAL_ALPHABET_SIZE,
+			   MAX_LOG2_NUM_LITERAL_STATES,
+			   c->new_state_counts, costs->literal);
+
+	for (sym = 0; sym < LITRUNLEN_ALPHABET_SIZE; sym++)
+		costs->litrunlen[sym] = (2 + sym / 2) * BIT_COST;
+
+	for (sym = 0; sym < LENGTH_ALPHABET_SIZE; sym++)
+		costs->length[sym] = (3 + sym / 4) * BIT_COST;
+
+	for (sym = 0; sym < NUM_REPS; sym++)
+		costs->offset[sym] = (2 + sym) * BIT_COST;
+	for (; sym < MAX_OFFSET_ALPHABET_SIZE; sym++)
+		costs->offset[sym] = 5 * BIT_COST;
+	add_extra_offset_bit_costs(costs);
+	add_decode_time_costs(c, costs);
+}
 
-			if (unlikely(max_len > in_end - in_next)) {
-				max_len = in_end - in_next;
-				nice_len = MIN(max_len, nice_len);
-			}
+/* Return the cost of a literal run length, including any extra bytes. */
+static forceinline u32
+litrunlen_cost(const struct costs *costs, u32 litrunlen)
+{
+	if (litrunlen < LITRUNLEN_ALPHABET_SIZE - 1)
+		return costs->litrunlen[litrunlen];
+	litrunlen -= LITRUNLEN_ALPHABET_SIZE - 1;
+	return costs->litrunlen[LITRUNLEN_ALPHABET_SIZE - 1] +
+	       (litrunlen < 0xFF ? 8 : 32) * BIT_COST;
+}
 
-			next_len = hc_matchfinder_longest_match(&c->hc_mf,
-								in_begin,
-								in_next - in_begin,
-							#if MIN_MATCH_LEN == 2
-								cur_len - 2,
-							#else
-								cur_len - 1,
-							#endif
-								max_len,
-								nice_len,
-								c->max_search_depth / 2,
-								next_hashes,
-								&next_offset);
-
-		#if MIN_MATCH_LEN == 2
-			if (next_len <= cur_len - 2) {
-		#else
-			if (next_len <= cur_len - 1) {
-		#endif
-				in_next++;
-				skip_len = cur_len - 2;
-				goto choose_cur_match;
-			}
+/* Return the cost of a match length, including any extra bytes. */
+static forceinline u32
+length_cost(const struct costs *costs, u32 length)
+{
+	length -= MIN_MATCH_LEN;
+	if (length < LENGTH_ALPHABET_SIZE - 1)
+		return costs->length[length];
+	length -= LENGTH_ALPHABET_SIZE - 1;
+	return costs->length[LENGTH_ALPHABET_SIZE - 1] +
+	       (length < 0xFF ? 8 : 32) * BIT_COST;
+}
+
+/* Consider reaching 'node' with the given item, and keep it if cheaper. */
+static forceinline void
+update_optimum_node(struct optimum_node *node, u32 cost,
+		    u32 length, u32 offset_data)
+{
+	if (cost < node->cost) {
+		node->cost = cost;
+		node->length = length;
+		node->offset_data = offset_data;
+	}
+}
 
-			next_offset_data = next_offset + (NUM_REPS - 1);
-			next_score = explicit_offset_match_score(next_len, next_offset_data);
+/*
+ * Find the cheapest parse of the block using the cached matches and the
+ * current costs, then record it as the block's literals and matches.  Returns
+ * the length of the final literal run.
+ */
+static u32
+near_optimal_parse_block(struct xpack_compressor *c,
+			 const u8 * const in_block_begin, const u32 block_length)
+{
+	struct optimum_node * const nodes = c->near_optimal->optimum_nodes;
+	const struct costs * const costs = &c->near_optimal->costs;
+	const struct lz_match *cache_ptr = c->near_optimal->match_cache;
+	const u8 * const in_begin = c->in_buffer;
+	const u32 nice_len = c->nice_match_length;
+	/* Repeat offsets may reach back before the parser's view of the stream
+	 * window, e.g. to continue a long distance match. */
+	const u32 in_prefix = c->stream_base;
+	u32 * const recent_offsets = c->recent_offsets;
+	u32 length;
+	u32 offset_data;
+	u32 litrunlen;
+	u32 skip_to = 0;
+	u32 i;
+
+	STATIC_ASSERT(MIN_MATCH_LEN >= 2);
+
+	nodes[0].cost = litrunlen_cost(costs, 0);
+	nodes[0].length = 0;
+	nodes[0].litrunlen = 0;
+	memcpy(nodes[0].recent_offsets, recent_offsets,
+	       sizeof(nodes[0].recent_offsets));
+	for (i = 1; i <= block_length; i++)
+		nodes[i].cost = UINT32_MAX;
+
+	for (i = 0; i < block_length; i++) {
+		struct optimum_node * const node = &nodes[i];
+		const u8 * const in_next = in_block_begin + i;
+		const u32 max_len = block_length - i;
+		const struct lz_match *matches;
+		u32 num_matches;
+		u32 base_cost;
+		u32 cost;
+		unsigned rep_idx;
 
-			rep_max_len = find_longest_repeat_offset_match(in_next,
-								       in_end - in_next,
-								       recent_offsets,
-								       &rep_max_idx);
-			in_next++;
+		/*
+		 * Don't consider any items beginning inside a very long match.
+		 * This loses little, and it keeps redundant data from taking
+		 * quadratic time.  Such nodes are never on the chosen path,
+		 * since no items are considered from them.
+		 */
+		if (i < skip_to) {
+			cache_ptr += 1 + cache_ptr->length;
+			continue;
+		}
 
-			if (rep_max_len >= 3 &&
-			    (rep_score = repeat_offset_match_score(rep_max_len,
-								   rep_max_idx)) >= next_score)
-			{
-
-				if (rep_score > cur_score) {
-					/*
-					 * The next match is better, and it's a
-					 * repeat offset match.
-					 */
-					record_literal(c, *(in_next - 2));
-					litrunlen++;
-					cur_len = rep_max_len;
-					cur_offset_data = rep_max_idx;
-					skip_len = cur_len - 1;
-					goto choose_cur_match;
-				}
+		/* The cheapest path to this node is now known, so fill in its
+		 * literal run length and recent offsets queue. */
+		if (i != 0) {
+			const struct optimum_node *prev = node - node->length;
+
+			memcpy(node->recent_offsets, prev->recent_offsets,
+			       sizeof(node->recent_offsets));
+			if (node->length == 1) {
+				node->litrunlen = prev->litrunlen + 1;
+			} else if (node->offset_data < NUM_REPS) {
+				node->litrunlen = 0;
+				node->recent_offsets[node->offset_data] =
+					prev->recent_offsets[0];
+				node->recent_offsets[0] =
+					prev->recent_offsets[node->offset_data];
 			} else {
-				if (next_score > cur_score) {
-					/*
-					 * The next match is better, and it's an
-					 * explicit offset match.
-					 */
-					record_literal(c, *(in_next - 2));
-					litrunlen++;
-					cur_len = next_len;
-					cur_offset_data = next_offset_data;
-					cur_score = next_score;
-					goto have_cur_match;
-				}
+				node->litrunlen = 0;
+				memcpy(&node->recent_offsets[1],
+				       &prev->recent_offsets[0],
+				       (NUM_REPS - 1) * sizeof(u32));
+				node->recent_offsets[0] =
+					node->offset_data - (NUM_REPS - 1);
 			}
+		}
 
-			/* The original match was better. */
-			skip_len = cur_len - 2;
+		num_matches = cache_ptr->length;
+		matches = cache_ptr + 1;
+		cache_ptr = matches + num_matches;
 
-		choose_cur_match:
-			match = &c->matches[c->num_matches++];
-			if (cur_offset_data < NUM_REPS) {
-				u32 offset;
+		/* Consider a literal. */
+		cost = node->cost + costs->literal[*in_next] +
+		       litrunlen_cost(costs, node->litrunlen + 1) -
+		       litrunlen_cost(costs, node->litrunlen);
+		update_optimum_node(node + 1, cost, 1, 0);
 
-				record_repeat_offset(c, match, cur_offset_data);
+		if (max_len < MIN_MATCH_LEN)
+			continue;
 
-				offset = recent_offsets[cur_offset_data];
-				recent_offsets[cur_offset_data] = recent_offsets[0];
-				recent_offsets[0] = offset;
-			} else {
-				record_explicit_offset(c, match,
-						       cur_offset_data - (NUM_REPS - 1));
-				STATIC_ASSERT(NUM_REPS >= 1 && NUM_REPS <= 4);
-			#if NUM_REPS >= 4
-				recent_offsets[3] = recent_offsets[2];
-			#endif
-			#if NUM_REPS >= 3
-				recent_offsets[2] = recent_offsets[1];
-			#endif
-			#if NUM_REPS >= 2
-				recent_offsets[1] = recent_offsets[0];
-			#endif
-				recent_offsets[0] = cur_offset_data - (NUM_REPS - 1);
+		/* A match ends the literal run and begins a new one. */
+		base_cost = node->cost + litrunlen_cost(costs, 0);
+
+		/* Consider repeat offset matches. */
+		for (rep_idx = 0; rep_idx < NUM_REPS; rep_idx++) {
+			const u32 offset = node->recent_offsets[rep_idx];
+			u32 rep_len;
+			u32 rep_cost;
+
+			if (offset > in_next - in_begin + in_prefix ||
+			    load_u16_unaligned(in_next) !=
+			    load_u16_unaligned(in_next - offset))
+				continue;
+			rep_len = lz_extend(in_next, in_next - offset, 2, max_len);
+			if (rep_len < MIN_MATCH_LEN)
+				continue;
+
+			rep_cost = base_cost + costs->offset[rep_idx];
+			length = MIN_MATCH_LEN;
+			if (rep_len >= nice_len) {
+				length = rep_len;
+				skip_to = MAX(skip_to, i + rep_len);
 			}
-			record_litrunlen(c, match, litrunlen);
-			record_length(c, match, cur_len);
-			litrunlen = 0;
+			do {
+				update_optimum_node(node + length,
+						    rep_cost +
+						    length_cost(costs, length),
+						    length, rep_idx);
+			} while (++length <= rep_len);
+		}
 
-			in_next = hc_matchfinder_skip_positions(&c->hc_mf,
-								in_begin,
-								in_next - in_begin,
-								in_end - in_begin,
-								skip_len,
-								next_hashes);
+		/*
+		 * Consider explicit offset matches.  The matchfinder only finds
+		 * matches of length 3 or more, and shorter matches are rarely
+		 * worthwhile without a repeat offset anyway.  If the longest
+		 * match is very long, consider only its full length.
+		 */
+		if (num_matches == 0)
+			continue;
+		length = MAX(MIN_MATCH_LEN, 3);
+		if (matches[num_matches - 1].length >= nice_len) {
+			matches += num_matches - 1;
+			num_matches = 1;
+			length = MIN(matches[0].length, max_len);
+			skip_to = MAX(skip_to, i + length);
+		}
+		do {
+			const u32 offset = matches->offset;
+			const u32 match_len = MIN(matches->length, max_len);
+			const u32 offset_cost = base_cost +
+				costs->offset[NUM_REPS + bsr32(offset)];
+
+			for (; length <= match_len; length++) {
+				update_optimum_node(node + length,
+						    offset_cost +
+						    length_cost(costs, length),
+						    length,
+						    offset + (NUM_REPS - 1));
+			}
+			matches++;
+		} while (--num_matches);
+	}
+
+	/* Reverse the path, so that each node on it holds the next item. */
+	i = block_length;
+	length = nodes[i].length;
+	offset_data = nodes[i].offset_data;
+	do {
+		struct optimum_node *prev = &nodes[i - length];
+		u32 prev_length = prev->length;
+		u32 prev_offset_data = prev->offset_data;
+
+		prev->length = length;
+		prev->offset_data = offset_data;
+		i -= length;
+		length = prev_length;
+		offset_data = prev_offset_data;
+	} while (i != 0);
+
+	/* Record the items on the path. */
+	litrunlen = 0;
+	for (i = 0; i < block_length; i += nodes[i].length) {
+		struct match *match;
+
+		if (nodes[i].length == 1) {
+			record_literal(c, in_block_begin[i]);
+			litrunlen++;
+			continue;
+		}
+
+		match = &c->matches[c->num_matches++];
+		offset_data = nodes[i].offset_data;
+		if (offset_data < NUM_REPS) {
+			u32 offset;
+
+			record_repeat_offset(c, match, offset_data);
+
+			offset = recent_offsets[offset_data];
+			recent_offsets[offset_data] = recent_offsets[0];
+			recent_offsets[0] = offset;
+		} else {
+			record_explicit_offset(c, match,
+					       offset_data - (NUM_REPS - 1));
+			STATIC_ASSERT(NUM_REPS >= 1 && NUM_REPS <= 4);
+		#if NUM_REPS >= 4
+			recent_offsets[3] = recent_offsets[2];
+		#endif
+		#if NUM_REPS >= 3
+			recent_offsets[2] = recent_offsets[1];
+		#endif
+		#if NUM_REPS >= 2
+			recent_offsets[1] = recent_offsets[0];
+		#endif
+			recent_offsets[0] = offset_data - (NUM_REPS - 1);
+		}
+		record_litrunlen(c, match, litrunlen);
+		record_length(c, match, nodes[i].length);
+		litrunlen = 0;
+	}
+	return litrunlen;
+}
+
+static size_t
+compress_near_optimal(struct xpack_compressor *c,
+		      void *out, size_t out_nbytes_avail)
+{
+	u8 * const out_begin = out;
+	u8 * out_next = out_begin;
+	u8 * const out_end = out_begin + out_nbytes_avail;
+	const u8 * const in_begin = c->in_buffer;
+	const u8 *	 in_next = in_begin + c->in_start;
+	const u8 * const in_end  = in_begin + c->in_nbytes;
+	const u32 window_size = c->window_size;
+	struct lz_match * const cache_end = c->near_optimal->match_cache_end;
+	const u32 nice_len = c->nice_match_length;
+	u32 max_len = MIN(in_end - in_next, MAX_COMPRESSOR_MATCH_LEN);
+	u32 next_hashes[2] = {0, 0};
+
+	if (in_end - in_next >= 4)
+		bt_matchfinder_init_hashes(&c->bt_mf, in_next, next_hashes);
+
+	do {
+		/* Starting a new block */
+
+		const u8 * const in_block_begin = in_next;
+		const u8 * const in_max_block_end =
+			in_next + MIN(SOFT_MAX_BLOCK_LENGTH, in_end - in_next);
+		struct lz_match *cache_ptr = c->near_optimal->match_cache;
+		const u8 *next_item = in_next;
+		u32 saved_recent_offsets[NUM_REPS];
+		u32 block_length;
+		u32 litrunlen;
+		unsigned pass;
+		size_t nbytes;
+
+		begin_block(c);
+
+		/* Find and cache the matches for the block. */
+		do {
+			struct lz_match * const header = cache_ptr;
+			u32 best_len;
+			u32 ldm_len;
+			u32 ldm_offset;
+
+			if (unlikely(max_len > in_end - in_next))
+				max_len = in_end - in_next;
+
+			cache_ptr = bt_matchfinder_get_matches(&c->bt_mf,
+							       in_begin,
+							       in_next - in_begin,
+							       max_len,
+							       nice_len,
+							       c->max_search_depth,
+							       MATCH_CUTOFF(in_next - in_begin,
+									    window_size),
+							       next_hashes,
+							       &best_len,
+							       header + 1);
+
+			/* A longer long distance match goes last, since the
+			 * matches are in order of increasing length. */
+			ldm_len = long_distance_match(c, in_next, max_len,
+						      &ldm_offset);
+			if (ldm_len > (cache_ptr != header + 1 ? best_len : 0)) {
+				cache_ptr->length = ldm_len;
+				cache_ptr->offset = ldm_offset;
+				cache_ptr++;
+				best_len = ldm_len;
+			}
+			header->length = cache_ptr - (header + 1);
+
+			/*
+			 * Count a provisional item for block splitting, as if
+			 * the block were being parsed greedily.  Counting an
+			 * item at every position would make the statistics
+			 * much noisier, since neighboring positions usually
+			 * have nearly the same matches.
+			 */
+			if (in_next >= next_item) {
+				if (header->length == 0) {
+					c->freqs.literal[*in_next]++;
+					c->num_literals++;
+					next_item = in_next + 1;
+				} else {
+					c->freqs.length[MIN(best_len - MIN_MATCH_LEN,
+							    LENGTH_ALPHABET_SIZE - 1)]++;
+					c->freqs.offset[NUM_REPS +
+							bsr32((cache_ptr - 1)->offset)]++;
+					c->num_matches++;
+					next_item = in_next + best_len;
+				}
+			}
+			in_next++;
+			if (header->length == 0)
+				continue;
+
+			/*
+			 * If the match is very long, then skip over it rather
+			 * than search for matches inside it.  This is much
+			 * faster on highly redundant data, and it's unlikely
+			 * that better matches would be found there anyway.
+			 */
+			if (best_len >= nice_len) {
+				u32 skip_len = MIN(best_len - 1,
+						   in_max_block_end - in_next);
+
+				while (skip_len--) {
+					if (unlikely(max_len > in_end - in_next))
+						max_len = in_end - in_next;
+					bt_matchfinder_skip_position(&c->bt_mf,
+								     in_begin,
+								     in_next - in_begin,
+								     max_len,
+								     nice_len,
+								     c->max_search_depth,
+								     MATCH_CUTOFF(in_next - in_begin,
+										  window_size),
+								     next_hashes);
+					cache_ptr->length = 0;
+					cache_ptr++;
+					in_next++;
+				}
+			}
 		} while (in_next < in_max_block_end &&
-			 !should_end_block(&c->split_stats, in_block_begin, in_next, in_end));
+			 cache_ptr < cache_end &&
+			 !should_end_block(c, in_block_begin, in_next, in_end));
+
+		/* Parse the block, refining the costs after each pass. */
+
+		block_length = in_next - in_block_begin;
+		memcpy(saved_recent_offsets, c->recent_offsets,
+		       sizeof(saved_recent_offsets));
+		set_initial_costs(c, in_block_begin, block_length);
+		for (pass = 1; ; pass++) {
+			begin_block(c);
+			litrunlen = near_optimal_parse_block(c, in_block_begin,
+							     block_length);
+			if (pass >= c->num_optim_passes)
+				break;
+			set_costs_from_freqs(c);
+			memcpy(c->recent_offsets, saved_recent_offsets,
+			       sizeof(saved_recent_offsets));
+		}
 
 		nbytes = write_block(c, out_next, out_end - out_next,
-				     in_next - in_block_begin, litrunlen,
-				     in_next == in_end);
+				     in_block_begin, block_length, litrunlen,
+				     in_next == in_end && c->is_final_data);
 		if (nbytes == 0)
 			return 0;
 
@@ -1763,125 +2942,1219 @@ compress_lazy(struct xpack_compressor *c, void *out, size_t out_nbytes_avail)
 	return out_next - out_begin;
 }
 
-LIBEXPORT struct xpack_compressor *
-xpack_alloc_compressor(size_t max_buffer_size, int compression_level)
+/*
+ * Prepare the matchfinder for a new input buffer.  @bufsize is the number of
+ * bytes that will be in the buffer at most, which need not be the maximum
+ * buffer size of the compressor; the cost of the reset is proportional to it.
+ */
+static void
+init_matchfinder(struct xpack_compressor *c, size_t bufsize)
 {
-	struct xpack_compressor *c;
+	switch (c->mf_type) {
+	case MATCHFINDER_HT:
+		ht_matchfinder_init(&c->ht_mf, bufsize);
+		break;
+	case MATCHFINDER_HC:
+		hc_matchfinder_init(&c->hc_mf, bufsize);
+		break;
+	case MATCHFINDER_BT:
+		bt_matchfinder_init(&c->bt_mf, bufsize);
+		break;
+	}
+}
 
-	c = malloc(offsetof(struct xpack_compressor, hc_mf) +
-		   hc_matchfinder_size(max_buffer_size));
-	if (!c)
-		goto err0;
+/*
+ * Set up the matchfinder for buffers up to @max_bufsize bytes.  The tables are
+ * placed in @tabs, or in the compressor itself if @tabs is NULL.
+ */
+static void
+setup_matchfinder(struct xpack_compressor *c, size_t max_bufsize, u32 *tabs)
+{
+	switch (c->mf_type) {
+	case MATCHFINDER_HT:
+		ht_matchfinder_setup(&c->ht_mf, max_bufsize,
+				     tabs ? tabs : c->ht_mf.tabs);
+		break;
+	case MATCHFINDER_HC:
+		hc_matchfinder_setup(&c->hc_mf, max_bufsize,
+				     tabs ? tabs : c->hc_mf.tabs);
+		break;
+	case MATCHFINDER_BT:
+		bt_matchfinder_setup(&c->bt_mf, max_bufsize,
+				     tabs ? tabs : c->bt_mf.tabs);
+		break;
+	}
+}
 
-#ifdef ENABLE_PREPROCESSING
-	c->in_buffer = malloc(max_buffer_size);
-	if (!c->in_buffer)
-		goto err1;
-#endif
+/* Return the size of the matchfinder tables for buffers up to @max_bufsize. */
+static size_t
+matchfinder_tabs_size(enum matchfinder_type mf_type, size_t max_bufsize)
+{
+	switch (mf_type) {
+	case MATCHFINDER_HT:
+		return ht_matchfinder_tabs_size(max_bufsize);
+	case MATCHFINDER_BT:
+		return bt_matchfinder_tabs_size(max_bufsize);
+	default:
+		return hc_matchfinder_tabs_size(max_bufsize);
+	}
+}
 
-	c->max_buffer_size = max_buffer_size;
+/* Return the size of a matchfinder, with its tables, for @max_bufsize. */
+static size_t
+matchfinder_size(enum matchfinder_type mf_type, size_t max_bufsize)
+{
+	switch (mf_type) {
+	case MATCHFINDER_HT:
+		return ht_matchfinder_size(max_bufsize);
+	case MATCHFINDER_BT:
+		return bt_matchfinder_size(max_bufsize);
+	default:
+		return hc_matchfinder_size(max_bufsize);
+	}
+}
+
+/*
+ * Insert the sequences of a preset dictionary into its matchfinder.  Only the
+ * dictionary itself is looked at, not any data that will follow it, so the
+ * sequences in its last few bytes are left out.  This way the result is the
+ * same for every buffer and can be copied by copy_dictionary_matchfinder().
+ */
+static void
+insert_dictionary(struct xpack_dictionary *d)
+{
+	const u8 * const in_begin = d->data;
+	const size_t dict_size = d->size;
+	const size_t max_bufsize = dict_size + d->max_buffer_size;
+
+	switch (d->mf_type) {
+	case MATCHFINDER_HT:
+		ht_matchfinder_setup(&d->ht_mf, max_bufsize, d->ht_mf.tabs);
+		ht_matchfinder_init(&d->ht_mf, max_bufsize);
+		if (dict_size >= 5 + 4) {
+			u32 next_hash = ht_matchfinder_hash(&d->ht_mf, in_begin);
+
+			ht_matchfinder_skip_positions(&d->ht_mf, in_begin, 0,
+						      dict_size, dict_size - 5,
+						      &next_hash);
+		}
+		break;
+	case MATCHFINDER_HC:
+		hc_matchfinder_setup(&d->hc_mf, max_bufsize, d->hc_mf.tabs);
+		hc_matchfinder_init(&d->hc_mf, max_bufsize);
+		if (dict_size >= 5 + 4) {
+			u32 next_hashes[2];
+
+			hc_matchfinder_init_hashes(&d->hc_mf, in_begin,
+						   next_hashes);
+			hc_matchfinder_skip_positions(&d->hc_mf, in_begin, 0,
+						      dict_size, dict_size - 5,
+						      next_hashes);
+		}
+		break;
+	case MATCHFINDER_BT:
+		bt_matchfinder_setup(&d->bt_mf, max_bufsize, d->bt_mf.tabs);
+		bt_matchfinder_init(&d->bt_mf, max_bufsize);
+		if (dict_size >= 5) {
+			u32 next_hashes[2];
+			size_t pos;
+
+			bt_matchfinder_init_hashes(&d->bt_mf, in_begin,
+						   next_hashes);
+			for (pos = 0; pos < dict_size - 4; pos++) {
+				bt_matchfinder_skip_position(&d->bt_mf,
+							     in_begin, pos,
+							     MIN(dict_size - pos,
+								 MAX_COMPRESSOR_MATCH_LEN),
+							     d->nice_match_length,
+							     d->max_search_depth,
+							     0, next_hashes);
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * Prepare the matchfinder for a new buffer which follows the preset dictionary,
+ * by copying the state that the dictionary left in its own matchfinder.  This
+ * must be done before the new buffer is placed after the dictionary.
+ *
+ * Copying the whole state costs far more than compressing a buffer of a few
+ * kilobytes does, so if the matchfinder still has the dictionary's state from
+ * the last buffer, just undo that buffer's insertions instead.  This isn't
+ * possible with binary trees, since inserting a sequence also changes the nodes
+ * of the dictionary's sequences.
+ */
+static void
+reset_dictionary_matchfinder(struct xpack_compressor *c)
+{
+	const struct xpack_dictionary *d = c->dict;
+	const size_t dirty_end = c->dict_mf_dirty_end;
+
+	switch (c->mf_type) {
+	case MATCHFINDER_HT:
+		if (dirty_end != 0 &&
+		    dirty_end - d->size < (1UL << d->ht_mf.hash_order) / 2)
+			ht_matchfinder_restore(&c->ht_mf, &d->ht_mf,
+					       c->dict_buffer, d->size,
+					       dirty_end);
+		else
+			ht_matchfinder_copy(&c->ht_mf, &d->ht_mf);
+		break;
+	case MATCHFINDER_HC:
+		if (dirty_end != 0 &&
+		    dirty_end - d->size < ((1UL << d->hc_mf.hash4_order) +
+					   d->size) / 2)
+			hc_matchfinder_restore(&c->hc_mf, &d->hc_mf,
+					       c->dict_buffer, d->size,
+					       dirty_end);
+		else
+			hc_matchfinder_copy(&c->hc_mf, &d->hc_mf, d->size);
+		break;
+	case MATCHFINDER_BT:
+		bt_matchfinder_copy(&c->bt_mf, &d->bt_mf, d->size);
+		break;
+	}
+	c->dict_mf_dirty_end = 0;
+}
+
+/* The parameters for a compression level */
+struct compression_params {
+	size_t (*impl)(struct xpack_compressor *, void *, size_t);
+	enum matchfinder_type mf_type;
+	unsigned max_search_depth;
+	unsigned nice_match_length;
+	unsigned num_optim_passes;
+	bool cost_based_split;
+};
+
+/*
+ * Get the parameters for the specified compression level.  Returns false if the
+ * compression level is not supported.
+ */
+static bool
+get_compression_params(int compression_level,
+		       struct compression_params *params)
+{
+	params->mf_type = MATCHFINDER_HC;
+	params->num_optim_passes = 0;
+	/* The cost-based block split check pays off from the lazy levels up */
+	params->cost_based_split = (compression_level >= 4);
 
 	switch (compression_level) {
 	case 1:
-		c->impl = compress_greedy;
-		c->max_search_depth = 1;
-		c->nice_match_length = MIN_MATCH_LEN;
+		params->impl = compress_fastest;
+		params->mf_type = MATCHFINDER_HT;
+		params->max_search_depth = 1;
+		params->nice_match_length = HT_MATCHFINDER_MIN_MATCH_LEN;
 		break;
 	case 2:
-		c->impl = compress_greedy;
-		c->max_search_depth = 8;
-		c->nice_match_length = 8;
+		params->impl = compress_greedy;
+		params->max_search_depth = 8;
+		params->nice_match_length = 8;
 		break;
 	case 3:
-		c->impl = compress_greedy;
-		c->max_search_depth = 16;
-		c->nice_match_length = 16;
+		params->impl = compress_greedy;
+		params->max_search_depth = 16;
+		params->nice_match_length = 16;
 		break;
 	case 4:
-		c->impl = compress_lazy;
-		c->max_search_depth = 8;
-		c->nice_match_length = 12;
+		params->impl = compress_lazy;
+		params->max_search_depth = 8;
+		params->nice_match_length = 12;
 		break;
 	case 5:
-		c->impl = compress_lazy;
-		c->max_search_depth = 16;
-		c->nice_match_length = 24;
+		params->impl = compress_lazy;
+		params->max_search_depth = 16;
+		params->nice_match_length = 24;
 		break;
 	case 6:
-		c->impl = compress_lazy;
-		c->max_search_depth = 32;
-		c->nice_match_length = 48;
+		params->impl = compress_lazy;
+		params->max_search_depth = 32;
+		params->nice_match_length = 48;
 		break;
 	case 7:
-		c->impl = compress_lazy;
-		c->max_search_depth = 64;
-		c->nice_match_length = 96;
+		params->impl = compress_lazy;
+		params->max_search_depth = 64;
+		params->nice_match_length = 96;
 		break;
 	case 8:
-		c->impl = compress_lazy;
-		c->max_search_depth = 128;
-		c->nice_match_length = 192;
+		params->impl = compress_lazy;
+		params->max_search_depth = 128;
+		params->nice_match_length = 192;
 		break;
 	case 9:
-		c->impl = compress_lazy;
-		c->max_search_depth = 256;
-		c->nice_match_length = 384;
+		params->impl = compress_lazy;
+		params->max_search_depth = 256;
+		params->nice_match_length = 384;
 		STATIC_ASSERT(EXTRA_LITERAL_SPACE >= 384 * 4 / 3);
 		break;
+	case 10:
+		params->impl = compress_near_optimal;
+		params->mf_type = MATCHFINDER_BT;
+		params->max_search_depth = 24;
+		params->nice_match_length = 48;
+		params->num_optim_passes = 2;
+		break;
+	case 11:
+		params->impl = compress_near_optimal;
+		params->mf_type = MATCHFINDER_BT;
+		params->max_search_depth = 48;
+		params->nice_match_length = 96;
+		params->num_optim_passes = 3;
+		break;
+	case 12:
+		params->impl = compress_near_optimal;
+		params->mf_type = MATCHFINDER_BT;
+		params->max_search_depth = 128;
+		params->nice_match_length = 128;
+		params->num_optim_passes = 4;
+		break;
 	default:
-		goto err2;
+		return false;
 	}
 
+	STATIC_ASSERT(SOFT_MAX_BLOCK_LENGTH + EXTRA_LITERAL_SPACE +
+		      MAX_COMPRESSOR_MATCH_LEN <= MAX_BLOCK_SIZE);
+
 	/* max_search_depth == 0 is invalid */
-	if (c->max_search_depth < 1)
-		c->max_search_depth = 1;
+	if (params->max_search_depth < 1)
+		params->max_search_depth = 1;
 
-	return c;
+	return true;
+}
+
+/*
+ * The parser settings for each decode speed.  Decompression takes about as
+ * long for a match as for four literals, plus a little for each byte; in
+ * particular, aligned blocks and far offsets make little difference within the
+ * usual chunk sizes.  So faster decompression means fewer items overall.  The
+ * greedy and lazy parsers choose only longer matches, which saves time when a
+ * match would cover fewer bytes than the literals it replaces take to decode.
+ * Near-optimal parsing adds the time of each item to its cost in bits.
+ */
+struct decode_speed_params {
+
+	/* The shortest explicit offset match that the greedy and lazy parsers
+	 * choose, normally and for offsets of FAR_MATCH_OFFSET or more */
+	u8 min_match_len;
+	u8 min_far_match_len;
+
+	/* The cost which near-optimal parsing adds to each literal and each
+	 * match, in the same units as the costs (BIT_COST per bit) */
+	u8 literal_time_cost;
+	u8 match_time_cost;
+};
+
+static const struct decode_speed_params
+decode_speed_params[XPACK_MAX_DECODE_SPEED + 1] = {
+	{ 3, 4, 0, 0 },
+	{ 4, 4, 16, 64 },
+	{ 4, 4, 32, 128 },
+	{ 4, 5, 48, 192 },
+};
+
+static void
+set_decode_speed_params(struct xpack_compressor *c, int decode_speed)
+{
+	const struct decode_speed_params *params =
+		&decode_speed_params[decode_speed];
+
+	c->min_match_len = MAX(params->min_match_len, MIN_MATCH_LEN);
+	c->min_far_match_len = params->min_far_match_len;
+	c->literal_time_cost = params->literal_time_cost;
+	c->match_time_cost = params->match_time_cost;
+}
+
+/* The sizes of the memory allocations that make up a compressor */
+struct compressor_sizes {
+	size_t compressor;	/* including the matchfinder */
+	size_t literals;
+	size_t matches;
+	size_t extra_bytes;
+	size_t match_cache;	/* in entries; 0 if no near-optimal state */
+	size_t near_optimal;
+	size_t preprocess_buffer;
+};
+
+typedef size_t (*compress_func_t)(struct xpack_compressor *, void *, size_t);
 
-err2:
+/*
+ * Return the version of the parser @impl that was compiled for the best
+ * instruction set extensions the CPU supports.
+ */
+static compress_func_t
+select_impl(compress_func_t impl)
+{
+#if DISPATCH_ENABLED
+	if (x86_have_cpu_feature(X86_CPU_FEATURE_BMI2)) {
+		if (impl == compress_greedy)
+			return compress_greedy_bmi2;
+		if (impl == compress_lazy)
+			return compress_lazy_bmi2;
+	}
+#endif
+	return impl;
+}
+
+/*
+ * Compute the sizes of the memory allocations for a compressor.  No block can be
+ * longer than the buffer, so the arrays for the items of a block are sized from
+ * the maximum buffer size as well as from the block length limits (see
+ * SOFT_MAX_BLOCK_LENGTH).  That makes a compressor for small buffers small.
+ */
+static void
+get_compressor_sizes(const struct compression_params *params,
+		     size_t max_buffer_size, struct compressor_sizes *sizes)
+{
+	const size_t max_block_length = MIN(MAX(max_buffer_size, 1),
+					    SOFT_MAX_BLOCK_LENGTH);
+
+	sizes->compressor = offsetof(struct xpack_compressor, hc_mf) +
+			    matchfinder_size(params->mf_type, max_buffer_size);
+
+	sizes->literals = MIN(MAX(max_buffer_size, 1),
+			      SOFT_MAX_BLOCK_LENGTH + EXTRA_LITERAL_SPACE);
+
+	sizes->matches = (DIV_ROUND_UP(max_block_length, MIN_MATCH_LEN) + 1) *
+			 sizeof(struct match);
+
+	sizes->extra_bytes = 6 + /* extra for actual block length > soft max */
+		MAX4(1 * DIV_ROUND_UP(max_block_length,
+				      MIN_MATCH_LEN + LENGTH_ALPHABET_SIZE - 1),
+		     3 * DIV_ROUND_UP(max_block_length,
+				      MIN_MATCH_LEN + LENGTH_ALPHABET_SIZE - 1 + 0xFF),
+		     1 * DIV_ROUND_UP(max_block_length,
+				      LITRUNLEN_ALPHABET_SIZE - 1),
+		     3 * DIV_ROUND_UP(max_block_length,
+				      LITRUNLEN_ALPHABET_SIZE - 1 + 0xFF));
+
+	sizes->match_cache = 0;
+	sizes->near_optimal = 0;
+	if (params->impl == compress_near_optimal) {
+		sizes->match_cache = MATCH_CACHE_ENTRIES_PER_POS * max_block_length;
+		sizes->near_optimal = sizeof(struct near_optimal_state) +
+				      (sizes->match_cache + max_block_length +
+				       params->max_search_depth + 2) *
+				      sizeof(struct lz_match) +
+				      (max_block_length + 1) *
+				      sizeof(struct optimum_node);
+	}
+
+	sizes->preprocess_buffer = 0;
 #ifdef ENABLE_PREPROCESSING
-	free(c->in_buffer);
-err1:
+	sizes->preprocess_buffer = max_buffer_size;
 #endif
-	free(c);
-err0:
+}
+
+/* Return the total arena space for the allocations in 'sizes' */
+static size_t
+get_arena_size(const struct compressor_sizes *sizes)
+{
+	return ARENA_ALIGNMENT - 1 +
+	       ARENA_SIZE(sizes->compressor) + ARENA_SIZE(sizes->literals) +
+	       ARENA_SIZE(sizes->matches) + ARENA_SIZE(sizes->extra_bytes) +
+	       ARENA_SIZE(sizes->near_optimal) +
+	       ARENA_SIZE(sizes->preprocess_buffer);
+}
+
+/*
+ * Allocate a compressor from 'allocator', or from the arena 'mem' if it isn't
+ * NULL.  An arena must be large enough for all of the compressor.
+ */
+static struct xpack_compressor *
+alloc_compressor(size_t max_buffer_size, int compression_level,
+		 const struct xpack_allocator *allocator,
+		 void *mem, size_t mem_size)
+{
+	struct compression_params params;
+	struct compressor_sizes sizes;
+	struct xpack_mem m;
+	struct xpack_compressor *c;
+
+	if (!get_compression_params(compression_level, &params))
+		return NULL;
+	get_compressor_sizes(&params, max_buffer_size, &sizes);
+	if (mem && mem_size < get_arena_size(&sizes))
+		return NULL;
+
+	xpack_mem_init(&m, allocator, mem, mem_size);
+	c = xpack_mem_alloc(&m, sizes.compressor);
+	if (!c)
+		return NULL;
+
+	c->mem = m;
+	c->max_buffer_size = max_buffer_size;
+	c->impl = select_impl(params.impl);
+	c->mf_type = params.mf_type;
+	c->max_search_depth = params.max_search_depth;
+	c->nice_match_length = params.nice_match_length;
+	c->num_optim_passes = params.num_optim_passes;
+	c->cost_based_split = params.cost_based_split;
+	set_decode_speed_params(c, 0);
+	c->compression_level = compression_level;
+	c->stream_window = NULL;
+	c->stream_window_alloc = 0;
+	c->stream_base = 0;
+	c->stream_out = NULL;
+	c->stream_active = false;
+	c->long_window_size = 0;
+	c->ldm = NULL;
+	c->ldm_size = 0;
+	c->ldm_matches = NULL;
+	c->ldm_next_pos = UINT32_MAX;
+	c->stats_callback = NULL;
+	c->stats_clock = NULL;
+	c->stats_private_data = NULL;
+	c->checksum_enabled = false;
+	c->checksum = 0;
+	c->near_optimal = NULL;
+	c->dict = NULL;
+	c->dict_owned = false;
+	c->dict_buffer = NULL;
+	c->dict_size = 0;
+	c->dict_mf_tabs = NULL;
+	c->dict_mf_dirty_end = 0;
+#ifdef ENABLE_PREPROCESSING
+	c->preprocess_buffer = NULL;
+	c->preprocessed = false;
+#endif
+
+	c->literals = xpack_mem_alloc(&c->mem, sizes.literals);
+	c->matches = xpack_mem_alloc(&c->mem, sizes.matches);
+	c->extra_bytes = xpack_mem_alloc(&c->mem, sizes.extra_bytes);
+	if (!c->literals || !c->matches || !c->extra_bytes)
+		goto err;
+
+	if (sizes.near_optimal) {
+		c->near_optimal = xpack_mem_alloc(&c->mem, sizes.near_optimal);
+		if (!c->near_optimal)
+			goto err;
+		c->near_optimal->match_cache_end =
+			&c->near_optimal->match_cache[sizes.match_cache];
+		c->near_optimal->optimum_nodes = (struct optimum_node *)
+			&c->near_optimal->match_cache[sizes.match_cache +
+						      MIN(MAX(max_buffer_size, 1),
+							  SOFT_MAX_BLOCK_LENGTH) +
+						      c->max_search_depth + 2];
+	}
+
+#ifdef ENABLE_PREPROCESSING
+	c->preprocess_buffer = xpack_mem_alloc(&c->mem,
+					       sizes.preprocess_buffer);
+	if (!c->preprocess_buffer)
+		goto err;
+#endif
+
+	setup_matchfinder(c, max_buffer_size, NULL);
+	build_predefined_codes(c);
+
+	return c;
+
+err:
+	xpack_free_compressor(c);
 	return NULL;
 }
 
+LIBEXPORT struct xpack_compressor *
+xpack_alloc_compressor(size_t max_buffer_size, int compression_level)
+{
+	return alloc_compressor(max_buffer_size, compression_level,
+				NULL, NULL, 0);
+}
+
+LIBEXPORT struct xpack_compressor *
+xpack_alloc_compressor_ex(size_t max_buffer_size, int compression_level,
+			  const struct xpack_allocator *allocator)
+{
+	return alloc_compressor(max_buffer_size, compression_level,
+				allocator, NULL, 0);
+}
+
+LIBEXPORT struct xpack_compressor *
+xpack_init_compressor(void *mem, size_t mem_size,
+		      size_t max_buffer_size, int compression_level)
+{
+	if (!mem)
+		return NULL;
+	return alloc_compressor(max_buffer_size, compression_level,
+				NULL, mem, mem_size);
+}
+
+LIBEXPORT size_t
+xpack_compressor_memory_usage(size_t max_buffer_size, int compression_level)
+{
+	struct compression_params params;
+	struct compressor_sizes sizes;
+
+	if (!get_compression_params(compression_level, &params))
+		return 0;
+	get_compressor_sizes(&params, max_buffer_size, &sizes);
+
+	return get_arena_size(&sizes);
+}
+
+#ifdef ENABLE_PREPROCESSING
+
+/* The size and maximum number of the samples looks_like_x86_code() takes */
+#define X86_SAMPLE_SIZE		4096
+#define X86_MAX_SAMPLES		16
+
+/*
+ * Guess whether the data is x86 machine code, which is the only kind of data
+ * that preprocessing helps.  On anything else it just costs time, and it can
+ * even hurt compression slightly.
+ *
+ * An E8 byte is counted as a call instruction if its 32-bit displacement is
+ * plausible for a call within the same program, i.e. less than 16 MiB either
+ * way.  Tiny displacements aren't counted, since outside of code they are
+ * typically small integers.  Code has several such calls per KiB, while other
+ * data containing E8 bytes, such as compressed data, rarely has even one.  To
+ * keep this cheap, only some evenly spaced samples of the data are looked at.
+ */
+static bool
+looks_like_x86_code(const u8 *data, size_t size)
+{
+	size_t num_samples;
+	size_t stride;
+	size_t sampled = 0;
+	size_t num_calls = 0;
+	size_t i;
+
+	if (size < 5)
+		return false;
+	size -= 4; /* stay clear of the end, for reading the displacements */
+
+	num_samples = MIN(DIV_ROUND_UP(size, X86_SAMPLE_SIZE), X86_MAX_SAMPLES);
+	stride = size / num_samples;
+	for (i = 0; i < num_samples; i++) {
+		const u8 *p = &data[i * stride];
+		const u8 *end = p + MIN(X86_SAMPLE_SIZE, size - i * stride);
+
+		sampled += end - p;
+		while (p < end && (p = memchr(p, 0xE8, end - p)) != NULL) {
+			u32 disp = get_unaligned_le32(p + 1);
+
+			if (disp + 0x1000000 < 0x2000000 &&
+			    disp + 256 >= 512)
+				num_calls++;
+			p += 5;
+		}
+	}
+	return num_calls * 1024 >= sampled;
+}
+
+#endif /* ENABLE_PREPROCESSING */
+
 LIBEXPORT size_t
 xpack_compress(struct xpack_compressor *c, const void *in, size_t in_nbytes,
 	       void *out, size_t out_nbytes_avail)
 {
-	/* Don't bother trying to compress very small inputs. */
-	if (in_nbytes < 100)
+	/*
+	 * Don't bother trying to compress very small inputs, unless there is a
+	 * dictionary which they might be able to refer to.
+	 */
+	if (in_nbytes < (c->dict_size ? 1 : 100))
 		return 0;
 
 	/* Safety check */
 	if (unlikely(in_nbytes > c->max_buffer_size))
 		return 0;
 
+	c->checksum = 0;
 #ifdef ENABLE_PREPROCESSING
-	/* Copy the input data into the internal buffer and preprocess it. */
-	memcpy(c->in_buffer, in, in_nbytes);
-	c->in_nbytes = in_nbytes;
-	preprocess(c->in_buffer, in_nbytes);
-#else
-	/* Preprocessing is disabled.  No internal buffer is needed. */
-	c->in_buffer = (void *)in;
-	c->in_nbytes = in_nbytes;
+	c->preprocessed = looks_like_x86_code(in, in_nbytes);
+	if (c->preprocessed && c->checksum_enabled)
+		c->checksum = xpack_crc32c(0, in, in_nbytes);
 #endif
+	if (c->dict_size) {
+		/* Place the input data right after the dictionary. */
+		reset_dictionary_matchfinder(c);
+	#ifdef ENABLE_PREPROCESSING
+		if (c->preprocessed)
+			preprocess_copy(&c->dict_buffer[c->dict_size],
+					in, in_nbytes);
+		else
+	#endif
+			memcpy(&c->dict_buffer[c->dict_size], in, in_nbytes);
+		c->in_buffer = c->dict_buffer;
+	} else {
+	#ifdef ENABLE_PREPROCESSING
+		/* Copy the input data into the internal buffer and
+		 * preprocess it, if it looks like it's worthwhile.
+		 * Otherwise no internal buffer is needed. */
+		if (c->preprocessed) {
+			preprocess_copy(c->preprocess_buffer, in, in_nbytes);
+			c->in_buffer = c->preprocess_buffer;
+		} else {
+			c->in_buffer = (void *)in;
+		}
+	#else
+		/* Preprocessing is disabled.  No internal buffer is needed. */
+		c->in_buffer = (void *)in;
+	#endif
+	}
+	c->in_start = c->dict_size;
+	c->in_nbytes = c->dict_size + in_nbytes;
+	c->window_size = UINT32_MAX;
+	c->is_final_data = true;
+	c->ldm_next_pos = UINT32_MAX;
+
+	/* This cancels any stream in progress, since the state is shared. */
+	c->stream_active = false;
+	c->stream_base = 0;
+
+	init_recent_offsets(c->recent_offsets);
+	reset_codes(&c->codes);
+	if (c->dict)
+		c->dict_mf_dirty_end = c->in_nbytes;
+	else
+		init_matchfinder(c, c->in_nbytes);
 
+	if (c->stats_callback)
+		c->block_start_time = read_stats_clock(c);
 	return (*c->impl)(c, out, out_nbytes_avail);
 }
 
+LIBEXPORT size_t
+xpack_compress_batch(struct xpack_compressor *c,
+		     struct xpack_batch_item *items, size_t num_items)
+{
+	size_t num_compressed = 0;
+	size_t i;
+
+	for (i = 0; i < num_items; i++) {
+		struct xpack_batch_item *item = &items[i];
+
+		item->out_nbytes = xpack_compress(c, item->in, item->in_nbytes,
+						  item->out,
+						  item->out_nbytes_avail);
+		if (item->out_nbytes != 0) {
+			item->result = 0;
+			num_compressed++;
+		} else {
+			item->result = -1;
+		}
+	}
+	return num_compressed;
+}
+
+/*
+ * Allocate a digested dictionary for compressors with the given maximum buffer
+ * size and compression level, and insert the dictionary into its matchfinder.
+ */
+static struct xpack_dictionary *
+alloc_dictionary(const void *dict, size_t dict_size, size_t max_buffer_size,
+		 int compression_level)
+{
+	struct compression_params params;
+	struct xpack_dictionary *d;
+
+	if (!get_compression_params(compression_level, &params))
+		return NULL;
+
+	if (dict_size == 0 || dict_size > MAX_DICTIONARY_SIZE ||
+	    max_buffer_size > UINT32_MAX - dict_size)
+		return NULL;
+
+	d = malloc(offsetof(struct xpack_dictionary, hc_mf) +
+		   matchfinder_size(params.mf_type,
+				    dict_size + max_buffer_size));
+	if (!d)
+		return NULL;
+
+	d->data = malloc(dict_size);
+	if (!d->data) {
+		free(d);
+		return NULL;
+	}
+	memcpy(d->data, dict, dict_size);
+	d->size = dict_size;
+	d->max_buffer_size = max_buffer_size;
+	d->compression_level = compression_level;
+	d->mf_type = params.mf_type;
+	d->nice_match_length = params.nice_match_length;
+	d->max_search_depth = params.max_search_depth;
+	d->has_freqs = false;
+
+	insert_dictionary(d);
+	return d;
+}
+
+/*
+ * For the near-optimal parser, estimate the symbol frequencies of data which
+ * follows the dictionary, by compressing the end of the dictionary as if it
+ * followed the rest.  If this fails, the parser just starts from the default
+ * costs as usual.
+ */
+static void
+estimate_dictionary_freqs(struct xpack_dictionary *d)
+{
+	const size_t tail_size = MIN(d->size / 4, 65536);
+	struct xpack_dictionary *head;
+	struct xpack_compressor *c;
+	void *out;
+
+	if (d->mf_type != MATCHFINDER_BT || tail_size < 1024)
+		return;
+
+	head = alloc_dictionary(d->data, d->size - tail_size, tail_size,
+				d->compression_level);
+	c = xpack_alloc_compressor(tail_size, d->compression_level);
+	out = malloc(tail_size);
+
+	if (head && c && out && xpack_compressor_use_dictionary(c, head) == 0 &&
+	    xpack_compress(c, &d->data[d->size - tail_size], tail_size,
+			   out, tail_size) != 0) {
+		d->freqs = c->freqs;
+		d->has_freqs = true;
+	}
+
+	free(out);
+	xpack_free_compressor(c);
+	xpack_free_dictionary(head);
+}
+
+/* Stop using the preset dictionary, if any. */
+static void
+release_dictionary(struct xpack_compressor *c)
+{
+	if (c->dict_owned)
+		xpack_free_dictionary((struct xpack_dictionary *)c->dict);
+	xpack_mem_free(&c->mem, c->dict_buffer);
+	xpack_mem_free(&c->mem, c->dict_mf_tabs);
+	c->dict = NULL;
+	c->dict_owned = false;
+	c->dict_buffer = NULL;
+	c->dict_size = 0;
+	c->dict_mf_tabs = NULL;
+	c->dict_mf_dirty_end = 0;
+}
+
+LIBEXPORT struct xpack_dictionary *
+xpack_digest_dictionary(const void *dict, size_t dict_size,
+			size_t max_buffer_size, int compression_level)
+{
+	struct xpack_dictionary *d;
+
+	d = alloc_dictionary(dict, dict_size, max_buffer_size,
+			     compression_level);
+	if (d)
+		estimate_dictionary_freqs(d);
+	return d;
+}
+
+LIBEXPORT int
+xpack_compressor_use_dictionary(struct xpack_compressor *c,
+				const struct xpack_dictionary *dict)
+{
+	u8 *dict_buffer;
+	u32 *dict_mf_tabs;
+
+	/* This cancels any stream in progress, since the matchfinder is set up
+	 * again. */
+	c->stream_active = false;
+
+	if (!dict) {
+		release_dictionary(c);
+		setup_matchfinder(c, c->max_buffer_size, NULL);
+		return 0;
+	}
+
+	if (dict->max_buffer_size != c->max_buffer_size ||
+	    dict->compression_level != c->compression_level)
+		return -1;
+
+	dict_buffer = xpack_mem_alloc(&c->mem, dict->size + c->max_buffer_size);
+	dict_mf_tabs = xpack_mem_alloc(&c->mem,
+				       matchfinder_tabs_size(c->mf_type,
+							     dict->size +
+							     c->max_buffer_size));
+	if (!dict_buffer || !dict_mf_tabs) {
+		xpack_mem_free(&c->mem, dict_buffer);
+		xpack_mem_free(&c->mem, dict_mf_tabs);
+		return -1;
+	}
+
+	memcpy(dict_buffer, dict->data, dict->size);
+	release_dictionary(c);
+	c->dict = dict;
+	c->dict_buffer = dict_buffer;
+	c->dict_size = dict->size;
+	c->dict_mf_tabs = dict_mf_tabs;
+	setup_matchfinder(c, dict->size + c->max_buffer_size, dict_mf_tabs);
+	return 0;
+}
+
+LIBEXPORT int
+xpack_compressor_set_dictionary(struct xpack_compressor *c,
+				const void *dict, size_t dict_size)
+{
+	struct xpack_dictionary *d;
+
+	if (dict_size == 0)
+		return xpack_compressor_use_dictionary(c, NULL);
+
+	d = xpack_digest_dictionary(dict, dict_size, c->max_buffer_size,
+				    c->compression_level);
+	if (!d)
+		return -1;
+
+	if (xpack_compressor_use_dictionary(c, d) != 0) {
+		xpack_free_dictionary(d);
+		return -1;
+	}
+	c->dict_owned = true;
+	return 0;
+}
+
+LIBEXPORT void
+xpack_free_dictionary(struct xpack_dictionary *dict)
+{
+	if (dict) {
+		free(dict->data);
+		free(dict);
+	}
+}
+
+/*
+ * Compress the data that has been fed into the stream window but not yet
+ * compressed, and place the result in the stream output buffer.  The stream
+ * output buffer must be empty.  If @is_final_data is true, then this ends the
+ * stream, even if there is no pending data.
+ */
+static void
+stream_compress_pending(struct xpack_compressor *c, bool is_final_data)
+{
+	const size_t pending = c->in_nbytes - c->in_start;
+	u32 saved_recent_offsets[NUM_REPS];
+	const u32 saved_checksum = c->checksum;
+	size_t nbytes = 0;
+
+	c->in_buffer = &c->stream_window[c->stream_base];
+	c->is_final_data = is_final_data;
+
+	/* Find the long distance matches first, since the parser goes over
+	 * them in order as it goes. */
+	if (c->stream_history > c->window_size && pending != 0) {
+		const u32 base = c->stream_base;
+		size_t num;
+		size_t i;
+
+		num = ldm_matchfinder_find_matches(c->ldm, c->stream_window,
+						   base + c->in_start,
+						   base + c->in_nbytes,
+						   c->stream_history,
+						   c->ldm_matches);
+		for (i = 0; i < num; i++)
+			c->ldm_matches[i].pos -= base;
+		c->ldm_next = c->ldm_matches;
+		c->ldm_end = &c->ldm_matches[num];
+		c->ldm_retry_end = 0;
+		c->ldm_next_pos = (num != 0) ? c->ldm_matches[0].pos :
+					       UINT32_MAX;
+	}
+
+	if (pending != 0) {
+		/*
+		 * Only keep the compressed data if it is smaller than the
+		 * original.  Otherwise, fall back to uncompressed blocks and
+		 * undo any changes to the recent offsets queue, since the
+		 * decompressor won't see the matches, and stop reusing tables
+		 * it won't see either.  The uncompressed blocks add the data
+		 * to the checksum again.  The matchfinder state remains valid
+		 * either way, since it only depends on the data.
+		 */
+		memcpy(saved_recent_offsets, c->recent_offsets,
+		       sizeof(saved_recent_offsets));
+		if (c->stats_callback)
+			c->block_start_time = read_stats_clock(c);
+		nbytes = (*c->impl)(c, c->stream_out, pending);
+		if (nbytes == 0) {
+			memcpy(c->recent_offsets, saved_recent_offsets,
+			       sizeof(saved_recent_offsets));
+			reset_codes(&c->codes);
+			c->checksum = saved_checksum;
+		}
+	}
+
+	if (nbytes == 0)
+		nbytes = write_uncompressed_blocks(c, &c->in_buffer[c->in_start],
+						   pending, c->stream_out,
+						   UNCOMPRESSED_BLOCKS_BOUND(pending),
+						   is_final_data);
+
+	c->stream_out_nbytes = nbytes;
+	c->stream_out_pos = 0;
+	c->in_start = c->in_nbytes;
+}
+
+/*
+ * Make room in the stream window for more data.  When the parser's view of the
+ * window is full, move it up so that exactly 'window_size' bytes of history
+ * precede the first byte that hasn't been compressed yet.  When the stream
+ * window itself is full, move the data in it down, keeping at least
+ * 'stream_history' bytes of history as well as all of the parser's view.
+ * Without long distance matching, both happen together.
+ */
+static void
+stream_slide_window(struct xpack_compressor *c)
+{
+	if (c->in_nbytes == 2 * (size_t)c->window_size) {
+		const size_t slide = c->in_start - c->window_size;
+
+		switch (c->mf_type) {
+		case MATCHFINDER_HT:
+			ht_matchfinder_slide_window(&c->ht_mf, slide);
+			break;
+		case MATCHFINDER_HC:
+			hc_matchfinder_slide_window(&c->hc_mf, slide,
+						    c->in_nbytes);
+			break;
+		case MATCHFINDER_BT:
+			bt_matchfinder_slide_window(&c->bt_mf, slide,
+						    c->in_nbytes);
+			break;
+		}
+		c->stream_base += slide;
+		c->in_start -= slide;
+		c->in_nbytes -= slide;
+	}
+
+	if (c->stream_base + c->in_nbytes == c->stream_window_alloc) {
+		const size_t slide = MIN(c->stream_base,
+					 c->stream_base + c->in_start -
+					 c->stream_history);
+
+		memmove(c->stream_window, &c->stream_window[slide],
+			c->stream_window_alloc - slide);
+		if (c->stream_history > c->window_size)
+			ldm_matchfinder_slide_window(c->ldm, slide);
+		c->stream_base -= slide;
+	}
+}
+
+LIBEXPORT int
+xpack_compress_stream_init(struct xpack_compressor *c)
+{
+	const size_t window_size = MIN(c->max_buffer_size / 2,
+				       MAX_STREAM_WINDOW_SIZE);
+	const size_t history = MAX(window_size, c->long_window_size);
+	size_t alloc = 2 * window_size;
+
+#ifdef ENABLE_PREPROCESSING
+	/* The decompressor postprocesses the whole buffer at once. */
+	return -1;
+#endif
+	if (window_size == 0)
+		return -1;
+
+	/*
+	 * With long distance matching, the stream window is large enough that
+	 * sliding it moves all but about 'history' bytes out, so that the time
+	 * spent sliding stays small.  See stream_slide_window().
+	 */
+	if (history > window_size) {
+		const size_t ldm_size = ldm_matchfinder_size(history);
+
+		alloc = 2 * history + window_size;
+
+		if (!c->ldm || c->ldm_size < ldm_size) {
+			xpack_mem_free(&c->mem, c->ldm);
+			c->ldm_size = 0;
+			c->ldm = xpack_mem_alloc(&c->mem, ldm_size);
+			if (!c->ldm)
+				return -1;
+			c->ldm_size = ldm_size;
+		}
+		if (!c->ldm_matches) {
+			c->ldm_matches = xpack_mem_alloc(&c->mem,
+				(window_size / LDM_MIN_MATCH_LEN + 1) *
+				sizeof(struct ldm_match));
+			if (!c->ldm_matches)
+				return -1;
+		}
+		ldm_matchfinder_setup(c->ldm, history);
+		ldm_matchfinder_init(c->ldm);
+	}
+
+	if (!c->stream_window || c->stream_window_alloc < alloc) {
+		xpack_mem_free(&c->mem, c->stream_window);
+		c->stream_window_alloc = 0;
+		c->stream_window = xpack_mem_alloc(&c->mem, alloc);
+		if (!c->stream_window)
+			return -1;
+		c->stream_window_alloc = alloc;
+	}
+
+	if (!c->stream_out) {
+		c->stream_out = xpack_mem_alloc(&c->mem,
+				UNCOMPRESSED_BLOCKS_BOUND(window_size));
+		if (!c->stream_out)
+			return -1;
+	}
+
+	c->in_buffer = c->stream_window;
+	c->in_start = 0;
+	c->in_nbytes = 0;
+	c->window_size = window_size;
+	c->stream_base = 0;
+	c->stream_history = history;
+	c->stream_segment_size = window_size;
+	c->stream_out_nbytes = 0;
+	c->stream_out_pos = 0;
+	c->stream_active = true;
+	c->checksum = 0;
+	c->ldm_next_pos = UINT32_MAX;
+
+	init_recent_offsets(c->recent_offsets);
+	reset_codes(&c->codes);
+	init_matchfinder(c, 2 * window_size);
+	c->dict_mf_dirty_end = 0;
+	return 0;
+}
+
+LIBEXPORT size_t
+xpack_compress_stream_feed(struct xpack_compressor *c,
+			   const void *in, size_t in_nbytes)
+{
+	const u8 *in_next = in;
+
+	if (!c->stream_active)
+		return 0;
+
+	for (;;) {
+		size_t n;
+
+		/* Compress the next segment as soon as it is full. */
+		if (c->in_nbytes - c->in_start == c->stream_segment_size) {
+			if (c->stream_out_pos != c->stream_out_nbytes)
+				break;
+			stream_compress_pending(c, false);
+		}
+
+		if (in_nbytes == 0)
+			break;
+
+		if (c->in_nbytes == 2 * (size_t)c->window_size ||
+		    c->stream_base + c->in_nbytes == c->stream_window_alloc)
+			stream_slide_window(c);
+
+		n = MIN(in_nbytes,
+			c->stream_segment_size - (c->in_nbytes - c->in_start));
+		n = MIN(n, 2 * (size_t)c->window_size - c->in_nbytes);
+		n = MIN(n, c->stream_window_alloc -
+			   (c->stream_base + c->in_nbytes));
+		memcpy(&c->stream_window[c->stream_base + c->in_nbytes],
+		       in_next, n);
+		c->in_nbytes += n;
+		in_next += n;
+		in_nbytes -= n;
+	}
+
+	return in_next - (const u8 *)in;
+}
+
+LIBEXPORT int
+xpack_compress_stream_flush(struct xpack_compressor *c)
+{
+	if (!c->stream_active || c->stream_out_pos != c->stream_out_nbytes)
+		return -1;
+
+	if (c->in_nbytes != c->in_start)
+		stream_compress_pending(c, false);
+	return 0;
+}
+
+LIBEXPORT int
+xpack_compress_stream_end(struct xpack_compressor *c)
+{
+	if (!c->stream_active || c->stream_out_pos != c->stream_out_nbytes)
+		return -1;
+
+	stream_compress_pending(c, true);
+	c->stream_active = false;
+	return 0;
+}
+
+LIBEXPORT size_t
+xpack_compress_stream_read(struct xpack_compressor *c,
+			   void *out, size_t out_nbytes_avail)
+{
+	size_t n = MIN(out_nbytes_avail,
+		       c->stream_out_nbytes - c->stream_out_pos);
+
+	memcpy(out, &c->stream_out[c->stream_out_pos], n);
+	c->stream_out_pos += n;
+	return n;
+}
+
+LIBEXPORT void
+xpack_compressor_set_block_stats_callback(struct xpack_compressor *c,
+					  xpack_block_stats_callback_t callback,
+					  unsigned long long (*clock)(void),
+					  void *private_data)
+{
+	c->stats_callback = callback;
+	c->stats_clock = clock;
+	c->stats_private_data = private_data;
+}
+
+LIBEXPORT int
+xpack_compressor_set_decode_speed(struct xpack_compressor *c, int decode_speed)
+{
+	if (decode_speed < 0 || decode_speed > XPACK_MAX_DECODE_SPEED)
+		return -1;
+	set_decode_speed_params(c, decode_speed);
+	return 0;
+}
+
+LIBEXPORT int
+xpack_compressor_set_long_window(struct xpack_compressor *c,
+				 size_t window_size)
+{
+	/* Each offset symbol after the repeat offsets is for one log2 value. */
+	STATIC_ASSERT(XPACK_MAX_LONG_WINDOW_SIZE <
+		      (size_t)1 << (MAX_OFFSET_ALPHABET_SIZE - NUM_REPS));
+
+	if (window_size > XPACK_MAX_LONG_WINDOW_SIZE)
+		return -1;
+	c->long_window_size = window_size;
+	return 0;
+}
+
+LIBEXPORT void
+xpack_compressor_set_checksum(struct xpack_compressor *c, int enabled)
+{
+	c->checksum_enabled = enabled;
+}
+
+LIBEXPORT uint32_t
+xpack_compressor_get_checksum(const struct xpack_compressor *c)
+{
+	return c->checksum;
+}
+
 LIBEXPORT void
 xpack_free_compressor(struct xpack_compressor *c)
 {
 	if (c) {
+		struct xpack_mem m = c->mem;
+
 	#ifdef ENABLE_PREPROCESSING
-		free(c->in_buffer);
+		xpack_mem_free(&m, c->preprocess_buffer);
 	#endif
-		free(c);
+		release_dictionary(c);
+		xpack_mem_free(&m, c->near_optimal);
+		xpack_mem_free(&m, c->extra_bytes);
+		xpack_mem_free(&m, c->matches);
+		xpack_mem_free(&m, c->literals);
+		xpack_mem_free(&m, c->ldm_matches);
+		xpack_mem_free(&m, c->ldm);
+		xpack_mem_free(&m, c->stream_out);
+		xpack_mem_free(&m, c->stream_window);
+		xpack_mem_free(&m, c);
 	}
 }
 
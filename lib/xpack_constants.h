@@ -12,9 +12,13 @@
 #define BLOCKTYPE_ALIGNED		2
 #define BLOCKTYPE_UNCOMPRESSED		3
 
+/* Flag in the block type: the buffer the block is in was preprocessed */
+#define BLOCKTYPE_FLAG_PREPROCESSED	4
+
 #define NUM_BLOCKTYPE_BITS		3
 #define NUM_BLOCKSIZE_BITS		20
 #define DEFAULT_BLOCK_SIZE		32768
+#define MAX_BLOCK_SIZE			((1 << NUM_BLOCKSIZE_BITS) - 1)
 
 #define NUM_ALIGNED_BITS		3
 
@@ -34,8 +38,14 @@
 
 #define MAX_LOG2_NUM_STATES		MAX_LOG2_NUM_LITERAL_STATES
 #define MAX_NUM_STATES			(1 << MAX_LOG2_NUM_STATES)
+#define PREDEFINED_LOG2_NUM_STATES	14
+#define REPEAT_LOG2_NUM_STATES		15
+
+#define LOG2_NUM_PREDEFINED_LITRUNLEN_STATES	7
+#define LOG2_NUM_PREDEFINED_LENGTH_STATES	9
+#define LOG2_NUM_PREDEFINED_OFFSET_STATES	8
 
-#define NUM_LITERAL_STREAMS		2
+#define NUM_LITERAL_STREAMS		4
 
 #define MAGIC_FILESIZE			12000000
 
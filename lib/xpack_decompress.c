@@ -28,10 +28,23 @@
 #ifdef __SSE2__
 #  include <emmintrin.h>
 #endif
+#ifdef __SSSE3__
+#  include <tmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
 
 #include "xpack_common.h"
 #include "x86_cpu_features.h"
 
+#if X86_CPU_FEATURES_ENABLED && COMPILER_SUPPORTS_AVX2_TARGET
+#  include <immintrin.h>
+#  define AVX2_KERNELS_ENABLED 1
+#else
+#  define AVX2_KERNELS_ENABLED 0
+#endif
+
 /*
  * If the expression passed to SAFETY_CHECK() evaluates to false, then the
  * decompression routine immediately returns DECOMPRESS_BAD_DATA, indicating the
@@ -99,6 +112,21 @@ typedef struct {
 )
 #endif
 
+/* Build a word which consists of the byte @b repeated. */
+static forceinline machine_word_t
+repeat_byte(u8 b)
+{
+	machine_word_t v;
+
+	STATIC_ASSERT(WORDBITS == 32 || WORDBITS == 64);
+
+	v = b;
+	v |= v << 8;
+	v |= v << 16;
+	v |= v << ((WORDBITS == 64) ? 32 : 0);
+	return v;
+}
+
 /*
  * Build the FSE decode table for an alphabet.
  *
@@ -128,31 +156,50 @@ build_fse_decode_table(fse_decode_entry_t decode_table[], u16 state_counts[],
 	const unsigned num_states = 1 << log2_num_states;
 	const unsigned state_generator = get_state_generator(num_states);
 	const unsigned state_mask = num_states - 1;
+	u8 spread[MAX_NUM_STATES + WORDBYTES];
 	unsigned state = 0;
 	u32 total_count = 0;
 	unsigned sym;
-
-	for (sym = 0; sym < alphabet_size; sym++) {
-		unsigned count = state_counts[sym];
-		if (count == 0) /* Unused symbol? */
-			continue;
-		total_count += count;
-		do {
-			decode_table[state].entry = sym;
-			state = (state + state_generator) & state_mask;
-		} while (--count);
-	}
+	unsigned i;
 
 	/*
-	 * Verify that the sum of the state counts really was
-	 * 2**log2_num_states.  With a bad input, the sum might be lower than
-	 * expected (in which case not all states were visited) or higher than
-	 * expected (in which case some states were visited multiple times).
-	 * Both cases are strictly forbidden.
+	 * Verify that the sum of the state counts really is 2**log2_num_states.
+	 * With a bad input, the sum might be lower than expected (in which case
+	 * not all states would be visited) or higher than expected (in which
+	 * case some states would be visited multiple times).  Both cases are
+	 * strictly forbidden.
 	 */
+	for (sym = 0; sym < alphabet_size; sym++)
+		total_count += state_counts[sym];
 	if (unlikely(total_count != num_states))
 		return false;
 
+	/*
+	 * Rather than stepping through the states once per symbol, which
+	 * branches on each symbol's count, first lay out the symbols in order
+	 * in 'spread', writing a word of copies of each symbol at a time.
+	 * Writing past the end of a symbol's run is fine, since the next run
+	 * overwrites it and 'spread' has a word of slack at the end.  Then
+	 * visit the states in the special order, assigning them the symbols
+	 * from 'spread' in turn.  This second loop has no data-dependent
+	 * branches.
+	 */
+	i = 0;
+	for (sym = 0; sym < alphabet_size; sym++) {
+		const machine_word_t v = repeat_byte(sym);
+		const unsigned count = state_counts[sym];
+		unsigned j = 0;
+		do {
+			store_word_unaligned(v, &spread[i + j]);
+			j += WORDBYTES;
+		} while (j < count);
+		i += count;
+	}
+	for (i = 0; i < num_states; i++) {
+		decode_table[state].entry = spread[i];
+		state = (state + state_generator) & state_mask;
+	}
+
 	/*
 	 * Now, set 'num_bits' and 'destination_range_start' for each decode
 	 * table entry.  This works as follows.  First, a little background:
@@ -260,6 +307,8 @@ copy_16_bytes_unaligned(const u8 *src, u8 *dst)
 #ifdef __SSE2__
 	__m128i v = _mm_loadu_si128((const __m128i *)src);
 	_mm_storeu_si128((__m128i *)dst, v);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	vst1q_u8(dst, vld1q_u8(src));
 #else
 	STATIC_ASSERT(WORDBYTES == 4 || WORDBYTES == 8);
 	if (WORDBYTES == 4) {
@@ -274,20 +323,128 @@ copy_16_bytes_unaligned(const u8 *src, u8 *dst)
 #endif
 }
 
-/* Build a word which consists of the byte @b repeated. */
-static forceinline machine_word_t
-repeat_byte(u8 b)
+/* Copy 32 bytes from @src to @dst, making no assumptions about alignment. */
+static forceinline void
+copy_32_bytes_unaligned(const u8 *src, u8 *dst)
 {
-	machine_word_t v;
+	copy_16_bytes_unaligned(src + 0, dst + 0);
+	copy_16_bytes_unaligned(src + 16, dst + 16);
+}
 
-	STATIC_ASSERT(WORDBITS == 32 || WORDBITS == 64);
+#if defined(__SSSE3__) || (defined(__aarch64__) && defined(__ARM_NEON))
+#  define PATTERN_EXPANSION_ENABLED 1
+#else
+#  define PATTERN_EXPANSION_ENABLED 0
+#endif
 
-	v = b;
-	v |= v << 8;
-	v |= v << 16;
-	v |= v << ((WORDBITS == 64) ? 32 : 0);
-	return v;
+#if PATTERN_EXPANSION_ENABLED || AVX2_KERNELS_ENABLED
+/*
+ * Pattern expansion for matches with offsets less than 16, where each byte
+ * copied depends on a byte copied only 'offset' bytes earlier.  Instead of
+ * copying one byte at a time, load the 'offset' bytes of the pattern (plus some
+ * don't-care bytes following them), then use a byte shuffle to replicate them
+ * to fill 32 bytes: byte 'i' of the result is byte 'i % offset' of the pattern.
+ * Storing this vector every 'pattern_steps[offset]' bytes, which is the largest
+ * multiple of 'offset' that is <= 32, then keeps the pattern in phase.
+ */
+static const u8 pattern_shuffle_masks[16][32] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1,
+	  0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1 },
+	{ 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0,
+	  1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1 },
+	{ 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3,
+	  0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3 },
+	{ 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0,
+	  1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1 },
+	{ 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3,
+	  4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1 },
+	{ 0, 1, 2, 3, 4, 5, 6, 0, 1, 2, 3, 4, 5, 6, 0, 1,
+	  2, 3, 4, 5, 6, 0, 1, 2, 3, 4, 5, 6, 0, 1, 2, 3 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7,
+	  0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 0, 1, 2, 3, 4, 5, 6,
+	  7, 8, 0, 1, 2, 3, 4, 5, 6, 7, 8, 0, 1, 2, 3, 4 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1, 2, 3, 4, 5,
+	  6, 7, 8, 9, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0, 1, 2, 3, 4,
+	  5, 6, 7, 8, 9, 10, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0, 1, 2, 3,
+	  4, 5, 6, 7, 8, 9, 10, 11, 0, 1, 2, 3, 4, 5, 6, 7 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 0, 1, 2,
+	  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 0, 1, 2, 3, 4, 5 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 0, 1,
+	  2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 0, 1, 2, 3 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 0,
+	  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 0, 1 },
+};
+
+static const u8 pattern_steps[16] = {
+	0, 32, 32, 30, 32, 30, 30, 28, 32, 27, 30, 22, 24, 26, 28, 30
+};
+#endif /* PATTERN_EXPANSION_ENABLED || AVX2_KERNELS_ENABLED */
+
+#if PATTERN_EXPANSION_ENABLED
+/*
+ * Write the pattern of period @offset that begins at @src == @dst - @offset,
+ * from @dst up to at least @end.  Up to 31 bytes past @end may be written.
+ */
+static forceinline void
+expand_pattern(const u8 *src, u8 *dst, const u8 *end, unsigned offset)
+{
+	const unsigned step = pattern_steps[offset];
+#ifdef __SSSE3__
+	const __m128i v = _mm_loadu_si128((const __m128i *)src);
+	const __m128i lo = _mm_shuffle_epi8(v,
+		_mm_loadu_si128((const __m128i *)&pattern_shuffle_masks[offset][0]));
+	const __m128i hi = _mm_shuffle_epi8(v,
+		_mm_loadu_si128((const __m128i *)&pattern_shuffle_masks[offset][16]));
+	do {
+		_mm_storeu_si128((__m128i *)(dst + 0), lo);
+		_mm_storeu_si128((__m128i *)(dst + 16), hi);
+		dst += step;
+	} while (dst < end);
+#else
+	const uint8x16_t v = vld1q_u8(src);
+	const uint8x16_t lo = vqtbl1q_u8(v,
+				vld1q_u8(&pattern_shuffle_masks[offset][0]));
+	const uint8x16_t hi = vqtbl1q_u8(v,
+				vld1q_u8(&pattern_shuffle_masks[offset][16]));
+	do {
+		vst1q_u8(dst + 0, lo);
+		vst1q_u8(dst + 16, hi);
+		dst += step;
+	} while (dst < end);
+#endif
 }
+#endif /* PATTERN_EXPANSION_ENABLED */
+
+#if AVX2_KERNELS_ENABLED
+/* AVX2 version of copy_32_bytes_unaligned() */
+static forceinline __attribute__((target("avx2"))) void
+copy_32_bytes_avx2(const u8 *src, u8 *dst)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)src);
+	_mm256_storeu_si256((__m256i *)dst, v);
+}
+
+/* AVX2 version of expand_pattern() */
+static forceinline __attribute__((target("avx2"))) void
+expand_pattern_avx2(const u8 *src, u8 *dst, const u8 *end, unsigned offset)
+{
+	const unsigned step = pattern_steps[offset];
+	const __m256i v = _mm256_shuffle_epi8(
+		_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+		_mm256_loadu_si256((const __m256i *)pattern_shuffle_masks[offset]));
+	do {
+		_mm256_storeu_si256((__m256i *)dst, v);
+		dst += step;
+	} while (dst < end);
+}
+#endif /* AVX2_KERNELS_ENABLED */
 
 
 /******************************************************************************
@@ -406,13 +563,15 @@ do {									\
  * Note that if the bitbuffer variable currently contains more than 8 bits, then
  * we must rewind 'in_next', effectively putting those bits back.  Only the bits
  * in what would be the "current" byte if we were reading one byte at a time can
- * be actually discarded.
+ * be actually discarded.  Any bytes that were "overrun" are given back too, so
+ * the overrun count starts over from zero.
  */
 #define ALIGN_INPUT()							\
 do {									\
 	in_next -= (bitsleft >> 3) - MIN(overrun_count, bitsleft >> 3);	\
 	bitbuf = 0;							\
 	bitsleft = 0;							\
+	overrun_count = 0;						\
 } while (0)
 
 
@@ -420,117 +579,639 @@ do {									\
 struct xpack_decompressor {
 
 	/*
-	 * The FSE decoding table for each alphabet.  The literal table can be
-	 * in union with the other tables because all literal symbols are
-	 * decoded first.
+	 * The FSE decoding table for each alphabet.  These are kept from one
+	 * block to the next, since a block may reuse the table that an earlier
+	 * block sent for an alphabet.
 	 */
-	union {
-		fse_decode_entry_t literal_decode_table
-				[1 << MAX_LOG2_NUM_LITERAL_STATES];
-		struct {
-			fse_decode_entry_t litrunlen_decode_table
-					[1 << MAX_LOG2_NUM_LITRUNLEN_STATES];
-			fse_decode_entry_t length_decode_table
-					[1 << MAX_LOG2_NUM_LENGTH_STATES];
-			fse_decode_entry_t offset_decode_table
-					[1 << MAX_LOG2_NUM_OFFSET_STATES];
-			fse_decode_entry_t aligned_decode_table
-					[1 << MAX_LOG2_NUM_ALIGNED_STATES];
-		};
-	};
+	fse_decode_entry_t literal_decode_table
+			[1 << MAX_LOG2_NUM_LITERAL_STATES];
+	fse_decode_entry_t litrunlen_decode_table
+			[1 << MAX_LOG2_NUM_LITRUNLEN_STATES];
+	fse_decode_entry_t length_decode_table
+			[1 << MAX_LOG2_NUM_LENGTH_STATES];
+	fse_decode_entry_t offset_decode_table
+			[1 << MAX_LOG2_NUM_OFFSET_STATES];
+	fse_decode_entry_t aligned_decode_table
+			[1 << MAX_LOG2_NUM_ALIGNED_STATES];
 
-	/* The FSE state counts for each alphabet */
-	union {
-		u16 state_counts[LITERAL_ALPHABET_SIZE +
-				 LITRUNLEN_ALPHABET_SIZE +
-				 LENGTH_ALPHABET_SIZE +
-				 MAX_OFFSET_ALPHABET_SIZE +
-				 ALIGNED_ALPHABET_SIZE];
-		struct {
-			u16 literal_state_counts[LITERAL_ALPHABET_SIZE];
-			u16 litrunlen_state_counts[LITRUNLEN_ALPHABET_SIZE];
-			u16 length_state_counts[LENGTH_ALPHABET_SIZE];
-			u16 offset_state_counts[MAX_OFFSET_ALPHABET_SIZE];
-			u16 aligned_state_counts[ALIGNED_ALPHABET_SIZE];
-		};
-	};
+	/* The decoding tables for the predefined state counts, built when the
+	 * decompressor is allocated */
+	fse_decode_entry_t predefined_litrunlen_decode_table
+			[1 << LOG2_NUM_PREDEFINED_LITRUNLEN_STATES];
+	fse_decode_entry_t predefined_length_decode_table
+			[1 << LOG2_NUM_PREDEFINED_LENGTH_STATES];
+	fse_decode_entry_t predefined_offset_decode_table
+			[1 << LOG2_NUM_PREDEFINED_OFFSET_STATES];
+
+	/*
+	 * The log2 number of states of each table above, or
+	 * REPEAT_LOG2_NUM_STATES if there is no table which can be reused
+	 */
+	unsigned log2_num_literal_states;
+	unsigned log2_num_litrunlen_states;
+	unsigned log2_num_length_states;
+	unsigned log2_num_offset_states;
+	unsigned log2_num_aligned_states;
+
+	/*
+	 * The FSE state counts sent in a block, for each alphabet that doesn't
+	 * reuse its table, in alphabet order
+	 */
+	u16 state_counts[LITERAL_ALPHABET_SIZE +
+			 LITRUNLEN_ALPHABET_SIZE +
+			 LENGTH_ALPHABET_SIZE +
+			 MAX_OFFSET_ALPHABET_SIZE +
+			 ALIGNED_ALPHABET_SIZE];
+
+	/* The recent offsets queue, carried over from one block to the next */
+	u32 recent_offsets[NUM_REPS];
+
+#ifdef ENABLE_PREPROCESSING
+	/* Nonzero if any block was flagged as preprocessed */
+	unsigned preprocessed;
+#endif
+
+	/*
+	 * The preset dictionary, if any; see
+	 * xpack_decompressor_set_dictionary().  Matches can refer back into the
+	 * last 'dict_avail' bytes of it: all of it for xpack_decompress(), but
+	 * none of it for streams.
+	 */
+	u8 *dict;
+	size_t dict_size;
+	size_t dict_avail;
+
+	/*
+	 * Streaming decompression state.  'stream_in' buffers the input which
+	 * has been fed but not yet decompressed, growing as needed to hold one
+	 * whole block.  'stream_window' holds the output: the last
+	 * 'stream_window_size' bytes may be referenced by matches, and the
+	 * bytes from 'stream_out_pos' to 'stream_out_nbytes' haven't been read
+	 * by the caller yet.
+	 */
+	u8 *stream_in;
+	size_t stream_in_size;
+	size_t stream_in_pos;
+	size_t stream_in_nbytes;
+	size_t stream_in_wanted;
+	u8 *stream_window;
+	size_t stream_window_size;
+	size_t stream_window_alloc;
+	size_t stream_out_pos;
+	size_t stream_out_nbytes;
+	bool stream_active;
+	bool stream_input_ended;
+	bool stream_finished;
+
+	/* The CRC-32C of the data produced so far, if enabled; see
+	 * xpack_decompressor_set_checksum() */
+	bool checksum_enabled;
+	u32 checksum;
+
+	/* Where all the allocations, including this one, come from */
+	struct xpack_mem mem;
 };
 
+/*
+ * No valid block can be this large when compressed: even a block consisting of
+ * only minimum-length matches with the longest possible codes takes less than 6
+ * bytes per uncompressed byte.  A streaming decompressor that has buffered this
+ * much input without completing a block therefore has bad data.
+ */
+#define MAX_STREAM_BLOCK_INPUT	(8 * MAX_BLOCK_SIZE)
+
+/* The initial size of the streaming decompressor's input buffer */
+#define INITIAL_STREAM_IN_SIZE	65536
+
+/* Build the decoding tables for the predefined state counts. */
+static void
+build_predefined_decode_tables(struct xpack_decompressor *d)
+{
+	/* build_fse_decode_table() needs a copy it can modify. */
+	memcpy(d->state_counts, predefined_litrunlen_state_counts,
+	       sizeof(predefined_litrunlen_state_counts));
+	build_fse_decode_table(d->predefined_litrunlen_decode_table,
+			       d->state_counts, LITRUNLEN_ALPHABET_SIZE,
+			       LOG2_NUM_PREDEFINED_LITRUNLEN_STATES);
+
+	memcpy(d->state_counts, predefined_length_state_counts,
+	       sizeof(predefined_length_state_counts));
+	build_fse_decode_table(d->predefined_length_decode_table,
+			       d->state_counts, LENGTH_ALPHABET_SIZE,
+			       LOG2_NUM_PREDEFINED_LENGTH_STATES);
+
+	memcpy(d->state_counts, predefined_offset_state_counts,
+	       sizeof(predefined_offset_state_counts));
+	build_fse_decode_table(d->predefined_offset_decode_table,
+			       d->state_counts, MAX_OFFSET_ALPHABET_SIZE,
+			       LOG2_NUM_PREDEFINED_OFFSET_STATES);
+}
+
+/* Forget the tables kept from earlier blocks, at the start of a buffer or
+ * stream. */
+static void
+reset_decode_tables(struct xpack_decompressor *d)
+{
+	d->log2_num_literal_states = REPEAT_LOG2_NUM_STATES;
+	d->log2_num_litrunlen_states = REPEAT_LOG2_NUM_STATES;
+	d->log2_num_length_states = REPEAT_LOG2_NUM_STATES;
+	d->log2_num_offset_states = REPEAT_LOG2_NUM_STATES;
+	d->log2_num_aligned_states = REPEAT_LOG2_NUM_STATES;
+}
+
 #define FUNCNAME xpack_decompress_default
 #define ATTRIBUTES
+#if AVX2_KERNELS_ENABLED && defined(__AVX2__)
+#  define COPY_32_BYTES copy_32_bytes_avx2
+#  define EXPAND_PATTERN expand_pattern_avx2
+#else
+#  define COPY_32_BYTES copy_32_bytes_unaligned
+#  if PATTERN_EXPANSION_ENABLED
+#    define EXPAND_PATTERN expand_pattern
+#  endif
+#endif
 #include "decompress_impl.h"
 #undef FUNCNAME
 #undef ATTRIBUTES
+#undef COPY_32_BYTES
+#undef EXPAND_PATTERN
 
 #if X86_CPU_FEATURES_ENABLED && \
 	COMPILER_SUPPORTS_BMI2_TARGET && !defined(__BMI2__)
 #  define FUNCNAME xpack_decompress_bmi2
 #  define ATTRIBUTES __attribute__((target("bmi2")))
+#  define COPY_32_BYTES copy_32_bytes_unaligned
+#  if PATTERN_EXPANSION_ENABLED
+#    define EXPAND_PATTERN expand_pattern
+#  endif
+#  include "decompress_impl.h"
+#  undef FUNCNAME
+#  undef ATTRIBUTES
+#  undef COPY_32_BYTES
+#  undef EXPAND_PATTERN
+#  define DISPATCH_BMI2 1
+#else
+#  define DISPATCH_BMI2 0
+#endif
+
+/*
+ * The AVX2 version also requires BMI2, which every processor with AVX2 that
+ * we care about has.
+ */
+#if AVX2_KERNELS_ENABLED && !defined(__AVX2__)
+#  define FUNCNAME xpack_decompress_avx2
+#  define ATTRIBUTES __attribute__((target("avx2,bmi2")))
+#  define COPY_32_BYTES copy_32_bytes_avx2
+#  define EXPAND_PATTERN expand_pattern_avx2
 #  include "decompress_impl.h"
 #  undef FUNCNAME
 #  undef ATTRIBUTES
-#  define DISPATCH_ENABLED 1
+#  undef COPY_32_BYTES
+#  undef EXPAND_PATTERN
+#  define DISPATCH_AVX2 1
 #else
-#  define DISPATCH_ENABLED 0
+#  define DISPATCH_AVX2 0
 #endif
 
+#define DISPATCH_ENABLED (DISPATCH_BMI2 || DISPATCH_AVX2)
+
 #if DISPATCH_ENABLED
 
 static enum decompress_result
-dispatch(struct xpack_decompressor *d, const void *in, size_t in_nbytes,
-	 void *out, size_t out_nbytes_avail, size_t *actual_out_nbytes_ret);
+dispatch(struct xpack_decompressor *d,
+	 const u8 **in_next_p, const u8 *in_end,
+	 u8 *out_begin, u8 **out_next_p, u8 *out_end,
+	 bool single_block, bool *is_final_ret);
 
 typedef enum decompress_result (*decompress_func_t)
-	(struct xpack_decompressor *d, const void *in, size_t in_nbytes,
-	 void *out, size_t out_nbytes_avail, size_t *actual_out_nbytes_ret);
+	(struct xpack_decompressor *d,
+	 const u8 **in_next_p, const u8 *in_end,
+	 u8 *out_begin, u8 **out_next_p, u8 *out_end,
+	 bool single_block, bool *is_final_ret);
 
 static decompress_func_t decompress_impl = dispatch;
 
 static enum decompress_result
-dispatch(struct xpack_decompressor *d, const void *in, size_t in_nbytes,
-	 void *out, size_t out_nbytes_avail, size_t *actual_out_nbytes_ret)
+dispatch(struct xpack_decompressor *d,
+	 const u8 **in_next_p, const u8 *in_end,
+	 u8 *out_begin, u8 **out_next_p, u8 *out_end,
+	 bool single_block, bool *is_final_ret)
 {
 	decompress_func_t f = xpack_decompress_default;
-#if X86_CPU_FEATURES_ENABLED
+#if DISPATCH_BMI2
 	if (x86_have_cpu_feature(X86_CPU_FEATURE_BMI2))
 		f = xpack_decompress_bmi2;
+#endif
+#if DISPATCH_AVX2
+	if (x86_have_cpu_feature(X86_CPU_FEATURE_AVX2) &&
+	    x86_have_cpu_feature(X86_CPU_FEATURE_BMI2))
+		f = xpack_decompress_avx2;
 #endif
 	decompress_impl = f;
-	return (*f)(d, in, in_nbytes, out, out_nbytes_avail,
-		    actual_out_nbytes_ret);
+	return (*f)(d, in_next_p, in_end, out_begin, out_next_p, out_end,
+		    single_block, is_final_ret);
 }
 #endif /* DISPATCH_ENABLED */
 
+/*
+ * Decompress one or more blocks, calling the appropriate implementation
+ * depending on the CPU features at runtime.  See decompress_impl.h for the
+ * documentation.
+ */
+static forceinline enum decompress_result
+decompress_blocks(struct xpack_decompressor *d,
+		  const u8 **in_next_p, const u8 *in_end,
+		  u8 *out_begin, u8 **out_next_p, u8 *out_end,
+		  bool single_block, bool *is_final_ret)
+{
+#if DISPATCH_ENABLED
+	return (*decompress_impl)(d, in_next_p, in_end, out_begin, out_next_p,
+				  out_end, single_block, is_final_ret);
+#else
+	return xpack_decompress_default(d, in_next_p, in_end, out_begin,
+					out_next_p, out_end, single_block,
+					is_final_ret);
+#endif
+}
+
 /*
  * This is the main decompression routine.  See libxpack.h for the
  * documentation.
  *
- * Note that the real code is in decompress_impl.h.  The part here just handles
- * calling the appropriate implementation depending on the CPU features at
- * runtime.
+ * Note that the real code is in decompress_impl.h.
  */
 LIBEXPORT enum decompress_result
 xpack_decompress(struct xpack_decompressor *d, const void *in, size_t in_nbytes,
 		 void *out, size_t out_nbytes_avail,
 		 size_t *actual_out_nbytes_ret)
 {
-#if DISPATCH_ENABLED
-	return (*decompress_impl)(d, in, in_nbytes, out, out_nbytes_avail,
-				  actual_out_nbytes_ret);
-#else
-	return xpack_decompress_default(d, in, in_nbytes, out, out_nbytes_avail,
-					actual_out_nbytes_ret);
+	const u8 *in_next = in;
+	u8 *out_next = out;
+	bool is_final;
+	enum decompress_result result;
+
+	/* This cancels any stream in progress, since the state is shared. */
+	d->stream_active = false;
+
+	init_recent_offsets(d->recent_offsets);
+	reset_decode_tables(d);
+#ifdef ENABLE_PREPROCESSING
+	d->preprocessed = 0;
 #endif
+	d->dict_avail = d->dict_size;
+	d->checksum = 0;
+
+	result = decompress_blocks(d, &in_next, in_next + in_nbytes,
+				   out, &out_next, out_next + out_nbytes_avail,
+				   false, &is_final);
+	if (result != DECOMPRESS_SUCCESS)
+		return result;
+
+#ifdef ENABLE_PREPROCESSING
+	/* Postprocess the data if needed.  The checksum was then computed
+	 * over the preprocessed data, so compute it again. */
+	if (d->preprocessed) {
+		postprocess(out, out_nbytes_avail);
+		if (d->checksum_enabled)
+			d->checksum = xpack_crc32c(0, out,
+						   out_next - (u8 *)out);
+	}
+#endif
+
+	if (actual_out_nbytes_ret) {
+		*actual_out_nbytes_ret = out_next - (u8 *)out;
+	} else {
+		if (out_next != (u8 *)out + out_nbytes_avail)
+			return DECOMPRESS_SHORT_OUTPUT;
+	}
+	return DECOMPRESS_SUCCESS;
+}
+
+LIBEXPORT enum decompress_result
+xpack_decompress_batch(struct xpack_decompressor *d,
+		       struct xpack_batch_item *items, size_t num_items)
+{
+	enum decompress_result first_failure = DECOMPRESS_SUCCESS;
+	size_t i;
+
+	for (i = 0; i < num_items; i++) {
+		struct xpack_batch_item *item = &items[i];
+
+		item->out_nbytes = 0;
+		item->result = xpack_decompress(d, item->in, item->in_nbytes,
+						item->out,
+						item->out_nbytes_avail,
+						&item->out_nbytes);
+		if (item->result != DECOMPRESS_SUCCESS &&
+		    first_failure == DECOMPRESS_SUCCESS)
+			first_failure = item->result;
+	}
+	return first_failure;
+}
+
+/*
+ * Try to decompress the next block of the stream into the stream window.  This
+ * must only be called when all previous output has been read.  Set
+ * *progress_ret to true if a block was decompressed, or to false if more input
+ * is needed first.
+ */
+static enum decompress_result
+stream_decompress_block(struct xpack_decompressor *d, bool *progress_ret)
+{
+	const size_t pending = d->stream_in_nbytes - d->stream_in_pos;
+	const u8 *in_next = &d->stream_in[d->stream_in_pos];
+	u8 *out_next;
+	bool is_final;
+	enum decompress_result result;
+
+	*progress_ret = false;
+
+	/*
+	 * The block can't currently be decompressed without seeing more
+	 * input.  Wait until the pending input has doubled before trying
+	 * again, so that the total time spent retrying stays linear.
+	 */
+	if (pending < d->stream_in_wanted && !d->stream_input_ended)
+		return DECOMPRESS_SUCCESS;
+
+	/*
+	 * Make sure that the largest possible block fits.  When it might not,
+	 * slide the window, keeping only the data that can still be
+	 * referenced.
+	 */
+	if (d->stream_window_alloc - d->stream_out_nbytes < MAX_BLOCK_SIZE) {
+		const size_t keep = MIN(d->stream_out_nbytes,
+					d->stream_window_size);
+
+		memmove(d->stream_window,
+			&d->stream_window[d->stream_out_nbytes - keep], keep);
+		d->stream_out_nbytes = keep;
+		d->stream_out_pos = keep;
+	}
+
+	out_next = &d->stream_window[d->stream_out_nbytes];
+
+	result = decompress_blocks(d, &in_next, &d->stream_in[d->stream_in_nbytes],
+				   d->stream_window, &out_next,
+				   &d->stream_window[d->stream_window_alloc],
+				   true, &is_final);
+	if (result != DECOMPRESS_SUCCESS) {
+		/*
+		 * There's no way to tell a truncated block from a corrupt one,
+		 * so assume the block is truncated unless the input has ended
+		 * or no valid block could be this long.
+		 */
+		if (d->stream_input_ended || pending >= MAX_STREAM_BLOCK_INPUT)
+			return DECOMPRESS_BAD_DATA;
+		d->stream_in_wanted = 2 * pending;
+		return DECOMPRESS_SUCCESS;
+	}
+
+	d->stream_in_pos = in_next - d->stream_in;
+	d->stream_in_wanted = 0;
+	d->stream_out_nbytes = out_next - d->stream_window;
+	d->stream_finished = is_final;
+	*progress_ret = true;
+	return DECOMPRESS_SUCCESS;
+}
+
+LIBEXPORT int
+xpack_decompress_stream_init(struct xpack_decompressor *d, size_t window_size)
+{
+	const size_t alloc = 2 * window_size + MAX_BLOCK_SIZE;
+
+#ifdef ENABLE_PREPROCESSING
+	/* Postprocessing needs the whole buffer at once. */
+	return -1;
+#endif
+	if (window_size > (size_t)-1 / 4)
+		return -1;
+
+	if (!d->stream_window || d->stream_window_alloc < alloc) {
+		xpack_mem_free(&d->mem, d->stream_window);
+		d->stream_window = xpack_mem_alloc(&d->mem, alloc);
+		if (!d->stream_window) {
+			d->stream_window_alloc = 0;
+			return -1;
+		}
+		d->stream_window_alloc = alloc;
+	}
+
+	d->stream_in_pos = 0;
+	d->stream_in_nbytes = 0;
+	d->stream_in_wanted = 0;
+	d->stream_window_size = window_size;
+	d->stream_out_pos = 0;
+	d->stream_out_nbytes = 0;
+	d->stream_active = true;
+	d->stream_input_ended = false;
+	d->stream_finished = false;
+	d->dict_avail = 0;
+	d->checksum = 0;
+
+	init_recent_offsets(d->recent_offsets);
+	reset_decode_tables(d);
+	return 0;
+}
+
+LIBEXPORT size_t
+xpack_decompress_stream_feed(struct xpack_decompressor *d,
+			     const void *in, size_t in_nbytes)
+{
+	size_t pending;
+
+	if (!d->stream_active || d->stream_input_ended || d->stream_finished)
+		return 0;
+
+	/* Discard the input that has already been decompressed. */
+	pending = d->stream_in_nbytes - d->stream_in_pos;
+	if (d->stream_in_pos != 0) {
+		memmove(d->stream_in, &d->stream_in[d->stream_in_pos], pending);
+		d->stream_in_pos = 0;
+		d->stream_in_nbytes = pending;
+	}
+
+	in_nbytes = MIN(in_nbytes, MAX_STREAM_BLOCK_INPUT - pending);
+
+	if (d->stream_in_size - pending < in_nbytes) {
+		size_t new_size = MAX(d->stream_in_size, INITIAL_STREAM_IN_SIZE);
+		u8 *new_buf;
+
+		while (new_size < pending + in_nbytes)
+			new_size *= 2;
+		new_size = MIN(new_size, MAX_STREAM_BLOCK_INPUT);
+
+		new_buf = xpack_mem_alloc(&d->mem, new_size);
+		if (new_buf) {
+			if (pending != 0)
+				memcpy(new_buf, d->stream_in, pending);
+			xpack_mem_free(&d->mem, d->stream_in);
+			d->stream_in = new_buf;
+			d->stream_in_size = new_size;
+		}
+		in_nbytes = MIN(in_nbytes, d->stream_in_size - pending);
+	}
+
+	/* Nothing to copy, and possibly still no buffer to copy it to. */
+	if (in_nbytes == 0)
+		return 0;
+
+	memcpy(&d->stream_in[pending], in, in_nbytes);
+	d->stream_in_nbytes += in_nbytes;
+	return in_nbytes;
+}
+
+LIBEXPORT enum decompress_result
+xpack_decompress_stream_read(struct xpack_decompressor *d,
+			     void *out, size_t out_nbytes_avail,
+			     size_t *actual_out_nbytes_ret)
+{
+	u8 *out_next = out;
+	u8 * const out_end = out_next + out_nbytes_avail;
+	enum decompress_result result = DECOMPRESS_SUCCESS;
+
+	if (!d->stream_active) {
+		*actual_out_nbytes_ret = 0;
+		return DECOMPRESS_BAD_DATA;
+	}
+
+	for (;;) {
+		size_t n = MIN(out_end - out_next,
+			       d->stream_out_nbytes - d->stream_out_pos);
+		bool progress;
+
+		memcpy(out_next, &d->stream_window[d->stream_out_pos], n);
+		out_next += n;
+		d->stream_out_pos += n;
+
+		if (out_next == out_end || d->stream_finished)
+			break;
+
+		result = stream_decompress_block(d, &progress);
+		if (result != DECOMPRESS_SUCCESS) {
+			d->stream_active = false;
+			break;
+		}
+		if (!progress)
+			break;
+	}
+
+	*actual_out_nbytes_ret = out_next - (u8 *)out;
+	return result;
+}
+
+LIBEXPORT int
+xpack_decompress_stream_end(struct xpack_decompressor *d)
+{
+	if (!d->stream_active)
+		return -1;
+
+	d->stream_input_ended = true;
+	return 0;
+}
+
+/* The arena space needed for a decompressor */
+#define DECOMPRESSOR_ARENA_SIZE	\
+	(ARENA_ALIGNMENT - 1 + ARENA_SIZE(sizeof(struct xpack_decompressor)))
+
+/*
+ * Allocate a decompressor from 'allocator', or from the arena 'mem' if it isn't
+ * NULL.
+ */
+static struct xpack_decompressor *
+alloc_decompressor(const struct xpack_allocator *allocator,
+		   void *mem, size_t mem_size)
+{
+	struct xpack_mem m;
+	struct xpack_decompressor *d;
+
+	if (mem && mem_size < DECOMPRESSOR_ARENA_SIZE)
+		return NULL;
+
+	xpack_mem_init(&m, allocator, mem, mem_size);
+	d = xpack_mem_alloc(&m, sizeof(struct xpack_decompressor));
+	if (!d)
+		return NULL;
+
+	d->mem = m;
+	d->dict = NULL;
+	d->dict_size = 0;
+	d->stream_in = NULL;
+	d->stream_in_size = 0;
+	d->stream_window = NULL;
+	d->stream_window_alloc = 0;
+	d->stream_active = false;
+	d->checksum_enabled = false;
+	d->checksum = 0;
+	build_predefined_decode_tables(d);
+	return d;
 }
 
 LIBEXPORT struct xpack_decompressor *
 xpack_alloc_decompressor(void)
 {
-	return malloc(sizeof(struct xpack_decompressor));
+	return alloc_decompressor(NULL, NULL, 0);
+}
+
+LIBEXPORT struct xpack_decompressor *
+xpack_alloc_decompressor_ex(const struct xpack_allocator *allocator)
+{
+	return alloc_decompressor(allocator, NULL, 0);
+}
+
+LIBEXPORT struct xpack_decompressor *
+xpack_init_decompressor(void *mem, size_t mem_size)
+{
+	if (!mem)
+		return NULL;
+	return alloc_decompressor(NULL, mem, mem_size);
+}
+
+LIBEXPORT size_t
+xpack_decompressor_memory_usage(void)
+{
+	return DECOMPRESSOR_ARENA_SIZE;
+}
+
+LIBEXPORT int
+xpack_decompressor_set_dictionary(struct xpack_decompressor *d,
+				  const void *dict, size_t dict_size)
+{
+	u8 *new_dict = NULL;
+
+	if (dict_size != 0) {
+		new_dict = xpack_mem_alloc(&d->mem, dict_size);
+		if (!new_dict)
+			return -1;
+		memcpy(new_dict, dict, dict_size);
+	}
+	xpack_mem_free(&d->mem, d->dict);
+	d->dict = new_dict;
+	d->dict_size = dict_size;
+	return 0;
+}
+
+LIBEXPORT void
+xpack_decompressor_set_checksum(struct xpack_decompressor *d, int enabled)
+{
+	d->checksum_enabled = enabled;
+}
+
+LIBEXPORT uint32_t
+xpack_decompressor_get_checksum(const struct xpack_decompressor *d)
+{
+	return d->checksum;
 }
 
 LIBEXPORT void
 xpack_free_decompressor(struct xpack_decompressor *d)
 {
-	free(d);
+	if (d) {
+		struct xpack_mem m = d->mem;
+
+		xpack_mem_free(&m, d->dict);
+		xpack_mem_free(&m, d->stream_in);
+		xpack_mem_free(&m, d->stream_window);
+		xpack_mem_free(&m, d);
+	}
 }
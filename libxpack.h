@@ -10,6 +10,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* Microsoft C / Visual Studio garbage.  If you want to link to the DLL version
  * of libxpack, then #define LIBXPACK_DLL. */
@@ -24,6 +25,23 @@ extern "C" {
 #  define LIBXPACKAPI
 #endif
 
+/* ========================================================================== */
+/*                            Memory allocation                               */
+/* ========================================================================== */
+
+/*
+ * struct xpack_allocator gives the functions which a compressor or decompressor
+ * allocated with xpack_alloc_compressor_ex() or xpack_alloc_decompressor_ex()
+ * uses instead of malloc() and free().  'alloc_func' must return memory aligned
+ * as malloc()'s is, or NULL on failure.  'free_func' is never passed NULL.
+ * 'private_data' is passed to both, e.g. to select a NUMA node or an arena.
+ */
+struct xpack_allocator {
+	void *(*alloc_func)(size_t size, void *private_data);
+	void (*free_func)(void *ptr, void *private_data);
+	void *private_data;
+};
+
 /* ========================================================================== */
 /*                               Compression                                  */
 /* ========================================================================== */
@@ -39,7 +57,9 @@ struct xpack_compressor;
  * compressor.
  *
  * 'compression_level' is the compression level on a zlib-like scale (1 =
- * fastest, 6 = medium/default, 9 = slowest).
+ * fastest, 6 = medium/default, 9 = slow).  Level 1 uses a much simpler
+ * matchfinder than the other levels, so it is considerably faster.  Levels 10
+ * through 12 are even slower and use near-optimal parsing to compress more.
  *
  * Returns a pointer to the new compressor, or NULL if out of memory or the
  * maximum buffer size or compression level is not supported.
@@ -47,6 +67,48 @@ struct xpack_compressor;
 LIBXPACKAPI struct xpack_compressor *
 xpack_alloc_compressor(size_t max_buffer_size, int compression_level);
 
+/*
+ * xpack_alloc_compressor_ex() is like xpack_alloc_compressor(), except that
+ * all the memory which the compressor allocates, both now and later (e.g. for
+ * streaming or a preset dictionary), comes from 'allocator'.  The allocator is
+ * copied.  If 'allocator' is NULL, malloc() and free() are used.
+ */
+LIBXPACKAPI struct xpack_compressor *
+xpack_alloc_compressor_ex(size_t max_buffer_size, int compression_level,
+			  const struct xpack_allocator *allocator);
+
+/*
+ * xpack_init_compressor() is like xpack_alloc_compressor(), except that the
+ * compressor is placed in the caller's memory at 'mem', which is 'mem_size'
+ * bytes long, so that the caller can e.g. pre-fault it or use huge pages.
+ * 'mem_size' must be at least xpack_compressor_memory_usage() for the same
+ * 'max_buffer_size' and 'compression_level'.  Memory which the compressor needs
+ * later, e.g. for streaming or a preset dictionary, is taken from whatever is
+ * left of 'mem', or allocated with malloc() once that runs out.
+ *
+ * Returns a pointer to the compressor, which lies within 'mem', or NULL if
+ * 'mem_size' is too small or the maximum buffer size or compression level is
+ * not supported.  xpack_free_compressor() must still be called to release any
+ * memory allocated later, but it doesn't free 'mem' itself.
+ */
+LIBXPACKAPI struct xpack_compressor *
+xpack_init_compressor(void *mem, size_t mem_size,
+		      size_t max_buffer_size, int compression_level);
+
+/*
+ * xpack_compressor_memory_usage() returns the number of bytes of memory that
+ * xpack_alloc_compressor() would allocate for a compressor with the same
+ * 'max_buffer_size' and 'compression_level', rounded up for alignment, or 0 if
+ * the compression level is not supported.  This is also the minimum 'mem_size'
+ * for xpack_init_compressor().  The buffers and hash tables are sized from
+ * 'max_buffer_size', so a compressor for small buffers needs much less memory
+ * than one for large buffers.  This does not include the stream buffers, which
+ * are allocated by xpack_compress_stream_init() and add about 'max_buffer_size
+ * * 1.5' bytes.
+ */
+LIBXPACKAPI size_t
+xpack_compressor_memory_usage(size_t max_buffer_size, int compression_level);
+
 /*
  * xpack_compress() compresses a buffer of data.  The function attempts to
  * compress 'in_nbytes' bytes of data located at 'in' and write the results to
@@ -59,9 +121,282 @@ xpack_compress(struct xpack_compressor *compressor,
 	       const void *in, size_t in_nbytes,
 	       void *out, size_t out_nbytes_avail);
 
+/*
+ * struct xpack_batch_item describes one buffer of a batch for
+ * xpack_compress_batch() or xpack_decompress_batch().  The caller fills in
+ * 'in', 'in_nbytes', 'out', and 'out_nbytes_avail'; the library sets
+ * 'out_nbytes' and 'result'.
+ */
+struct xpack_batch_item {
+	const void *in;
+	size_t in_nbytes;
+	void *out;
+	size_t out_nbytes_avail;
+	size_t out_nbytes;
+	int result;
+};
+
+/*
+ * xpack_compress_batch() compresses each of the 'num_items' buffers described
+ * by 'items' separately, as xpack_compress() would, using the compressor's
+ * preset dictionary if it has one.  Each compressed buffer can be decompressed
+ * on its own.  For each item, 'out_nbytes' is set to the compressed size and
+ * 'result' to 0, or both to 0 and -1 if the buffer could not be compressed to
+ * 'out_nbytes_avail' bytes or fewer.  Returns the number of buffers that were
+ * compressed.
+ *
+ * This is meant for many small buffers, such as messages: the buffers share
+ * the compressor's setup instead of each resetting it from scratch.  With a
+ * preset dictionary, this means only the part of the matchfinder that the
+ * previous buffer changed is reset (except at levels 10 and above).  The same
+ * holds for a sequence of xpack_compress() calls with nothing else in between.
+ */
+LIBXPACKAPI size_t
+xpack_compress_batch(struct xpack_compressor *compressor,
+		     struct xpack_batch_item *items, size_t num_items);
+
+/*
+ * xpack_compressor_set_dictionary() sets a preset dictionary for the
+ * compressor.  Every later call to xpack_compress() then compresses its buffer
+ * as if the 'dict_size' bytes at 'dict' came right before it, so matches can
+ * refer to data in the dictionary.  This helps a lot with small buffers that
+ * resemble each other and a dictionary of typical content, such as short
+ * messages of one kind.  With a dictionary, buffers shorter than 100 bytes are
+ * compressed too.  The data must be decompressed by a decompressor which has
+ * the same dictionary set with xpack_decompressor_set_dictionary().
+ *
+ * The dictionary is copied, so the caller may free it afterwards.  It is
+ * inserted into a matchfinder once, here, and each buffer then starts from a
+ * copy of the matchfinder state, which takes time proportional to 'dict_size +
+ * max_buffer_size'.  This is the same as xpack_digest_dictionary() followed by
+ * xpack_compressor_use_dictionary(), except that the digested dictionary
+ * belongs to the compressor.  It allocates about 'dict_size + max_buffer_size'
+ * bytes plus two sets of matchfinder tables covering both, which
+ * xpack_compressor_memory_usage() doesn't count.  Streams don't use the
+ * dictionary, and setting one cancels any stream in progress.
+ *
+ * Passing a 'dict_size' of 0 removes the dictionary.  Returns 0 on success, or
+ * -1 if out of memory or 'dict_size' is larger than 268435456 bytes, in which
+ * case the previous dictionary (if any) remains set.
+ */
+LIBXPACKAPI int
+xpack_compressor_set_dictionary(struct xpack_compressor *compressor,
+				const void *dict, size_t dict_size);
+
+struct xpack_dictionary;
+
+/*
+ * xpack_digest_dictionary() inserts a preset dictionary into a matchfinder once,
+ * for compressors with the given 'max_buffer_size' and 'compression_level'.
+ * The result isn't modified afterwards, so any number of compressors, including
+ * ones on different threads, can share it with xpack_compressor_use_dictionary()
+ * rather than each digesting the dictionary itself.  The dictionary is copied.
+ * For levels 10 through 12, this also estimates the symbol statistics of data
+ * which follows the dictionary, which the near-optimal parser starts from.
+ *
+ * Returns the digested dictionary, or NULL if out of memory, 'dict_size' is 0
+ * or larger than 268435456 bytes, or the compression level is not supported.
+ */
+LIBXPACKAPI struct xpack_dictionary *
+xpack_digest_dictionary(const void *dict, size_t dict_size,
+			size_t max_buffer_size, int compression_level);
+
+/*
+ * xpack_compressor_use_dictionary() sets a digested preset dictionary for the
+ * compressor, with the same effect as xpack_compressor_set_dictionary().  The
+ * compressor only refers to 'dict', so it must not be freed while any
+ * compressor still uses it.  Passing NULL removes the dictionary.
+ *
+ * Returns 0 on success, or -1 if out of memory or 'dict' was digested for a
+ * different 'max_buffer_size' or compression level, in which case the previous
+ * dictionary (if any) remains set.
+ */
+LIBXPACKAPI int
+xpack_compressor_use_dictionary(struct xpack_compressor *compressor,
+				const struct xpack_dictionary *dict);
+
+/*
+ * xpack_free_dictionary() frees a dictionary digested with
+ * xpack_digest_dictionary().  If NULL is passed, then no action is taken.
+ */
+LIBXPACKAPI void
+xpack_free_dictionary(struct xpack_dictionary *dict);
+
+/*
+ * xpack_compress_stream_init() starts compressing a stream of data whose total
+ * size need not be known in advance.  The stream is compressed in segments of
+ * 'max_buffer_size / 2' bytes, and matches may refer back up to that many bytes
+ * into the data from earlier segments.  The compressed stream is a sequence of
+ * blocks in the same format produced by xpack_compress(), so it can be
+ * decompressed with xpack_decompress() once it is complete.
+ *
+ * The first call allocates the stream buffers, which are then reused for later
+ * streams.  Starting a new stream discards any stream in progress, as does
+ * calling xpack_compress().  Returns 0 on success, or -1 if out of memory,
+ * 'max_buffer_size' is too small, or the library was built with preprocessing
+ * enabled (which streaming does not support yet).
+ */
+LIBXPACKAPI int
+xpack_compress_stream_init(struct xpack_compressor *compressor);
+
+/*
+ * xpack_compress_stream_feed() provides up to 'in_nbytes' bytes of data at 'in'
+ * to the stream, and returns the number of bytes that were consumed.  Fewer
+ * bytes than provided are consumed only when a segment is full but compressed
+ * data from an earlier segment has not yet been read; read the pending output
+ * with xpack_compress_stream_read() and then feed the rest.
+ */
+LIBXPACKAPI size_t
+xpack_compress_stream_feed(struct xpack_compressor *compressor,
+			   const void *in, size_t in_nbytes);
+
+/*
+ * xpack_compress_stream_read() copies up to 'out_nbytes_avail' bytes of
+ * pending compressed data to 'out' and returns the number of bytes copied.  A
+ * return value of 0 means that no compressed data is currently pending.
+ */
+LIBXPACKAPI size_t
+xpack_compress_stream_read(struct xpack_compressor *compressor,
+			   void *out, size_t out_nbytes_avail);
+
+/*
+ * xpack_compress_stream_flush() compresses all data fed so far, even if the
+ * current segment is not full, so that it can be read with
+ * xpack_compress_stream_read().  The output ends on a block boundary, so a
+ * decompressor can reproduce all the data fed so far.  Flushing often hurts the
+ * compression ratio.  Returns 0 on success, or -1 if no stream is active or
+ * compressed data is still pending.
+ */
+LIBXPACKAPI int
+xpack_compress_stream_flush(struct xpack_compressor *compressor);
+
+/*
+ * xpack_compress_stream_end() compresses all remaining data and ends the
+ * stream.  The remaining compressed data must then be read with
+ * xpack_compress_stream_read().  Returns 0 on success, or -1 if no stream is
+ * active or compressed data is still pending.
+ */
+LIBXPACKAPI int
+xpack_compress_stream_end(struct xpack_compressor *compressor);
+
+/* Statistics about one block written by the compressor */
+struct xpack_block_stats {
+
+	/* The block type: 1 = verbatim, 2 = aligned, 3 = uncompressed */
+	int block_type;
+
+	/* The number of bytes of data the block holds */
+	size_t uncompressed_size;
+
+	/* The size of the block in bytes, including its header */
+	size_t compressed_size;
+
+	/* The size in bytes of the block header, including the FSE state
+	 * counts but not the extra length bytes */
+	size_t header_size;
+
+	/* The number of extra length bytes which follow the header */
+	size_t extra_bytes_size;
+
+	/* The number of literals and matches in the block, and how many of the
+	 * matches used a repeat offset */
+	size_t num_literals;
+	size_t num_matches;
+	size_t num_repeat_offset_matches;
+
+	/* The time spent choosing the items of the block (matchfinding and
+	 * parsing), and then writing them (choosing the FSE tables and entropy
+	 * coding), in the units of the clock passed to
+	 * xpack_compressor_set_block_stats_callback(), or 0 if there is none */
+	unsigned long long parse_time;
+	unsigned long long encode_time;
+};
+
+typedef void (*xpack_block_stats_callback_t)(const struct xpack_block_stats *stats,
+					     void *private_data);
+
+/*
+ * xpack_compressor_set_block_stats_callback() makes the compressor call
+ * 'callback' with the statistics of each block it writes, for tuning.  This
+ * covers xpack_compress() and streams, including the uncompressed blocks a
+ * stream falls back to.  Blocks written before an xpack_compress() call ran out
+ * of space are reported too, although that call returns 0, as are blocks which
+ * a stream then replaces with uncompressed blocks.  'private_data' is passed
+ * through to the callback.  If 'clock' is not NULL, then it is called to
+ * measure the times in the statistics; it should return a monotonic time in any
+ * unit.  Passing a NULL 'callback' turns the statistics off, which is the
+ * default.
+ */
+LIBXPACKAPI void
+xpack_compressor_set_block_stats_callback(struct xpack_compressor *compressor,
+					  xpack_block_stats_callback_t callback,
+					  unsigned long long (*clock)(void),
+					  void *private_data);
+
+/* The highest decode speed for xpack_compressor_set_decode_speed() */
+#define XPACK_MAX_DECODE_SPEED	3
+
+/*
+ * xpack_compressor_set_decode_speed() makes the compressor trade compression
+ * ratio for faster decompression.  'decode_speed' is 0, the default, for the
+ * best ratio, up to XPACK_MAX_DECODE_SPEED for the fastest decompression.  The
+ * higher it is, the more the compressor prefers fewer, longer matches and fewer
+ * literals, since the decompressor spends its time per item rather than per
+ * byte.  The data can be decompressed as usual.  This applies from the next
+ * buffer or stream onwards.  Returns 0, or -1 if 'decode_speed' is out of
+ * range.
+ */
+LIBXPACKAPI int
+xpack_compressor_set_decode_speed(struct xpack_compressor *compressor,
+				  int decode_speed);
+
+/* The largest window for xpack_compressor_set_long_window(), which is the
+ * largest match offset that the format can represent */
+#define XPACK_MAX_LONG_WINDOW_SIZE	(((size_t)1 << 29) - 1)
+
+/*
+ * xpack_compressor_set_long_window() turns on long distance matching for the
+ * streams started afterwards with xpack_compress_stream_init(), so that matches
+ * may refer back up to 'window_size' bytes rather than just the stream's
+ * segment size.  Only long repeats, of 64 bytes or more, are found that far
+ * back; the rest of the matchfinding is unchanged.  This is for large inputs
+ * with redundancy at a long distance, such as backups.  The stream window then
+ * takes about 2 * 'window_size' bytes, and the long distance matchfinder about
+ * 'window_size' / 16 bytes more.  The compressed stream must be decompressed
+ * with a 'window_size' of at least this much.  A 'window_size' of 0, the
+ * default, or one no larger than the segment size turns it off.  Returns 0, or
+ * -1 if 'window_size' is larger than XPACK_MAX_LONG_WINDOW_SIZE.
+ */
+LIBXPACKAPI int
+xpack_compressor_set_long_window(struct xpack_compressor *compressor,
+				 size_t window_size);
+
+/*
+ * xpack_compressor_set_checksum() turns on or off the CRC-32C checksum of the
+ * data the compressor compresses, which is off by default.  The checksum is
+ * computed one block at a time while the block's data is still in the cache,
+ * which is much cheaper than going over the data again afterwards.
+ */
+LIBXPACKAPI void
+xpack_compressor_set_checksum(struct xpack_compressor *compressor,
+			      int enabled);
+
+/*
+ * xpack_compressor_get_checksum() returns the CRC-32C, as xpack_crc32c() would
+ * compute it, of the data which the last xpack_compress() call compressed
+ * (for xpack_compress_batch(), the last item), or of the data of the stream
+ * which has been compressed so far.  The result is only meaningful if the
+ * checksum was turned on with xpack_compressor_set_checksum() beforehand and
+ * for xpack_compress(), if the data was compressed successfully.
+ */
+LIBXPACKAPI uint32_t
+xpack_compressor_get_checksum(const struct xpack_compressor *compressor);
+
 /*
  * xpack_free_compressor() frees a compressor allocated with
- * xpack_alloc_compressor().  If NULL is passed, then no action is taken.
+ * xpack_alloc_compressor() or xpack_alloc_compressor_ex(), or releases a
+ * compressor set up with xpack_init_compressor().  If NULL is passed, then no
+ * action is taken.
  */
 LIBXPACKAPI void
 xpack_free_compressor(struct xpack_compressor *compressor);
@@ -80,6 +415,56 @@ struct xpack_decompressor;
 LIBXPACKAPI struct xpack_decompressor *
 xpack_alloc_decompressor(void);
 
+/*
+ * xpack_alloc_decompressor_ex() is like xpack_alloc_decompressor(), except
+ * that all the memory which the decompressor allocates, both now and later
+ * (e.g. for streaming or a preset dictionary), comes from 'allocator'.  The
+ * allocator is copied.  If 'allocator' is NULL, malloc() and free() are used.
+ */
+LIBXPACKAPI struct xpack_decompressor *
+xpack_alloc_decompressor_ex(const struct xpack_allocator *allocator);
+
+/*
+ * xpack_init_decompressor() is like xpack_alloc_decompressor(), except that
+ * the decompressor is placed in the caller's memory at 'mem', which is
+ * 'mem_size' bytes long and must be at least xpack_decompressor_memory_usage()
+ * bytes.  Memory which the decompressor needs later, e.g. for streaming or a
+ * preset dictionary, is taken from whatever is left of 'mem', or allocated
+ * with malloc() once that runs out.
+ *
+ * Returns a pointer to the decompressor, which lies within 'mem', or NULL if
+ * 'mem_size' is too small.  xpack_free_decompressor() must still be called to
+ * release any memory allocated later, but it doesn't free 'mem' itself.
+ */
+LIBXPACKAPI struct xpack_decompressor *
+xpack_init_decompressor(void *mem, size_t mem_size);
+
+/*
+ * xpack_decompressor_memory_usage() returns the number of bytes of memory that
+ * xpack_alloc_decompressor() allocates, which is also the minimum 'mem_size'
+ * for xpack_init_decompressor().  This does not include the stream buffers or
+ * the preset dictionary.
+ */
+LIBXPACKAPI size_t
+xpack_decompressor_memory_usage(void);
+
+/*
+ * xpack_decompressor_set_dictionary() sets the preset dictionary for data
+ * compressed with xpack_compressor_set_dictionary() or
+ * xpack_compressor_use_dictionary().  Matches in the data given
+ * to later calls of xpack_decompress() can then refer back into the dictionary
+ * from the beginning of the output.  The dictionary must be exactly the same,
+ * or the data won't decompress correctly; the format doesn't record which
+ * dictionary was used.  The dictionary is copied.  Streams don't use it.
+ *
+ * Passing a 'dict_size' of 0 removes the dictionary.  Returns 0 on success, or
+ * -1 if out of memory, in which case the previous dictionary (if any) remains
+ * set.
+ */
+LIBXPACKAPI int
+xpack_decompressor_set_dictionary(struct xpack_decompressor *decompressor,
+				  const void *dict, size_t dict_size);
+
 /* Result of a call to xpack_decompress() */
 enum decompress_result {
 
@@ -133,13 +518,129 @@ xpack_decompress(struct xpack_decompressor *decompressor,
 		 void *out, size_t out_nbytes_avail,
 		 size_t *actual_out_nbytes_ret);
 
+/*
+ * xpack_decompress_batch() decompresses each of the 'num_items' buffers
+ * described by 'items' separately, as xpack_decompress() would with a non-NULL
+ * 'actual_out_nbytes_ret', using the decompressor's preset dictionary if it has
+ * one.  For each item, 'out_nbytes' is set to the decompressed size and
+ * 'result' to the 'enum decompress_result' of decompressing it.  Returns
+ * DECOMPRESS_SUCCESS if every buffer was decompressed successfully, or else the
+ * result for the first one that wasn't.
+ */
+LIBXPACKAPI enum decompress_result
+xpack_decompress_batch(struct xpack_decompressor *decompressor,
+		       struct xpack_batch_item *items, size_t num_items);
+
+/*
+ * xpack_decompress_stream_init() starts decompressing a stream of compressed
+ * data that is provided piece by piece, such as the output of the streaming
+ * compression functions.  Output becomes available one block at a time, so only
+ * 'window_size' bytes of history plus one block need to be kept in memory.
+ *
+ * 'window_size' must be at least the largest match offset in the data.  For a
+ * stream from xpack_compress_stream_init(), this is half the compressor's
+ * 'max_buffer_size', or the window passed to xpack_compressor_set_long_window()
+ * if that is larger; for the output of xpack_compress(), it is the uncompressed
+ * size.  Starting a new stream discards any stream in progress, as does calling
+ * xpack_decompress().  Returns 0 on success, or -1 if out of memory or the
+ * library was built with preprocessing enabled (which streaming does not
+ * support yet).
+ */
+LIBXPACKAPI int
+xpack_decompress_stream_init(struct xpack_decompressor *decompressor,
+			     size_t window_size);
+
+/*
+ * xpack_decompress_stream_feed() provides up to 'in_nbytes' bytes of compressed
+ * data at 'in' to the stream, and returns the number of bytes that were
+ * consumed.  The input is buffered internally until a whole block is
+ * available.  Fewer bytes than provided are consumed if the buffered data
+ * reached the maximum size of a block or memory could not be allocated; in that
+ * case, call xpack_decompress_stream_read() before feeding the rest.  Once the
+ * final block has been decompressed, no more input is consumed.
+ */
+LIBXPACKAPI size_t
+xpack_decompress_stream_feed(struct xpack_decompressor *decompressor,
+			     const void *in, size_t in_nbytes);
+
+/*
+ * xpack_decompress_stream_read() decompresses as many blocks as needed from the
+ * buffered input and copies up to 'out_nbytes_avail' bytes of uncompressed data
+ * to 'out'.  The number of bytes copied is written to *actual_out_nbytes_ret.
+ *
+ * Returns 0 (DECOMPRESS_SUCCESS) or DECOMPRESS_BAD_DATA.  An actual size of 0
+ * with DECOMPRESS_SUCCESS means that more input is needed or, after
+ * xpack_decompress_stream_end() has been called, that the stream is complete.
+ * If the input ended before the final block, then DECOMPRESS_BAD_DATA is
+ * returned.
+ */
+LIBXPACKAPI enum decompress_result
+xpack_decompress_stream_read(struct xpack_decompressor *decompressor,
+			     void *out, size_t out_nbytes_avail,
+			     size_t *actual_out_nbytes_ret);
+
+/*
+ * xpack_decompress_stream_end() indicates that all input has been fed.  The
+ * remaining output must then be read with xpack_decompress_stream_read().
+ * Returns 0 on success, or -1 if no stream is active.
+ */
+LIBXPACKAPI int
+xpack_decompress_stream_end(struct xpack_decompressor *decompressor);
+
+/*
+ * xpack_decompressor_set_checksum() turns on or off the CRC-32C checksum of the
+ * data the decompressor produces, which is off by default.  As when
+ * compressing, it is computed one block at a time right after the block has
+ * been decompressed, while its data is still in the cache.
+ */
+LIBXPACKAPI void
+xpack_decompressor_set_checksum(struct xpack_decompressor *decompressor,
+				int enabled);
+
+/*
+ * xpack_decompressor_get_checksum() returns the CRC-32C of the data produced by
+ * the last successful xpack_decompress() call (for xpack_decompress_batch(),
+ * the last item), or of the data of the stream which has been decompressed so
+ * far, which may be more than has been read.  The result is only meaningful if
+ * the checksum was turned on with xpack_decompressor_set_checksum() beforehand.
+ * Compare it with a checksum from xpack_compressor_get_checksum() or
+ * xpack_crc32c() to verify the data.
+ */
+LIBXPACKAPI uint32_t
+xpack_decompressor_get_checksum(const struct xpack_decompressor *decompressor);
+
 /*
  * xpack_free_decompressor() frees a decompressor allocated with
- * xpack_alloc_decompressor().  If NULL is passed, no action is taken.
+ * xpack_alloc_decompressor() or xpack_alloc_decompressor_ex(), or releases a
+ * decompressor set up with xpack_init_decompressor().  If NULL is passed, no
+ * action is taken.
  */
 LIBXPACKAPI void
 xpack_free_decompressor(struct xpack_decompressor *decompressor);
 
+/* ========================================================================== */
+/*                                Checksums                                   */
+/* ========================================================================== */
+
+/*
+ * xpack_crc32c() updates a running CRC-32C (the Castagnoli CRC, as used by
+ * iSCSI and ext4) with 'len' bytes of data at 'buffer' and returns the new
+ * value.  Pass 0 as 'crc' to start a new checksum.  This uses the processor's
+ * CRC-32C instruction if it has one (SSE4.2 on x86, or the CRC32 extension on
+ * AArch64).
+ */
+LIBXPACKAPI uint32_t
+xpack_crc32c(uint32_t crc, const void *buffer, size_t len);
+
+/*
+ * xpack_crc32c_combine() returns the CRC-32C of two pieces of data one after
+ * the other, given the CRC-32C of each and the length of the second one.  This
+ * takes time proportional to the logarithm of 'len2', so e.g. the checksums of
+ * chunks computed on different threads can be combined into the checksum of the
+ * whole data without going over it again.
+ */
+LIBXPACKAPI uint32_t
+xpack_crc32c_combine(uint32_t crc1, uint32_t crc2, unsigned long long len2);
 
 #ifdef __cplusplus
 }
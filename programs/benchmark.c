@@ -27,22 +27,37 @@
 
 #include "prog_util.h"
 
-static const tchar *const optstring = T("123456789hL:s:V");
+static const tchar *const optstring = T("123456789D:F:hL:n:s:ST:u:Vw:");
 
 static void
 show_usage(FILE *fp)
 {
 	fprintf(fp,
-"Usage: %"TS" [-123456789hV] [-L LVL] [-s SIZE] [FILE]...\n"
+"Usage: %"TS" [-123456789hSV] [-D DICT] [-F FORMAT] [-L LVLS] [-n RUNS]\n"
+"       [-s SIZES] [-T THREADS] [-u SPEED] [-w RUNS] [FILE]...\n"
 "Benchmark XPACK compression and decompression on the specified FILEs.\n"
 "\n"
 "Options:\n"
 "  -1        fastest (worst) compression\n"
 "  -9        slowest (best) compression\n"
+"  -D DICT   use the preset dictionary in the file DICT\n"
+"  -F FORMAT output format: text, csv, or json (default text)\n"
 "  -h        print this help\n"
-"  -L LVL    compression level [1-9] (default 6)\n"
-"  -s SIZE   chunk size (default 524288)\n"
-"  -V        show version and legal information\n",
+"  -L LVLS   compression levels [1-12], e.g. 6 or 1-9 or 1,6,12 (default 6)\n"
+"  -n RUNS   number of timed runs, of which the median and p99 are shown\n"
+"            (default 1)\n"
+"  -s SIZES  chunk sizes, e.g. 524288 or 4096,65536 (default 524288)\n"
+"  -S        show statistics about the compressed blocks (text format only)\n"
+"  -T THREADS numbers of threads, e.g. 1,2,4 (0 = one per processor,\n"
+"            default 1)\n"
+"  -u SPEED  favor decompression speed over ratio [0-3] (default 0)\n"
+"  -V        show version and legal information\n"
+"  -w RUNS   number of untimed warmup runs before the timed ones (default 0)\n"
+"\n"
+"Each combination of level, chunk size, and number of threads is benchmarked\n"
+"on each FILE in turn.  A run compresses all the chunks of the file, then\n"
+"decompresses them; with multiple threads, the chunks are shared out between\n"
+"the threads.\n",
 	program_invocation_name);
 }
 
@@ -59,109 +74,751 @@ show_version(void)
 	);
 }
 
+/* The most values that can be given in a list, such as with -L */
+#define MAX_LIST_LEN		32
+
+/* The largest file that is benchmarked.  The file and its compressed and
+ * decompressed chunks are all held in memory. */
+#define MAX_FILE_SIZE		((size_t)-1 / 4)
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+struct options {
+	u32 levels[MAX_LIST_LEN];
+	unsigned num_levels;
+	u32 chunk_sizes[MAX_LIST_LEN];
+	unsigned num_chunk_sizes;
+	u32 thread_counts[MAX_LIST_LEN];
+	unsigned num_thread_counts;
+	unsigned max_threads;
+	unsigned num_runs;
+	unsigned num_warmup_runs;
+	int decode_speed;
+	enum output_format format;
+	bool show_stats;
+	void *dict;
+	size_t dict_size;
+	unsigned num_results; /* results written so far */
+};
+
+/* Totals of the statistics of the blocks compressed from one file */
+struct block_stats_totals {
+	u64 num_blocks[4];
+	u64 uncompressed_size;
+	u64 compressed_size;
+	u64 header_size;
+	u64 extra_bytes_size;
+	u64 num_literals;
+	u64 num_matches;
+	u64 num_repeat_offset_matches;
+	u64 parse_time;
+	u64 encode_time;
+};
+
+static void
+add_block_stats(const struct xpack_block_stats *stats, void *private_data)
+{
+	struct block_stats_totals *totals = private_data;
+
+	totals->num_blocks[stats->block_type & 3]++;
+	totals->uncompressed_size += stats->uncompressed_size;
+	totals->compressed_size += stats->compressed_size;
+	totals->header_size += stats->header_size;
+	totals->extra_bytes_size += stats->extra_bytes_size;
+	totals->num_literals += stats->num_literals;
+	totals->num_matches += stats->num_matches;
+	totals->num_repeat_offset_matches += stats->num_repeat_offset_matches;
+	totals->parse_time += stats->parse_time;
+	totals->encode_time += stats->encode_time;
+}
+
+static unsigned long long
+stats_clock(void)
+{
+	return current_time();
+}
+
+static u64
+percent(u64 part, u64 whole)
+{
+	return whole ? part * 100 / whole : 0;
+}
+
+static void
+show_block_stats(const struct block_stats_totals *totals)
+{
+	const u64 num_blocks = totals->num_blocks[1] + totals->num_blocks[2] +
+			       totals->num_blocks[3];
+
+	if (num_blocks == 0)
+		return;
+
+	printf("\tBlocks: %"PRIu64" (%"PRIu64" verbatim, %"PRIu64" aligned, "
+	       "%"PRIu64" uncompressed), %"PRIu64" bytes on average\n",
+	       num_blocks, totals->num_blocks[1], totals->num_blocks[2],
+	       totals->num_blocks[3], totals->uncompressed_size / num_blocks);
+	printf("\tBlock headers: %"PRIu64" bytes (%"PRIu64"%% of output), "
+	       "plus %"PRIu64" extra length bytes\n",
+	       totals->header_size,
+	       percent(totals->header_size, totals->compressed_size),
+	       totals->extra_bytes_size);
+	printf("\tItems: %"PRIu64" literals, %"PRIu64" matches "
+	       "(%"PRIu64"%% with repeat offsets)\n",
+	       totals->num_literals, totals->num_matches,
+	       percent(totals->num_repeat_offset_matches, totals->num_matches));
+	printf("\tParsing time: %"PRIu64" ms (%"PRIu64"%%), "
+	       "encoding time: %"PRIu64" ms (%"PRIu64"%%)\n",
+	       totals->parse_time / 1000000,
+	       percent(totals->parse_time,
+		       totals->parse_time + totals->encode_time),
+	       totals->encode_time / 1000000,
+	       percent(totals->encode_time,
+		       totals->parse_time + totals->encode_time));
+}
+
+/* What is being benchmarked: one file, split into chunks of one size */
+struct bench {
+	const u8 *data;
+	size_t size;
+	u32 chunk_size;
+	size_t num_chunks;
+	u8 *compressed;		/* one slot of 'chunk_size' bytes per chunk */
+	u32 *compressed_sizes;	/* 0 if the chunk didn't compress */
+	u8 *decompressed;
+	void **ctxs;		/* the struct bench_thread of each thread */
+};
+
+/* The per-thread context */
+struct bench_thread {
+	struct xpack_compressor *compressor;
+	struct xpack_decompressor *decompressor;
+	struct block_stats_totals totals;
+};
+
+/* The results of benchmarking one combination of options on one file */
+struct bench_result {
+	u64 compressed_size;
+	u64 compress_median;	/* times, in nanoseconds */
+	u64 compress_p99;
+	u64 decompress_median;
+	u64 decompress_p99;
+};
+
+static int
+compress_chunk(void *_ctx, struct chunk_job *job)
+{
+	struct bench_thread *ctx = _ctx;
+
+	job->out_nbytes = xpack_compress(ctx->compressor, job->src,
+					 job->in_nbytes, job->dst,
+					 job->in_nbytes - 1);
+	return 0;
+}
+
+static int
+decompress_chunk(void *_ctx, struct chunk_job *job)
+{
+	struct bench_thread *ctx = _ctx;
+
+	if (xpack_decompress(ctx->decompressor, job->src, job->in_nbytes,
+			     job->dst, job->out_nbytes, NULL) !=
+	    DECOMPRESS_SUCCESS)
+		return -1;
+	return 0;
+}
+
+/*
+ * Fill in @job to compress or decompress chunk @i.  Returns false if there is
+ * nothing to do, which is the case when decompressing a chunk that didn't
+ * compress.
+ */
+static bool
+prepare_job(const struct bench *b, size_t i, bool decompress,
+	    struct chunk_job *job)
+{
+	const size_t offset = i * b->chunk_size;
+	const u32 size = MIN(b->size - offset, b->chunk_size);
+
+	if (!decompress) {
+		job->src = b->data + offset;
+		job->in_nbytes = size;
+		job->dst = b->compressed + offset;
+		return true;
+	}
+	if (b->compressed_sizes[i] == 0)
+		return false;
+	job->src = b->compressed + offset;
+	job->in_nbytes = b->compressed_sizes[i];
+	job->dst = b->decompressed + offset;
+	job->out_nbytes = size;
+	return true;
+}
+
+/* Record the result of a job that prepare_job() filled in. */
+static int
+finish_job(struct bench *b, bool decompress, const struct chunk_job *job)
+{
+	if (!decompress) {
+		b->compressed_sizes[((const u8 *)job->src - b->data) /
+				    b->chunk_size] = job->out_nbytes;
+		return 0;
+	}
+	if (job->result != 0) {
+		msg("failed to decompress data");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compress or decompress all the chunks, sharing them out between
+ * @num_threads threads.  The time taken is returned in *@time_ret.  Starting
+ * and stopping the threads is not included in it.
+ */
+static int
+run_pass(struct bench *b, unsigned num_threads, bool decompress,
+	 u64 *time_ret)
+{
+	const chunk_func_t func = decompress ? decompress_chunk :
+					       compress_chunk;
+	struct chunk_pool *pool = NULL;
+	struct chunk_job serial_job;
+	struct chunk_job *job;
+	u64 start_time;
+	size_t i = 0;
+	int ret = 0;
+
+	if (num_threads > 1) {
+		pool = chunk_pool_create(num_threads, b->ctxs, func, 0, 0);
+		if (pool == NULL)
+			return -1;
+	}
+
+	start_time = current_time();
+	if (pool == NULL) {
+		for (; i < b->num_chunks && ret == 0; i++) {
+			if (!prepare_job(b, i, decompress, &serial_job))
+				continue;
+			serial_job.result = (*func)(b->ctxs[0], &serial_job);
+			ret = finish_job(b, decompress, &serial_job);
+		}
+	} else {
+		for (;;) {
+			job = chunk_pool_get_job(pool);
+			if (job == NULL) {
+				/* All slots are busy; wait for the oldest. */
+				job = chunk_pool_collect(pool);
+				ret = finish_job(b, decompress, job);
+				if (ret != 0)
+					goto out;
+				continue;
+			}
+			while (i < b->num_chunks &&
+			       !prepare_job(b, i, decompress, job))
+				i++;
+			if (i == b->num_chunks)
+				break;
+			i++;
+			chunk_pool_submit(pool, job);
+		}
+		while (ret == 0 && (job = chunk_pool_collect(pool)) != NULL)
+			ret = finish_job(b, decompress, job);
+	}
+	*time_ret = current_time() - start_time;
+out:
+	chunk_pool_destroy(pool);
+	return ret;
+}
+
 static int
-do_benchmark(struct file_stream *in, void *original_buf, void *compressed_buf,
-	     void *decompressed_buf, u32 chunk_size,
-	     struct xpack_compressor *compressor,
-	     struct xpack_decompressor *decompressor)
+cmp_u64(const void *p1, const void *p2)
 {
-	u64 total_uncompressed_size = 0;
-	u64 total_compressed_size = 0;
-	u64 total_compress_time = 0;
-	u64 total_decompress_time = 0;
-	ssize_t ret;
-
-	while ((ret = xread(in, original_buf, chunk_size)) > 0) {
-		u32 original_size = ret;
-		u32 compressed_size;
-		u64 start_time;
-		enum decompress_result result;
-
-		total_uncompressed_size += original_size;
-
-		/* Compress the chunk of data. */
-		start_time = current_time();
-		compressed_size = xpack_compress(compressor,
-						 original_buf,
-						 original_size,
-						 compressed_buf,
-						 original_size - 1);
-		total_compress_time += current_time() - start_time;
-
-		if (compressed_size) {
-			/* Successfully compressed the chunk of data. */
-
-			/* Decompress the data we just compressed and compare
-			 * the result with the original. */
-			start_time = current_time();
-			result = xpack_decompress(decompressor,
-						  compressed_buf,
-						  compressed_size,
-						  decompressed_buf,
-						  original_size,
-						  NULL);
-			total_decompress_time += current_time() - start_time;
-
-			if (result != DECOMPRESS_SUCCESS) {
-				msg("%"TS": failed to decompress data",
-				    in->name);
-				return -1;
+	const u64 v1 = *(const u64 *)p1;
+	const u64 v2 = *(const u64 *)p2;
+
+	return (v1 > v2) - (v1 < v2);
+}
+
+/* Sort the @n times and return the median and 99th percentile of them. */
+static void
+get_percentiles(u64 times[], unsigned n, u64 *median_ret, u64 *p99_ret)
+{
+	qsort(times, n, sizeof(times[0]), cmp_u64);
+	*median_ret = (n % 2) ? times[n / 2] :
+				(times[n / 2 - 1] + times[n / 2]) / 2;
+	*p99_ret = times[(n * 99 + 99) / 100 - 1];
+}
+
+/*
+ * Do the warmup runs, then the timed runs, on @num_threads threads, checking
+ * every time that the data decompresses to the original.
+ */
+static int
+benchmark_combination(struct bench *b, unsigned num_threads,
+		      const struct options *options,
+		      struct bench_result *result)
+{
+	const unsigned num_runs = options->num_warmup_runs + options->num_runs;
+	u64 *compress_times;
+	u64 *decompress_times;
+	unsigned run;
+	size_t i;
+	int ret = -1;
+
+	compress_times = xmalloc(options->num_runs * sizeof(u64));
+	decompress_times = xmalloc(options->num_runs * sizeof(u64));
+	if (compress_times == NULL || decompress_times == NULL)
+		goto out;
+
+	if (options->show_stats) {
+		for (i = 0; i < num_threads; i++) {
+			struct bench_thread *ctx = b->ctxs[i];
+
+			memset(&ctx->totals, 0, sizeof(ctx->totals));
+			xpack_compressor_set_block_stats_callback(
+				ctx->compressor, add_block_stats, stats_clock,
+				&ctx->totals);
+		}
+	}
+
+	for (run = 0; run < num_runs; run++) {
+		u64 compress_time, decompress_time;
+
+		ret = run_pass(b, num_threads, false, &compress_time);
+		if (ret != 0)
+			goto out;
+		ret = run_pass(b, num_threads, true, &decompress_time);
+		if (ret != 0)
+			goto out;
+
+		for (i = 0; i < b->num_chunks; i++) {
+			const size_t offset = i * b->chunk_size;
+
+			if (b->compressed_sizes[i] != 0 &&
+			    memcmp(b->data + offset, b->decompressed + offset,
+				   MIN(b->size - offset, b->chunk_size)) != 0) {
+				msg("data did not decompress to original");
+				ret = -1;
+				goto out;
 			}
+		}
+
+		/* Gather block statistics from the first run only. */
+		if (run == 0 && options->show_stats) {
+			for (i = 0; i < num_threads; i++) {
+				struct bench_thread *ctx = b->ctxs[i];
 
-			if (memcmp(original_buf, decompressed_buf,
-				   original_size) != 0)
-			{
-				msg("%"TS": data did not decompress to "
-				    "original", in->name);
-				return -1;
+				xpack_compressor_set_block_stats_callback(
+					ctx->compressor, NULL, NULL, NULL);
 			}
+		}
 
-			total_compressed_size += compressed_size;
-		} else {
-			/* Compression did not make the chunk smaller. */
-			total_compressed_size += original_size;
+		if (run >= options->num_warmup_runs) {
+			compress_times[run - options->num_warmup_runs] =
+				MAX(compress_time, 1);
+			decompress_times[run - options->num_warmup_runs] =
+				MAX(decompress_time, 1);
 		}
 	}
 
-	if (ret < 0)
-		return ret;
+	result->compressed_size = 0;
+	for (i = 0; i < b->num_chunks; i++) {
+		const size_t offset = i * b->chunk_size;
+
+		result->compressed_size += b->compressed_sizes[i] ?
+			b->compressed_sizes[i] :
+			MIN(b->size - offset, b->chunk_size);
+	}
+	get_percentiles(compress_times, options->num_runs,
+			&result->compress_median, &result->compress_p99);
+	get_percentiles(decompress_times, options->num_runs,
+			&result->decompress_median, &result->decompress_p99);
+	ret = 0;
+out:
+	free(decompress_times);
+	free(compress_times);
+	return ret;
+}
 
-	if (total_uncompressed_size == 0) {
-		printf("\tFile was empty.\n");
+/*
+ * Return the speed in MB/s of processing @size bytes in @time nanoseconds.  It
+ * is fractional, since the slowest levels can run at well under 1 MB/s.
+ */
+static double
+mb_per_sec(u64 size, u64 time)
+{
+	if (time == 0)
 		return 0;
+	return 1000.0 * size / time;
+}
+
+static void
+show_time_text(const char *what, u64 median, u64 p99, u64 size,
+	       unsigned num_threads, const struct options *options)
+{
+	if (options->num_runs == 1)
+		printf("\t%s time: %"PRIu64" ms", what, median / 1000000);
+	else
+		printf("\t%s time: %"PRIu64" ms median, %"PRIu64" ms p99",
+		       what, median / 1000000, p99 / 1000000);
+	printf(" (%.2f MB/s", mb_per_sec(size, median));
+	if (num_threads > 1)
+		printf(", %.2f MB/s per thread",
+		       mb_per_sec(size, median) / num_threads);
+	printf(")\n");
+}
+
+/* Print @name as a quoted JSON string or CSV field. */
+static void
+show_quoted_name(const tchar *name, enum output_format format)
+{
+	const tchar *p;
+
+	putchar('"');
+	for (p = name; *p != '\0'; p++) {
+		if (*p == '"')
+			printf(format == FORMAT_JSON ? "\\\"" : "\"\"");
+		else if (format == FORMAT_JSON && *p == '\\')
+			printf("\\\\");
+		else if (format == FORMAT_JSON && (unsigned)*p < 0x20)
+			printf("\\u%04x", (unsigned)*p);
+		else
+			printf("%"TC, *p);
 	}
+	putchar('"');
+}
+
+static const char *const csv_header =
+	"file,level,decode_speed,chunk_size,threads,runs,original_size,compressed_size,"
+	"compress_median_ns,compress_p99_ns,compress_mb_per_sec,"
+	"compress_mb_per_sec_per_thread,"
+	"decompress_median_ns,decompress_p99_ns,decompress_mb_per_sec,"
+	"decompress_mb_per_sec_per_thread\n";
+
+static void
+show_result(const tchar *name, const struct bench *b, int level,
+	    unsigned num_threads, const struct bench_result *result,
+	    struct options *options)
+{
+	const double c_speed = mb_per_sec(b->size, result->compress_median);
+	const double d_speed = mb_per_sec(b->size, result->decompress_median);
+	unsigned i;
+
+	switch (options->format) {
+	case FORMAT_TEXT:
+		printf("\tLevel %d, chunk size %"PRIu32", %u thread%s:\n",
+		       level, b->chunk_size, num_threads,
+		       num_threads == 1 ? "" : "s");
+		printf("\tCompressed %"PRIu64 " => %"PRIu64" bytes "
+		       "(%u.%03u%%)\n",
+		       (u64)b->size, result->compressed_size,
+		       (unsigned int)(result->compressed_size * 100 / b->size),
+		       (unsigned int)(result->compressed_size * 100000 /
+				      b->size % 1000));
+		show_time_text("Compression", result->compress_median,
+			       result->compress_p99, b->size, num_threads,
+			       options);
+		show_time_text("Decompression", result->decompress_median,
+			       result->decompress_p99, b->size, num_threads,
+			       options);
+		if (options->show_stats) {
+			struct block_stats_totals totals;
+			const u64 *src;
+			u64 *dst;
+			size_t j;
+
+			/* Sum the statistics of the threads. */
+			memset(&totals, 0, sizeof(totals));
+			for (i = 0; i < num_threads; i++) {
+				const struct bench_thread *ctx = b->ctxs[i];
+
+				src = (const u64 *)&ctx->totals;
+				dst = (u64 *)&totals;
+				for (j = 0; j < sizeof(totals) / sizeof(u64);
+				     j++)
+					dst[j] += src[j];
+			}
+			show_block_stats(&totals);
+		}
+		break;
+	case FORMAT_CSV:
+		show_quoted_name(name, options->format);
+		printf(",%d,%d,%"PRIu32",%u,%u,%"PRIu64",%"PRIu64","
+		       "%"PRIu64",%"PRIu64",%.2f,%.2f,"
+		       "%"PRIu64",%"PRIu64",%.2f,%.2f\n",
+		       level, options->decode_speed, b->chunk_size,
+		       num_threads, options->num_runs,
+		       (u64)b->size, result->compressed_size,
+		       result->compress_median, result->compress_p99,
+		       c_speed, c_speed / num_threads,
+		       result->decompress_median, result->decompress_p99,
+		       d_speed, d_speed / num_threads);
+		break;
+	case FORMAT_JSON:
+		printf("%s\n  {\"file\": ", options->num_results ? "," : "");
+		show_quoted_name(name, options->format);
+		printf(", \"level\": %d, \"decode_speed\": %d, "
+		       "\"chunk_size\": %"PRIu32", "
+		       "\"threads\": %u, \"runs\": %u,\n"
+		       "   \"original_size\": %"PRIu64", "
+		       "\"compressed_size\": %"PRIu64",\n"
+		       "   \"compress_median_ns\": %"PRIu64", "
+		       "\"compress_p99_ns\": %"PRIu64", "
+		       "\"compress_mb_per_sec\": %.2f, "
+		       "\"compress_mb_per_sec_per_thread\": %.2f,\n"
+		       "   \"decompress_median_ns\": %"PRIu64", "
+		       "\"decompress_p99_ns\": %"PRIu64", "
+		       "\"decompress_mb_per_sec\": %.2f, "
+		       "\"decompress_mb_per_sec_per_thread\": %.2f}",
+		       level, options->decode_speed, b->chunk_size,
+		       num_threads, options->num_runs,
+		       (u64)b->size, result->compressed_size,
+		       result->compress_median, result->compress_p99,
+		       c_speed, c_speed / num_threads,
+		       result->decompress_median, result->decompress_p99,
+		       d_speed, d_speed / num_threads);
+		break;
+	}
+	options->num_results++;
+	fflush(stdout);
+}
+
+static void
+free_thread_contexts(void **ctxs, unsigned num_threads)
+{
+	unsigned i;
 
-	if (total_compress_time == 0)
-		total_compress_time = 1;
-	if (total_decompress_time == 0)
-		total_decompress_time = 1;
-
-	printf("\tCompressed %"PRIu64 " => %"PRIu64" bytes (%u.%03u%%)\n",
-	       total_uncompressed_size, total_compressed_size,
-	       (unsigned int)(total_compressed_size * 100 /
-				total_uncompressed_size),
-	       (unsigned int)(total_compressed_size * 100000 /
-				total_uncompressed_size % 1000));
-	printf("\tCompression time: %"PRIu64" ms (%"PRIu64" MB/s)\n",
-	       total_compress_time / 1000000,
-	       1000 * total_uncompressed_size / total_compress_time);
-	printf("\tDecompression time: %"PRIu64" ms (%"PRIu64" MB/s)\n",
-	       total_decompress_time / 1000000,
-	       1000 * total_uncompressed_size / total_decompress_time);
+	for (i = 0; i < num_threads; i++) {
+		struct bench_thread *ctx = ctxs[i];
 
+		if (ctx == NULL)
+			continue;
+		xpack_free_decompressor(ctx->decompressor);
+		xpack_free_compressor(ctx->compressor);
+		free(ctx);
+		ctxs[i] = NULL;
+	}
+}
+
+/* Allocate a compressor and decompressor for each thread. */
+static int
+alloc_thread_contexts(void **ctxs, u32 chunk_size, int level,
+		      const struct options *options)
+{
+	unsigned i;
+
+	for (i = 0; i < options->max_threads; i++) {
+		struct bench_thread *ctx = xmalloc(sizeof(*ctx));
+
+		ctxs[i] = ctx;
+		if (ctx == NULL)
+			goto err;
+		memset(ctx, 0, sizeof(*ctx));
+		ctx->compressor = alloc_compressor(chunk_size, level);
+		ctx->decompressor = alloc_decompressor();
+		if (ctx->compressor == NULL || ctx->decompressor == NULL)
+			goto err;
+		xpack_compressor_set_decode_speed(ctx->compressor,
+						  options->decode_speed);
+		if (options->dict != NULL &&
+		    (xpack_compressor_set_dictionary(ctx->compressor,
+						     options->dict,
+						     options->dict_size) != 0 ||
+		     xpack_decompressor_set_dictionary(ctx->decompressor,
+						       options->dict,
+						       options->dict_size) != 0)) {
+			msg("Unable to load dictionary");
+			goto err;
+		}
+	}
 	return 0;
+
+err:
+	free_thread_contexts(ctxs, options->max_threads);
+	return -1;
+}
+
+/* Benchmark every combination of the options on the file @path. */
+static int
+benchmark_file(const tchar *path, struct options *options)
+{
+	const tchar *name = path ? path : T("standard input");
+	void *data = NULL;
+	struct bench b;
+	unsigned i, j, k;
+	int ret;
+
+	memset(&b, 0, sizeof(b));
+	b.ctxs = xmalloc(options->max_threads * sizeof(b.ctxs[0]));
+	if (b.ctxs == NULL)
+		return -1;
+	for (i = 0; i < options->max_threads; i++)
+		b.ctxs[i] = NULL;
+
+	ret = read_file(path, MAX_FILE_SIZE, &data, &b.size);
+	if (ret != 0)
+		goto out;
+	b.data = data;
+
+	if (options->format == FORMAT_TEXT)
+		printf("Processing %"TS"...\n", name);
+	if (b.size == 0) {
+		if (options->format == FORMAT_TEXT)
+			printf("\tFile was empty.\n");
+		goto out;
+	}
+
+	ret = -1;
+	b.decompressed = xmalloc(b.size);
+	if (b.decompressed == NULL)
+		goto out;
+
+	for (i = 0; i < options->num_chunk_sizes; i++) {
+		b.chunk_size = options->chunk_sizes[i];
+		b.num_chunks = (b.size + b.chunk_size - 1) / b.chunk_size;
+		b.compressed = xmalloc(b.num_chunks * b.chunk_size);
+		b.compressed_sizes = xmalloc(b.num_chunks *
+					     sizeof(b.compressed_sizes[0]));
+		if (b.compressed == NULL || b.compressed_sizes == NULL)
+			goto out;
+
+		for (j = 0; j < options->num_levels; j++) {
+			const int level = options->levels[j];
+
+			if (alloc_thread_contexts(b.ctxs, b.chunk_size, level,
+						  options) != 0)
+				goto out;
+			for (k = 0; k < options->num_thread_counts; k++) {
+				const unsigned num_threads =
+					options->thread_counts[k];
+				struct bench_result result;
+
+				ret = benchmark_combination(&b, num_threads,
+							    options, &result);
+				if (ret != 0) {
+					msg("%"TS": benchmark failed", name);
+					goto out;
+				}
+				show_result(name, &b, level, num_threads,
+					    &result, options);
+			}
+			free_thread_contexts(b.ctxs, options->max_threads);
+		}
+		free(b.compressed_sizes);
+		free(b.compressed);
+		b.compressed_sizes = NULL;
+		b.compressed = NULL;
+	}
+	ret = 0;
+out:
+	free_thread_contexts(b.ctxs, options->max_threads);
+	free(b.compressed_sizes);
+	free(b.compressed);
+	free(b.decompressed);
+	free(data);
+	free(b.ctxs);
+	return ret;
+}
+
+/*
+ * Parse a list of values separated by commas, such as "1,6,12", into @values.
+ * If @allow_ranges, then a range of values such as "1-9" may be given too.
+ * @parse_value parses one value, returning 0 if it is invalid.  Returns the
+ * number of values, or 0 on error.
+ */
+static unsigned
+parse_list(const tchar *arg, u32 values[MAX_LIST_LEN], bool allow_ranges,
+	   u32 (*parse_value)(const tchar *arg))
+{
+	tchar buf[32];
+	unsigned n = 0;
+
+	for (;;) {
+		const tchar *end = arg;
+		const tchar *dash = NULL;
+		u32 first, last;
+
+		while (*end != '\0' && *end != ',') {
+			if (*end == '-' && allow_ranges && dash == NULL &&
+			    end != arg)
+				dash = end;
+			end++;
+		}
+		if (end - arg >= ARRAY_LEN(buf)) {
+			msg("Invalid list: \"%"TS"\"", arg);
+			return 0;
+		}
+		tmemcpy(buf, arg, end - arg);
+		buf[end - arg] = '\0';
+
+		if (dash != NULL) {
+			buf[dash - arg] = '\0';
+			first = (*parse_value)(buf);
+			last = first ? (*parse_value)(&buf[dash - arg + 1]) : 0;
+		} else {
+			first = last = (*parse_value)(buf);
+		}
+		if (first == 0 || last == 0)
+			return 0;
+		for (; first <= last; first++) {
+			if (n == MAX_LIST_LEN) {
+				msg("Too many values in list (maximum is %d)",
+				    MAX_LIST_LEN);
+				return 0;
+			}
+			values[n++] = first;
+		}
+
+		if (*end == '\0')
+			break;
+		arg = end + 1;
+	}
+	if (n == 0)
+		msg("Empty list");
+	return n;
+}
+
+static u32
+parse_level_value(const tchar *arg)
+{
+	return parse_compression_level(arg);
+}
+
+static u32
+parse_threads_value(const tchar *arg)
+{
+	unsigned num_threads;
+
+	if (parse_num_threads(arg, &num_threads) != 0)
+		return 0;
+	if (num_threads == 0)
+		num_threads = get_num_processors();
+	return num_threads;
+}
+
+static unsigned
+parse_count(const tchar *arg, unsigned min)
+{
+	tchar *tmp;
+	unsigned long count = tstrtoul(arg, &tmp, 10);
+
+	if (count < min || count > 1000000 || *tmp != '\0' || *arg == '\0') {
+		msg("Invalid number of runs: \"%"TS"\".  "
+		    "Must be an integer in the range [%u, 1000000].", arg, min);
+		return (unsigned)-1;
+	}
+	return count;
 }
 
 int
 tmain(int argc, tchar *argv[])
 {
-	u32 chunk_size = 524288;
-	int compression_level = 6;
-	void *original_buf = NULL;
-	void *compressed_buf = NULL;
-	void *decompressed_buf = NULL;
-	struct xpack_compressor *compressor = NULL;
-	struct xpack_decompressor *decompressor = NULL;
+	struct options options;
+	const tchar *dict_path = NULL;
 	tchar *default_file_list[] = { NULL };
 	int opt_char;
 	int i;
@@ -169,6 +826,16 @@ tmain(int argc, tchar *argv[])
 
 	program_invocation_name = get_filename(argv[0]);
 
+	memset(&options, 0, sizeof(options));
+	options.levels[0] = 6;
+	options.num_levels = 1;
+	options.chunk_sizes[0] = 524288;
+	options.num_chunk_sizes = 1;
+	options.thread_counts[0] = 1;
+	options.num_thread_counts = 1;
+	options.num_runs = 1;
+	options.format = FORMAT_TEXT;
+
 	while ((opt_char = tgetopt(argc, argv, optstring)) != -1) {
 		switch (opt_char) {
 		case '1':
@@ -180,24 +847,71 @@ tmain(int argc, tchar *argv[])
 		case '7':
 		case '8':
 		case '9':
-			compression_level = opt_char - '0';
+			options.levels[0] = opt_char - '0';
+			options.num_levels = 1;
+			break;
+		case 'D':
+			dict_path = toptarg;
+			break;
+		case 'F':
+			if (!tstrcmp(toptarg, T("text"))) {
+				options.format = FORMAT_TEXT;
+			} else if (!tstrcmp(toptarg, T("csv"))) {
+				options.format = FORMAT_CSV;
+			} else if (!tstrcmp(toptarg, T("json"))) {
+				options.format = FORMAT_JSON;
+			} else {
+				msg("Invalid output format: \"%"TS"\".  "
+				    "Must be text, csv, or json.", toptarg);
+				return 1;
+			}
 			break;
 		case 'h':
 			show_usage(stdout);
 			return 0;
 		case 'L':
-			compression_level = parse_compression_level(toptarg);
-			if (compression_level <= 0)
+			options.num_levels = parse_list(toptarg, options.levels,
+							true,
+							parse_level_value);
+			if (options.num_levels == 0)
+				return 1;
+			break;
+		case 'n':
+			options.num_runs = parse_count(toptarg, 1);
+			if (options.num_runs == (unsigned)-1)
 				return 1;
 			break;
 		case 's':
-			chunk_size = parse_chunk_size(toptarg);
-			if (chunk_size == 0)
+			options.num_chunk_sizes = parse_list(toptarg,
+							     options.chunk_sizes,
+							     false,
+							     parse_chunk_size);
+			if (options.num_chunk_sizes == 0)
+				return 1;
+			break;
+		case 'S':
+			options.show_stats = true;
+			break;
+		case 'T':
+			options.num_thread_counts =
+				parse_list(toptarg, options.thread_counts,
+					   false, parse_threads_value);
+			if (options.num_thread_counts == 0)
+				return 1;
+			break;
+		case 'u':
+			options.decode_speed = parse_decode_speed(toptarg);
+			if (options.decode_speed < 0)
 				return 1;
 			break;
 		case 'V':
 			show_version();
 			return 0;
+		case 'w':
+			options.num_warmup_runs = parse_count(toptarg, 0);
+			if (options.num_warmup_runs == (unsigned)-1)
+				return 1;
+			break;
 		default:
 			show_usage(stderr);
 			return 1;
@@ -207,17 +921,27 @@ tmain(int argc, tchar *argv[])
 	argc -= toptind;
 	argv += toptind;
 
-	original_buf = xmalloc(chunk_size);
-	compressed_buf = xmalloc(chunk_size - 1);
-	decompressed_buf = xmalloc(chunk_size);
-	compressor = alloc_compressor(chunk_size, compression_level);
-	decompressor = alloc_decompressor();
+	for (i = 0; i < options.num_thread_counts; i++) {
+	#ifndef HAVE_PTHREAD
+		if (options.thread_counts[i] > 1) {
+			msg("Multithreading is not supported in this build; "
+			    "using 1 thread");
+			options.thread_counts[i] = 1;
+		}
+	#endif
+		options.max_threads = MAX(options.max_threads,
+					  options.thread_counts[i]);
+	}
 
-	ret = -1;
-	if (original_buf == NULL || compressed_buf == NULL ||
-	    decompressed_buf == NULL ||
-	    compressor == NULL || decompressor == NULL)
-		goto out;
+	if (options.format != FORMAT_TEXT)
+		options.show_stats = false;
+
+	if (dict_path != NULL) {
+		ret = read_file(dict_path, MAX_DICTIONARY_SIZE,
+				&options.dict, &options.dict_size);
+		if (ret != 0)
+			return 1;
+	}
 
 	if (argc == 0) {
 		argv = default_file_list;
@@ -228,32 +952,36 @@ tmain(int argc, tchar *argv[])
 				argv[i] = NULL;
 	}
 
-	printf("Benchmarking XPACK compression:\n");
-	printf("\tChunk size: %"PRIu32"\n", chunk_size);
-	printf("\tCompression level: %d\n", compression_level);
-
-	for (i = 0; i < argc; i++) {
-		struct file_stream in;
+	switch (options.format) {
+	case FORMAT_TEXT:
+		printf("Benchmarking XPACK compression:\n");
+		printf("\tRuns: %u", options.num_runs);
+		if (options.num_warmup_runs)
+			printf(", after %u warmup run%s",
+			       options.num_warmup_runs,
+			       options.num_warmup_runs == 1 ? "" : "s");
+		printf("\n");
+		if (options.decode_speed != 0)
+			printf("\tDecode speed: %d\n", options.decode_speed);
+		if (dict_path != NULL)
+			printf("\tDictionary size: %"PRIu64"\n",
+			       (u64)options.dict_size);
+		break;
+	case FORMAT_CSV:
+		printf("%s", csv_header);
+		break;
+	case FORMAT_JSON:
+		printf("[");
+		break;
+	}
 
-		ret = xopen_for_read(argv[i], &in);
-		if (ret != 0)
-			goto out;
+	ret = 0;
+	for (i = 0; i < argc && ret == 0; i++)
+		ret = benchmark_file(argv[i], &options);
 
-		printf("Processing %"TS"...\n", in.name);
+	if (options.format == FORMAT_JSON)
+		printf("\n]\n");
 
-		ret = do_benchmark(&in, original_buf, compressed_buf,
-				   decompressed_buf, chunk_size, compressor,
-				   decompressor);
-		xclose(&in);
-		if (ret != 0)
-			goto out;
-	}
-	ret = 0;
-out:
-	xpack_free_decompressor(decompressor);
-	xpack_free_compressor(compressor);
-	free(decompressed_buf);
-	free(compressed_buf);
-	free(original_buf);
+	free(options.dict);
 	return -ret;
 }
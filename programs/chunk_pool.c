@@ -0,0 +1,318 @@
+/*
+ * chunk_pool.c - a pool of threads which process chunks in parallel
+ *
+ * Copyright 2016 Eric Biggers
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The main thread fills in jobs and submits them in order.  Each worker thread
+ * takes the oldest job that nobody has started on yet and processes it using
+ * its own context, e.g. its own compressor.  The main thread then collects the
+ * finished jobs in the same order they were submitted, so the output order
+ * doesn't depend on which worker finishes first.
+ *
+ * The jobs form a ring.  A job slot can be reused only once its job has been
+ * collected, so the number of slots bounds both memory usage and how far the
+ * workers can get ahead of the main thread.
+ */
+
+#include "prog_util.h"
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+struct chunk_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t job_submitted;
+	pthread_cond_t job_finished;
+	chunk_func_t func;
+	void **ctxs;
+	unsigned num_threads;
+	pthread_t *threads;
+	struct chunk_job *jobs;
+	unsigned num_jobs;
+
+	/*
+	 * The counts of jobs submitted, started, and collected so far.  The
+	 * slot of job 'n' is 'n % num_jobs'.
+	 */
+	u64 num_submitted;
+	u64 num_started;
+	u64 num_collected;
+
+	bool terminate;
+};
+
+struct worker_args {
+	struct chunk_pool *pool;
+	void *ctx;
+};
+
+static void *
+worker_thread(void *_args)
+{
+	struct worker_args *args = _args;
+	struct chunk_pool *pool = args->pool;
+	void *ctx = args->ctx;
+	struct chunk_job *job;
+
+	free(args);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->num_started == pool->num_submitted &&
+		       !pool->terminate)
+			pthread_cond_wait(&pool->job_submitted, &pool->lock);
+		if (pool->num_started == pool->num_submitted)
+			break;
+		job = &pool->jobs[pool->num_started++ % pool->num_jobs];
+		pthread_mutex_unlock(&pool->lock);
+
+		job->result = (*pool->func)(ctx, job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->finished = true;
+		pthread_cond_broadcast(&pool->job_finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Create a pool of 'num_threads' threads.  The thread with index 'i' processes
+ * jobs by calling 'func' with context 'ctxs[i]'.  Each job slot gets an input
+ * buffer of 'in_size' bytes and an output buffer of 'out_size' bytes.  Returns
+ * NULL on error, after printing a message.
+ */
+struct chunk_pool *
+chunk_pool_create(unsigned num_threads, void **ctxs, chunk_func_t func,
+		  size_t in_size, size_t out_size)
+{
+	struct chunk_pool *pool;
+	unsigned i;
+
+	pool = xmalloc(sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->func = func;
+	pool->ctxs = ctxs;
+	pool->num_threads = 0;
+	pool->num_jobs = 2 * num_threads;
+	pool->num_submitted = 0;
+	pool->num_started = 0;
+	pool->num_collected = 0;
+	pool->terminate = false;
+	pool->threads = xmalloc(num_threads * sizeof(pool->threads[0]));
+	pool->jobs = xmalloc(pool->num_jobs * sizeof(pool->jobs[0]));
+	if (pool->threads == NULL || pool->jobs == NULL)
+		goto err_free_arrays;
+
+	for (i = 0; i < pool->num_jobs; i++) {
+		pool->jobs[i].in = NULL;
+		pool->jobs[i].out = NULL;
+	}
+	for (i = 0; i < pool->num_jobs; i++) {
+		pool->jobs[i].in = xmalloc(in_size);
+		pool->jobs[i].out = xmalloc(out_size);
+		if (pool->jobs[i].in == NULL || pool->jobs[i].out == NULL)
+			goto err_free_bufs;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_submitted, NULL);
+	pthread_cond_init(&pool->job_finished, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		struct worker_args *args = xmalloc(sizeof(*args));
+
+		if (args == NULL)
+			goto err_destroy;
+		args->pool = pool;
+		args->ctx = ctxs[i];
+		if (pthread_create(&pool->threads[i], NULL,
+				   worker_thread, args) != 0) {
+			msg_errno("Unable to create thread");
+			free(args);
+			goto err_destroy;
+		}
+		pool->num_threads++;
+	}
+	return pool;
+
+err_destroy:
+	chunk_pool_destroy(pool);
+	return NULL;
+
+err_free_bufs:
+	for (i = 0; i < pool->num_jobs; i++) {
+		free(pool->jobs[i].in);
+		free(pool->jobs[i].out);
+	}
+err_free_arrays:
+	free(pool->jobs);
+	free(pool->threads);
+	free(pool);
+	return NULL;
+}
+
+/*
+ * Return the next free job slot, or NULL if all slots are in use.  In the
+ * latter case, chunk_pool_collect() must be called first.
+ */
+struct chunk_job *
+chunk_pool_get_job(struct chunk_pool *pool)
+{
+	struct chunk_job *job;
+
+	if (pool->num_submitted - pool->num_collected == pool->num_jobs)
+		return NULL;
+
+	job = &pool->jobs[pool->num_submitted % pool->num_jobs];
+	job->finished = false;
+	return job;
+}
+
+/* Submit the job which was returned by the last chunk_pool_get_job(). */
+void
+chunk_pool_submit(struct chunk_pool *pool, struct chunk_job *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->num_submitted++;
+	pthread_cond_signal(&pool->job_submitted);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the oldest uncollected job to finish, and return it.  Returns NULL
+ * if no jobs are outstanding.  The job's buffers may be used until the next
+ * call to chunk_pool_get_job().
+ */
+struct chunk_job *
+chunk_pool_collect(struct chunk_pool *pool)
+{
+	struct chunk_job *job;
+
+	if (pool->num_collected == pool->num_submitted)
+		return NULL;
+
+	job = &pool->jobs[pool->num_collected % pool->num_jobs];
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->finished)
+		pthread_cond_wait(&pool->job_finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool->num_collected++;
+	return job;
+}
+
+/*
+ * Stop the worker threads and free the pool.  Jobs which were submitted but not
+ * collected are still processed, but their results are discarded.
+ */
+void
+chunk_pool_destroy(struct chunk_pool *pool)
+{
+	unsigned i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->terminate = true;
+	pthread_cond_broadcast(&pool->job_submitted);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->job_finished);
+	pthread_cond_destroy(&pool->job_submitted);
+	pthread_mutex_destroy(&pool->lock);
+
+	for (i = 0; i < pool->num_jobs; i++) {
+		free(pool->jobs[i].in);
+		free(pool->jobs[i].out);
+	}
+	free(pool->jobs);
+	free(pool->threads);
+	free(pool);
+}
+
+/* Return the number of processors that are online, or 1 if unknown. */
+unsigned
+get_num_processors(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+#else /* HAVE_PTHREAD */
+
+struct chunk_pool *
+chunk_pool_create(unsigned num_threads, void **ctxs, chunk_func_t func,
+		  size_t in_size, size_t out_size)
+{
+	return NULL;
+}
+
+struct chunk_job *
+chunk_pool_get_job(struct chunk_pool *pool)
+{
+	return NULL;
+}
+
+void
+chunk_pool_submit(struct chunk_pool *pool, struct chunk_job *job)
+{
+}
+
+struct chunk_job *
+chunk_pool_collect(struct chunk_pool *pool)
+{
+	return NULL;
+}
+
+void
+chunk_pool_destroy(struct chunk_pool *pool)
+{
+}
+
+unsigned
+get_num_processors(void)
+{
+	return 1;
+}
+
+#endif /* !HAVE_PTHREAD */
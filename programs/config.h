@@ -0,0 +1,20 @@
+/* THIS FILE WAS AUTOMATICALLY GENERATED.  DO NOT EDIT. */
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+/* Is the clock_gettime() function available? */
+#define HAVE_CLOCK_GETTIME 1
+
+/* Is the futimens() function available? */
+#define HAVE_FUTIMENS 1
+
+/* Is the futimes() function available? */
+#define HAVE_FUTIMES 1
+
+/* Is the posix_fallocate() function available? */
+#define HAVE_POSIX_FALLOCATE 1
+
+/* Are POSIX threads available? */
+#define HAVE_PTHREAD 1
+
+#endif /* _CONFIG_H */
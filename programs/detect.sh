@@ -24,9 +24,24 @@ check_function() {
 	fi
 }
 
+check_pthread() {
+	echo "#include <pthread.h>" > "$tmpfile"
+	echo "int main() { pthread_create(0, 0, 0, 0); }" >> "$tmpfile"
+	echo
+	echo "/* Are POSIX threads available? */"
+	if [ -n "$PTHREAD_FLAGS" ] && \
+	   $CC $PTHREAD_FLAGS -x c $tmpfile -o /dev/null > /dev/null 2>&1; then
+		echo "#define HAVE_PTHREAD 1"
+	else
+		echo "/* HAVE_PTHREAD is not set */"
+	fi
+}
+
 check_function clock_gettime
 check_function futimens
 check_function futimes
+check_function posix_fallocate
+check_pthread
 
 echo
 echo "#endif /* _CONFIG_H */"
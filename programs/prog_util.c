@@ -31,10 +31,13 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifdef _WIN32
 #  include <windows.h>
 #else
 #  include <unistd.h>
+#  include <sys/mman.h>
 #  include <sys/time.h>
 #endif
 
@@ -158,6 +161,8 @@ xopen_for_read(const tchar *path, struct file_stream *strm)
 		strm->is_standard_stream = true;
 		strm->name = T("standard input");
 		strm->fd = STDIN_FILENO;
+		strm->mmap_mem = NULL;
+		strm->mmap_writable = false;
 	#ifdef _WIN32
 		_setmode(strm->fd, O_BINARY);
 	#endif
@@ -165,6 +170,8 @@ xopen_for_read(const tchar *path, struct file_stream *strm)
 	}
 
 	strm->is_standard_stream = false;
+	strm->mmap_mem = NULL;
+	strm->mmap_writable = false;
 
 	strm->name = quote_path(path);
 	if (strm->name == NULL)
@@ -188,6 +195,8 @@ xopen_for_write(const tchar *path, bool overwrite, struct file_stream *strm)
 		strm->is_standard_stream = true;
 		strm->name = T("standard output");
 		strm->fd = STDOUT_FILENO;
+		strm->mmap_mem = NULL;
+		strm->mmap_writable = false;
 	#ifdef _WIN32
 		_setmode(strm->fd, O_BINARY);
 	#endif
@@ -195,12 +204,15 @@ xopen_for_write(const tchar *path, bool overwrite, struct file_stream *strm)
 	}
 
 	strm->is_standard_stream = false;
+	strm->mmap_mem = NULL;
+	strm->mmap_writable = false;
 
 	strm->name = quote_path(path);
 	if (strm->name == NULL)
 		goto err;
 retry:
-	strm->fd = topen(path, O_WRONLY | O_BINARY | O_NOFOLLOW |
+	/* Opened for reading too, since map_for_write() needs that. */
+	strm->fd = topen(path, O_RDWR | O_BINARY | O_NOFOLLOW |
 				O_CREAT | O_EXCL, 0644);
 	if (strm->fd < 0) {
 		if (errno != EEXIST) {
@@ -235,6 +247,93 @@ err:
 	return -1;
 }
 
+/*
+ * Try to map a file which was opened for reading into memory, so that its data
+ * can be used in place instead of being copied by read().  This works only for
+ * regular files, starting from the current position, so it works for standard
+ * input too when it was redirected from a file.  Anything else, such as a pipe,
+ * is left alone and is read with read() as usual.
+ */
+void
+map_for_read(struct file_stream *strm)
+{
+#ifndef _WIN32
+	struct stat stbuf;
+	off_t pos;
+	void *mem;
+
+	if (fstat(strm->fd, &stbuf) != 0 || !S_ISREG(stbuf.st_mode) ||
+	    stbuf.st_size <= 0 || (u64)stbuf.st_size > ~(size_t)0)
+		return;
+
+	pos = lseek(strm->fd, 0, SEEK_CUR);
+	if (pos < 0 || pos > stbuf.st_size)
+		return;
+
+	mem = mmap(NULL, stbuf.st_size, PROT_READ, MAP_SHARED, strm->fd, 0);
+	if (mem == MAP_FAILED)
+		return;
+#ifdef MADV_SEQUENTIAL
+	madvise(mem, stbuf.st_size, MADV_SEQUENTIAL);
+#endif
+	strm->mmap_mem = mem;
+	strm->mmap_size = stbuf.st_size;
+	strm->mmap_pos = pos;
+	strm->mmap_writable = false;
+#endif /* !_WIN32 */
+}
+
+/*
+ * Try to map a newly created output file into memory, with its final size of
+ * 'size' bytes, so that the data can be produced directly in the file with
+ * xwrite_in_place().  The blocks are reserved first, so that running out of
+ * space is reported here rather than by a SIGBUS while writing to the mapping.
+ * If the file can't be mapped, it is left empty and full_write() works as
+ * usual.  Returns 0 on success, even if the file wasn't mapped, or -1 on error.
+ */
+int
+map_for_write(struct file_stream *strm, u64 size)
+{
+#if !defined(_WIN32) && defined(HAVE_POSIX_FALLOCATE)
+	struct stat stbuf;
+	void *mem;
+	int err;
+
+	if (strm->is_standard_stream || size == 0 || size > ~(size_t)0 ||
+	    (off_t)size < 0 || (u64)(off_t)size != size)
+		return 0;
+
+	if (fstat(strm->fd, &stbuf) != 0 || !S_ISREG(stbuf.st_mode) ||
+	    stbuf.st_size != 0)
+		return 0;
+
+	err = posix_fallocate(strm->fd, 0, size);
+	if (err == 0) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   strm->fd, 0);
+		if (mem != MAP_FAILED) {
+			strm->mmap_mem = mem;
+			strm->mmap_size = size;
+			strm->mmap_pos = 0;
+			strm->mmap_writable = true;
+			return 0;
+		}
+	}
+
+	/* posix_fallocate() may have extended the file before failing. */
+	if (ftruncate(strm->fd, 0) != 0) {
+		msg_errno("Error truncating %"TS, strm->name);
+		return -1;
+	}
+	if (err == ENOSPC || err == EFBIG) {
+		errno = err;
+		msg_errno("Error writing to %"TS, strm->name);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 /*
  * Read from a file, returning the full count to indicate all bytes were read, a
  * short count (possibly 0) to indicate EOF, or -1 to indicate error.
@@ -245,6 +344,14 @@ xread(struct file_stream *strm, void *buf, size_t count)
 	char *p = buf;
 	size_t orig_count = count;
 
+	if (strm->mmap_mem != NULL) {
+		count = MIN(count, strm->mmap_size -
+				   MIN(strm->mmap_pos, strm->mmap_size));
+		memcpy(buf, &strm->mmap_mem[strm->mmap_pos], count);
+		strm->mmap_pos += count;
+		return count;
+	}
+
 	while (count != 0) {
 		ssize_t res = read(strm->fd, p, MIN(count, INT_MAX));
 		if (res == 0)
@@ -259,6 +366,80 @@ xread(struct file_stream *strm, void *buf, size_t count)
 	return orig_count - count;
 }
 
+/*
+ * Like xread(), but also set *data_ret to point to the data.  If the file is
+ * mapped, that's where the data is in the mapping, and 'buf' isn't touched.
+ * Otherwise the data is read into 'buf' as usual.
+ */
+ssize_t
+xread_direct(struct file_stream *strm, void *buf, size_t count,
+	     const void **data_ret)
+{
+	if (strm->mmap_mem != NULL) {
+		count = MIN(count, strm->mmap_size -
+				   MIN(strm->mmap_pos, strm->mmap_size));
+		*data_ret = &strm->mmap_mem[strm->mmap_pos];
+		strm->mmap_pos += count;
+		return count;
+	}
+	*data_ret = buf;
+	return xread(strm, buf, count);
+}
+
+/*
+ * Read the whole of a file, such as a dictionary, into a newly allocated buffer.
+ * Files larger than 'max_size' bytes are rejected.  Returns 0 on success or -1
+ * on error.
+ */
+int
+read_file(const tchar *path, size_t max_size, void **buf_ret, size_t *size_ret)
+{
+	struct file_stream strm;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	ssize_t ret;
+
+	if (xopen_for_read(path, &strm) != 0)
+		return -1;
+
+	for (;;) {
+		if (size == capacity) {
+			char *new_buf;
+
+			/* Allow one extra byte, so that oversized files are
+			 * detected without reading them all. */
+			if (capacity > max_size)
+				goto too_large;
+			capacity = MIN(MAX(2 * capacity, 65536), max_size + 1);
+			new_buf = realloc(buf, capacity);
+			if (new_buf == NULL) {
+				msg("Out of memory");
+				goto err;
+			}
+			buf = new_buf;
+		}
+		ret = xread(&strm, buf + size, capacity - size);
+		if (ret < 0)
+			goto err;
+		if (ret == 0)
+			break;
+		size += ret;
+	}
+	xclose(&strm);
+	*buf_ret = buf;
+	*size_ret = size;
+	return 0;
+
+too_large:
+	msg("%"TS" is too large (maximum size is %"PRIu64" bytes)",
+	    strm.name, (u64)max_size);
+err:
+	xclose(&strm);
+	free(buf);
+	return -1;
+}
+
 /* Skip over 'count' bytes from a file, returning 0 on success or -1 on error */
 int
 skip_bytes(struct file_stream *strm, size_t count)
@@ -270,6 +451,16 @@ skip_bytes(struct file_stream *strm, size_t count)
 	if (count == 0)
 		return 0;
 
+	if (strm->mmap_mem != NULL) {
+		if (count > strm->mmap_size -
+			    MIN(strm->mmap_pos, strm->mmap_size)) {
+			msg("%"TS": unexpected end-of-file", strm->name);
+			return -1;
+		}
+		strm->mmap_pos += count;
+		return 0;
+	}
+
 	bufsize = MIN(count, 4096);
 	buffer = xmalloc(bufsize);
 	if (buffer == NULL)
@@ -292,12 +483,48 @@ out:
 	return ret;
 }
 
+/*
+ * Reposition a file, returning the new offset or -1 if the file can't be
+ * seeked.  No message is printed, since callers may fall back to reading.
+ */
+s64
+xlseek(struct file_stream *strm, s64 offset, int whence)
+{
+	if (strm->mmap_mem != NULL) {
+		if (whence == SEEK_CUR)
+			offset += strm->mmap_pos;
+		else if (whence == SEEK_END)
+			offset += strm->mmap_size;
+		if (offset < 0 || (u64)offset > ~(size_t)0)
+			return -1;
+		strm->mmap_pos = offset;
+		return offset;
+	}
+#ifdef _WIN32
+	return _lseeki64(strm->fd, offset, whence);
+#else
+	return lseek(strm->fd, offset, whence);
+#endif
+}
+
 /* Write to a file, returning 0 if all bytes were written or -1 on error */
 int
 full_write(struct file_stream *strm, const void *buf, size_t count)
 {
 	const char *p = buf;
 
+	if (strm->mmap_writable) {
+		void *dst = xwrite_in_place(strm, count);
+
+		if (dst == NULL) {
+			msg("Error writing to %"TS": more data than expected",
+			    strm->name);
+			return -1;
+		}
+		memcpy(dst, buf, count);
+		return 0;
+	}
+
 	while (count != 0) {
 		ssize_t res = write(strm->fd, p, MIN(count, INT_MAX));
 		if (res <= 0) {
@@ -310,11 +537,48 @@ full_write(struct file_stream *strm, const void *buf, size_t count)
 	return 0;
 }
 
+/*
+ * If the file is mapped for writing and the next 'count' bytes fit in it, return
+ * a pointer to where they go in the mapping and advance the position past them,
+ * so that the caller can produce them in place.  Otherwise return NULL.
+ */
+void *
+xwrite_in_place(struct file_stream *strm, size_t count)
+{
+	void *p;
+
+	if (!strm->mmap_writable || count > strm->mmap_size - strm->mmap_pos)
+		return NULL;
+	p = &strm->mmap_mem[strm->mmap_pos];
+	strm->mmap_pos += count;
+	return p;
+}
+
 /* Close a file, returning 0 on success or -1 on error */
 int
 xclose(struct file_stream *strm)
 {
 	int ret = 0;
+
+#ifndef _WIN32
+	if (strm->mmap_mem != NULL) {
+		munmap(strm->mmap_mem, strm->mmap_size);
+		if (strm->mmap_writable) {
+			/* Drop any space which wasn't used, e.g. on error. */
+			if (strm->mmap_pos != strm->mmap_size &&
+			    ftruncate(strm->fd, strm->mmap_pos) != 0) {
+				msg_errno("Error truncating %"TS, strm->name);
+				ret = -1;
+			}
+		} else if (strm->is_standard_stream) {
+			/* Leave standard input where it would have been. */
+			lseek(strm->fd, MIN(strm->mmap_pos, strm->mmap_size),
+			      SEEK_SET);
+		}
+		strm->mmap_mem = NULL;
+		strm->mmap_writable = false;
+	}
+#endif
 	if (strm->fd >= 0 && !strm->is_standard_stream) {
 		if (close(strm->fd) != 0) {
 			msg_errno("Error closing %"TS, strm->name);
@@ -346,6 +610,27 @@ parse_chunk_size(const tchar *arg)
 	return chunk_size;
 }
 
+/*
+ * Parse the long window size given on the command line, returning the window
+ * size on success or 0 on error
+ */
+u32
+parse_window_size(const tchar *arg)
+{
+	tchar *tmp;
+	unsigned long window_size = tstrtoul(arg, &tmp, 10);
+
+	if (window_size < 1024 || window_size > XPACK_MAX_LONG_WINDOW_SIZE ||
+	    *tmp != '\0') {
+		msg("Invalid window size: \"%"TS"\".  "
+		    "Must be an integer in the range [1024, %lu].", arg,
+		    (unsigned long)XPACK_MAX_LONG_WINDOW_SIZE);
+		return 0;
+	}
+
+	return window_size;
+}
+
 /*
  * Parse the compression level given on the command line, returning the
  * compression level on success or 0 on error
@@ -356,15 +641,83 @@ parse_compression_level(const tchar *arg)
 	tchar *tmp;
 	unsigned long level = tstrtoul(arg, &tmp, 10);
 
-	if (level < 1 || level > 9 || *tmp != '\0') {
+	if (level < 1 || level > 12 || *tmp != '\0') {
 		msg("Invalid compression level: \"%"TS"\".  "
-		    "Must be an integer in the range [1, 9].", arg);
+		    "Must be an integer in the range [1, 12].", arg);
 		return 0;
 	}
 
 	return level;
 }
 
+/*
+ * Parse the decode speed given on the command line, returning the decode speed
+ * on success or -1 on error
+ */
+int
+parse_decode_speed(const tchar *arg)
+{
+	tchar *tmp;
+	unsigned long speed = tstrtoul(arg, &tmp, 10);
+
+	if (speed > XPACK_MAX_DECODE_SPEED || *tmp != '\0' || *arg == '\0') {
+		msg("Invalid decode speed: \"%"TS"\".  "
+		    "Must be an integer in the range [0, %d].", arg,
+		    XPACK_MAX_DECODE_SPEED);
+		return -1;
+	}
+
+	return speed;
+}
+
+/*
+ * Parse a byte range of the form START:LENGTH given on the command line.
+ * Returns 0 on success or -1 on error.
+ */
+int
+parse_byte_range(const tchar *arg, u64 *start_ret, u64 *length_ret)
+{
+	const tchar *p = arg;
+	tchar *tmp;
+	unsigned long long start, length;
+
+	start = tstrtoull(p, &tmp, 10);
+	if (tmp == p || *tmp != ':')
+		goto invalid;
+	p = tmp + 1;
+	length = tstrtoull(p, &tmp, 10);
+	if (tmp == p || *tmp != '\0')
+		goto invalid;
+
+	*start_ret = start;
+	*length_ret = length;
+	return 0;
+
+invalid:
+	msg("Invalid byte range: \"%"TS"\".  Must be START:LENGTH.", arg);
+	return -1;
+}
+
+/*
+ * Parse the number of threads given on the command line, where 0 means one
+ * thread per processor.  Returns 0 on success or -1 on error.
+ */
+int
+parse_num_threads(const tchar *arg, unsigned *num_threads_ret)
+{
+	tchar *tmp;
+	unsigned long num_threads = tstrtoul(arg, &tmp, 10);
+
+	if (num_threads > 4096 || *tmp != '\0' || *arg == '\0') {
+		msg("Invalid number of threads: \"%"TS"\".  "
+		    "Must be an integer in the range [0, 4096].", arg);
+		return -1;
+	}
+
+	*num_threads_ret = num_threads;
+	return 0;
+}
+
 /* Allocate a new XPACK compressor */
 struct xpack_compressor *
 alloc_compressor(u32 chunk_size, int level)
@@ -72,6 +72,7 @@ extern int wmain(int argc, wchar_t **argv);
 #  define	tstrlen		wcslen
 #  define	tstrrchr	wcsrchr
 #  define	tstrtoul	wcstoul
+#  define	tstrtoull	wcstoull
 #  define	tstrxcmp	wcsicmp
 #  define	tunlink		_wunlink
 #  define	tutimbuf	_utimbuf
@@ -107,6 +108,7 @@ extern int wmain(int argc, wchar_t **argv);
 #  define	tstrlen		strlen
 #  define	tstrrchr	strrchr
 #  define	tstrtoul	strtoul
+#  define	tstrtoull	strtoull
 #  define	tstrxcmp	strcmp
 #  define	tunlink		unlink
 #  define	tutimbuf	utimbuf
@@ -130,24 +132,77 @@ struct file_stream {
 	int fd;
 	tchar *name;
 	bool is_standard_stream;
+
+	/* If the file is memory-mapped: the mapping, which covers the whole
+	 * file, and the current position in it.  Otherwise mmap_mem is NULL. */
+	u8 *mmap_mem;
+	size_t mmap_size;
+	size_t mmap_pos;
+	bool mmap_writable;
 };
 
 extern int xopen_for_read(const tchar *path, struct file_stream *strm);
 extern int xopen_for_write(const tchar *path, bool force,
 			   struct file_stream *strm);
 
+extern void map_for_read(struct file_stream *strm);
+extern int map_for_write(struct file_stream *strm, u64 size);
+
 extern ssize_t xread(struct file_stream *strm, void *buf, size_t count);
+extern ssize_t xread_direct(struct file_stream *strm, void *buf, size_t count,
+			    const void **data_ret);
+extern void *xwrite_in_place(struct file_stream *strm, size_t count);
 extern int skip_bytes(struct file_stream *strm, size_t count);
+extern s64 xlseek(struct file_stream *strm, s64 offset, int whence);
 extern int full_write(struct file_stream *strm, const void *buf, size_t count);
+extern int read_file(const tchar *path, size_t max_size,
+		     void **buf_ret, size_t *size_ret);
 
 extern int xclose(struct file_stream *strm);
 
 extern u32 parse_chunk_size(const tchar *arg);
+extern u32 parse_window_size(const tchar *arg);
 extern int parse_compression_level(const tchar *arg);
+extern int parse_decode_speed(const tchar *arg);
+extern int parse_num_threads(const tchar *arg, unsigned *num_threads_ret);
+extern int parse_byte_range(const tchar *arg, u64 *start_ret, u64 *length_ret);
+
+/* The largest dictionary that xpack_compressor_set_dictionary() accepts */
+#define MAX_DICTIONARY_SIZE	268435456
 
 extern struct xpack_compressor *alloc_compressor(u32 chunk_size, int level);
 extern struct xpack_decompressor *alloc_decompressor(void);
 
+/* chunk_pool.c */
+
+/* A unit of work for a chunk pool */
+struct chunk_job {
+	void *in;		/* input buffer, filled in by the main thread */
+	void *out;		/* output buffer, filled in by a worker */
+	const void *src;	/* the input: 'in', or memory of a mapped file */
+	void *dst;		/* where the output goes: 'out', or a mapping */
+	u32 in_nbytes;		/* number of valid bytes in 'in' */
+	u32 out_nbytes;		/* expected or actual size of the output */
+	u32 checksum;		/* CRC-32C of the uncompressed data */
+	bool use_checksum;	/* compute, or check, 'checksum'? */
+	int result;		/* return value of the chunk function */
+	bool finished;		/* (private) has a worker finished the job? */
+};
+
+/* Process a job using the per-thread context 'ctx' */
+typedef int (*chunk_func_t)(void *ctx, struct chunk_job *job);
+
+struct chunk_pool;
+
+extern struct chunk_pool *chunk_pool_create(unsigned num_threads, void **ctxs,
+					    chunk_func_t func,
+					    size_t in_size, size_t out_size);
+extern struct chunk_job *chunk_pool_get_job(struct chunk_pool *pool);
+extern void chunk_pool_submit(struct chunk_pool *pool, struct chunk_job *job);
+extern struct chunk_job *chunk_pool_collect(struct chunk_pool *pool);
+extern void chunk_pool_destroy(struct chunk_pool *pool);
+extern unsigned get_num_processors(void);
+
 /* tgetopt.c */
 
 extern tchar *toptarg;
@@ -0,0 +1,515 @@
+/*
+ * train_dict.c - a program which builds a preset dictionary from samples
+ *
+ * Copyright 2016 Eric Biggers
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The dictionary is built from the segments of the samples which cover the
+ * most common substrings, similar to the "COVER" algorithm of Zstandard.  Every
+ * substring of DMER_LEN bytes ("d-mer") is scored by the number of samples it
+ * occurs in.  The samples are divided into one epoch per segment wanted, and
+ * from each epoch the segment of 'segment_len' bytes whose distinct d-mers have
+ * the highest total score is chosen.  The scores of the d-mers in a chosen
+ * segment are then zeroed, so that later segments cover different content.
+ *
+ * The segments are laid out with the highest-scoring ones at the end of the
+ * dictionary, since that is nearest the data and so takes the shortest
+ * offsets to refer to.
+ */
+
+#include "prog_util.h"
+
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+/* The length of the substrings which are counted */
+#define DMER_LEN	8
+
+struct segment {
+	u32 start;
+	u32 score;
+};
+
+struct trainer {
+
+	/* All the samples, concatenated */
+	u8 *data;
+	size_t data_size;
+	size_t data_capacity;
+
+	/* The end offset of each sample in 'data' */
+	u32 *sample_ends;
+	size_t num_samples;
+	size_t samples_capacity;
+
+	/* For each d-mer hash code: the number of samples it occurs in, the
+	 * last sample it was counted for, and how many times it occurs in the
+	 * segment currently being scored */
+	unsigned hash_order;
+	u32 *freqs;
+	u32 *last_sample;
+	u32 *window_counts;
+};
+
+static const tchar *const optstring = T("hk:ls:S:o:V");
+
+static void
+show_usage(FILE *fp)
+{
+	fprintf(fp,
+"Usage: %"TS" [-hlV] [-k LEN] [-s SIZE] [-S SIZE] [-o DICT] FILE...\n"
+"Build a preset dictionary for xpack -D from sample FILEs.\n"
+"\n"
+"Options:\n"
+"  -h        print this help\n"
+"  -k LEN    length of the segments to choose (default 256)\n"
+"  -l        treat each line of the FILEs as a separate sample\n"
+"  -o DICT   write the dictionary to DICT instead of standard output\n"
+"  -s SIZE   dictionary size (default 112640)\n"
+"  -S SIZE   split the FILEs into samples of SIZE bytes\n"
+"  -V        show version and legal information\n",
+	program_invocation_name);
+}
+
+static void
+show_version(void)
+{
+	printf(
+"XPACK dictionary training program, experimental version\n"
+"Copyright 2016 Eric Biggers\n"
+"\n"
+"This program is free software which may be modified and/or redistributed\n"
+"under the terms of the MIT license.  There is NO WARRANTY, to the extent\n"
+"permitted by law.  See the COPYING file for details.\n"
+	);
+}
+
+/* Parse a size given on the command line, returning 0 on error */
+static u32
+parse_size(const tchar *arg, u32 min_size, u32 max_size, const char *what)
+{
+	tchar *tmp;
+	unsigned long size = tstrtoul(arg, &tmp, 10);
+
+	if (size < min_size || size > max_size || *tmp != '\0') {
+		msg("Invalid %s: \"%"TS"\".  Must be an integer in the range "
+		    "[%"PRIu32", %"PRIu32"]", what, arg, min_size, max_size);
+		return 0;
+	}
+	return size;
+}
+
+/* Remember that a sample ends at the current end of the data */
+static int
+end_sample(struct trainer *t)
+{
+	if (t->data_size == (t->num_samples > 0 ?
+			     t->sample_ends[t->num_samples - 1] : 0))
+		return 0; /* empty sample */
+
+	if (t->num_samples == t->samples_capacity) {
+		size_t new_capacity = MAX(2 * t->samples_capacity, 256);
+		u32 *new_ends = realloc(t->sample_ends,
+					new_capacity * sizeof(new_ends[0]));
+		if (new_ends == NULL) {
+			msg("Out of memory");
+			return -1;
+		}
+		t->sample_ends = new_ends;
+		t->samples_capacity = new_capacity;
+	}
+	t->sample_ends[t->num_samples++] = t->data_size;
+	return 0;
+}
+
+/*
+ * Read a file and append it to the samples, splitting it into lines or pieces
+ * of 'sample_size' bytes if requested.  Returns 0 on success or -1 on error.
+ */
+static int
+add_samples(struct trainer *t, const tchar *path, bool by_line,
+	    u32 sample_size)
+{
+	struct file_stream in;
+	size_t start;
+	ssize_t ret;
+
+	if (xopen_for_read(path, &in) != 0)
+		return -1;
+
+	start = t->data_size;
+	for (;;) {
+		if (t->data_size == t->data_capacity) {
+			size_t new_capacity = MAX(2 * t->data_capacity, 1048576);
+			u8 *new_data;
+
+			if (new_capacity > 0x80000000) {
+				msg("Too much sample data (max 2 GiB)");
+				goto err;
+			}
+			new_data = realloc(t->data, new_capacity);
+			if (new_data == NULL) {
+				msg("Out of memory");
+				goto err;
+			}
+			t->data = new_data;
+			t->data_capacity = new_capacity;
+		}
+		ret = xread(&in, &t->data[t->data_size],
+			    t->data_capacity - t->data_size);
+		if (ret < 0)
+			goto err;
+		if (ret == 0)
+			break;
+		t->data_size += ret;
+	}
+	xclose(&in);
+
+	if (by_line) {
+		size_t end = t->data_size;
+		size_t i;
+
+		for (i = start; i < end; i++) {
+			if (t->data[i] == '\n') {
+				t->data_size = i + 1;
+				if (end_sample(t) != 0)
+					return -1;
+			}
+		}
+		t->data_size = end;
+	} else if (sample_size != 0) {
+		size_t end = t->data_size;
+
+		while (end - start > sample_size) {
+			start += sample_size;
+			t->data_size = start;
+			if (end_sample(t) != 0)
+				return -1;
+		}
+		t->data_size = end;
+	}
+	return end_sample(t);
+
+err:
+	xclose(&in);
+	return -1;
+}
+
+static forceinline u32
+hash_dmer(const u8 *p, unsigned hash_order)
+{
+	u64 v = 0;
+	int i;
+
+	for (i = 0; i < DMER_LEN; i++)
+		v |= (u64)p[i] << (8 * i);
+	return (u32)((v * 0x9E3779B97F4A7C15ULL) >> (64 - hash_order));
+}
+
+/* Count the number of samples in which each d-mer occurs */
+static int
+count_dmers(struct trainer *t)
+{
+	size_t hash_size;
+	size_t sample_start = 0;
+	size_t i;
+
+	t->hash_order = 16;
+	while (t->hash_order < 24 &&
+	       ((size_t)1 << t->hash_order) < t->data_size)
+		t->hash_order++;
+	hash_size = (size_t)1 << t->hash_order;
+
+	t->freqs = calloc(hash_size, sizeof(u32));
+	t->last_sample = malloc(hash_size * sizeof(u32));
+	t->window_counts = calloc(hash_size, sizeof(u32));
+	if (t->freqs == NULL || t->last_sample == NULL ||
+	    t->window_counts == NULL) {
+		msg("Out of memory");
+		return -1;
+	}
+	memset(t->last_sample, 0xFF, hash_size * sizeof(u32));
+
+	for (i = 0; i < t->num_samples; i++) {
+		size_t pos;
+
+		for (pos = sample_start;
+		     pos + DMER_LEN <= t->sample_ends[i]; pos++) {
+			u32 h = hash_dmer(&t->data[pos], t->hash_order);
+
+			if (t->last_sample[h] != i) {
+				t->last_sample[h] = i;
+				t->freqs[h]++;
+			}
+		}
+		sample_start = t->sample_ends[i];
+	}
+	return 0;
+}
+
+/*
+ * Find the best segment of 'segment_len' bytes starting in [begin, end), where
+ * a segment's score is the total frequency of its distinct d-mers.  Segments
+ * may span sample boundaries; d-mers that would span one are still counted,
+ * which costs a little precision but keeps the scan simple.
+ */
+static struct segment
+find_best_segment(struct trainer *t, size_t begin, size_t end,
+		  u32 segment_len)
+{
+	const size_t num_dmers = segment_len - DMER_LEN + 1;
+	struct segment best = { 0, 0 };
+	u32 score = 0;
+	size_t pos;
+
+	/* Slide a window of 'num_dmers' d-mers over the epoch. */
+	for (pos = begin; pos < end + num_dmers - 1; pos++) {
+		u32 h = hash_dmer(&t->data[pos], t->hash_order);
+
+		if (t->window_counts[h]++ == 0)
+			score += t->freqs[h];
+
+		if (pos >= begin + num_dmers) {
+			u32 old = hash_dmer(&t->data[pos - num_dmers],
+					    t->hash_order);
+			if (--t->window_counts[old] == 0)
+				score -= t->freqs[old];
+		}
+
+		if (pos + 1 >= begin + num_dmers && score > best.score) {
+			best.start = pos + 1 - num_dmers;
+			best.score = score;
+		}
+	}
+
+	/* Clear the window counts for the next epoch. */
+	for (pos = begin; pos < end + num_dmers - 1; pos++)
+		t->window_counts[hash_dmer(&t->data[pos], t->hash_order)] = 0;
+
+	/* Don't let later segments score for the same d-mers. */
+	if (best.score != 0)
+		for (pos = best.start; pos < best.start + num_dmers; pos++)
+			t->freqs[hash_dmer(&t->data[pos], t->hash_order)] = 0;
+
+	return best;
+}
+
+static int
+cmp_segments(const void *p1, const void *p2)
+{
+	const struct segment *s1 = p1;
+	const struct segment *s2 = p2;
+
+	if (s1->score != s2->score)
+		return (s1->score < s2->score) ? -1 : 1;
+	return (s1->start < s2->start) ? -1 : (s1->start > s2->start);
+}
+
+/*
+ * Build a dictionary of up to 'dict_size' bytes into 'dict'.  Returns the
+ * actual size of the dictionary, or 0 if out of memory.
+ */
+static size_t
+build_dictionary(struct trainer *t, u8 *dict, u32 dict_size, u32 segment_len)
+{
+	struct segment *segments;
+	size_t num_segments = 0;
+	size_t max_segments;
+	size_t epoch_size;
+	size_t num_epochs;
+	size_t filled = 0;
+	size_t out_pos;
+	size_t begin;
+	size_t i;
+
+	/* With less sample data than a dictionary, use all of it. */
+	if (t->data_size <= dict_size) {
+		memcpy(dict, t->data, t->data_size);
+		return t->data_size;
+	}
+
+	max_segments = DIV_ROUND_UP(dict_size, segment_len);
+	num_epochs = MIN(max_segments, t->data_size / segment_len);
+	epoch_size = t->data_size / num_epochs;
+
+	segments = xmalloc(max_segments * sizeof(segments[0]));
+	if (segments == NULL)
+		return 0;
+
+	/*
+	 * Take one segment per epoch.  Later passes find new segments, since the
+	 * d-mers of the segments already chosen no longer score, so keep going
+	 * until the dictionary is full or nothing useful is left.
+	 */
+	while (filled < dict_size) {
+		size_t prev_num_segments = num_segments;
+
+		for (begin = 0; begin + segment_len <= t->data_size &&
+		     filled < dict_size; begin += epoch_size) {
+			size_t end = MIN(begin + epoch_size,
+					 t->data_size - segment_len + 1);
+			struct segment seg = find_best_segment(t, begin, end,
+							       segment_len);
+			if (seg.score == 0)
+				continue;
+			segments[num_segments++] = seg;
+			filled += segment_len;
+		}
+		if (num_segments == prev_num_segments)
+			break;
+	}
+
+	/* Put the highest-scoring segments last, and if the last segment
+	 * overfilled the dictionary, trim the lowest-scoring one. */
+	qsort(segments, num_segments, sizeof(segments[0]), cmp_segments);
+	out_pos = 0;
+	for (i = 0; i < num_segments; i++) {
+		u32 skip = 0;
+
+		if (i == 0 && filled > dict_size)
+			skip = filled - dict_size;
+		memcpy(&dict[out_pos], &t->data[segments[i].start + skip],
+		       segment_len - skip);
+		out_pos += segment_len - skip;
+	}
+	free(segments);
+	return out_pos;
+}
+
+int
+tmain(int argc, tchar *argv[])
+{
+	struct trainer t;
+	u32 dict_size = 112640;
+	u32 segment_len = 256;
+	u32 sample_size = 0;
+	bool by_line = false;
+	const tchar *out_path = NULL;
+	struct file_stream out;
+	u8 *dict = NULL;
+	size_t actual_size;
+	int opt_char;
+	int i;
+	int ret = -1;
+
+	program_invocation_name = get_filename(argv[0]);
+
+	while ((opt_char = tgetopt(argc, argv, optstring)) != -1) {
+		switch (opt_char) {
+		case 'h':
+			show_usage(stdout);
+			return 0;
+		case 'k':
+			segment_len = parse_size(toptarg, 16, 65536,
+						 "segment length");
+			if (segment_len == 0)
+				return 1;
+			break;
+		case 'l':
+			by_line = true;
+			break;
+		case 'o':
+			out_path = toptarg;
+			break;
+		case 's':
+			dict_size = parse_size(toptarg, 256,
+					       MAX_DICTIONARY_SIZE,
+					       "dictionary size");
+			if (dict_size == 0)
+				return 1;
+			break;
+		case 'S':
+			sample_size = parse_size(toptarg, 1, 0xFFFFFFFF,
+						 "sample size");
+			if (sample_size == 0)
+				return 1;
+			break;
+		case 'V':
+			show_version();
+			return 0;
+		default:
+			show_usage(stderr);
+			return 1;
+		}
+	}
+
+	argc -= toptind;
+	argv += toptind;
+
+	if (argc == 0) {
+		show_usage(stderr);
+		return 1;
+	}
+
+	memset(&t, 0, sizeof(t));
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '-' && argv[i][1] == '\0')
+			argv[i] = NULL;
+		if (add_samples(&t, argv[i], by_line, sample_size) != 0)
+			goto out;
+	}
+
+	if (t.num_samples == 0) {
+		msg("No sample data");
+		goto out;
+	}
+
+	if (count_dmers(&t) != 0)
+		goto out;
+
+	dict = xmalloc(dict_size);
+	if (dict == NULL)
+		goto out;
+	actual_size = build_dictionary(&t, dict, dict_size,
+				       MIN(segment_len, dict_size));
+	if (actual_size == 0)
+		goto out;
+
+	if (xopen_for_write(out_path, true, &out) != 0)
+		goto out;
+	if (out_path == NULL && isatty(out.fd)) {
+		msg("Refusing to write dictionary to terminal.  "
+		    "Use -o to give a file.");
+		xclose(&out);
+		goto out;
+	}
+	ret = full_write(&out, dict, actual_size);
+	if (xclose(&out) != 0)
+		ret = -1;
+	if (ret == 0)
+		msg("Built a %"PRIu64"-byte dictionary from %"PRIu64" samples "
+		    "(%"PRIu64" bytes)", (u64)actual_size,
+		    (u64)t.num_samples, (u64)t.data_size);
+out:
+	free(dict);
+	free(t.window_counts);
+	free(t.last_sample);
+	free(t.freqs);
+	free(t.sample_ends);
+	free(t.data);
+	return -ret;
+}
@@ -39,35 +39,55 @@
 
 struct options {
 	bool to_stdout;
+	bool checksum;
 	bool decompress;
 	bool force;
 	bool keep;
 	int compression_level;
+	int decode_speed;
 	u32 chunk_size;
+	u32 long_window;
+	unsigned num_threads;
+	bool write_index;
+	bool extract_range;
+	u64 range_start;
+	u64 range_length;
 	const tchar *suffix;
+	const tchar *dict_path;
+	void *dict;
+	size_t dict_size;
+	u32 dict_id;
 };
 
-static const tchar *const optstring = T("123456789cdfhkL:s:S:V");
+static const tchar *const optstring = T("123456789cCdD:fhikL:r:s:S:T:u:VW:");
 
 static void
 show_usage(FILE *fp)
 {
 	fprintf(fp,
-"Usage: %"TS" [-123456789cdfhkV] [-L LVL] [-s SIZE] [-S SUF] [FILE]...\n"
+"Usage: %"TS" [-123456789cCdfhikV] [-D DICT] [-L LVL] [-r RANGE] [-s SIZE]\n"
+"       [-S SUF] [-T N] [-u SPEED] [-W SIZE] [FILE]...\n"
 "Compress or decompress the specified FILEs.\n"
 "\n"
 "Options:\n"
 "  -1        fastest (worst) compression\n"
 "  -9        slowest (best) compression\n"
 "  -c        write to standard output\n"
+"  -C        store checksums, which are verified when decompressing\n"
 "  -d        decompress\n"
+"  -D DICT   use the preset dictionary in the file DICT\n"
 "  -f        overwrite existing output files\n"
 "  -h        print this help\n"
+"  -i        write a chunk index, so that byte ranges can be read quickly\n"
 "  -k        don't delete input files\n"
-"  -L LVL    compression level [1-9] (default 6)\n"
+"  -L LVL    compression level [1-12] (default 6)\n"
+"  -r RANGE  decompress only the bytes START:LENGTH to standard output\n"
 "  -s SIZE   chunk size (default 524288)\n"
 "  -S SUF    use suffix .SUF instead of .xpack\n"
+"  -T N      use N threads (0 = one per processor, default 1)\n"
+"  -u SPEED  favor decompression speed over ratio [0-3] (default 0)\n"
 "  -V        show version and legal information\n"
+"  -W SIZE   compress as one stream, matching up to SIZE bytes back\n"
 "\n"
 "NOTICE: this program is currently experimental, and the on-disk format\n"
 "is not yet stable!\n",
@@ -125,11 +145,103 @@ struct xpack_file_header {
 	u8 compression_level;
 };
 
+/*
+ * Version 2 files have a 32-bit flags field following the version 1 header.
+ * Files without any flags set are written as version 1.
+ */
+#define XPACK_FLAG_INDEX	0x00000001	/* chunk index at end of file */
+#define XPACK_FLAG_DICTIONARY	0x00000002	/* preset dictionary was used */
+#define XPACK_FLAG_CHECKSUM	0x00000004	/* CRC-32C of the data */
+#define XPACK_FLAG_LONG_WINDOW	0x00000008	/* chunks form one stream */
+#define XPACK_KNOWN_FLAGS	(XPACK_FLAG_INDEX | XPACK_FLAG_DICTIONARY | \
+				 XPACK_FLAG_CHECKSUM | XPACK_FLAG_LONG_WINDOW)
+
+/* Do the chunks end with an explicit marker rather than at end-of-file? */
+#define HAS_END_MARKER(flags)	\
+	((flags) & (XPACK_FLAG_INDEX | XPACK_FLAG_CHECKSUM))
+
+/* The number of bytes between a chunk header and the chunk's stored data */
+#define CHUNK_CHECKSUM_SIZE(flags)	\
+	(((flags) & XPACK_FLAG_CHECKSUM) ? sizeof(u32) : 0)
+
+/*
+ * If XPACK_FLAG_DICTIONARY is set, then the flags field is followed by the
+ * 32-bit ID of the dictionary, which is its Adler-32 checksum as in zlib.  The
+ * dictionary itself isn't stored in the file, so the same one must be given
+ * again to decompress.
+ *
+ * If XPACK_FLAG_LONG_WINDOW is set, then next comes the 32-bit window size.
+ * The chunks are then consecutive parts of one compressed stream whose matches
+ * may refer that far back, across chunk boundaries, so they can only be
+ * decompressed in order.  The compressor flushes the stream after each chunk,
+ * and the chunk's stored data is what that produced.  This can be a little
+ * larger than the original data, so the sizes can't tell whether a chunk was
+ * stored uncompressed; but the stream itself falls back to uncompressed blocks.
+ * The chunk size is limited so that the streaming decompressor can always take
+ * a whole chunk at once.
+ */
+#define MAX_LONG_WINDOW_CHUNK_SIZE	4194304
+
+/* The largest valid stored size of a chunk */
+#define MAX_STORED_SIZE(original_size, flags)				\
+	(((flags) & XPACK_FLAG_LONG_WINDOW) ?				\
+	 (original_size) + (original_size) / 16 + 64 : (original_size))
+
 struct xpack_chunk_header {
 	u32 stored_size;
 	u32 original_size;
 };
 
+/*
+ * If XPACK_FLAG_CHECKSUM is set, then each chunk header is followed by the
+ * 32-bit CRC-32C of the chunk's original data, and after the last chunk comes a
+ * chunk header with both sizes 0, then the CRC-32C of all the original data.
+ * Besides corrupt chunks, this catches chunks that are missing, duplicated, or
+ * out of order, and a file that was cut off between two chunks.
+ *
+ * If XPACK_FLAG_INDEX is set, then after the last chunk comes a chunk header
+ * with both sizes 0, then the checksum of all the data if there is one, then a
+ * copy of every chunk header in order, then this footer.  A reader can locate
+ * any chunk by reading the footer and summing the sizes in the index, without
+ * walking through the chunks themselves.
+ */
+struct xpack_index_footer {
+	u64 num_chunks;
+#define XPACK_INDEX_MAGIC "XPACKIDX"
+	char magic[8];
+};
+
+/* The chunk headers collected for the index while compressing */
+struct chunk_index {
+	struct xpack_chunk_header *entries;
+	size_t num_entries;
+	size_t capacity;
+};
+
+/* Compute the ID of a preset dictionary */
+static u32
+dictionary_id(const void *dict, size_t size)
+{
+	const u8 *p = dict;
+	u32 s1 = 1;
+	u32 s2 = 0;
+
+	while (size != 0) {
+		/* 5552 is the most bytes that can be summed without the sums
+		 * overflowing before the reduction modulo 65521. */
+		size_t n = MIN(size, 5552);
+
+		size -= n;
+		do {
+			s1 += *p++;
+			s2 += s1;
+		} while (--n);
+		s1 %= 65521;
+		s2 %= 65521;
+	}
+	return (s2 << 16) | s1;
+}
+
 static void
 bswap_file_header(struct xpack_file_header *hdr)
 {
@@ -149,18 +261,35 @@ bswap_chunk_header(struct xpack_chunk_header *hdr)
 }
 
 static int
-write_file_header(struct file_stream *out, u32 chunk_size, int compression_level)
+write_file_header(struct file_stream *out, u32 chunk_size, int compression_level,
+		  u32 flags, u32 dict_id, u32 long_window)
 {
 	struct xpack_file_header hdr;
+	u32 flags_le = le32_bswap(flags);
+	u32 dict_id_le = le32_bswap(dict_id);
+	u32 long_window_le = le32_bswap(long_window);
+	int ret;
 
 	memcpy(hdr.magic, XPACK_MAGIC, sizeof(hdr.magic));
 	hdr.chunk_size = chunk_size;
-	hdr.header_size = sizeof(hdr);
-	hdr.version = 1;
+	hdr.header_size = sizeof(hdr) + (flags ? sizeof(flags_le) : 0) +
+			  ((flags & XPACK_FLAG_DICTIONARY) ?
+			   sizeof(dict_id_le) : 0) +
+			  ((flags & XPACK_FLAG_LONG_WINDOW) ?
+			   sizeof(long_window_le) : 0);
+	hdr.version = flags ? 2 : 1;
 	hdr.compression_level = compression_level;
 
 	bswap_file_header(&hdr);
-	return full_write(out, &hdr, sizeof(hdr));
+	ret = full_write(out, &hdr, sizeof(hdr));
+	if (ret != 0 || !flags)
+		return ret;
+	ret = full_write(out, &flags_le, sizeof(flags_le));
+	if (ret == 0 && (flags & XPACK_FLAG_DICTIONARY))
+		ret = full_write(out, &dict_id_le, sizeof(dict_id_le));
+	if (ret == 0 && (flags & XPACK_FLAG_LONG_WINDOW))
+		ret = full_write(out, &long_window_le, sizeof(long_window_le));
+	return ret;
 }
 
 static int
@@ -176,113 +305,1033 @@ write_chunk_header(struct file_stream *out, u32 stored_size, u32 original_size)
 }
 
 static int
-do_compress(struct xpack_compressor *compressor, struct file_stream *in,
-	    struct file_stream *out, u32 chunk_size)
+write_checksum(struct file_stream *out, u32 checksum)
+{
+	u32 checksum_le = le32_bswap(checksum);
+
+	return full_write(out, &checksum_le, sizeof(checksum_le));
+}
+
+/* Remember a chunk header for the index.  Returns 0 on success or -1. */
+static int
+add_index_entry(struct chunk_index *index, u32 stored_size, u32 original_size)
+{
+	if (index->num_entries == index->capacity) {
+		size_t new_capacity = MAX(2 * index->capacity, 256);
+		struct xpack_chunk_header *new_entries;
+
+		new_entries = realloc(index->entries,
+				      new_capacity * sizeof(new_entries[0]));
+		if (new_entries == NULL) {
+			msg("Out of memory");
+			return -1;
+		}
+		index->entries = new_entries;
+		index->capacity = new_capacity;
+	}
+	index->entries[index->num_entries].stored_size = stored_size;
+	index->entries[index->num_entries].original_size = original_size;
+	bswap_chunk_header(&index->entries[index->num_entries]);
+	index->num_entries++;
+	return 0;
+}
+
+/* Write the index and the index footer. */
+static int
+write_index(struct file_stream *out, const struct chunk_index *index)
+{
+	struct xpack_index_footer footer;
+	int ret;
+
+	STATIC_ASSERT(sizeof(struct xpack_index_footer) == 16);
+
+	ret = full_write(out, index->entries,
+			 index->num_entries * sizeof(index->entries[0]));
+	if (ret != 0)
+		return ret;
+
+	footer.num_chunks = le64_bswap((u64)index->num_entries);
+	memcpy(footer.magic, XPACK_INDEX_MAGIC, sizeof(footer.magic));
+	return full_write(out, &footer, sizeof(footer));
+}
+
+/*
+ * Write what follows the last chunk, if anything: the end-of-chunks marker,
+ * then the checksum of all the data and the index, if they are wanted.
+ */
+static int
+write_chunks_end(struct file_stream *out, const struct chunk_index *index,
+		 const u32 *stream_checksum)
+{
+	int ret;
+
+	if (index == NULL && stream_checksum == NULL)
+		return 0;
+
+	ret = write_chunk_header(out, 0, 0);
+	if (ret == 0 && stream_checksum != NULL)
+		ret = write_checksum(out, *stream_checksum);
+	if (ret == 0 && index != NULL)
+		ret = write_index(out, index);
+	return ret;
+}
+
+/*
+ * Write a chunk, storing it compressed if 'compressed_size' is nonzero or
+ * uncompressed otherwise.  If 'stream_checksum' isn't NULL, then the chunk's
+ * 'checksum' is stored with it and added to *stream_checksum.
+ */
+static int
+write_chunk(struct file_stream *out, struct chunk_index *index,
+	    u32 *stream_checksum, u32 checksum,
+	    const void *original_buf, u32 original_size,
+	    const void *compressed_buf, u32 compressed_size)
+{
+	const void *stored_buf;
+	u32 stored_size;
+	int ret;
+
+	if (compressed_size == 0) {
+		/* Store the chunk uncompressed */
+		stored_buf = original_buf;
+		stored_size = original_size;
+	} else {
+		/* Store the chunk compressed */
+		stored_buf = compressed_buf;
+		stored_size = compressed_size;
+	}
+
+	if (index != NULL) {
+		ret = add_index_entry(index, stored_size, original_size);
+		if (ret != 0)
+			return ret;
+	}
+
+	ret = write_chunk_header(out, stored_size, original_size);
+	if (ret != 0)
+		return ret;
+
+	if (stream_checksum != NULL) {
+		ret = write_checksum(out, checksum);
+		if (ret != 0)
+			return ret;
+		*stream_checksum = xpack_crc32c_combine(*stream_checksum,
+							checksum,
+							original_size);
+	}
+
+	return full_write(out, stored_buf, stored_size);
+}
+
+/*
+ * Return the checksum of a chunk of 'size' bytes at 'data' which 'compressor'
+ * just compressed to 'compressed_size' bytes.  The compressor computed it while
+ * compressing, unless the chunk didn't compress and will be stored as is.
+ */
+static u32
+get_chunk_checksum(struct xpack_compressor *compressor,
+		   const void *data, u32 size, u32 compressed_size)
+{
+	if (compressed_size == 0)
+		return xpack_crc32c(0, data, size);
+	return xpack_compressor_get_checksum(compressor);
+}
+
+/* Compress a chunk on a worker thread */
+static int
+compress_chunk(void *compressor, struct chunk_job *job)
+{
+	job->out_nbytes = xpack_compress(compressor, job->src, job->in_nbytes,
+					 job->dst, job->in_nbytes - 1);
+	if (job->use_checksum)
+		job->checksum = get_chunk_checksum(compressor, job->src,
+						   job->in_nbytes,
+						   job->out_nbytes);
+	return 0;
+}
+
+/*
+ * Compress chunks in parallel.  The main thread reads the chunks and writes the
+ * results in order, while the worker threads do the compression.
+ */
+static int
+do_compress_parallel(struct xpack_compressor **compressors,
+		     unsigned num_threads, struct file_stream *in,
+		     struct file_stream *out, u32 chunk_size,
+		     struct chunk_index *index, u32 *stream_checksum)
+{
+	struct chunk_pool *pool;
+	struct chunk_job *job;
+	ssize_t ret;
+
+	pool = chunk_pool_create(num_threads, (void **)compressors,
+				 compress_chunk, chunk_size, chunk_size - 1);
+	if (pool == NULL)
+		return -1;
+
+	for (;;) {
+		job = chunk_pool_get_job(pool);
+		if (job == NULL) {
+			/* All slots are busy; write out the oldest chunk. */
+			job = chunk_pool_collect(pool);
+			ret = write_chunk(out, index, stream_checksum,
+					  job->checksum, job->src,
+					  job->in_nbytes, job->dst,
+					  job->out_nbytes);
+			if (ret != 0)
+				goto out;
+			continue;
+		}
+
+		ret = xread_direct(in, job->in, chunk_size, &job->src);
+		if (ret <= 0)
+			break;
+		job->in_nbytes = ret;
+		job->dst = job->out;
+		job->use_checksum = (stream_checksum != NULL);
+		chunk_pool_submit(pool, job);
+	}
+
+	/* Write out the remaining chunks. */
+	while (ret == 0 && (job = chunk_pool_collect(pool)) != NULL)
+		ret = write_chunk(out, index, stream_checksum, job->checksum,
+				  job->src, job->in_nbytes,
+				  job->dst, job->out_nbytes);
+out:
+	chunk_pool_destroy(pool);
+	return ret;
+}
+
+/*
+ * Compress the chunks of the input file.  If 'index' isn't NULL, then the chunk
+ * headers are collected into it and written at the end.  If 'use_checksum' is
+ * true, then the checksums of each chunk and of all the data are written too.
+ */
+static int
+do_compress(struct xpack_compressor **compressors, unsigned num_threads,
+	    struct file_stream *in, struct file_stream *out, u32 chunk_size,
+	    struct chunk_index *index, bool use_checksum)
 {
-	void *original_buf = xmalloc(chunk_size);
-	void *compressed_buf = xmalloc(chunk_size - 1);
-	ssize_t ret = -1;
+	void *original_buf = NULL;
+	void *compressed_buf = NULL;
+	const void *data;
+	u32 checksum = 0;
+	u32 *stream_checksum = use_checksum ? &checksum : NULL;
+	ssize_t ret;
+
+	if (num_threads > 1) {
+		ret = do_compress_parallel(compressors, num_threads,
+					   in, out, chunk_size, index,
+					   stream_checksum);
+		goto out_write_end;
+	}
 
+	ret = -1;
+	original_buf = xmalloc(chunk_size);
+	compressed_buf = xmalloc(chunk_size - 1);
 	if (original_buf == NULL || compressed_buf == NULL)
 		goto out;
 
-	while ((ret = xread(in, original_buf, chunk_size)) > 0) {
+	/* If the input file is mapped, the chunks are compressed in place. */
+	while ((ret = xread_direct(in, original_buf, chunk_size, &data)) > 0) {
 		u32 original_size = ret;
 		u32 compressed_size;
-		void *stored_buf;
-		u32 stored_size;
 
-		compressed_size = xpack_compress(compressor,
-						 original_buf,
+		compressed_size = xpack_compress(compressors[0],
+						 data,
 						 original_size,
 						 compressed_buf,
 						 original_size - 1);
-		if (compressed_size == 0) {
-			/* Store the chunk uncompressed */
-			stored_buf = original_buf;
-			stored_size = original_size;
-		} else {
-			/* Store the chunk compressed */
-			stored_buf = compressed_buf;
-			stored_size = compressed_size;
-		}
 
-		ret = write_chunk_header(out, stored_size, original_size);
+		ret = write_chunk(out, index, stream_checksum,
+				  use_checksum ?
+				  get_chunk_checksum(compressors[0], data,
+						     original_size,
+						     compressed_size) : 0,
+				  data, original_size,
+				  compressed_buf, compressed_size);
 		if (ret != 0)
 			goto out;
+	}
+out_write_end:
+	if (ret == 0)
+		ret = write_chunks_end(out, index, stream_checksum);
+out:
+	free(compressed_buf);
+	free(original_buf);
+	return ret;
+}
+
+/*
+ * Compress the chunks of the input file as one stream whose matches may refer
+ * back into earlier chunks, for XPACK_FLAG_LONG_WINDOW.  'compressor' was
+ * allocated for two chunks, so each chunk is one segment of the stream.  If
+ * 'use_checksum' is true, then the checksums of each chunk and of all the data
+ * are written too; the compressor's checksum covers the whole stream, so each
+ * chunk's checksum is recovered from the stream's before and after it.
+ */
+static int
+do_compress_long(struct xpack_compressor *compressor, struct file_stream *in,
+		 struct file_stream *out, u32 chunk_size, bool use_checksum)
+{
+	const u32 compressed_buf_size =
+		MAX_STORED_SIZE(chunk_size, XPACK_FLAG_LONG_WINDOW);
+	u8 *original_buf = NULL;
+	u8 *compressed_buf = NULL;
+	const void *data;
+	u32 checksum = 0;
+	u32 *stream_checksum = use_checksum ? &checksum : NULL;
+	u32 prev_checksum = 0;
+	ssize_t ret;
+
+	ret = -1;
+	original_buf = xmalloc(chunk_size);
+	compressed_buf = xmalloc(compressed_buf_size);
+	if (original_buf == NULL || compressed_buf == NULL)
+		goto out;
+
+	if (xpack_compress_stream_init(compressor) != 0) {
+		msg("Unable to start a stream with a long window");
+		goto out;
+	}
 
-		ret = full_write(out, stored_buf, stored_size);
+	while ((ret = xread_direct(in, original_buf, chunk_size, &data)) > 0) {
+		u32 original_size = ret;
+		u32 compressed_size;
+		u32 cur_checksum;
+
+		/* A whole chunk is consumed, and is compressed right away if it
+		 * fills the segment.  Otherwise flushing compresses it. */
+		xpack_compress_stream_feed(compressor, data, original_size);
+		compressed_size = xpack_compress_stream_read(compressor,
+							     compressed_buf,
+							     compressed_buf_size);
+		xpack_compress_stream_flush(compressor);
+		compressed_size += xpack_compress_stream_read(compressor,
+					&compressed_buf[compressed_size],
+					compressed_buf_size - compressed_size);
+
+		cur_checksum = xpack_compressor_get_checksum(compressor);
+		ret = write_chunk(out, NULL, stream_checksum,
+				  cur_checksum ^
+				  xpack_crc32c_combine(prev_checksum, 0,
+						       original_size),
+				  data, original_size,
+				  compressed_buf, compressed_size);
 		if (ret != 0)
 			goto out;
+		prev_checksum = cur_checksum;
 	}
+	if (ret == 0)
+		ret = write_chunks_end(out, NULL, stream_checksum);
 out:
 	free(compressed_buf);
 	free(original_buf);
 	return ret;
 }
 
+/* Read a stored checksum.  Returns 0 on success or -1 on error. */
+static int
+read_checksum(struct file_stream *in, u32 *checksum_ret)
+{
+	u32 checksum_le;
+	ssize_t ret;
+
+	ret = xread(in, &checksum_le, sizeof(checksum_le));
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(checksum_le)) {
+		msg("%"TS": unexpected end-of-file", in->name);
+		return -1;
+	}
+	*checksum_ret = le32_bswap(checksum_le);
+	return 0;
+}
+
+/*
+ * Read and validate the next chunk header, and the chunk's checksum if the file
+ * has checksums.  Returns 1 if a chunk header was read, 0 at the end of the
+ * chunks, or -1 on error.
+ */
 static int
-do_decompress(struct xpack_decompressor *decompressor, struct file_stream *in,
-	      struct file_stream *out, u32 chunk_size)
+read_chunk_header(struct file_stream *in, u32 chunk_size, u32 flags,
+		  u32 *stored_size_ret, u32 *original_size_ret,
+		  u32 *checksum_ret)
 {
-	void *original_buf = xmalloc(chunk_size);
-	void *compressed_buf = xmalloc(chunk_size - 1);
-	ssize_t ret = -1;
 	struct xpack_chunk_header chunk_hdr;
+	ssize_t ret;
+
+	ret = xread(in, &chunk_hdr, sizeof(chunk_hdr));
+	if (ret < 0)
+		return -1;
+
+	/* With an index or checksums, the chunks end with an explicit marker
+	 * instead. */
+	if (ret == 0 && !HAS_END_MARKER(flags))
+		return 0;
+
+	if (ret != sizeof(chunk_hdr)) {
+		msg("%"TS": unexpected end-of-file", in->name);
+		return -1;
+	}
+
+	bswap_chunk_header(&chunk_hdr);
+
+	if (HAS_END_MARKER(flags) &&
+	    chunk_hdr.stored_size == 0 && chunk_hdr.original_size == 0)
+		return 0;
+
+	if (chunk_hdr.original_size < 1 ||
+	    chunk_hdr.original_size > chunk_size ||
+	    chunk_hdr.stored_size < 1 ||
+	    chunk_hdr.stored_size > MAX_STORED_SIZE(chunk_hdr.original_size,
+						    flags)) {
+		msg("%"TS": file corrupt", in->name);
+		return -1;
+	}
+
+	*checksum_ret = 0;
+	if ((flags & XPACK_FLAG_CHECKSUM) && read_checksum(in, checksum_ret))
+		return -1;
+
+	*stored_size_ret = chunk_hdr.stored_size;
+	*original_size_ret = chunk_hdr.original_size;
+	return 1;
+}
+
+/*
+ * Check the checksum of all the data, which follows the end-of-chunks marker,
+ * against 'checksum', which was combined from the checksums of the chunks.
+ * Returns 0 if it matches or -1 otherwise.
+ */
+static int
+check_stream_checksum(struct file_stream *in, u32 checksum)
+{
+	u32 stored_checksum;
+
+	if (read_checksum(in, &stored_checksum) != 0)
+		return -1;
+	if (stored_checksum != checksum) {
+		msg("%"TS": checksum mismatch", in->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * After a whole file's end-of-chunks marker, check the checksum of all the
+ * data, which is 'checksum' if it is right, then the index of the
+ * 'num_chunks' chunks that were read, if there is one, and that nothing else
+ * follows, so that data appended to the file, such as another file, isn't
+ * ignored.  Returns 0 if all is well or -1 otherwise.
+ */
+static int
+check_end_of_chunks(struct file_stream *in, u32 flags, u32 checksum,
+		    u64 num_chunks)
+{
+	struct xpack_index_footer footer;
+	u8 byte;
+	ssize_t ret;
+
+	if ((flags & XPACK_FLAG_CHECKSUM) &&
+	    check_stream_checksum(in, checksum) != 0)
+		return -1;
+
+	if (flags & XPACK_FLAG_INDEX) {
+		/* The chunks were just checked, so only the count in the
+		 * footer has to agree with them. */
+		if (skip_bytes(in, num_chunks *
+				   sizeof(struct xpack_chunk_header)) != 0)
+			return -1;
+		ret = xread(in, &footer, sizeof(footer));
+		if (ret < 0)
+			return -1;
+		if (ret != sizeof(footer)) {
+			msg("%"TS": unexpected end-of-file", in->name);
+			return -1;
+		}
+		if (memcmp(footer.magic, XPACK_INDEX_MAGIC,
+			   sizeof(footer.magic)) != 0 ||
+		    le64_bswap(footer.num_chunks) != num_chunks) {
+			msg("%"TS": file corrupt", in->name);
+			return -1;
+		}
+	}
+
+	ret = xread(in, &byte, 1);
+	if (ret < 0)
+		return -1;
+	if (ret != 0) {
+		msg("%"TS": file corrupt", in->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the stored data of a chunk, into 'buf' or in place if the file is mapped,
+ * and set *data_ret to point to it.  Returns 0 on success or -1 on error.
+ */
+static int
+read_chunk_data(struct file_stream *in, void *buf, u32 stored_size,
+		const void **data_ret)
+{
+	ssize_t ret = xread_direct(in, buf, stored_size, data_ret);
+
+	if (ret < 0)
+		return -1;
+
+	if (ret != stored_size) {
+		msg("%"TS": unexpected end-of-file", in->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Return the checksum of a chunk of 'size' bytes at 'data' which was just
+ * decompressed by 'decompressor', or which was stored uncompressed.
+ */
+static u32
+get_decompressed_checksum(struct xpack_decompressor *decompressor,
+			  const void *data, u32 size, bool was_compressed)
+{
+	if (!was_compressed)
+		return xpack_crc32c(0, data, size);
+	return xpack_decompressor_get_checksum(decompressor);
+}
+
+/*
+ * Read the stored data of a chunk and decompress it if needed, and set
+ * *data_ret to point to the original data.  That's 'original_buf', except that
+ * a chunk stored uncompressed in a mapped file is left where it is.  If
+ * 'checksum' isn't NULL, the original data is checked against it.  Returns 0
+ * on success or -1 on error.
+ */
+static int
+read_and_decompress_chunk(struct xpack_decompressor *decompressor,
+			  struct file_stream *in,
+			  u32 stored_size, u32 original_size,
+			  const u32 *checksum,
+			  void *original_buf, void *compressed_buf,
+			  const void **data_ret)
+{
+	enum decompress_result result;
+	const void *stored_data;
+	int ret;
+
+	ret = read_chunk_data(in, (stored_size == original_size) ?
+			      original_buf : compressed_buf, stored_size,
+			      &stored_data);
+	if (ret != 0)
+		return ret;
+
+	if (stored_size == original_size) {
+		/* Chunk was stored uncompressed */
+		*data_ret = stored_data;
+	} else {
+		/* Chunk was stored compressed */
+		result = xpack_decompress(decompressor,
+					  stored_data, stored_size,
+					  original_buf, original_size,
+					  NULL);
+		if (result != DECOMPRESS_SUCCESS) {
+			msg("%"TS": data corrupt", in->name);
+			return -1;
+		}
+		*data_ret = original_buf;
+	}
+
+	if (checksum != NULL &&
+	    get_decompressed_checksum(decompressor, *data_ret, original_size,
+				      stored_size != original_size)
+	    != *checksum) {
+		msg("%"TS": checksum mismatch", in->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Decompress a chunk on a worker thread.  Chunks which were stored uncompressed
+ * are written directly from the input, unless the output file is mapped.
+ * Returns 0 on success, -1 if the data is corrupt, or 1 if the data doesn't
+ * match its checksum.
+ */
+static int
+decompress_chunk(void *decompressor, struct chunk_job *job)
+{
+	const bool was_compressed = (job->in_nbytes != job->out_nbytes);
+	const void *data = job->dst;
+
+	if (!was_compressed) {
+		if (job->dst != job->out)
+			memcpy(job->dst, job->src, job->out_nbytes);
+		else
+			data = job->src;
+	} else if (xpack_decompress(decompressor, job->src, job->in_nbytes,
+				    job->dst, job->out_nbytes, NULL)
+		   != DECOMPRESS_SUCCESS) {
+		return -1;
+	}
+
+	if (job->use_checksum &&
+	    get_decompressed_checksum(decompressor, data, job->out_nbytes,
+				      was_compressed) != job->checksum)
+		return 1;
+	return 0;
+}
+
+/* Write out the result of a chunk decompressed on a worker thread */
+static int
+write_decompressed_chunk(struct file_stream *in, struct file_stream *out,
+			 const struct chunk_job *job)
+{
+	if (job->result != 0) {
+		msg("%"TS": %s", in->name, (job->result > 0) ?
+		    "checksum mismatch" : "data corrupt");
+		return -1;
+	}
+	if (job->dst != job->out) /* already in the output file's mapping */
+		return 0;
+	return full_write(out, (job->in_nbytes == job->out_nbytes) ?
+				job->src : job->out, job->out_nbytes);
+}
+
+/*
+ * Decompress chunks in parallel.  The main thread reads the chunks and writes
+ * the results in order, while the worker threads do the decompression.
+ */
+static int
+do_decompress_parallel(struct xpack_decompressor **decompressors,
+		       unsigned num_threads, struct file_stream *in,
+		       struct file_stream *out, u32 chunk_size, u32 flags)
+{
+	struct chunk_pool *pool;
+	struct chunk_job *job;
+	u32 stream_checksum = 0;
+	u64 num_chunks = 0;
+	int ret;
+
+	pool = chunk_pool_create(num_threads, (void **)decompressors,
+				 decompress_chunk, chunk_size, chunk_size);
+	if (pool == NULL)
+		return -1;
+
+	for (;;) {
+		u32 stored_size;
+		u32 original_size;
+		u32 checksum;
+
+		job = chunk_pool_get_job(pool);
+		if (job == NULL) {
+			/* All slots are busy; write out the oldest chunk. */
+			job = chunk_pool_collect(pool);
+			ret = write_decompressed_chunk(in, out, job);
+			if (ret != 0)
+				goto out;
+			continue;
+		}
+
+		ret = read_chunk_header(in, chunk_size, flags,
+					&stored_size, &original_size,
+					&checksum);
+		if (ret <= 0)
+			break;
+
+		ret = read_chunk_data(in, job->in, stored_size, &job->src);
+		if (ret != 0)
+			break;
+
+		stream_checksum = xpack_crc32c_combine(stream_checksum,
+						       checksum,
+						       original_size);
+		num_chunks++;
+		job->in_nbytes = stored_size;
+		job->out_nbytes = original_size;
+		job->checksum = checksum;
+		job->use_checksum = (flags & XPACK_FLAG_CHECKSUM) != 0;
+		job->dst = xwrite_in_place(out, original_size);
+		if (job->dst == NULL)
+			job->dst = job->out;
+		chunk_pool_submit(pool, job);
+	}
+
+	/* Write out the remaining chunks. */
+	while (ret == 0 && (job = chunk_pool_collect(pool)) != NULL)
+		ret = write_decompressed_chunk(in, out, job);
+
+	if (ret == 0 && HAS_END_MARKER(flags))
+		ret = check_end_of_chunks(in, flags, stream_checksum,
+					  num_chunks);
+out:
+	chunk_pool_destroy(pool);
+	return ret;
+}
+
+static int
+do_decompress(struct xpack_decompressor **decompressors, unsigned num_threads,
+	      struct file_stream *in, struct file_stream *out, u32 chunk_size,
+	      u32 flags)
+{
+	void *original_buf;
+	void *compressed_buf;
+	int ret = -1;
+	u32 original_size;
+	u32 stored_size;
+	u32 checksum;
+	u32 stream_checksum = 0;
+	u64 num_chunks = 0;
 
+	if (num_threads > 1)
+		return do_decompress_parallel(decompressors, num_threads,
+					      in, out, chunk_size, flags);
+
+	original_buf = xmalloc(chunk_size);
+	compressed_buf = xmalloc(chunk_size - 1);
 	if (original_buf == NULL || compressed_buf == NULL)
 		goto out;
 
-	while ((ret = xread(in, &chunk_hdr, sizeof(chunk_hdr)))
-			== sizeof(chunk_hdr))
+	while ((ret = read_chunk_header(in, chunk_size, flags,
+					&stored_size, &original_size,
+					&checksum)) > 0)
 	{
-		u32 original_size;
-		u32 stored_size;
-		enum decompress_result result;
+		/* If the output file is mapped, decompress straight into it. */
+		void *dst = xwrite_in_place(out, original_size);
+		const void *data;
+
+		ret = read_and_decompress_chunk(decompressors[0], in,
+						stored_size, original_size,
+						(flags & XPACK_FLAG_CHECKSUM) ?
+						&checksum : NULL,
+						dst ? dst : original_buf,
+						compressed_buf, &data);
+		if (ret != 0)
+			goto out;
+		stream_checksum = xpack_crc32c_combine(stream_checksum,
+						       checksum,
+						       original_size);
+		num_chunks++;
+
+		if (dst == NULL)
+			ret = full_write(out, data, original_size);
+		else if (data != dst)
+			memcpy(dst, data, original_size);
+		if (ret != 0)
+			goto out;
+	}
 
-		bswap_chunk_header(&chunk_hdr);
-		original_size = chunk_hdr.original_size;
-		stored_size = chunk_hdr.stored_size;
+	if (ret == 0 && HAS_END_MARKER(flags))
+		ret = check_end_of_chunks(in, flags, stream_checksum,
+					  num_chunks);
+out:
+	free(compressed_buf);
+	free(original_buf);
+	return ret;
+}
 
-		if (original_size < 1 || original_size > chunk_size ||
-		    stored_size < 1 || stored_size > original_size) {
-			msg("%"TS": file corrupt", in->name);
-			ret = -1;
-			goto out;
+/*
+ * If the input file is mapped, walk its chunk headers to find the size it will
+ * decompress to, so that the output file can be mapped at its final size.
+ * Returns 0 if the input isn't mapped or the chunks can't be walked; any
+ * corruption is then reported by the decompression itself.
+ */
+static u64
+get_decompressed_size(const struct file_stream *in, u32 chunk_size, u32 flags)
+{
+	struct xpack_chunk_header hdr;
+	size_t pos = in->mmap_pos;
+	u64 size = 0;
+
+	if (in->mmap_mem == NULL || pos > in->mmap_size)
+		return 0;
+
+	for (;;) {
+		if (in->mmap_size - pos < sizeof(hdr)) {
+			if (pos == in->mmap_size && !HAS_END_MARKER(flags))
+				return size;
+			return 0;
 		}
+		memcpy(&hdr, &in->mmap_mem[pos], sizeof(hdr));
+		bswap_chunk_header(&hdr);
+		pos += sizeof(hdr);
+
+		if (HAS_END_MARKER(flags) &&
+		    hdr.stored_size == 0 && hdr.original_size == 0)
+			return size;
+
+		if (hdr.original_size < 1 || hdr.original_size > chunk_size ||
+		    hdr.stored_size < 1 ||
+		    hdr.stored_size > MAX_STORED_SIZE(hdr.original_size,
+						      flags) ||
+		    hdr.stored_size + CHUNK_CHECKSUM_SIZE(flags) >
+				in->mmap_size - pos)
+			return 0;
+
+		pos += CHUNK_CHECKSUM_SIZE(flags) + hdr.stored_size;
+		size += hdr.original_size;
+	}
+}
+
+/*
+ * Use the chunk index to find the chunk containing uncompressed offset
+ * 'start', and seek to its chunk header.  On success, returns 1 and sets
+ * *chunk_start_ret to the uncompressed offset of that chunk.  Returns 0 if the
+ * file can't be seeked, so the caller should walk the chunks instead, or -1 on
+ * error.
+ */
+static int
+seek_to_chunk(struct file_stream *in, u32 header_size, u32 flags, u64 start,
+	      u64 *chunk_start_ret)
+{
+	struct xpack_index_footer footer;
+	struct xpack_chunk_header *entries;
+	s64 footer_pos;
+	u64 num_chunks;
+	u64 chunk_pos = header_size;
+	u64 chunk_start = 0;
+	u64 i;
+	int ret = -1;
+
+	footer_pos = xlseek(in, -(s64)sizeof(footer), SEEK_END);
+	if (footer_pos < 0)
+		return 0;
+	if (footer_pos < header_size)
+		goto corrupt;
+
+	if (xread(in, &footer, sizeof(footer)) != sizeof(footer) ||
+	    memcmp(footer.magic, XPACK_INDEX_MAGIC, sizeof(footer.magic)) != 0)
+		goto corrupt;
+
+	num_chunks = le64_bswap(footer.num_chunks);
+	if (num_chunks > (footer_pos - header_size) / sizeof(entries[0]))
+		goto corrupt;
+
+	entries = xmalloc(num_chunks * sizeof(entries[0]));
+	if (entries == NULL)
+		return -1;
+
+	if (xlseek(in, footer_pos - num_chunks * sizeof(entries[0]),
+		   SEEK_SET) < 0 ||
+	    xread(in, entries, num_chunks * sizeof(entries[0])) !=
+			num_chunks * sizeof(entries[0]))
+		goto corrupt_free_entries;
+
+	for (i = 0; i < num_chunks; i++) {
+		bswap_chunk_header(&entries[i]);
+		if (chunk_start + entries[i].original_size > start)
+			break;
+		chunk_start += entries[i].original_size;
+		chunk_pos += sizeof(entries[i]) + CHUNK_CHECKSUM_SIZE(flags) +
+			     entries[i].stored_size;
+	}
+
+	if (xlseek(in, chunk_pos, SEEK_SET) < 0)
+		goto corrupt_free_entries;
+
+	*chunk_start_ret = chunk_start;
+	ret = 1;
+	goto out_free_entries;
+
+corrupt_free_entries:
+	msg("%"TS": chunk index corrupt", in->name);
+out_free_entries:
+	free(entries);
+	return ret;
+
+corrupt:
+	msg("%"TS": chunk index corrupt", in->name);
+	return -1;
+}
+
+/*
+ * Decompress only the uncompressed bytes [start, start + length) of the file.
+ * With an index, the chunks before the range are skipped with a single seek.
+ * Otherwise, their headers are still walked, but their data isn't decoded.
+ * Only the chunks which are decoded have their checksums verified.
+ */
+static int
+do_decompress_range(struct xpack_decompressor *decompressor,
+		    struct file_stream *in, struct file_stream *out,
+		    u32 chunk_size, u32 header_size, u32 flags,
+		    u64 start, u64 length)
+{
+	const u64 end = start + MIN(length, ~(u64)0 - start);
+	void *original_buf;
+	void *compressed_buf;
+	u64 chunk_start = 0;
+	u32 original_size;
+	u32 stored_size;
+	u32 checksum;
+	const void *data;
+	int ret;
 
-		ret = xread(in, (stored_size == original_size) ?
-				original_buf : compressed_buf, stored_size);
+	if (flags & XPACK_FLAG_INDEX) {
+		ret = seek_to_chunk(in, header_size, flags, start,
+				    &chunk_start);
 		if (ret < 0)
+			return ret;
+	}
+
+	ret = -1;
+	original_buf = xmalloc(chunk_size);
+	compressed_buf = xmalloc(chunk_size - 1);
+	if (original_buf == NULL || compressed_buf == NULL)
+		goto out;
+
+	ret = 0;
+	while (chunk_start < end &&
+	       (ret = read_chunk_header(in, chunk_size, flags,
+					&stored_size, &original_size,
+					&checksum)) > 0)
+	{
+		if (chunk_start + original_size <= start) {
+			ret = skip_bytes(in, stored_size);
+		} else {
+			u64 begin = MAX(start, chunk_start) - chunk_start;
+			u64 stop = MIN(end, chunk_start + original_size) -
+				   chunk_start;
+
+			ret = read_and_decompress_chunk(decompressor, in,
+							stored_size,
+							original_size,
+							(flags &
+							 XPACK_FLAG_CHECKSUM) ?
+							&checksum : NULL,
+							original_buf,
+							compressed_buf,
+							&data);
+			if (ret == 0)
+				ret = full_write(out, (const u8 *)data + begin,
+						 stop - begin);
+		}
+		if (ret != 0)
+			goto out;
+		chunk_start += original_size;
+	}
+out:
+	free(compressed_buf);
+	free(original_buf);
+	return ret;
+}
+
+/*
+ * Decompress the stored data of the next chunk of a file with
+ * XPACK_FLAG_LONG_WINDOW, continuing the stream in 'decompressor'.  Since the
+ * compressor flushed the stream after the chunk, all of the chunk can be
+ * decompressed without looking at the next one.  Returns 0 on success or -1 if
+ * the data is corrupt.
+ */
+static int
+decompress_long_window_chunk(struct xpack_decompressor *decompressor,
+			     const u8 *in, u32 in_nbytes,
+			     u8 *out, u32 out_nbytes)
+{
+	u32 in_pos = 0;
+	u32 out_pos = 0;
+
+	while (out_pos < out_nbytes) {
+		size_t fed = xpack_decompress_stream_feed(decompressor,
+							  &in[in_pos],
+							  in_nbytes - in_pos);
+		size_t n;
+
+		in_pos += fed;
+		if (xpack_decompress_stream_read(decompressor, &out[out_pos],
+						 out_nbytes - out_pos, &n)
+		    != DECOMPRESS_SUCCESS)
+			return -1;
+		out_pos += n;
+		if (fed == 0 && n == 0)
+			return -1;
+	}
+	return (in_pos == in_nbytes) ? 0 : -1;
+}
+
+/*
+ * Decompress a file with XPACK_FLAG_LONG_WINDOW, writing only the uncompressed
+ * bytes [start, start + length).  Every chunk up to the end of the range must
+ * be decompressed, since later chunks may refer to the data of earlier ones.
+ */
+static int
+do_decompress_long(struct xpack_decompressor *decompressor,
+		   struct file_stream *in, struct file_stream *out,
+		   u32 chunk_size, u32 long_window, u32 flags,
+		   u64 start, u64 length)
+{
+	const u64 end = start + MIN(length, ~(u64)0 - start);
+	u8 *original_buf;
+	u8 *compressed_buf;
+	u64 chunk_start = 0;
+	u32 original_size;
+	u32 stored_size;
+	u32 checksum;
+	u32 prev_checksum = 0;
+	u64 num_chunks = 0;
+	const void *data;
+	int ret = -1;
+
+	original_buf = xmalloc(chunk_size);
+	compressed_buf = xmalloc(MAX_STORED_SIZE(chunk_size, flags));
+	if (original_buf == NULL || compressed_buf == NULL)
+		goto out;
+
+	if (xpack_decompress_stream_init(decompressor, long_window) != 0) {
+		msg("%"TS": unable to allocate a window of %"PRIu32" bytes",
+		    in->name, long_window);
+		goto out;
+	}
+
+	ret = 0;
+	while (chunk_start < end &&
+	       (ret = read_chunk_header(in, chunk_size, flags,
+					&stored_size, &original_size,
+					&checksum)) > 0)
+	{
+		ret = read_chunk_data(in, compressed_buf, stored_size, &data);
+		if (ret != 0)
 			goto out;
 
-		if (ret != stored_size) {
-			msg("%"TS": unexpected end-of-file", in->name);
+		if (decompress_long_window_chunk(decompressor, data,
+						 stored_size, original_buf,
+						 original_size) != 0) {
+			msg("%"TS": data corrupt", in->name);
 			ret = -1;
 			goto out;
 		}
 
-		if (stored_size != original_size) {
-			/* Chunk was stored compressed */
-			result = xpack_decompress(decompressor,
-						  compressed_buf, stored_size,
-						  original_buf, original_size,
-						  NULL);
-			if (result != DECOMPRESS_SUCCESS) {
-				msg("%"TS": data corrupt", in->name);
+		if (flags & XPACK_FLAG_CHECKSUM) {
+			u32 cur_checksum =
+				xpack_decompressor_get_checksum(decompressor);
+
+			if ((cur_checksum ^
+			     xpack_crc32c_combine(prev_checksum, 0,
+						  original_size)) != checksum) {
+				msg("%"TS": checksum mismatch", in->name);
 				ret = -1;
 				goto out;
 			}
+			prev_checksum = cur_checksum;
 		}
 
-		ret = full_write(out, original_buf, original_size);
-		if (ret != 0)
-			goto out;
-	}
-	if (ret > 0) {
-		msg("%"TS": unexpected end-of-file", in->name);
-		ret = -1;
+		if (chunk_start + original_size > start) {
+			u64 begin = MAX(start, chunk_start) - chunk_start;
+			u64 stop = MIN(end, chunk_start + original_size) -
+				   chunk_start;
+
+			ret = full_write(out, &original_buf[begin],
+					 stop - begin);
+			if (ret != 0)
+				goto out;
+		}
+		chunk_start += original_size;
+		num_chunks++;
 	}
+
+	/* The decompressor's checksum covers all the data from the start. */
+	if (ret == 0 && chunk_start < end && HAS_END_MARKER(flags))
+		ret = check_end_of_chunks(in, flags, prev_checksum,
+					  num_chunks);
 out:
 	free(compressed_buf);
 	free(original_buf);
@@ -369,14 +1418,21 @@ restore_metadata(struct file_stream *out, const tchar *newpath,
 }
 
 static int
-decompress_file(struct xpack_decompressor *decompressor, const tchar *path,
+decompress_file(struct xpack_decompressor **decompressors, const tchar *path,
 		const struct options *options)
 {
 	tchar *newpath = NULL;
 	struct file_stream in;
 	struct file_stream out;
 	struct xpack_file_header hdr;
+	u32 header_size;
+	u32 flags_le;
+	u32 flags = 0;
+	u32 dict_id_le;
+	u32 long_window_le;
+	u32 long_window = 0;
 	struct stat stbuf;
+	unsigned i;
 	int ret;
 	int ret2;
 
@@ -408,6 +1464,8 @@ decompress_file(struct xpack_decompressor *decompressor, const tchar *path,
 	if (ret != 0)
 		goto out_close_in;
 
+	map_for_read(&in);
+
 	ret = xread(&in, &hdr, sizeof(hdr));
 	if (ret < 0)
 		goto out_close_in;
@@ -424,20 +1482,99 @@ decompress_file(struct xpack_decompressor *decompressor, const tchar *path,
 		goto out_close_in;
 	}
 
-	if (hdr.version != 1) {
+	if (hdr.version != 1 && hdr.version != 2) {
 		msg("%"TS": unsupported version (%d)", in.name, hdr.version);
 		ret = -1;
 		goto out_close_in;
 	}
 
-	if (hdr.header_size < sizeof(hdr)) {
+	if (hdr.header_size < sizeof(hdr) +
+			      (hdr.version >= 2 ? sizeof(flags_le) : 0)) {
 		msg("%"TS": incorrect header size (%"PRIu16")", in.name,
 		    hdr.header_size);
 		ret = -1;
 		goto out_close_in;
 	}
+	header_size = hdr.header_size;
+
+	if (hdr.version >= 2) {
+		ret = xread(&in, &flags_le, sizeof(flags_le));
+		if (ret < 0)
+			goto out_close_in;
+		if (ret != sizeof(flags_le)) {
+			msg("%"TS": unexpected end-of-file", in.name);
+			ret = -1;
+			goto out_close_in;
+		}
+		flags = le32_bswap(flags_le);
+		hdr.header_size -= sizeof(flags_le);
+		if (flags & ~XPACK_KNOWN_FLAGS) {
+			msg("%"TS": unsupported flags (0x%08"PRIx32")",
+			    in.name, flags);
+			ret = -1;
+			goto out_close_in;
+		}
+	}
+
+	if (flags & XPACK_FLAG_DICTIONARY) {
+		if (hdr.header_size < sizeof(hdr) + sizeof(dict_id_le)) {
+			msg("%"TS": incorrect header size (%"PRIu32")",
+			    in.name, header_size);
+			ret = -1;
+			goto out_close_in;
+		}
+		ret = xread(&in, &dict_id_le, sizeof(dict_id_le));
+		if (ret < 0)
+			goto out_close_in;
+		if (ret != sizeof(dict_id_le)) {
+			msg("%"TS": unexpected end-of-file", in.name);
+			ret = -1;
+			goto out_close_in;
+		}
+		hdr.header_size -= sizeof(dict_id_le);
+		if (options->dict == NULL) {
+			msg("%"TS": compressed with a preset dictionary; "
+			    "use -D to give it", in.name);
+			ret = -1;
+			goto out_close_in;
+		}
+		if (le32_bswap(dict_id_le) != options->dict_id) {
+			msg("%"TS": compressed with a different dictionary",
+			    in.name);
+			ret = -1;
+			goto out_close_in;
+		}
+	}
+
+	if (flags & XPACK_FLAG_LONG_WINDOW) {
+		if (hdr.header_size < sizeof(hdr) + sizeof(long_window_le)) {
+			msg("%"TS": incorrect header size (%"PRIu32")",
+			    in.name, header_size);
+			ret = -1;
+			goto out_close_in;
+		}
+		ret = xread(&in, &long_window_le, sizeof(long_window_le));
+		if (ret < 0)
+			goto out_close_in;
+		if (ret != sizeof(long_window_le)) {
+			msg("%"TS": unexpected end-of-file", in.name);
+			ret = -1;
+			goto out_close_in;
+		}
+		hdr.header_size -= sizeof(long_window_le);
+		long_window = le32_bswap(long_window_le);
+		if (long_window < hdr.chunk_size ||
+		    long_window > XPACK_MAX_LONG_WINDOW_SIZE) {
+			msg("%"TS": unsupported window size (%"PRIu32")",
+			    in.name, long_window);
+			ret = -1;
+			goto out_close_in;
+		}
+	}
 
-	if (hdr.chunk_size < 1024 || hdr.chunk_size > 67108864) {
+	if (hdr.chunk_size < 1024 ||
+	    hdr.chunk_size > ((flags & XPACK_FLAG_LONG_WINDOW) ?
+			      MAX_LONG_WINDOW_CHUNK_SIZE : 67108864)) {
 		msg("%"TS": unsupported chunk size (%"PRIu32")", in.name,
 		    hdr.chunk_size);
 		ret = -1;
@@ -452,7 +1589,33 @@ decompress_file(struct xpack_decompressor *decompressor, const tchar *path,
 	if (ret != 0)
 		goto out_close_in;
 
-	ret = do_decompress(decompressor, &in, &out, hdr.chunk_size);
+	for (i = 0; i < options->num_threads; i++)
+		xpack_decompressor_set_checksum(decompressors[i],
+						flags & XPACK_FLAG_CHECKSUM);
+
+	if (options->extract_range && (flags & XPACK_FLAG_LONG_WINDOW)) {
+		ret = do_decompress_long(decompressors[0], &in, &out,
+					 hdr.chunk_size, long_window, flags,
+					 options->range_start,
+					 options->range_length);
+	} else if (options->extract_range) {
+		ret = do_decompress_range(decompressors[0], &in, &out,
+					  hdr.chunk_size, header_size,
+					  flags, options->range_start,
+					  options->range_length);
+	} else {
+		ret = map_for_write(&out, get_decompressed_size(&in,
+								hdr.chunk_size,
+								flags));
+		if (ret == 0 && (flags & XPACK_FLAG_LONG_WINDOW))
+			ret = do_decompress_long(decompressors[0], &in, &out,
+						 hdr.chunk_size, long_window,
+						 flags, 0, ~(u64)0);
+		else if (ret == 0)
+			ret = do_decompress(decompressors,
+					    options->num_threads, &in, &out,
+					    hdr.chunk_size, flags);
+	}
 	if (ret != 0)
 		goto out_close_out;
 
@@ -476,12 +1639,13 @@ out:
 }
 
 static int
-compress_file(struct xpack_compressor *compressor, const tchar *path,
+compress_file(struct xpack_compressor **compressors, const tchar *path,
 	      const struct options *options)
 {
 	tchar *newpath = NULL;
 	struct file_stream in;
 	struct file_stream out;
+	struct chunk_index index;
 	struct stat stbuf;
 	int ret;
 	int ret2;
@@ -513,6 +1677,8 @@ compress_file(struct xpack_compressor *compressor, const tchar *path,
 	if (ret != 0)
 		goto out_close_in;
 
+	map_for_read(&in);
+
 	ret = xopen_for_write(newpath, options->force, &out);
 	if (ret != 0)
 		goto out_close_in;
@@ -525,11 +1691,29 @@ compress_file(struct xpack_compressor *compressor, const tchar *path,
 	}
 
 	ret = write_file_header(&out, options->chunk_size,
-				options->compression_level);
+				options->compression_level,
+				(options->write_index ? XPACK_FLAG_INDEX : 0) |
+				(options->dict ? XPACK_FLAG_DICTIONARY : 0) |
+				(options->checksum ? XPACK_FLAG_CHECKSUM : 0) |
+				(options->long_window ?
+				 XPACK_FLAG_LONG_WINDOW : 0),
+				options->dict_id, options->long_window);
 	if (ret != 0)
 		goto out_close_out;
 
-	ret = do_compress(compressor, &in, &out, options->chunk_size);
+	if (options->long_window) {
+		ret = do_compress_long(compressors[0], &in, &out,
+				       options->chunk_size, options->checksum);
+	} else {
+		index.entries = NULL;
+		index.num_entries = 0;
+		index.capacity = 0;
+		ret = do_compress(compressors, options->num_threads, &in, &out,
+				  options->chunk_size,
+				  options->write_index ? &index : NULL,
+				  options->checksum);
+		free(index.entries);
+	}
 	if (ret != 0)
 		goto out_close_out;
 
@@ -564,12 +1748,22 @@ tmain(int argc, tchar *argv[])
 	program_invocation_name = get_filename(argv[0]);
 
 	options.to_stdout = false;
+	options.checksum = false;
 	options.decompress = is_xunpack();
 	options.force = false;
 	options.keep = false;
 	options.compression_level = 6;
+	options.decode_speed = 0;
 	options.chunk_size = 524288;
+	options.long_window = 0;
+	options.num_threads = 1;
+	options.write_index = false;
+	options.extract_range = false;
 	options.suffix = T("xpack");
+	options.dict_path = NULL;
+	options.dict = NULL;
+	options.dict_size = 0;
+	options.dict_id = 0;
 
 	while ((opt_char = tgetopt(argc, argv, optstring)) != -1) {
 		switch (opt_char) {
@@ -587,15 +1781,24 @@ tmain(int argc, tchar *argv[])
 		case 'c':
 			options.to_stdout = true;
 			break;
+		case 'C':
+			options.checksum = true;
+			break;
 		case 'd':
 			options.decompress = true;
 			break;
+		case 'D':
+			options.dict_path = toptarg;
+			break;
 		case 'f':
 			options.force = true;
 			break;
 		case 'h':
 			show_usage(stdout);
 			return 0;
+		case 'i':
+			options.write_index = true;
+			break;
 		case 'k':
 			options.keep = true;
 			break;
@@ -605,6 +1808,12 @@ tmain(int argc, tchar *argv[])
 			if (options.compression_level <= 0)
 				return 1;
 			break;
+		case 'r':
+			if (parse_byte_range(toptarg, &options.range_start,
+					     &options.range_length))
+				return 1;
+			options.extract_range = true;
+			break;
 		case 's':
 			options.chunk_size = parse_chunk_size(toptarg);
 			if (options.chunk_size == 0)
@@ -613,9 +1822,23 @@ tmain(int argc, tchar *argv[])
 		case 'S':
 			options.suffix = toptarg;
 			break;
+		case 'T':
+			if (parse_num_threads(toptarg, &options.num_threads))
+				return 1;
+			break;
+		case 'u':
+			options.decode_speed = parse_decode_speed(toptarg);
+			if (options.decode_speed < 0)
+				return 1;
+			break;
 		case 'V':
 			show_version();
 			return 0;
+		case 'W':
+			options.long_window = parse_window_size(toptarg);
+			if (options.long_window == 0)
+				return 1;
+			break;
 		default:
 			show_usage(stderr);
 			return 1;
@@ -634,31 +1857,152 @@ tmain(int argc, tchar *argv[])
 				argv[i] = NULL;
 	}
 
+	if (options.extract_range) {
+		if (!options.decompress) {
+			msg("-r can only be used when decompressing");
+			return 1;
+		}
+		/* A range is always written to standard output. */
+		options.to_stdout = true;
+		options.keep = true;
+	}
+
+	/*
+	 * With -W, the chunks are parts of one stream, so each one depends on
+	 * the ones before it.  They can't be compressed in parallel or read
+	 * without the chunks before them, and streams don't support preset
+	 * dictionaries.  The window is at least the chunk size, since matches
+	 * can always refer back that far within the stream.
+	 */
+	if (options.long_window && !options.decompress) {
+		if (options.write_index || options.dict_path != NULL) {
+			msg("-W can't be used with -i or -D");
+			return 1;
+		}
+		if (options.chunk_size > MAX_LONG_WINDOW_CHUNK_SIZE) {
+			msg("-W can only be used with a chunk size of at most "
+			    "%d", MAX_LONG_WINDOW_CHUNK_SIZE);
+			return 1;
+		}
+		options.long_window = MAX(options.long_window,
+					  options.chunk_size);
+		options.num_threads = 1;
+	}
+
+	if (options.num_threads == 0)
+		options.num_threads = get_num_processors();
+#ifndef HAVE_PTHREAD
+	if (options.num_threads > 1) {
+		msg("Multithreading is not supported in this build; "
+		    "using 1 thread");
+		options.num_threads = 1;
+	}
+#endif
+
+	if (options.dict_path != NULL) {
+		if (read_file(options.dict_path, MAX_DICTIONARY_SIZE,
+			      &options.dict, &options.dict_size) != 0)
+			return 1;
+		options.dict_id = dictionary_id(options.dict,
+						options.dict_size);
+	}
+
 	ret = 0;
 	if (options.decompress) {
-		struct xpack_decompressor *d;
+		struct xpack_decompressor **decompressors;
+		unsigned j;
 
-		d = alloc_decompressor();
-		if (d == NULL)
+		decompressors = xmalloc(options.num_threads *
+					sizeof(decompressors[0]));
+		if (decompressors == NULL)
 			return 1;
 
+		for (j = 0; j < options.num_threads; j++) {
+			decompressors[j] = alloc_decompressor();
+			if (decompressors[j] == NULL) {
+				ret = 1;
+				goto out_free_decompressors;
+			}
+			if (options.dict != NULL &&
+			    xpack_decompressor_set_dictionary(decompressors[j],
+							      options.dict,
+							      options.dict_size)
+			    != 0) {
+				msg("Unable to load dictionary");
+				xpack_free_decompressor(decompressors[j]);
+				ret = 1;
+				goto out_free_decompressors;
+			}
+		}
+
 		for (i = 0; i < argc; i++)
-			ret |= -decompress_file(d, argv[i], &options);
+			ret |= -decompress_file(decompressors, argv[i],
+						&options);
 
-		xpack_free_decompressor(d);
+	out_free_decompressors:
+		while (j--)
+			xpack_free_decompressor(decompressors[j]);
+		free(decompressors);
 	} else {
-		struct xpack_compressor *c;
+		struct xpack_compressor **compressors;
+		struct xpack_dictionary *digested_dict = NULL;
+		unsigned j;
+
+		/* Digest the dictionary once for all the threads. */
+		if (options.dict_size != 0) {
+			digested_dict = xpack_digest_dictionary(options.dict,
+						options.dict_size,
+						options.chunk_size,
+						options.compression_level);
+			if (digested_dict == NULL) {
+				msg("Unable to load dictionary");
+				return 1;
+			}
+		}
 
-		c = alloc_compressor(options.chunk_size,
-				     options.compression_level);
-		if (c == NULL)
+		compressors = xmalloc(options.num_threads *
+				      sizeof(compressors[0]));
+		if (compressors == NULL)
 			return 1;
 
+		for (j = 0; j < options.num_threads; j++) {
+			/* With -W, each chunk is one segment of the stream. */
+			compressors[j] = alloc_compressor(options.long_window ?
+						2 * options.chunk_size :
+						options.chunk_size,
+						options.compression_level);
+			if (compressors[j] == NULL) {
+				ret = 1;
+				goto out_free_compressors;
+			}
+			if (options.long_window)
+				xpack_compressor_set_long_window(compressors[j],
+							options.long_window);
+			xpack_compressor_set_decode_speed(compressors[j],
+							  options.decode_speed);
+			xpack_compressor_set_checksum(compressors[j],
+						      options.checksum);
+			if (digested_dict != NULL &&
+			    xpack_compressor_use_dictionary(compressors[j],
+							    digested_dict)
+			    != 0) {
+				msg("Unable to load dictionary");
+				xpack_free_compressor(compressors[j]);
+				ret = 1;
+				goto out_free_compressors;
+			}
+		}
+
 		for (i = 0; i < argc; i++)
-			ret |= -compress_file(c, argv[i], &options);
+			ret |= -compress_file(compressors, argv[i], &options);
 
-		xpack_free_compressor(c);
+	out_free_compressors:
+		while (j--)
+			xpack_free_compressor(compressors[j]);
+		free(compressors);
+		xpack_free_dictionary(digested_dict);
 	}
+	free(options.dict);
 
 	/*
 	 * If ret=0, there were no warnings or errors.  Exit with status 0.
@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+#
+# Generate lib/crc32c_table.h, the tables used by lib/crc32c.c.
+#
+# Usage: ./tools/gen_crc32c_table.py > lib/crc32c_table.h
+#
+
+POLY = 0x82F63B78	# CRC-32C (Castagnoli), bit-reversed
+LANE_SIZE = 1024	# must match CRC32C_LANE_SIZE in lib/crc32c.c
+
+def update_byte(crc, byte):
+    crc ^= byte
+    for _ in range(8):
+        crc = (crc >> 1) ^ (POLY if crc & 1 else 0)
+    return crc
+
+def shift(crc, nbytes):
+    for _ in range(nbytes):
+        crc = update_byte(crc, 0)
+    return crc
+
+def print_table(name, values):
+    print('#if NEED_%s' % name.upper())
+    print('static const u32 %s[0x%x] = {' % (name, len(values)))
+    for i in range(0, len(values), 6):
+        print('\t' + ' '.join('0x%08x,' % v for v in values[i:i+6]))
+    print('};')
+    print('#endif')
+
+# slice8[k * 256 + b] is the CRC of the byte b followed by k zero bytes.
+slice8 = [update_byte(0, b) for b in range(256)]
+for k in range(1, 8):
+    slice8 += [update_byte(slice8[(k - 1) * 256 + b], 0)
+               for b in range(256)]
+
+# lane_shift[k * 256 + b] is the CRC of LANE_SIZE zero bytes, starting from the
+# CRC value b << (8 * k).
+lane_shift = [shift(b << (8 * k), LANE_SIZE)
+              for k in range(4) for b in range(256)]
+
+print('/*')
+print(' * crc32c_table.h - tables for CRC-32C')
+print(' *')
+print(' * This file was generated by tools/gen_crc32c_table.py.  Do not edit.')
+print(' * The includer defines NEED_<table name> to 1 for each table it uses.')
+print(' */')
+print()
+print_table('crc32c_slice8_table', slice8)
+print()
+print_table('crc32c_lane_shift_table', lane_shift)
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Test 'xpack -W' with repeats just within, and just beyond, the largest long
+# window, which is the largest offset that the format can represent.  Each
+# input is a 4 MiB random block, other random data, then the same block again.
+# Run from the top of the tree after 'make'.  This needs about 3 GiB of memory
+# and 2 GiB of space in $TMPDIR.
+#
+
+set -e
+
+MAX_WINDOW=536870911		# XPACK_MAX_LONG_WINDOW_SIZE
+BLOCK_SIZE=4194304
+TMPDIR=${TMPDIR:-/tmp}
+DIR=$(mktemp -d "$TMPDIR/long_window_test.XXXXXX")
+trap 'rm -rf "$DIR"' EXIT
+
+head -c $BLOCK_SIZE /dev/urandom > "$DIR/block"
+
+# Test a repeat of the block at an offset of @1 bytes, with the -L level @2.
+# If @3 is "found", the repeat must be within the window and must have been
+# matched, so the output must be at least 3 MiB smaller than the input.
+run_test() {
+	offset=$1
+	level=$2
+	expected=$3
+
+	echo "Offset $offset, level $level"
+	{
+		cat "$DIR/block"
+		head -c $((offset - BLOCK_SIZE)) /dev/urandom
+		cat "$DIR/block"
+	} > "$DIR/in"
+	./xpack -c -C -L $level -W $MAX_WINDOW "$DIR/in" > "$DIR/in.xpack"
+	./xpack -d -c "$DIR/in.xpack" | cmp - "$DIR/in"
+
+	in_size=$(wc -c < "$DIR/in")
+	out_size=$(wc -c < "$DIR/in.xpack")
+	if [ "$expected" = found ] &&
+	   [ $((out_size + 3145728)) -gt "$in_size" ]; then
+		echo "The repeat wasn't found ($in_size => $out_size bytes)"
+		exit 1
+	fi
+}
+
+echo "Window $((MAX_WINDOW + 1))"
+if ./xpack -c -W $((MAX_WINDOW + 1)) "$DIR/block" > /dev/null 2>&1; then
+	echo "A window beyond the largest offset was accepted"
+	exit 1
+fi
+
+run_test $(((1 << 29) - 65536)) 1 found
+run_test $(((1 << 29) - 65536)) 10 found
+run_test $(((1 << 29) + 65536)) 1 not_found
+run_test $((600 << 20)) 10 not_found
+
+echo "All tests passed"